@@ -0,0 +1,478 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the library on marshal files, each operation runs in a child
+   process which decodes the file again, so its peak RSS is the input,
+   the tree and what the operation needs. Results are JSON lines, one per
+   file and operation:
+   {"corpus": "ints", "op": "decode", "bytes": ..., "nodes": ...,
+    "reps": ..., "seconds": ..., "mb_per_s": ..., "ns_per_node": ...,
+    "allocs_per_node": ..., "peak_rss_kb": ...}
+   seconds is the best repetition, MB/s are of marshal input, and for
+   hash lookups nodes are the lookups made. */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "marshal.h"
+
+#define MIN_REPS 3
+#define DEFAULT_TIME 0.5 /* seconds each operation runs for at least */
+
+/* the library's malloc and realloc calls, counted by its allocator */
+static unsigned long allocations;
+
+static void *
+counting_malloc(void *data, size_t size)
+{
+	(void)data;
+	allocations++;
+	return malloc(size);
+}
+
+static void *
+counting_realloc(void *data, void *mem, size_t size)
+{
+	(void)data;
+	allocations++;
+	return realloc(mem, size);
+}
+
+static void
+counting_free(void *data, void *mem)
+{
+	(void)data;
+	free(mem);
+}
+
+static const marshal_allocator_t counting = {
+	counting_malloc, counting_realloc, counting_free, NULL
+};
+
+typedef struct
+{
+	const char *corpus;
+	const char *data;
+	size_t size;
+	double min_time;
+	marshal_t *tree;
+	unsigned long nodes;
+} bench_t;
+
+typedef struct
+{
+	unsigned long reps;
+	double best;
+	unsigned long nodes; /* what ns_per_node divides by, 0 for the tree's */
+	unsigned long allocations; /* of one repetition */
+} result_t;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+fail(const char *what, const char *corpus)
+{
+	fprintf(stderr, "%s failed on %s.\n", what, corpus);
+	exit(1);
+}
+
+static unsigned long
+count_nodes(const marshal_t *root)
+{
+	marshal_iter_t iter;
+	unsigned long count = 0;
+	int event;
+	marshal_iter_init(&iter, root);
+	while ((event = marshal_iter_next(&iter)) > 0)
+		if (MARSHAL_ITER_LEAVE != event)
+			count++;
+	marshal_iter_done(&iter);
+	return count;
+}
+
+/* keeps the best repetition, runs until both MIN_REPS and min_time */
+static int
+keep(result_t *result, double start, double spent, const bench_t *b)
+{
+	if (!result->reps || spent < result->best)
+		result->best = spent;
+	result->reps++;
+	return result->reps < MIN_REPS || now() - start < b->min_time;
+}
+
+/* operations */
+
+static void
+bench_decode(const bench_t *b, result_t *r)
+{
+	double start = now();
+	do
+	{
+		unsigned long before = allocations;
+		double t = now();
+		marshal_t *m = marshal_decode(b->data);
+		t = now() - t;
+		r->allocations = allocations - before;
+		if (!m)
+			fail("Decode", b->corpus);
+		marshal_free(m);
+		if (!keep(r, start, t, b))
+			break;
+	} while (1);
+}
+
+static void
+bench_encode(const bench_t *b, result_t *r)
+{
+	double start = now();
+	do
+	{
+		unsigned long before = allocations;
+		size_t size;
+		double t = now();
+		void *data = marshal_encode(b->tree, &size);
+		t = now() - t;
+		r->allocations = allocations - before;
+		if (!data)
+			fail("Encode", b->corpus);
+		marshal_free_memory(data);
+		if (!keep(r, start, t, b))
+			break;
+	} while (1);
+}
+
+static void
+bench_clone(const bench_t *b, result_t *r)
+{
+	double start = now();
+	do
+	{
+		unsigned long before = allocations;
+		double t = now();
+		marshal_t *m = marshal_clone(NULL, b->tree);
+		t = now() - t;
+		r->allocations = allocations - before;
+		if (!m)
+			fail("Clone", b->corpus);
+		marshal_free(m);
+		if (!keep(r, start, t, b))
+			break;
+	} while (1);
+}
+
+static void
+bench_equal(const bench_t *b, result_t *r)
+{
+	double start = now();
+	marshal_t *copy = marshal_clone(NULL, b->tree);
+	if (!copy)
+		fail("Clone", b->corpus);
+	do
+	{
+		unsigned long before = allocations;
+		double t = now();
+		int equal = marshal_equal(b->tree, copy);
+		t = now() - t;
+		r->allocations = allocations - before;
+		if (!equal)
+			fail("Equal", b->corpus);
+		if (!keep(r, start, t, b))
+			break;
+	} while (1);
+	marshal_free(copy);
+}
+
+static void
+bench_free(const bench_t *b, result_t *r)
+{
+	double start = now();
+	do
+	{
+		marshal_t *m = marshal_decode(b->data);
+		double t;
+		if (!m)
+			fail("Decode", b->corpus);
+		t = now();
+		marshal_free(m);
+		t = now() - t;
+		r->allocations = 0;
+		if (!keep(r, start, t, b))
+			break;
+	} while (1);
+}
+
+/* looks every key of every hash up */
+static void
+lookups(const bench_t *b, result_t *r, int flags)
+{
+	marshal_t *tree = flags ? marshal_decode_flags(b->data, flags) : b->tree;
+	marshal_t **hashes = NULL;
+	size_t count = 0, capacity = 0, i;
+	marshal_iter_t iter;
+	int event;
+	double start;
+
+	if (!tree)
+		fail("Decode", b->corpus);
+	marshal_iter_init(&iter, tree);
+	while ((event = marshal_iter_next(&iter)) > 0)
+	{
+		if (MARSHAL_ITER_ENTER != event || MARSHAL_HASH != iter.node->type)
+			continue;
+		if (count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 256;
+			hashes = realloc(hashes, capacity * sizeof(marshal_t *));
+			if (!hashes)
+				fail("Allocation", b->corpus);
+		}
+		hashes[count++] = iter.node;
+		r->nodes += iter.node->hash.count;
+	}
+	marshal_iter_done(&iter);
+
+	start = now();
+	do
+	{
+		unsigned long before = allocations;
+		double t = now();
+		for (i = 0; i < count; i++)
+		{
+			const marshal_hash_t *hash = &hashes[i]->hash;
+			int j;
+			for (j = 0; j < hash->count; j++)
+				if (!marshal_hash_get(hashes[i], hash->pairs[j*2]))
+					fail("Hash lookup", b->corpus);
+		}
+		t = now() - t;
+		r->allocations = allocations - before;
+		if (!keep(r, start, t, b))
+			break;
+	} while (1);
+
+	free(hashes);
+	if (flags)
+		marshal_free(tree);
+}
+
+static void
+bench_hash_get(const bench_t *b, result_t *r)
+{
+	lookups(b, r, 0);
+}
+
+static void
+bench_hash_get_indexed(const bench_t *b, result_t *r)
+{
+	lookups(b, r, MARSHAL_DECODE_INDEX_HASHES);
+}
+
+static const struct
+{
+	const char *name;
+	void (*run)(const bench_t *b, result_t *r);
+	int needs_hashes;
+}
+ops[] = {
+	{ "decode", bench_decode, 0 },
+	{ "encode", bench_encode, 0 },
+	{ "clone", bench_clone, 0 },
+	{ "equal", bench_equal, 0 },
+	{ "free", bench_free, 0 },
+	{ "hash_get", bench_hash_get, 1 },
+	{ "hash_get_indexed", bench_hash_get_indexed, 1 }
+};
+
+static int
+has_hashes(const marshal_t *root)
+{
+	marshal_iter_t iter;
+	int event, found = 0;
+	marshal_iter_init(&iter, root);
+	while (!found && (event = marshal_iter_next(&iter)) > 0)
+		found = MARSHAL_ITER_ENTER == event
+			&& MARSHAL_HASH == iter.node->type && iter.node->hash.count;
+	marshal_iter_done(&iter);
+	return found;
+}
+
+/* runs in the child, writes the result line into out */
+static void
+run(bench_t *b, int op, FILE *out)
+{
+	result_t r;
+	struct rusage usage;
+	double mb_per_s, ns_per_node;
+
+	b->tree = marshal_decode(b->data);
+	if (!b->tree)
+		fail("Decode", b->corpus);
+	if (ops[op].needs_hashes && !has_hashes(b->tree))
+	{
+		marshal_free(b->tree);
+		return;
+	}
+	b->nodes = count_nodes(b->tree);
+
+	memset(&r, 0, sizeof(r));
+	ops[op].run(b, &r);
+	getrusage(RUSAGE_SELF, &usage);
+	if (!r.nodes)
+		r.nodes = b->nodes;
+
+	mb_per_s = b->size / r.best / 1e6;
+	ns_per_node = r.best * 1e9 / r.nodes;
+	fprintf(out, "{\"corpus\": \"%s\", \"op\": \"%s\", \"bytes\": %lu, "
+		"\"nodes\": %lu, \"reps\": %lu, \"seconds\": %.6f, "
+		"\"mb_per_s\": %.1f, \"ns_per_node\": %.2f, ",
+		b->corpus, ops[op].name, (unsigned long)b->size, r.nodes, r.reps,
+		r.best, mb_per_s, ns_per_node);
+	fprintf(out, "\"allocs_per_node\": %.3f, ",
+		(double)r.allocations / r.nodes);
+	fprintf(out, "\"peak_rss_kb\": %ld}\n", (long)usage.ru_maxrss);
+	fprintf(stderr, "%-10s %-16s %9.1f MB/s %9.2f ns/node\n",
+		b->corpus, ops[op].name, mb_per_s, ns_per_node);
+	marshal_free(b->tree);
+}
+
+static char *
+read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	char *data;
+	long len;
+	if (!file)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = malloc(len > 0 ? len : 1);
+	if (data && (size_t)len != fread(data, 1, len, file))
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	*size = len;
+	return data;
+}
+
+/* the file name without its directory and extension */
+static char *
+corpus_name(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char *name, *dot;
+	base = base ? base + 1 : path;
+	name = malloc(strlen(base) + 1);
+	if (!name)
+		return NULL;
+	strcpy(name, base);
+	dot = strrchr(name, '.');
+	if (dot && dot != name)
+		*dot = '\0';
+	return name;
+}
+
+static void
+usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-t SECONDS] [-o RESULTS] FILE...\n",
+		program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *out = stdout;
+	double min_time = DEFAULT_TIME;
+	int i, op;
+
+	marshal_set_allocator(&counting);
+	for (i = 1; i < argc && '-' == argv[i][0]; i += 2)
+	{
+		if (i + 1 >= argc)
+			usage(argv[0]);
+		if (0 == strcmp("-t", argv[i]))
+			min_time = atof(argv[i+1]);
+		else if (0 == strcmp("-o", argv[i]))
+		{
+			out = fopen(argv[i+1], "w");
+			if (!out)
+			{
+				fprintf(stderr, "Can't write %s.\n", argv[i+1]);
+				return 1;
+			}
+		}
+		else
+			usage(argv[0]);
+	}
+	if (i == argc)
+		usage(argv[0]);
+
+	for (; i < argc; i++)
+	{
+		bench_t b;
+
+		memset(&b, 0, sizeof(b));
+		b.min_time = min_time;
+		b.corpus = corpus_name(argv[i]);
+		b.data = read_file(argv[i], &b.size);
+		if (!b.corpus || !b.data)
+		{
+			fprintf(stderr, "Can't read %s.\n", argv[i]);
+			return 1;
+		}
+
+		for (op = 0; op < (int)(sizeof(ops) / sizeof(ops[0])); op++)
+		{
+			pid_t pid;
+			int status;
+			fflush(out);
+			pid = fork();
+			if (pid < 0)
+			{
+				perror("fork");
+				return 1;
+			}
+			if (0 == pid)
+			{
+				run(&b, op, out);
+				fflush(out);
+				_exit(0);
+			}
+			if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+					|| WEXITSTATUS(status))
+				return 1;
+		}
+		free((void *)b.data);
+		free((void *)b.corpus);
+	}
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
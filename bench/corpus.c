@@ -0,0 +1,452 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Writes the benchmark corpus: marshal 4.8 files laid out the way Ruby
+   dumps them (symlinks, object links, string encodings). The bytes are
+   written directly so the corpus doesn't depend on the encoder being
+   measured, and the same seed and scale always give the same files. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEED 20190312UL
+#define MAX_SYMBOLS 64
+
+typedef struct
+{
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+	const char *symbols[MAX_SYMBOLS];
+	int symbol_count;
+	long objects; /* index of the next object, for links */
+} out_t;
+
+static unsigned long state = SEED;
+
+/* xorshift32, the same sequence everywhere */
+static unsigned long
+next_random(void)
+{
+	state ^= (state << 13) & 0xFFFFFFFFUL;
+	state ^= state >> 17;
+	state ^= (state << 5) & 0xFFFFFFFFUL;
+	return state;
+}
+
+static long
+random_range(long low, long high)
+{
+	return low + (long)(next_random() % (unsigned long)(high - low + 1));
+}
+
+static void
+put(out_t *out, const void *bytes, size_t size)
+{
+	if (out->size + size > out->capacity)
+	{
+		size_t capacity = out->capacity ? out->capacity : 65536;
+		while (capacity < out->size + size)
+			capacity *= 2;
+		out->data = realloc(out->data, capacity);
+		if (!out->data)
+		{
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		out->capacity = capacity;
+	}
+	memcpy(out->data + out->size, bytes, size);
+	out->size += size;
+}
+
+static void
+put_byte(out_t *out, int c)
+{
+	unsigned char byte = (unsigned char)c;
+	put(out, &byte, 1);
+}
+
+/* Ruby's w_long */
+static void
+put_long(out_t *out, long x)
+{
+	unsigned char bytes[sizeof(long) + 1];
+	int i;
+	if (0 == x)
+	{
+		put_byte(out, 0);
+		return;
+	}
+	if (0 < x && x < 123)
+	{
+		put_byte(out, (int)(x + 5));
+		return;
+	}
+	if (-124 < x && x < 0)
+	{
+		put_byte(out, (int)((x - 5) & 0xFF));
+		return;
+	}
+	for (i = 1; i < (int)sizeof(long) + 1; i++)
+	{
+		bytes[i] = (unsigned char)(x & 0xFF);
+		x >>= 8;
+		if (0 == x)
+		{
+			bytes[0] = (unsigned char)i;
+			break;
+		}
+		if (-1 == x)
+		{
+			bytes[0] = (unsigned char)-i;
+			break;
+		}
+	}
+	put(out, bytes, i + 1);
+}
+
+static void
+put_symbol(out_t *out, const char *name)
+{
+	int i;
+	for (i = 0; i < out->symbol_count; i++)
+	{
+		if (0 == strcmp(name, out->symbols[i]))
+		{
+			put_byte(out, ';');
+			put_long(out, i);
+			return;
+		}
+	}
+	if (out->symbol_count < MAX_SYMBOLS)
+		out->symbols[out->symbol_count++] = name;
+	put_byte(out, ':');
+	put_long(out, (long)strlen(name));
+	put(out, name, strlen(name));
+}
+
+/* a UTF-8 string, returns its object index */
+static long
+put_string(out_t *out, const char *data, size_t size)
+{
+	put_byte(out, 'I');
+	put_byte(out, '"');
+	put_long(out, (long)size);
+	put(out, data, size);
+	put_long(out, 1);
+	put_symbol(out, "E");
+	put_byte(out, 'T');
+	return out->objects++;
+}
+
+static void
+put_link(out_t *out, long index)
+{
+	put_byte(out, '@');
+	put_long(out, index);
+}
+
+static void
+put_array(out_t *out, long count)
+{
+	put_byte(out, '[');
+	put_long(out, count);
+	out->objects++;
+}
+
+static void
+put_hash(out_t *out, long count)
+{
+	put_byte(out, '{');
+	put_long(out, count);
+	out->objects++;
+}
+
+/* random text, with some two bytes characters */
+static size_t
+random_text(char *buf, size_t size)
+{
+	static const char letters[] = "abcdefghijklmnopqrstuvwxyz     ";
+	size_t i = 0;
+	while (i < size)
+	{
+		if (i + 1 < size && 0 == next_random() % 16)
+		{
+			buf[i++] = (char)0xC3;
+			buf[i++] = (char)(0xA0 + next_random() % 0x1F);
+		}
+		else
+			buf[i++] = letters[next_random() % (sizeof(letters) - 1)];
+	}
+	return size;
+}
+
+/* corpora */
+
+/* fixnums of every encoded size */
+static void
+ints(out_t *out, long scale)
+{
+	long i, count = 1000000 * scale;
+	put_array(out, count);
+	for (i = 0; i < count; i++)
+	{
+		switch (next_random() % 4)
+		{
+			case 0: put_byte(out, 'i'); put_long(out, random_range(0, 122)); break;
+			case 1: put_byte(out, 'i'); put_long(out, random_range(-255, 255)); break;
+			case 2: put_byte(out, 'i'); put_long(out, random_range(-65535, 65535)); break;
+			default:
+				put_byte(out, 'i');
+				put_long(out, random_range(-1073741824L, 1073741823L));
+		}
+	}
+}
+
+static void
+floats(out_t *out, long scale)
+{
+	long i, count = 400000 * scale;
+	char text[64];
+	put_array(out, count);
+	for (i = 0; i < count; i++)
+	{
+		double value = (double)random_range(-1000000000L, 1000000000L)
+			/ (double)random_range(1, 100000);
+		int size = sprintf(text, "%.17g", value);
+		put_byte(out, 'f');
+		put_long(out, size);
+		put(out, text, size);
+		out->objects++;
+	}
+}
+
+/* rows of string keys and values, repeated keys are links like Ruby's
+   frozen hash keys */
+static void
+strings(out_t *out, long scale)
+{
+	static const char *keys[] = {
+		"id", "name", "email", "city", "bio", "tag", "title", "note"
+	};
+	long key_index[8];
+	long i, count = 20000 * scale;
+	char text[256];
+	int k;
+
+	put_array(out, count);
+	for (i = 0; i < count; i++)
+	{
+		put_hash(out, 8);
+		for (k = 0; k < 8; k++)
+		{
+			if (i)
+				put_link(out, key_index[k]);
+			else
+				key_index[k] = put_string(out, keys[k], strlen(keys[k]));
+			put_string(out, text,
+				random_text(text, (size_t)random_range(8, 200)));
+		}
+	}
+}
+
+/* lookup tables of 32 string keys, wide enough to be indexed */
+static void
+wide(out_t *out, long scale)
+{
+	long key_index[32];
+	long i, count = 10000 * scale;
+	char key[32];
+	int k;
+
+	put_array(out, count);
+	for (i = 0; i < count; i++)
+	{
+		put_hash(out, 32);
+		for (k = 0; k < 32; k++)
+		{
+			if (i)
+				put_link(out, key_index[k]);
+			else
+				key_index[k] = put_string(out, key,
+					(size_t)sprintf(key, "field_%d", k));
+			put_byte(out, 'i');
+			put_long(out, random_range(0, 1000));
+		}
+	}
+}
+
+/* chains of arrays and hashes nested 400 levels */
+static void
+deep(out_t *out, long scale)
+{
+	long i, count = 256 * scale;
+	int level;
+	put_array(out, count);
+	for (i = 0; i < count; i++)
+	{
+		for (level = 0; level < 400; level++)
+		{
+			if (level % 2)
+			{
+				put_hash(out, 1);
+				put_symbol(out, "next");
+			}
+			else
+			{
+				put_array(out, 2);
+				put_byte(out, 'i');
+				put_long(out, level);
+			}
+		}
+		put_byte(out, '0');
+	}
+}
+
+/* objects of one class pointing at earlier ones and sharing an array */
+static void
+graph(out_t *out, long scale)
+{
+	long i, count = 25000 * scale;
+	long *nodes = malloc(count * sizeof(long));
+	long tags = 0;
+	char text[32];
+
+	if (!nodes)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	put_array(out, count);
+	for (i = 0; i < count; i++)
+	{
+		put_byte(out, 'o');
+		put_symbol(out, "Node");
+		put_long(out, 4);
+		nodes[i] = out->objects++;
+
+		put_symbol(out, "@id");
+		put_byte(out, 'i');
+		put_long(out, i % 1000000);
+
+		put_symbol(out, "@label");
+		put_string(out, text, random_text(text, (size_t)random_range(4, 24)));
+
+		put_symbol(out, "@next");
+		if (i)
+			put_link(out, nodes[random_range(0, i - 1)]);
+		else
+			put_byte(out, '0');
+
+		put_symbol(out, "@tags");
+		if (i)
+			put_link(out, tags);
+		else
+		{
+			tags = out->objects;
+			put_array(out, 3);
+			put_symbol(out, "red");
+			put_symbol(out, "green");
+			put_symbol(out, "blue");
+		}
+	}
+	free(nodes);
+}
+
+/* user defined objects carrying 64 KB each */
+static void
+userdef(out_t *out, long scale)
+{
+	long i, j, count = 128 * scale;
+	size_t size = 65536;
+	unsigned char *blob = malloc(size);
+	if (!blob)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	put_array(out, count);
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < (long)size; j++)
+			blob[j] = (unsigned char)next_random();
+		put_byte(out, 'u');
+		put_symbol(out, "Blob");
+		put_long(out, (long)size);
+		put(out, blob, size);
+		out->objects++;
+	}
+	free(blob);
+}
+
+static const struct
+{
+	const char *name;
+	void (*write)(out_t *out, long scale);
+}
+corpora[] = {
+	{ "ints", ints },
+	{ "floats", floats },
+	{ "strings", strings },
+	{ "deep", deep },
+	{ "graph", graph },
+	{ "userdef", userdef },
+	{ "wide", wide }
+};
+
+int main(int argc, char **argv)
+{
+	long scale = 1;
+	int i;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s DIRECTORY [SCALE]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		scale = atol(argv[2]);
+	if (scale < 1)
+	{
+		fprintf(stderr, "The scale must be a positive integer.\n");
+		return 1;
+	}
+
+	for (i = 0; i < (int)(sizeof(corpora) / sizeof(corpora[0])); i++)
+	{
+		out_t out;
+		char path[4096];
+		FILE *file;
+
+		memset(&out, 0, sizeof(out));
+		state = SEED + i;
+		put_byte(&out, 4);
+		put_byte(&out, 8);
+		corpora[i].write(&out, scale);
+
+		sprintf(path, "%.4000s/%s.marshal", argv[1], corpora[i].name);
+		file = fopen(path, "wb");
+		if (!file || out.size != fwrite(out.data, 1, out.size, file))
+		{
+			fprintf(stderr, "Failed to write %s.\n", path);
+			return 1;
+		}
+		fclose(file);
+		free(out.data);
+	}
+	return 0;
+}
@@ -16,56 +16,196 @@
  */
 #include <stdlib.h>
 #include <string.h>
-#include "marshal.h"
+#include "internal.h"
+
+#define MIN_CAPACITY 4
+
+/* makes room for at least need slots of slot_size pointers,
+   growing geometrically so appending is amortized O(1)
+   on failure memory and capacity are left untouched */
+static int
+reserve(void ***mem, int *capacity, int need, int slot_size)
+{
+	void **grown;
+	int size = *capacity;
+	if (need <= size)
+		return 1;
+	size += size / 2;
+	if (size < MIN_CAPACITY)
+		size = MIN_CAPACITY;
+	if (size < need)
+		size = need;
+	grown = mem_realloc(*mem, (size_t)size * slot_size * sizeof(void *));
+	if (!grown)
+		return 0;
+	*mem = grown;
+	*capacity = size;
+	return 1;
+}
 
 marshal_t *
 marshal_array_get(const marshal_t *array, int index)
 {
 	marshal_array_t *a = (marshal_array_t *)array;
-	if (!a || MARSHAL_ARRAY != a->type || index >= a->count || !a->values)
+	if (!a || MARSHAL_ARRAY != a->type || index < 0 || index >= a->count
+			|| !a->values)
 		return NULL;
 	return a->values[index];
 }
 
+marshal_t *
+marshal_array_reserve(marshal_t *array, int capacity)
+{
+	marshal_array_t *a = (marshal_array_t *)array;
+	if (!a || MARSHAL_ARRAY != a->type || a->shared || capacity < 0)
+		return NULL;
+	if (!reserve(&a->values, &a->capacity, capacity, 1))
+		return NULL;
+	return array;
+}
+
 marshal_t *
 marshal_array_add(marshal_t *array, marshal_t *value)
+{
+	return marshal_array_extend(array, &value, 1);
+}
+
+marshal_t *
+marshal_array_extend(marshal_t *array, marshal_t **values, int count)
 {
 	marshal_array_t *a = (marshal_array_t *)array;
-	if (MARSHAL_ARRAY != a->type)
+	if (!a || MARSHAL_ARRAY != a->type || a->shared || count < 0)
 		return NULL;
-	a->values = realloc(a->values, (a->count+1) * sizeof(void *));
-	/* if realloc fails then a->values has no reference
-	   a memory leak may occur */
-	if (!a->values)
+	if (!reserve(&a->values, &a->capacity, a->count + count, 1))
 		return NULL;
-	a->values[a->count] = value;
-	a->count++;
+	if (count)
+		memcpy(a->values + a->count, values, count * sizeof(void *));
+	a->count += count;
+	a->digest = 0;
 	return array;
 }
 
 marshal_t *
 marshal_array_del(marshal_t *array, int index)
+{
+	return marshal_array_splice(array, index, 1, NULL, 0);
+}
+
+marshal_t *
+marshal_array_del_range(marshal_t *array, int index, int count)
+{
+	return marshal_array_splice(array, index, count, NULL, 0);
+}
+
+marshal_t *
+marshal_array_splice(marshal_t *array, int index, int del,
+	marshal_t **values, int count)
 {
 	int i;
 	marshal_array_t *a = (marshal_array_t *)array;
-	if (MARSHAL_ARRAY != a->type || index >= a->count || index < 0)
+	if (!a || MARSHAL_ARRAY != a->type || a->shared
+			|| index < 0 || del < 0 || count < 0
+			|| index > a->count || del > a->count - index)
+		return NULL;
+	/* allocate first, so a failure leaves the array untouched */
+	if (!reserve(&a->values, &a->capacity, a->count - del + count, 1))
 		return NULL;
 
-	marshal_free(a->values[index]);
-
-	/* remove it from values */
-	for (i = index; i < a->count-1; i++)
-		a->values[i] = a->values[i+1];
-	a->values[i] = NULL;
+	for (i = index; i < index + del; i++)
+		marshal_free(a->values[i]);
 
-	a->count--;
+	/* shift the tail once */
+	a->digest = 0;
+	memmove(a->values + index + count, a->values + index + del,
+		(a->count - index - del) * sizeof(void *));
+	if (count)
+		memcpy(a->values + index, values, count * sizeof(void *));
+	a->count += count - del;
 	return array;
 }
 
+#define INDEX_MIN_SIZE 16
+
+/* slots keep the low half of the structural hash */
+#define KEY_HASH(key) ((unsigned int)marshal_hash_value(key))
+
+typedef struct
+{
+	unsigned int hash;
+	int pair; /* pair index + 1, 0 when empty */
+} slot_t;
+
+typedef struct
+{
+	int size; /* power of two, at least twice the key count */
+	slot_t *slots;
+} index_t;
+
+static void
+index_insert(index_t *index, unsigned int hash, int pair)
+{
+	int mask = index->size - 1;
+	int i = hash & mask;
+	while (index->slots[i].pair)
+		i = (i+1) & mask;
+	index->slots[i].hash = hash;
+	index->slots[i].pair = pair + 1;
+}
+
+/* index and slots share a single allocation, marshal_free releases it */
+static index_t *
+index_build(const marshal_hash_t *h, int keys)
+{
+	index_t *index;
+	int size = INDEX_MIN_SIZE;
+	int i;
+
+	while (size < keys*2)
+		size *= 2;
+	index = mem_calloc(1, sizeof(index_t) + size * sizeof(slot_t));
+	if (!index)
+		return NULL;
+	index->size = size;
+	index->slots = (slot_t *)(index + 1);
+	for (i = 0; i < h->count; i++)
+		index_insert(index, KEY_HASH(h->pairs[i*2]), i);
+	return index;
+}
+
+size_t
+index_size(const void *index)
+{
+	const index_t *i = index;
+	return i ? sizeof(index_t) + i->size * sizeof(slot_t) : 0;
+}
+
+void *
+index_copy(void *mem, const void *index)
+{
+	index_t *copy = mem;
+	memcpy(copy, index, index_size(index));
+	copy->slots = (slot_t *)(copy + 1);
+	return copy;
+}
+
 static int
-hash_get_index(const marshal_hash_t *h, const marshal_t *key)
+hash_get_index(const marshal_hash_t *h, const marshal_t *key,
+	unsigned int hash)
 {
 	int i;
+	if (h->index)
+	{
+		index_t *index = h->index;
+		int mask = index->size - 1;
+		for (i = hash & mask; index->slots[i].pair; i = (i+1) & mask)
+		{
+			slot_t *slot = &index->slots[i];
+			if (slot->hash == hash
+				&& marshal_equal(h->pairs[(slot->pair-1)*2], key))
+				return slot->pair - 1;
+		}
+		return -1;
+	}
 	for (i = 0; i < h->count; i++)
 	{
 		if (marshal_equal(h->pairs[i*2], key))
@@ -74,6 +214,34 @@ hash_get_index(const marshal_hash_t *h, const marshal_t *key)
 	return -1;
 }
 
+int
+hash_find(const marshal_t *hash, uint64_t hashed, key_match_fn match,
+	const void *data)
+{
+	const marshal_hash_t *h = &hash->hash;
+	int i;
+	if (h->index)
+	{
+		index_t *index = h->index;
+		unsigned int low = (unsigned int)hashed;
+		int mask = index->size - 1;
+		for (i = low & mask; index->slots[i].pair; i = (i+1) & mask)
+		{
+			slot_t *slot = &index->slots[i];
+			if (slot->hash == low
+				&& match(h->pairs[(slot->pair-1)*2], data))
+				return slot->pair - 1;
+		}
+		return -1;
+	}
+	for (i = 0; i < h->count; i++)
+	{
+		if (match(h->pairs[i*2], data))
+			return i;
+	}
+	return -1;
+}
+
 marshal_t *
 marshal_hash_get(const marshal_t *hash, const marshal_t *key)
 {
@@ -81,7 +249,7 @@ marshal_hash_get(const marshal_t *hash, const marshal_t *key)
 	int index;
 	if (MARSHAL_HASH != h->type)
 		return NULL;
-	index = hash_get_index(h, key);
+	index = hash_get_index(h, key, h->index ? KEY_HASH(key) : 0);
 	return index < 0 ? h->def : h->pairs[index*2+1];
 }
 
@@ -89,20 +257,33 @@ marshal_t *
 marshal_hash_set(marshal_t *hash, marshal_t *key, marshal_t *value)
 {
 	marshal_hash_t *h = (marshal_hash_t *)hash;
+	unsigned int key_hashed;
 	int index;
-	if (!key || !value || MARSHAL_HASH != h->type)
+	if (!key || !value || MARSHAL_HASH != h->type || h->shared)
 		return NULL;
-	index = hash_get_index(h, key);
+	/* index_build hashes the keys itself, only an index needs the hash */
+	key_hashed = h->index ? KEY_HASH(key) : 0;
+	index = hash_get_index(h, key, key_hashed);
+	h->digest = 0;
 	/* no previous value found */
 	if (index < 0)
 	{
-		h->pairs = realloc(h->pairs, (h->count+2) * sizeof(void *));
-		/* same as in marshal_array_add, leak is possible */
-		if (!h->pairs)
+		if (!reserve(&h->pairs, &h->capacity, h->count+1, 2))
 			return NULL;
 		h->pairs[h->count*2] = key;
 		h->pairs[h->count*2+1] = value;
 		h->count++;
+
+		/* an index that can't be grown is dropped, lookups still work */
+		if (h->index && h->count*2 > ((index_t *)h->index)->size)
+		{
+			mem_free(h->index);
+			h->index = index_build(h, h->capacity);
+		}
+		else if (h->index)
+			index_insert(h->index, key_hashed, h->count-1);
+		else if (h->count >= INDEX_MIN_COUNT)
+			h->index = index_build(h, h->capacity);
 	}
 	else
 	{
@@ -118,20 +299,100 @@ marshal_hash_set(marshal_t *hash, marshal_t *key, marshal_t *value)
 	return value;
 }
 
-MARSHAL_API marshal_t *
+marshal_t *
+marshal_hash_reserve(marshal_t *hash, int capacity)
+{
+	marshal_hash_t *h = (marshal_hash_t *)hash;
+	if (!h || MARSHAL_HASH != h->type || h->shared || capacity < 0)
+		return NULL;
+	if (!reserve(&h->pairs, &h->capacity, capacity, 2))
+		return NULL;
+	/* size the index up front too, so filling it never rehashes */
+	if (h->index && ((index_t *)h->index)->size < h->capacity*2)
+		return marshal_hash_index(hash);
+	return hash;
+}
+
+marshal_t *
+marshal_hash_index(marshal_t *hash)
+{
+	marshal_hash_t *h = (marshal_hash_t *)hash;
+	index_t *index;
+	if (!h || MARSHAL_HASH != h->type || h->shared)
+		return NULL;
+	index = index_build(h, h->capacity > h->count ? h->capacity : h->count);
+	if (!index)
+		return NULL;
+	if (h->index)
+		mem_free(h->index);
+	h->index = index;
+	return hash;
+}
+
+marshal_t *
 marshal_object_get(const marshal_t *marshal, const char *name)
 {
-	int i;
-        if (MARSHAL_OBJECT != marshal->type)
-                return NULL;
-        for (i = 0; i < marshal->object.count; i++)
-        {
-                marshal_t *symbol = marshal->object.vars[i*2];
-                marshal_t *var = marshal->object.vars[i*2+1];
-                if (MARSHAL_SYMBOL != symbol->type)
-                        continue;
-                if (0 == strcmp(symbol->symbol.name, name))
-                        return var;
-        }
-        return NULL;
+	int slot;
+	if (!IS_OBJECT(marshal))
+		return NULL;
+	slot = marshal_shape_slot(marshal->object.shape, name);
+	return slot < 0 ? NULL : marshal->object.vars[slot];
+}
+
+marshal_t *
+marshal_object_set(marshal_t *object, const char *name, marshal_t *value)
+{
+	marshal_object_t *o = (marshal_object_t *)object;
+	marshal_shape_t *shape;
+	int slot;
+	if (!name || !value || !IS_OBJECT(object) || o->shared)
+		return NULL;
+
+	slot = marshal_shape_slot(o->shape, name);
+	if (slot >= 0)
+	{
+		marshal_free(o->vars[slot]);
+		o->vars[slot] = value;
+		o->digest = 0;
+		return value;
+	}
+	/* a struct's members are its class' */
+	if (MARSHAL_STRUCT == o->type)
+		return NULL;
+
+	/* shapes are shared, a new ivar moves the object to a new one */
+	if (!reserve(&o->vars, &o->capacity, o->count+1, 1))
+		return NULL;
+	shape = shape_new(o->klass, o->count, o->shape->names, name);
+	if (!shape)
+		return NULL;
+	shape_release(o->shape);
+	o->shape = shape;
+	o->vars[o->count] = value;
+	o->count++;
+	o->digest = 0;
+	return value;
+}
+
+marshal_t *
+marshal_object_field(const marshal_t *object, marshal_field_t *field)
+{
+	const marshal_object_t *o = (const marshal_object_t *)object;
+	if (!IS_OBJECT(object))
+		return NULL;
+	if (o->shape->id != field->shape_id)
+	{
+		field->slot = marshal_shape_slot(o->shape, field->name);
+		field->shape_id = o->shape->id;
+	}
+	return field->slot < 0 ? NULL : o->vars[field->slot];
+}
+
+marshal_t *
+marshal_unwrap(const marshal_t *marshal)
+{
+	while (MARSHAL_USERCLASS == marshal->type
+			|| MARSHAL_EXTENDED == marshal->type)
+		marshal = marshal->wrapped.value;
+	return (marshal_t *)marshal;
 }
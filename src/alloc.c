@@ -0,0 +1,121 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+#define OK 0
+#define FAILED 1
+
+/* the default allocator, libc's while its functions are NULL */
+static marshal_allocator_t global;
+
+/* the calling thread's override */
+static THREAD_LOCAL const marshal_allocator_t *local;
+
+#define CURRENT (local ? local : &global)
+
+void *
+mem_alloc(size_t size)
+{
+	const marshal_allocator_t *a = CURRENT;
+	if (stats_on)
+	{
+		thread_stats.allocations++;
+		thread_stats.allocated_bytes += size;
+	}
+	return a->malloc ? a->malloc(a->data, size) : malloc(size);
+}
+
+void *
+mem_calloc(size_t count, size_t size)
+{
+	const marshal_allocator_t *a = CURRENT;
+	void *mem;
+	if (stats_on)
+	{
+		thread_stats.allocations++;
+		thread_stats.allocated_bytes += count * size;
+	}
+	if (!a->malloc)
+		return calloc(count, size);
+	if (size && count > (size_t)-1 / size)
+		return NULL;
+	mem = a->malloc(a->data, count * size);
+	if (mem)
+		memset(mem, 0, count * size);
+	return mem;
+}
+
+void *
+mem_realloc(void *mem, size_t size)
+{
+	const marshal_allocator_t *a = CURRENT;
+	if (stats_on)
+	{
+		thread_stats.allocations++;
+		thread_stats.allocated_bytes += size;
+	}
+	return a->realloc ? a->realloc(a->data, mem, size) : realloc(mem, size);
+}
+
+void
+mem_free(void *mem)
+{
+	const marshal_allocator_t *a = CURRENT;
+	/* I think some libc implementations do not take free(NULL) as a nop */
+	if (!mem)
+		return;
+	if (a->free)
+		a->free(a->data, mem);
+	else
+		free(mem);
+}
+
+const marshal_allocator_t *
+mem_allocator(void)
+{
+	return local;
+}
+
+int
+marshal_set_allocator(const marshal_allocator_t *allocator)
+{
+	if (!allocator)
+	{
+		memset(&global, 0, sizeof(global));
+		return OK;
+	}
+	if (!allocator->malloc || !allocator->realloc || !allocator->free)
+		return FAILED;
+	memcpy(&global, allocator, sizeof(global));
+	return OK;
+}
+
+const marshal_allocator_t *
+marshal_use_allocator(const marshal_allocator_t *allocator)
+{
+	const marshal_allocator_t *previous = local;
+	local = allocator;
+	return previous;
+}
+
+void
+marshal_free_memory(void *mem)
+{
+	mem_free(mem);
+}
@@ -0,0 +1,214 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include "internal.h"
+
+/* items a worker takes at once, small blobs decode in a few microseconds so
+   single items would make the cursors the bottleneck */
+#define CHUNK 64
+
+/* the items a worker starts with, the others take from it once they're
+   done with theirs */
+typedef struct
+{
+	size_t next; /* first item nobody took */
+	size_t end;
+} range_t;
+
+typedef struct
+{
+	const marshal_slice_t *in;
+	marshal_t **out;
+	int *errors;
+	int flags;
+	const marshal_allocator_t *allocator;
+	range_t *ranges;
+	int count;
+	size_t failed;
+} batch_t;
+
+typedef struct
+{
+	batch_t *batch;
+	int index;
+} worker_t;
+
+/* takes a chunk from range, returns its size (0 once it's drained) */
+static size_t
+take(range_t *range, size_t *first)
+{
+	size_t begin;
+	if (range->next >= range->end)
+		return 0;
+	begin = ATOMIC_ADD(range->next, CHUNK);
+	if (begin >= range->end)
+		return 0;
+	*first = begin;
+	return range->end - begin < CHUNK ? range->end - begin : CHUNK;
+}
+
+static void
+decode_chunk(batch_t *batch, marshal_decoder_t *decoder, size_t first,
+	size_t size)
+{
+	size_t i, done = 0;
+	for (i = first; i < first + size; i++)
+	{
+		int error;
+		batch->out[i] = decoder_decode(decoder, batch->in[i].data,
+			batch->in[i].size, &error);
+		if (batch->errors)
+			batch->errors[i] = error;
+		if (batch->out[i])
+			done++;
+	}
+	ATOMIC_ADD(batch->failed, -done);
+}
+
+static void *
+work(void *arg)
+{
+	worker_t *worker = arg;
+	batch_t *batch = worker->batch;
+	marshal_decoder_t *decoder;
+	const marshal_allocator_t *previous;
+	size_t first, size;
+	int i;
+
+	previous = marshal_use_allocator(batch->allocator);
+	decoder = marshal_decoder_new(batch->flags, batch->allocator);
+	if (!decoder)
+		goto done;
+	/* its own range first, then the others' starting with the next one */
+	for (i = 0; i < batch->count; i++)
+	{
+		range_t *range = &batch->ranges[(worker->index + i) % batch->count];
+		while ((size = take(range, &first)))
+			decode_chunk(batch, decoder, first, size);
+	}
+	marshal_decoder_free(decoder);
+
+done:
+	marshal_use_allocator(previous);
+	return NULL;
+}
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+
+/* splits the batch between count threads, the caller being the first one
+   returns 0 if it couldn't get their memory */
+static int
+run(batch_t *batch, size_t n, int count)
+{
+	/* the bookkeeping is the library's own, like the reclaimer's queue it
+	   stays out of the callers' allocators */
+	range_t *ranges = malloc(count * sizeof(range_t));
+	worker_t *workers = malloc(count * sizeof(worker_t));
+	pthread_t *threads = malloc(count * sizeof(pthread_t));
+	int *started = calloc(count, sizeof(int));
+	size_t step = n / count;
+	int i, ok = ranges && workers && threads && started;
+
+	if (ok)
+	{
+		/* contiguous ranges keep each worker's writes to out apart */
+		for (i = 0; i < count; i++)
+		{
+			ranges[i].next = i * step;
+			ranges[i].end = i + 1 == count ? n : (i + 1) * step;
+			workers[i].batch = batch;
+			workers[i].index = i;
+		}
+		batch->ranges = ranges;
+		batch->count = count;
+		/* a thread which can't be started leaves its range to the others */
+		for (i = 1; i < count; i++)
+			started[i] = !pthread_create(&threads[i], NULL, work,
+				&workers[i]);
+		work(&workers[0]);
+		for (i = 1; i < count; i++)
+			if (started[i])
+				pthread_join(threads[i], NULL);
+	}
+	if (ranges)
+		free(ranges);
+	if (workers)
+		free(workers);
+	if (threads)
+		free(threads);
+	if (started)
+		free(started);
+	return ok;
+}
+
+static int
+cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+#else
+/* without threads the caller does everything */
+#define run(batch, n, count) 0
+#define cpus() 1
+#endif
+
+size_t
+marshal_decode_batch(const marshal_slice_t *in, size_t n, marshal_t **out,
+	int *errors, int flags, int nthreads)
+{
+	batch_t batch;
+	range_t all;
+	worker_t self;
+	size_t i;
+	int count;
+
+	/* until a worker says otherwise everything failed, which is also what
+	   is left if no decoder could be made */
+	for (i = 0; i < n; i++)
+	{
+		out[i] = NULL;
+		if (errors)
+			errors[i] = MARSHAL_ERROR_INVALID;
+	}
+
+	batch.in = in;
+	batch.out = out;
+	batch.errors = errors;
+	batch.flags = flags;
+	batch.allocator = mem_allocator();
+	batch.failed = n;
+
+	/* no thread for less than a chunk */
+	count = nthreads > 0 ? nthreads : cpus();
+	if ((size_t)count > (n + CHUNK - 1) / CHUNK)
+		count = (int)((n + CHUNK - 1) / CHUNK);
+	if (count > 1 && run(&batch, n, count))
+		return batch.failed;
+
+	all.next = 0;
+	all.end = n;
+	batch.ranges = &all;
+	batch.count = 1;
+	self.batch = &batch;
+	self.index = 0;
+	work(&self);
+	return batch.failed;
+}
@@ -16,23 +16,39 @@
  */
 #include <stdlib.h>
 #include <string.h>
-#include "marshal.h"
+#include "internal.h"
 
+/* room: inline bytes past the type's struct, a dest never has them */
 static marshal_t *
-alloc(marshal_t *dest, int type)
+alloc(marshal_t *dest, int type, size_t room)
 {
-	marshal_t *m = dest ? dest : malloc(sizeof(marshal_t));
-	memset(m, 0, sizeof(marshal_t));
+	size_t size = node_size(type) + (dest ? 0 : room);
+	marshal_t *m = dest ? dest : mem_alloc(size);
+	if (!m)
+		return NULL;
+	STATS_ADD(cloned_bytes, size);
+	memset(m, 0, size);
 	m->type = type;
 	return m;
 }
 
+/* frees what a failed clone made, a dest is its caller's */
+static marshal_t *
+discard(marshal_t *dest, marshal_t *m)
+{
+	node_clear(m);
+	if (!dest)
+		mem_free(m);
+	return NULL;
+}
+
 static void *
 memory_clone(int len, void *src)
 {
-	void *mem = malloc(len);
+	void *mem = mem_alloc(len);
 	if (!mem)
 		return NULL;
+	STATS_ADD(cloned_bytes, len);
 	memcpy(mem, src, len);
 	return mem;
 }
@@ -41,9 +57,10 @@ static char *
 string_clone(const char *src)
 {
 	size_t len = strlen(src);
-	char *clone = malloc(len + 1);
+	char *clone = mem_alloc(len + 1);
 	if (!clone)
 		return NULL;
+	STATS_ADD(cloned_bytes, len + 1);
 	memcpy(clone, src, len);
 	clone[len] = 0;
 	return clone;
@@ -52,7 +69,9 @@ string_clone(const char *src)
 static marshal_t *
 clone_boolean(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_BOOLEAN);
+	marshal_t *m = alloc(dest, MARSHAL_BOOLEAN, 0);
+	if (!m)
+		return NULL;
 	m->boolean.value = src->boolean.value;
 	return m;
 }
@@ -60,7 +79,9 @@ clone_boolean(marshal_t *dest, const marshal_t *src)
 static marshal_t *
 clone_integer(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_INTEGER);
+	marshal_t *m = alloc(dest, MARSHAL_INTEGER, 0);
+	if (!m)
+		return NULL;
 	m->integer.value = src->integer.value;
 	return m;
 }
@@ -68,17 +89,21 @@ clone_integer(marshal_t *dest, const marshal_t *src)
 static marshal_t *
 clone_bignum(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_BIGNUM);
+	marshal_t *m = alloc(dest, MARSHAL_BIGNUM, 0);
+	if (!m)
+		return NULL;
 	m->bignum.sign = src->bignum.sign;
 	m->bignum.length = src->bignum.length;
 	m->bignum.bytes = memory_clone(m->bignum.length, src->bignum.bytes);
-	return m->bignum.bytes ? m : NULL;
+	return m->bignum.bytes ? m : discard(dest, m);
 }
 
 static marshal_t *
 clone_float(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_FLOAT);
+	marshal_t *m = alloc(dest, MARSHAL_FLOAT, 0);
+	if (!m)
+		return NULL;
 	m->float_no.value = src->float_no.value;
 	return m;
 }
@@ -86,18 +111,28 @@ clone_float(marshal_t *dest, const marshal_t *src)
 static marshal_t *
 clone_symbol(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_SYMBOL);
-	m->symbol.name = string_clone(src->symbol.name);
-	return m->symbol.name ? m : NULL;
+	size_t len = strlen(src->symbol.name) + 1;
+	int fits = !dest && len <= INLINE_SIZE;
+	marshal_t *m = alloc(dest, MARSHAL_SYMBOL, fits ? INLINE_SIZE : 0);
+	if (!m)
+		return NULL;
+	m->symbol.name = fits ? memcpy(SYMBOL_INLINE(m), src->symbol.name, len)
+		: string_clone(src->symbol.name);
+	return m->symbol.name ? m : discard(dest, m);
 }
 
-static void *
-clone_values(int count, void **src)
+/* values is NULL for none, as in made nodes, returns 0 on failure */
+static int
+clone_values(int count, void **src, void ***values)
 {
 	int i;
-	void **values = malloc(count * sizeof(void *));
-	if (!values)
-		return NULL;
+	*values = NULL;
+	if (!count)
+		return 1;
+	*values = mem_alloc(count * sizeof(void *));
+	if (!*values)
+		return 0;
+	STATS_ADD(cloned_bytes, count * sizeof(void *));
 	for (i = 0; i < count; i++)
 	{
 		marshal_t *value = marshal_clone(NULL, src[i]);
@@ -105,99 +140,328 @@ clone_values(int count, void **src)
 		{
 			int j;
 			for (j = 0; j < i; j++)
-				marshal_free(values[j]);
-			free(values);
-			return NULL;
+				marshal_free((*values)[j]);
+			mem_free(*values);
+			*values = NULL;
+			return 0;
 		}
-		values[i] = value;
+		(*values)[i] = value;
 	}
-	return values;
+	return 1;
 }
 
 static marshal_t *
 clone_array(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_ARRAY);
+	marshal_t *m = alloc(dest, MARSHAL_ARRAY, 0);
+	if (!m)
+		return NULL;
+	if (!clone_values(src->array.count, src->array.values,
+			&m->array.values))
+		return discard(dest, m);
 	m->array.count = src->array.count;
-	m->array.values = clone_values(m->array.count, src->array.values);
-	return m->array.values ? m : NULL;
+	m->array.capacity = src->array.count;
+	m->array.digest = src->array.digest;
+	return m;
 }
 
 static marshal_t *
 clone_hash(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_HASH);
+	marshal_t *m = alloc(dest, MARSHAL_HASH, 0);
+	if (!m)
+		return NULL;
+	if (!clone_values(src->hash.count * 2, src->hash.pairs, &m->hash.pairs))
+		return discard(dest, m);
 	m->hash.count = src->hash.count;
-	m->hash.pairs = clone_values(m->hash.count * 2, src->hash.pairs);
-	return m->hash.pairs ? m : NULL;
+	m->hash.capacity = src->hash.count;
+	m->hash.digest = src->hash.digest;
+	if (src->hash.def)
+	{
+		m->hash.def = marshal_clone(NULL, src->hash.def);
+		if (!m->hash.def)
+			return discard(dest, m);
+	}
+	/* a missing index only makes lookups slower */
+	if (src->hash.index)
+		marshal_hash_index(m);
+	return m;
 }
 
 static marshal_t *
 clone_string(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_STRING);
+	int fits = !dest && src->string.data_size + 4 <= INLINE_SIZE;
+	marshal_t *m = alloc(dest, MARSHAL_STRING, fits ? INLINE_SIZE : 0);
+	if (!m)
+		return NULL;
 	m->string.data_size = src->string.data_size;
-	m->string.data = malloc(m->string.data_size + 4);
+	m->string.data = fits ? STRING_INLINE(m)
+		: mem_alloc(m->string.data_size + 4);
 	if (!m->string.data)
-		return NULL;
+		return discard(dest, m);
+	if (!fits)
+		STATS_ADD(cloned_bytes, m->string.data_size + 4);
 	memcpy(m->string.data, src->string.data, m->string.data_size);
-	memset(m->string.data + m->string.data_size, 0, 4);
+	memset((char *)m->string.data + m->string.data_size, 0, 4);
+	if (!clone_values(src->string.count * 2, src->string.pairs,
+			&m->string.pairs))
+		return discard(dest, m);
 	m->string.count = src->string.count;
-	m->string.pairs = clone_values(m->string.count * 2, src->string.pairs);
-	if (!m->string.pairs)
-		return NULL;
 	m->string.encoding = src->string.encoding;
+	m->string.is_ascii = src->string.is_ascii;
+	m->string.is_valid_utf8 = src->string.is_valid_utf8;
+	m->string.digest = src->string.digest;
 	return m;
 }
 
 static marshal_t *
 clone_class(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_CLASS);
+	marshal_t *m = alloc(dest, MARSHAL_CLASS, 0);
+	if (!m)
+		return NULL;
 	m->klass.name = string_clone(src->klass.name);
-	return m->klass.name ? m : NULL;
+	return m->klass.name ? m : discard(dest, m);
 }
 
 static marshal_t *
 clone_module(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_MODULE);
+	marshal_t *m = alloc(dest, MARSHAL_MODULE, 0);
+	if (!m)
+		return NULL;
 	m->module.name = string_clone(src->module.name);
-	return m->module.name ? m : NULL;
+	return m->module.name ? m : discard(dest, m);
 }
 
+/* objects and structs */
 static marshal_t *
 clone_object(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_OBJECT);
+	marshal_t *m = alloc(dest, src->type, 0);
+	if (!m)
+		return NULL;
+	if (!clone_values(src->object.count, src->object.vars, &m->object.vars))
+		return discard(dest, m);
 	m->object.count = src->object.count;
-	m->object.vars = clone_values(m->object.count*2, src->object.vars);
+	m->object.capacity = src->object.count;
+	m->object.digest = src->object.digest;
 	m->object.symbol_instance =
 		marshal_clone(NULL, src->object.symbol_instance);
+	if (!m->object.symbol_instance)
+		return discard(dest, m);
 	m->object.klass =
 		((marshal_t *)m->object.symbol_instance)->symbol.name;
+	/* layouts are immutable, so they are shared */
+	m->object.shape = shape_retain(src->object.shape);
 	return m;
 }
 
 static marshal_t *
 clone_userdef(marshal_t *dest, const marshal_t *src)
 {
-	marshal_t *m = alloc(dest, MARSHAL_USERDEF);
+	marshal_t *m = alloc(dest, MARSHAL_USERDEF, 0);
+	if (!m)
+		return NULL;
 	m->userdef.size = src->userdef.size;
 	m->userdef.data = memory_clone(m->userdef.size, src->userdef.data);
+	if (!m->userdef.data && m->userdef.size)
+		return discard(dest, m);
 	m->userdef.symbol_instance =
 		marshal_clone(NULL, src->userdef.symbol_instance);
+	if (!m->userdef.symbol_instance)
+		return discard(dest, m);
 	m->userdef.klass =
 		((marshal_t *)m->userdef.symbol_instance)->symbol.name;
+	if (!clone_values(src->userdef.count * 2, src->userdef.pairs,
+			&m->userdef.pairs))
+		return discard(dest, m);
+	m->userdef.count = src->userdef.count;
+	return m;
+}
+
+static marshal_t *
+clone_wrapped(marshal_t *dest, const marshal_t *src)
+{
+	marshal_t *m = alloc(dest, src->type, 0);
+	if (!m)
+		return NULL;
+	m->wrapped.value = marshal_clone(NULL, src->wrapped.value);
+	if (!m->wrapped.value)
+		return discard(dest, m);
+	m->wrapped.symbol_instance =
+		marshal_clone(NULL, src->wrapped.symbol_instance);
+	if (!m->wrapped.symbol_instance)
+		return discard(dest, m);
+	m->wrapped.klass =
+		((marshal_t *)m->wrapped.symbol_instance)->symbol.name;
+	return m;
+}
+
+marshal_t *
+node_retain(marshal_t *node)
+{
+	if (!node)
+		return NULL;
+	if (SHARED_STATIC == node->head.shared)
+		return node;
+	/* a block's nodes live as long as it, so they can only be copied */
+	if (node->head.shared < 0)
+		return marshal_clone(NULL, node);
+	/* a private node had a single owner, now it has two */
+	if (!ATOMIC_CAS(node->head.shared, 0, 2))
+		ATOMIC_INC(node->head.shared);
+	return node;
+}
+
+/* copies the children pointers, which get one more owner, values is
+   NULL for none as in clone_values, returns 0 on failure */
+static int
+retain_values(int count, void **src, void ***values)
+{
+	int i;
+	*values = NULL;
+	if (!count)
+		return 1;
+	*values = mem_alloc(count * sizeof(void *));
+	if (!*values)
+		return 0;
+	for (i = 0; i < count; i++)
+	{
+		(*values)[i] = node_retain(src[i]);
+		if (src[i] && !(*values)[i])
+		{
+			while (i--)
+				marshal_free((*values)[i]);
+			mem_free(*values);
+			*values = NULL;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* a new private node sharing src's children */
+static marshal_t *
+shallow_clone(const marshal_t *src)
+{
+	marshal_t *m;
+	switch (src->type)
+	{
+		case MARSHAL_ARRAY:
+		case MARSHAL_HASH:
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			break;
+		default:
+			/* leaves are deep copied, there's nothing below to share */
+			if (SHARED_STATIC != src->head.shared)
+				return marshal_clone(NULL, src);
+			/* a singleton is the only one it would get */
+			m = mem_alloc(node_size(src->type));
+			return m ? marshal_clone(m, src) : NULL;
+	}
+
+	m = mem_alloc(node_size(src->type));
+	if (!m)
+		return NULL;
+	memcpy(m, src, node_size(src->type));
+	m->head.shared = 0;
+	switch (src->type)
+	{
+		case MARSHAL_ARRAY:
+			m->array.capacity = src->array.count;
+			if (retain_values(src->array.count, src->array.values,
+					&m->array.values))
+				return m;
+			break;
+		case MARSHAL_HASH:
+			m->hash.capacity = src->hash.count;
+			m->hash.index = NULL;
+			if (!retain_values(src->hash.count * 2, src->hash.pairs,
+					&m->hash.pairs))
+				break;
+			m->hash.def = node_retain(src->hash.def);
+			if (src->hash.def && !m->hash.def)
+			{
+				marshal_free(m);
+				return NULL;
+			}
+			/* a missing index only makes lookups slower */
+			if (src->hash.index)
+				marshal_hash_index(m);
+			return m;
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			m->object.capacity = src->object.count;
+			if (!retain_values(src->object.count, src->object.vars,
+					&m->object.vars))
+				break;
+			shape_retain(m->object.shape);
+			m->object.symbol_instance =
+				node_retain(src->object.symbol_instance);
+			if (!m->object.symbol_instance)
+			{
+				marshal_free(m);
+				return NULL;
+			}
+			m->object.klass =
+				((marshal_t *)m->object.symbol_instance)->symbol.name;
+			return m;
+		default:
+			m->wrapped.value = node_retain(src->wrapped.value);
+			if (!m->wrapped.value)
+				break;
+			m->wrapped.symbol_instance =
+				node_retain(src->wrapped.symbol_instance);
+			if (!m->wrapped.symbol_instance)
+			{
+				marshal_free(m->wrapped.value);
+				break;
+			}
+			m->wrapped.klass =
+				((marshal_t *)m->wrapped.symbol_instance)->symbol.name;
+			return m;
+	}
+	mem_free(m);
+	return NULL;
+}
+
+marshal_t *
+marshal_clone_cow(const marshal_t *src)
+{
+	return node_retain((marshal_t *)src);
+}
+
+marshal_t *
+marshal_unshare(marshal_t **node)
+{
+	marshal_t *m = *node;
+	if (!m || !m->head.shared)
+		return m;
+	m = shallow_clone(m);
+	if (!m)
+		return NULL;
+	marshal_free(*node);
+	*node = m;
 	return m;
 }
 
 marshal_t *
 marshal_clone(marshal_t *dest, const marshal_t *src)
 {
+	/* nil, booleans and small integers have a node for everyone */
+	marshal_t *shared = dest ? NULL : singleton_of(src);
+	if (shared)
+		return shared;
 	switch (src->type)
 	{
-		case MARSHAL_NIL: return alloc(dest, MARSHAL_NIL);
+		case MARSHAL_NIL: return alloc(dest, MARSHAL_NIL, 0);
 		case MARSHAL_BOOLEAN: return clone_boolean(dest, src);
 		case MARSHAL_INTEGER: return clone_integer(dest, src);
 		case MARSHAL_BIGNUM: return clone_bignum(dest, src);
@@ -210,6 +474,12 @@ marshal_clone(marshal_t *dest, const marshal_t *src)
 		case MARSHAL_MODULE: return clone_module(dest, src);
 		case MARSHAL_OBJECT: return clone_object(dest, src);
 		case MARSHAL_USERDEF: return clone_userdef(dest, src);
+		case MARSHAL_STRUCT: return clone_object(dest, src);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			return clone_wrapped(dest, src);
 		default: return NULL;
 	}
 }
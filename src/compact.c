@@ -0,0 +1,374 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+#define OK 0
+#define FAILED 1
+#define CHECK(x) do { if (x) return FAILED; } while(0)
+
+/* keeps pointers and doubles aligned in the nodes area */
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* a block is: its header, the nodes area (each node followed by its
+   children arrays, depth-first), the objects' shapes and the bytes */
+typedef struct
+{
+	int shape_count;
+	marshal_shape_t **shapes;
+} block_t;
+
+/* shared nodes met in the source, so they are copied only once */
+typedef struct
+{
+	const marshal_t *src;
+	marshal_t *copy;
+} seen_t;
+
+typedef struct
+{
+	size_t size;
+	size_t count;
+	seen_t *entries;
+
+	/* sizes, then cursors while copying */
+	size_t nodes;
+	size_t bytes;
+	int objects;
+	char *node_cur;
+	char *byte_cur;
+	marshal_shape_t **shapes;
+} compact_t;
+
+static size_t
+seen_slot(const compact_t *c, const marshal_t *src)
+{
+	size_t mask = c->size - 1;
+	size_t i = ((size_t)src / sizeof(void *)) * 2654435761u & mask;
+	while (c->entries[i].src && c->entries[i].src != src)
+		i = (i+1) & mask;
+	return i;
+}
+
+/* returns src's entry, adding it when it's missing, NULL on failure */
+static seen_t *
+seen_entry(compact_t *c, const marshal_t *src)
+{
+	size_t i;
+	if (c->size)
+	{
+		i = seen_slot(c, src);
+		if (c->entries[i].src)
+			return &c->entries[i];
+	}
+	if ((c->count + 1) * 2 > c->size)
+	{
+		seen_t *old = c->entries;
+		size_t size = c->size;
+		c->size = size ? size * 2 : 64;
+		c->entries = mem_calloc(c->size, sizeof(seen_t));
+		if (!c->entries)
+		{
+			c->entries = old;
+			c->size = size;
+			return NULL;
+		}
+		for (i = 0; i < size; i++)
+		{
+			if (old[i].src)
+				c->entries[seen_slot(c, old[i].src)] = old[i];
+		}
+		if (old)
+			mem_free(old);
+	}
+	i = seen_slot(c, src);
+	c->entries[i].src = src;
+	c->entries[i].copy = NULL;
+	c->count++;
+	return &c->entries[i];
+}
+
+static int
+measure(compact_t *c, const marshal_t *src);
+
+static int
+measure_values(compact_t *c, int count, void **values)
+{
+	int i;
+	c->nodes += ALIGN(count * sizeof(void *));
+	for (i = 0; i < count; i++)
+		CHECK(measure(c, values[i]));
+	return OK;
+}
+
+static int
+measure(compact_t *c, const marshal_t *src)
+{
+	/* singletons stay where they are */
+	if (!src || SHARED_STATIC == src->head.shared)
+		return OK;
+	if (src->head.shared)
+	{
+		seen_t *entry = seen_entry(c, src);
+		CHECK(!entry);
+		if (entry->copy)
+			return OK;
+		/* measured, the copy is filled later */
+		entry->copy = (marshal_t *)src;
+	}
+
+	c->nodes += node_size(src->type);
+	switch (src->type)
+	{
+		case MARSHAL_NIL:
+		case MARSHAL_BOOLEAN:
+		case MARSHAL_INTEGER:
+		case MARSHAL_FLOAT:
+			return OK;
+		case MARSHAL_BIGNUM:
+			c->bytes += src->bignum.length;
+			return OK;
+		case MARSHAL_SYMBOL:
+			c->bytes += strlen(src->symbol.name) + 1;
+			return OK;
+		case MARSHAL_CLASS:
+			c->bytes += strlen(src->klass.name) + 1;
+			return OK;
+		case MARSHAL_MODULE:
+			c->bytes += strlen(src->module.name) + 1;
+			return OK;
+		case MARSHAL_ARRAY:
+			return measure_values(c, src->array.count, src->array.values);
+		case MARSHAL_HASH:
+			c->nodes += ALIGN(index_size(src->hash.index));
+			CHECK(measure(c, src->hash.def));
+			return measure_values(c, src->hash.count*2, src->hash.pairs);
+		case MARSHAL_STRING:
+			c->bytes += src->string.data_size + 4;
+			return measure_values(c, src->string.count*2,
+				src->string.pairs);
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			c->objects++;
+			CHECK(measure(c, src->object.symbol_instance));
+			return measure_values(c, src->object.count, src->object.vars);
+		case MARSHAL_USERDEF:
+			c->bytes += src->userdef.size;
+			if (!src->userdef.symbol_instance)
+				c->bytes += strlen(src->userdef.klass) + 1;
+			CHECK(measure(c, src->userdef.symbol_instance));
+			return measure_values(c, src->userdef.count*2,
+				src->userdef.pairs);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			CHECK(measure(c, src->wrapped.symbol_instance));
+			return measure(c, src->wrapped.value);
+		default:
+			return FAILED;
+	}
+}
+
+static void *
+take_node(compact_t *c, size_t size)
+{
+	void *mem = c->node_cur;
+	c->node_cur += ALIGN(size);
+	return mem;
+}
+
+static void *
+take_bytes(compact_t *c, const void *src, size_t size)
+{
+	void *mem = c->byte_cur;
+	memcpy(mem, src, size);
+	c->byte_cur += size;
+	return mem;
+}
+
+static char *
+take_name(compact_t *c, const char *name)
+{
+	return take_bytes(c, name, strlen(name) + 1);
+}
+
+static marshal_t *
+copy(compact_t *c, const marshal_t *src);
+
+static void **
+copy_values(compact_t *c, int count, void **src)
+{
+	void **values = take_node(c, count * sizeof(void *));
+	int i;
+	for (i = 0; i < count; i++)
+		values[i] = src[i] ? copy(c, src[i]) : NULL;
+	return values;
+}
+
+/* measure went first, so nothing is allocated here */
+static marshal_t *
+copy(compact_t *c, const marshal_t *src)
+{
+	seen_t *entry = NULL;
+	marshal_t *m;
+
+	if (SHARED_STATIC == src->head.shared)
+		return (marshal_t *)src;
+	if (src->head.shared)
+	{
+		entry = seen_entry(c, src);
+		if (entry->copy)
+			return entry->copy;
+	}
+	/* inline bytes are taken below like the others */
+	m = take_node(c, node_size(src->type));
+	memcpy(m, src, node_size(src->type));
+	m->head.shared = SHARED_PINNED;
+	if (entry)
+		entry->copy = m;
+
+	switch (src->type)
+	{
+		case MARSHAL_BIGNUM:
+			m->bignum.bytes = take_bytes(c, src->bignum.bytes,
+				src->bignum.length);
+			break;
+		case MARSHAL_SYMBOL:
+			m->symbol.name = take_name(c, src->symbol.name);
+			break;
+		case MARSHAL_CLASS:
+			m->klass.name = take_name(c, src->klass.name);
+			break;
+		case MARSHAL_MODULE:
+			m->module.name = take_name(c, src->module.name);
+			break;
+		case MARSHAL_ARRAY:
+			m->array.capacity = src->array.count;
+			m->array.values = copy_values(c, src->array.count,
+				src->array.values);
+			break;
+		case MARSHAL_HASH:
+			m->hash.capacity = src->hash.count;
+			if (src->hash.index)
+				m->hash.index = index_copy(take_node(c,
+					index_size(src->hash.index)), src->hash.index);
+			m->hash.pairs = copy_values(c, src->hash.count*2,
+				src->hash.pairs);
+			m->hash.def = src->hash.def ? copy(c, src->hash.def) : NULL;
+			break;
+		case MARSHAL_STRING:
+			m->string.data = take_bytes(c, src->string.data,
+				src->string.data_size);
+			take_bytes(c, "\0\0\0", 4);
+			m->string.pairs = copy_values(c, src->string.count*2,
+				src->string.pairs);
+			break;
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			m->object.capacity = src->object.count;
+			m->object.vars = copy_values(c, src->object.count,
+				src->object.vars);
+			m->object.symbol_instance = copy(c, src->object.symbol_instance);
+			m->object.klass =
+				((marshal_t *)m->object.symbol_instance)->symbol.name;
+			m->object.shape = shape_retain(src->object.shape);
+			*c->shapes++ = m->object.shape;
+			break;
+		case MARSHAL_USERDEF:
+			m->userdef.data = take_bytes(c, src->userdef.data,
+				src->userdef.size);
+			if (src->userdef.symbol_instance)
+			{
+				m->userdef.symbol_instance =
+					copy(c, src->userdef.symbol_instance);
+				m->userdef.klass = ((marshal_t *)
+					m->userdef.symbol_instance)->symbol.name;
+			}
+			else
+				m->userdef.klass = take_name(c, src->userdef.klass);
+			m->userdef.pairs = copy_values(c, src->userdef.count*2,
+				src->userdef.pairs);
+			break;
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			m->wrapped.symbol_instance =
+				copy(c, src->wrapped.symbol_instance);
+			m->wrapped.klass = ((marshal_t *)
+				m->wrapped.symbol_instance)->symbol.name;
+			m->wrapped.value = copy(c, src->wrapped.value);
+			break;
+	}
+	return m;
+}
+
+marshal_t *
+marshal_compact(const marshal_t *marshal)
+{
+	compact_t c;
+	block_t *block;
+	marshal_t *root;
+	size_t i;
+
+	if (!marshal)
+		return NULL;
+	/* it's as immutable as a block already */
+	if (SHARED_STATIC == marshal->head.shared)
+		return (marshal_t *)marshal;
+	memset(&c, 0, sizeof(c));
+	if (OK != measure(&c, marshal))
+	{
+		if (c.entries)
+			mem_free(c.entries);
+		return NULL;
+	}
+
+	block = mem_alloc(ALIGN(sizeof(block_t)) + c.nodes
+		+ c.objects * sizeof(marshal_shape_t *) + c.bytes);
+	if (!block)
+	{
+		if (c.entries)
+			mem_free(c.entries);
+		return NULL;
+	}
+	for (i = 0; i < c.size; i++)
+		c.entries[i].copy = NULL;
+	c.node_cur = (char *)block + ALIGN(sizeof(block_t));
+	block->shape_count = c.objects;
+	block->shapes = (marshal_shape_t **)(c.node_cur + c.nodes);
+	c.shapes = block->shapes;
+	c.byte_cur = (char *)(block->shapes + c.objects);
+
+	root = copy(&c, marshal);
+	root->head.shared = SHARED_BLOCK;
+	if (c.entries)
+		mem_free(c.entries);
+	return root;
+}
+
+void
+block_free(marshal_t *marshal)
+{
+	block_t *block = (block_t *)((char *)marshal - ALIGN(sizeof(block_t)));
+	int i;
+	for (i = 0; i < block->shape_count; i++)
+		shape_release(block->shapes[i]);
+	mem_free(block);
+}
@@ -14,13 +14,15 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "marshal.h"
+#include "internal.h"
 #include "format.h"
 
 #define GROW_RATE 8
+#define LOCAL_NAMES 16 /* ivar names read without allocating */
 
 #define OK 0
 #define FAILED 1
@@ -28,132 +30,242 @@
 #define CHECK(call) do { int _err = call ; if (_err) return _err; } while (0)
 #define CHECK_NULL(call) do { if (! call ) return FAILED; } while (0)
 
+/* a known ivar layout, kept by its class and names across decodes */
 typedef struct
 {
+	unsigned int hash;
+	marshal_shape_t *shape;
+} shape_entry_t;
+
+typedef struct
+{
+	int flags;
 	int sym_size;
 	int obj_size;
 	int sym_count;
 	int obj_count;
 	marshal_t **syms;
 	marshal_t **objs;
+	/* symbols that aren't hosted in the tree (e.g. ivar names) */
+	int own_size;
+	int own_count;
+	marshal_t **own;
+	int shape_size;
+	int shape_count;
+	shape_entry_t *shapes;
+	int depth; /* of the node being decoded */
 } cache_t;
 
-typedef const void *buf_t;
+/* input, end is NULL when its size isn't known */
+typedef struct
+{
+	const char *cur;
+	const char *end;
+	int overrun; /* something was read past end */
+	/* chunked input, where end is the chunk's, see decode_chunks */
+	chunk_fn next;
+	void *source;
+	const char *chunk;
+	size_t offset; /* of chunk in the input */
+} buf_t;
 
 static marshal_t *
 decode(buf_t *buf, cache_t *cache);
 
-/* https://stackoverflow.com/questions/1001307 */
-union endian_checker
+static marshal_t *
+decode_as(buf_t *buf, cache_t *cache, char type);
+
+static void
+input_init(buf_t *buf, const void *data, const void *end)
 {
-	unsigned int i;
-	char c[4];
-};
+	buf->cur = buf->chunk = data;
+	buf->end = end;
+	buf->overrun = 0;
+	buf->next = NULL;
+	buf->source = NULL;
+	buf->offset = 0;
+}
 
-static int
-is_big_endian()
+/* bytes read so far */
+static size_t
+input_position(const buf_t *buf)
 {
-	union endian_checker bint;
-	bint.i = 0x01020304;
-	return bint.c[0] == 1; 
+	return buf->offset + (buf->cur - buf->chunk);
 }
 
+/* reads across chunks, what's past the input's end reads as zeros and the
+   decode fails afterwards */
 static void
-read(void *ptr, size_t size, buf_t *buf)
+read_chunks(char *ptr, size_t size, buf_t *buf)
 {
-	memcpy(ptr, *buf, size);	
-	*buf += size;
+	for (;;)
+	{
+		size_t left = buf->end - buf->cur;
+		const void *chunk;
+		if (size <= left)
+		{
+			memcpy(ptr, buf->cur, size);
+			buf->cur += size;
+			return;
+		}
+		memcpy(ptr, buf->cur, left);
+		ptr += left;
+		size -= left;
+		buf->offset += buf->end - buf->chunk;
+		buf->chunk = buf->cur = buf->end;
+		if (buf->overrun || !buf->next
+				|| !(left = buf->next(buf->source, &chunk)))
+		{
+			memset(ptr, 0, size);
+			buf->overrun = 1;
+			return;
+		}
+		buf->chunk = buf->cur = chunk;
+		buf->end = buf->cur + left;
+	}
 }
 
 static void
-read_int(void *ptr, size_t size, size_t store, buf_t *buf)
+read(void *ptr, size_t size, buf_t *buf)
 {
-	if (is_big_endian())
+	if (buf->end && size > (size_t)(buf->end - buf->cur))
 	{
-		/* https://stackoverflow.com/questions/8571089 */
-		char *dest = ptr;
-		char *src = (char *)*buf;
-		size_t i, j;
-		
-		memset(dest, 0, store);
-		for (i = 0, j = store-1; i < size; i++, j--)
-			dest[j] = src[i];
-		*buf += size;
+		read_chunks(ptr, size, buf);
+		return;
 	}
-	else
-		read(ptr, size, buf);
+	memcpy(ptr, buf->cur, size);
+	buf->cur += size;
 }
 
+/* whether size bytes may be left, so bogus sizes fail before allocating
+   (chunked inputs can't tell), those that don't are an overrun */
 static int
-add_object(cache_t *cache, marshal_t *new_obj)
+fits(long size, buf_t *buf)
 {
-	/* expand cache if it's required */
-	if (cache->obj_size <= cache->obj_count+1)
+	if (!buf->end || buf->next || size <= buf->end - buf->cur)
+		return 1;
+	buf->overrun = 1;
+	return 0;
+}
+
+static int
+append(marshal_t ***list, int *size, int *count, marshal_t *item)
+{
+	/* expand list if it's required */
+	if (*size <= *count)
 	{
-		cache->obj_size = cache->obj_size ?
-			cache->obj_size * GROW_RATE : GROW_RATE;
-		cache->objs = realloc(cache->objs, cache->obj_size * sizeof(void *));
-		if (!cache->objs)
+		int grown_size = *size ? *size * GROW_RATE : GROW_RATE;
+		marshal_t **grown = mem_realloc(*list, grown_size * sizeof(void *));
+		if (!grown)
 			return FAILED;
+		*list = grown;
+		*size = grown_size;
 	}
-	cache->objs[cache->obj_count] = new_obj;
-	cache->obj_count++;
+	(*list)[*count] = item;
+	(*count)++;
 	return OK;
 }
 
+/* nodes taken out of the tree may still be in the caches, they go away
+   with them (a failed decode doesn't read the caches again) */
+static int
+keep_replaced(cache_t *cache, marshal_t **nodes)
+{
+	int i;
+	for (i = 0; i < 2; i++)
+	{
+		if (nodes[i]
+				&& append(&cache->own, &cache->own_size, &cache->own_count,
+					nodes[i]))
+		{
+			for (; i < 2; i++)
+				marshal_free(nodes[i]);
+			return FAILED;
+		}
+	}
+	return OK;
+}
+
+static int
+add_object(cache_t *cache, marshal_t *new_obj)
+{
+	return append(&cache->objs, &cache->obj_size, &cache->obj_count,
+		new_obj);
+}
+
+/* same as Ruby's r_long, bytes are little-endian whatever the host's */
 static int
 read_integer(buf_t *buf)
 {
-	/* FIXME n is possible to overflow */
-	int n = 0;
-	int raw = 0;
-	read_int(&raw, 1, sizeof(raw), buf);
+	signed char c = 0;
+	unsigned char byte;
+	long x;
+	int i;
 
-	if (0 == raw)
+	read(&c, 1, buf);
+	if (0 == c)
 		return 0;
-	else if (raw <= 5)
+	if (c > 4)
+		return c - 5;
+	if (c < -4)
+		return c + 5;
+	if (c > 0)
 	{
-		read_int(&n, raw, sizeof(n), buf);
-		return n;
+		for (x = 0, i = 0; i < c; i++)
+		{
+			read(&byte, 1, buf);
+			x |= (long)byte << (8 * i);
+		}
 	}
-	else if (raw <= 0x7F)
-		return raw - 5;
-	else if (raw <= 0xFB)
-		return raw - 0xFB;
-	else if (raw <= 0xFF)
+	else
 	{
-		int bytes = (0xFF+1) - raw;
-		read_int(&n, bytes, sizeof(n), buf);
-		return n - (1 << bytes * 8);
+		/* negative, each byte replaces the sign's ones */
+		for (x = -1, i = 0; i < -c; i++)
+		{
+			read(&byte, 1, buf);
+			x &= ~(0xFFL << (8 * i));
+			x |= (long)byte << (8 * i);
+		}
 	}
-	/* it should never reach here,
-	 * returning 0 something (an allocation) should fail */
-	return 0;
+	return (int)x;
 }
 
+/* reads len bytes followed by pad NULs into room when they fit in its
+   INLINE_SIZE bytes (room can be NULL), otherwise into a new allocation */
 static char *
-read_chars(buf_t *buf)
+read_padded(buf_t *buf, int len, int pad, char *room)
 {
 	char *raw;
-	int len = read_integer(buf);
 
-	if (len < 0)
+	if (len < 0 || !fits(len, buf))
 		return NULL;
-	raw = malloc(len+1);
+	raw = room && len <= INLINE_SIZE - pad ? room : mem_alloc(len + pad);
 	if (!raw)
 		return NULL;
 	read(raw, len, buf);
-	raw[len] = 0;
+	memset(raw + len, 0, pad);
 	return raw;
 }
 
-static void **
-decode_values(int count, buf_t *buf, cache_t *cache)
+static char *
+read_chars(buf_t *buf)
+{
+	return read_padded(buf, read_integer(buf), 1, NULL);
+}
+
+/* values is NULL for none, as in made nodes */
+static int
+decode_values(int count, buf_t *buf, cache_t *cache, void ***values)
 {
 	int i;
-	marshal_t **values = malloc(count * sizeof(marshal_t *));
-	if (!values)
-		return NULL;
+	*values = NULL;
+	/* every value takes a byte at least */
+	if (count < 0 || !fits(count, buf))
+		return FAILED;
+	if (!count)
+		return OK;
+	*values = mem_alloc(count * sizeof(marshal_t *));
+	CHECK_NULL(*values);
 	for (i = 0; i < count; i++)
 	{
 		marshal_t *value = decode(buf, cache);
@@ -161,13 +273,14 @@ decode_values(int count, buf_t *buf, cache_t *cache)
 		{
 			int j;
 			for (j = 0; j < i; j++)
-				marshal_free(values[j]);
-			free(values);
-			return NULL;
+				marshal_free((*values)[j]);
+			mem_free(*values);
+			*values = NULL;
+			return FAILED;
 		}
-		values[i] = value;
+		(*values)[i] = value;
 	}
-	return (void **)values;
+	return OK;
 }
 
 static int
@@ -206,41 +319,21 @@ search_encoding(int count, void **pairs)
 }
 
 
-static int
-decode_nil(marshal_t *m)
-{
-	m->type = MARSHAL_NIL;
-	return OK;
-}
-
-static int
-decode_true(marshal_t *m)
-{
-	m->type = MARSHAL_BOOLEAN;
-	m->boolean.value = 1;
-	return OK;
-}
-
-static int
-decode_false(marshal_t *m)
-{
-	m->type = MARSHAL_BOOLEAN;
-	m->boolean.value = 0;
-	return OK;
-}
-
-static int
-decode_integer(marshal_t *m, buf_t *buf)
+static void
+check_string(marshal_t *m, cache_t *cache)
 {
-	m->type = MARSHAL_INTEGER;
-	m->integer.value = read_integer(buf);
-	return OK;
+	m->string.is_ascii = -1;
+	m->string.is_valid_utf8 = -1;
+	m->string.digest = 0;
+	if (cache->flags & MARSHAL_DECODE_VALIDATE_UTF8)
+		marshal_string_validate(m);
 }
 
 static int
 decode_bignum(marshal_t *m, buf_t *buf, cache_t *cache)
 {
 	char sign;
+	int len;
 	m->type = MARSHAL_BIGNUM;
 
 	read(&sign, 1, buf);
@@ -251,62 +344,134 @@ decode_bignum(marshal_t *m, buf_t *buf, cache_t *cache)
 	else
 		return FAILED;
 	
-	m->bignum.length = read_integer(buf) * 2;
+	/* a length in shorts, which the input must still hold */
+	len = read_integer(buf);
+	if (len < 0 || len > INT_MAX / 2 || !fits(len * 2L, buf))
+		return FAILED;
+	m->bignum.length = len * 2;
 
-	m->bignum.bytes = malloc(m->bignum.length);
+	m->bignum.bytes = mem_alloc(m->bignum.length);
 	CHECK_NULL(m->bignum.bytes);
 
 	/* is it ok to allocate bignum in a little-endian based order? */
 	read(m->bignum.bytes, m->bignum.length, buf);
 
-	return add_object(cache, m);
+	if (OK == add_object(cache, m))
+		return OK;
+	mem_free(m->bignum.bytes);
+	return FAILED;
 }
 
 static int
-decode_float(marshal_t *m, buf_t *buf)
+decode_float(marshal_t *m, buf_t *buf, cache_t *cache)
 {
 	char *raw = read_chars(buf);
 	CHECK_NULL(raw);
 
 	m->type = MARSHAL_FLOAT;
 	m->float_no.value = atof(raw);
-	free(raw);
-	return OK;
+	mem_free(raw);
+	/* floats are objects, links may point to them */
+	return add_object(cache, m);
 }
 
 static int
 decode_symbol(marshal_t *m, buf_t *buf, cache_t *cache)
 {
 	m->type = MARSHAL_SYMBOL;
-	m->symbol.name = read_chars(buf);
+	m->symbol.name = read_padded(buf, read_integer(buf), 1,
+		SYMBOL_INLINE(m));
 	CHECK_NULL(m->symbol.name);
 
-	/* expand symbol cache if it's required */
-	if (cache->sym_size <= cache->sym_count+1)
+	if (append(&cache->syms, &cache->sym_size, &cache->sym_count, m))
 	{
-		cache->sym_size = cache->sym_size ?
-			cache->sym_size * GROW_RATE : GROW_RATE;
-		cache->syms =
-			realloc(cache->syms, cache->sym_size * sizeof(void *));
-		if (!cache->syms)
+		if (!IS_INLINE_SYMBOL(m))
+			mem_free(m->symbol.name);
+		return FAILED;
+	}
+	return OK;
+}
+
+/* a symbol's ivars only give the encoding of its name, whose bytes are
+   kept as they are, the ivars go away with the caches since they may be
+   linked until then */
+static int
+drop_ivars(buf_t *buf, cache_t *cache)
+{
+	int count = read_integer(buf);
+	void **pairs;
+	int i;
+
+	if (count <= 0)
+		return count ? FAILED : OK;
+	CHECK(decode_values(count*2, buf, cache, &pairs));
+	for (i = 0; i < count*2; i++)
+	{
+		if (append(&cache->own, &cache->own_size, &cache->own_count,
+				pairs[i]))
 		{
-			free(m->symbol.name);
+			for (; i < count*2; i++)
+				marshal_free(pairs[i]);
+			mem_free(pairs);
 			return FAILED;
 		}
 	}
-	cache->syms[cache->sym_count] = m;
-	cache->sym_count++;
+	mem_free(pairs);
 	return OK;
 }
 
+/* reads a symbol or a symlink without making a node for the tree
+   returns its index in the symbol cache, -1 on failure */
 static int
-decode_symlink(marshal_t *m, buf_t *buf, cache_t *cache)
+read_symbol(buf_t *buf, cache_t *cache)
+{
+	char type = 0;
+	int ivars, index;
+	marshal_t *m;
+
+	read(&type, 1, buf);
+	if (M_SYMLINK == type)
+	{
+		index = read_integer(buf);
+		return index >= 0 && index < cache->sym_count ? index : -1;
+	}
+	/* symbols named out of ASCII come with their encoding */
+	ivars = M_IVAR == type;
+	if (ivars)
+		read(&type, 1, buf);
+	if (M_SYMBOL != type)
+		return -1;
+
+	m = mem_alloc(node_size(MARSHAL_SYMBOL) + INLINE_SIZE);
+	if (!m)
+		return -1;
+	m->head.shared = 0;
+	if (decode_symbol(m, buf, cache))
+	{
+		mem_free(m);
+		return -1;
+	}
+	index = cache->sym_count - 1;
+	/* a failed decode is dropped as a whole, the symbol cache included */
+	if (append(&cache->own, &cache->own_size, &cache->own_count, m))
+	{
+		marshal_free(m);
+		return -1;
+	}
+	if (ivars && drop_ivars(buf, cache))
+		return -1;
+	return index;
+}
+
+/* links are copies of what they point to, sized for its type */
+static marshal_t *
+decode_symlink(buf_t *buf, cache_t *cache)
 {
 	int index = read_integer(buf);
-	if (index >= cache->sym_count)
-		return FAILED;
-	CHECK_NULL(marshal_clone(m, cache->syms[index]));
-	return OK;
+	if (index < 0 || index >= cache->sym_count)
+		return NULL;
+	STATS_ADD(symlinks, 1);
+	return marshal_clone(NULL, cache->syms[index]);
 }
 
 static int
@@ -318,12 +483,13 @@ decode_array(marshal_t *m, buf_t *buf, cache_t *cache)
 	CHECK(add_object(cache, m));
 
 	len = read_integer(buf);
-	values = decode_values(len, buf, cache);
-	CHECK_NULL(values);
+	CHECK(decode_values(len, buf, cache, &values));
 
 	m->type = MARSHAL_ARRAY;
 	m->array.count = len;
+	m->array.capacity = len;
 	m->array.values = values;
+	m->array.digest = 0;
 	return OK;
 }
 
@@ -332,24 +498,37 @@ decode_hash(marshal_t *m, buf_t *buf, cache_t *cache, int has_def)
 {
 	void **pairs;
 	void *def = NULL;
-	int len;
+	int len, i;
 
 	CHECK(add_object(cache, m));
 
 	len = read_integer(buf);
-	pairs = decode_values(len*2, buf, cache);
-	CHECK_NULL(pairs);
+	if (len < 0 || len > INT_MAX / 2)
+		return FAILED;
+	CHECK(decode_values(len*2, buf, cache, &pairs));
 
 	if (has_def)
 	{
 		def = decode(buf, cache);
-		CHECK_NULL(def);
+		if (!def)
+		{
+			for (i = 0; i < len*2; i++)
+				marshal_free(pairs[i]);
+			mem_free(pairs);
+			return FAILED;
+		}
 	}
 
 	m->type = MARSHAL_HASH;
 	m->hash.count = len;
+	m->hash.capacity = len;
 	m->hash.pairs = pairs;
 	m->hash.def = def;
+	m->hash.index = NULL;
+	m->hash.digest = 0;
+	/* an index that can't be built only makes lookups slower */
+	if (cache->flags & MARSHAL_DECODE_INDEX_HASHES && len >= INDEX_MIN_COUNT)
+		marshal_hash_index(m);
 	return OK;
 }
 
@@ -357,38 +536,81 @@ static int
 decode_old_string(marshal_t *m, buf_t *buf, cache_t *cache)
 {
 	m->type = MARSHAL_STRING;
-	m->string.data = read_chars(buf);
-	m->string.data_size = strlen(m->string.data);
+	m->string.data_size = read_integer(buf);
+	m->string.data = read_padded(buf, m->string.data_size, 4,
+		STRING_INLINE(m));
 	CHECK_NULL(m->string.data);
 	m->string.count = 0;
 	m->string.pairs = NULL;
 	m->string.encoding = MARSHAL_ENCODING_ASCII_8BIT;
+	check_string(m, cache);
 	return add_object(cache, m);
 }
 
+static int
+decode_wrapped(marshal_t *m, buf_t *buf, cache_t *cache, char type,
+	int ivars);
+
+static int
+decode_userdef(marshal_t *m, buf_t *buf, cache_t *cache);
+
+/* the ivars of a _dump result follow it (I u ...) */
+static int
+decode_userdef_ivars(marshal_t *m, buf_t *buf, cache_t *cache)
+{
+	int count;
+	CHECK(decode_userdef(m, buf, cache));
+	count = read_integer(buf);
+	if (count < 0 || decode_values(count*2, buf, cache, &m->userdef.pairs))
+	{
+		mem_free(m->userdef.data);
+		marshal_free(m->userdef.symbol_instance);
+		return FAILED;
+	}
+	m->userdef.count = count;
+	return OK;
+}
+
 static int
 decode_ivar(marshal_t *m, buf_t *buf, cache_t *cache)
 {
-	char type;
+	char type = 0;
 	int data_len;
 	void *data;
-	int count;
+	int count, i;
 	void **pairs;
-
-	CHECK(add_object(cache, m));
+	marshal_t *old[2];
 
 	/* read head data (string) */
 	read(&type, 1, buf);
+	/* the ivars follow the string inside */
+	if (M_USERCLASS == type || M_EXTENDED == type)
+		return decode_wrapped(m, buf, cache, type, 1);
+	if (M_USERDEF == type)
+		return decode_userdef_ivars(m, buf, cache);
+	/* symbols aren't objects, links don't count them */
+	if (M_SYMBOL == type)
+	{
+		CHECK(decode_symbol(m, buf, cache));
+		if (OK == drop_ivars(buf, cache))
+			return OK;
+		if (!IS_INLINE_SYMBOL(m))
+			mem_free(m->symbol.name);
+		return FAILED;
+	}
+	CHECK(add_object(cache, m));
 	data_len = read_integer(buf);
-	data = malloc(data_len+4);
+	if (data_len < 0 || !fits(data_len, buf))
+		return FAILED;
+	/* regexes don't keep their source inline */
+	data = read_padded(buf, data_len, 4,
+		M_STRING == type ? STRING_INLINE(m) : NULL);
 	CHECK_NULL(data);
-	read(data, data_len, buf);
-	memset(data+data_len, 0, 4);
 
 	/* get instances */
 	count = read_integer(buf);
-	pairs = decode_values(count*2, buf, cache);
-	CHECK_NULL(pairs);
+	if (decode_values(count*2, buf, cache, &pairs))
+		goto failed;
 
 	switch (type)
 	{
@@ -399,12 +621,25 @@ decode_ivar(marshal_t *m, buf_t *buf, cache_t *cache)
 			m->string.count = count;
 			m->string.pairs = pairs;
 			m->string.encoding = search_encoding(count, pairs);
-			break;
+			/* other encodings are kept, the replaced ivar may still be
+			   in the caches */
+			if (cache->flags & MARSHAL_DECODE_UTF8
+					&& OK == string_to_utf8(m, old))
+				CHECK(keep_replaced(cache, old));
+			check_string(m, cache);
+			return OK;
 
 		case M_REGEX:
-			return FAILED;
+		default:
+			for (i = 0; i < count*2; i++)
+				marshal_free(pairs[i]);
+			mem_free(pairs);
 	}
-	return OK;
+
+failed:
+	if (data != STRING_INLINE(m))
+		mem_free(data);
+	return FAILED;
 }
 
 static int
@@ -425,29 +660,155 @@ decode_module(marshal_t *m, buf_t *buf, cache_t *cache)
 	return add_object(cache, m);
 }
 
+static unsigned int
+hash_string(unsigned int h, const char *p)
+{
+	for (; *p; p++)
+		h = h * 31u + (unsigned char)*p;
+	return h * 31u;
+}
+
+static unsigned int
+shape_hash(const char *klass, int count, char *const *names)
+{
+	unsigned int h = hash_string(count, klass);
+	int i;
+	for (i = 0; i < count; i++)
+		h = hash_string(h, names[i]);
+	return h;
+}
+
 static int
-decode_object(marshal_t *m, buf_t *buf, cache_t *cache)
+same_shape(const marshal_shape_t *shape, const char *klass, int count,
+	char *const *names)
 {
-	int count;
-	void **vars;
+	int i;
+	if (shape->count != count || strcmp(shape->klass, klass))
+		return 0;
+	for (i = 0; i < count; i++)
+		if (strcmp(shape->names[i], names[i]))
+			return 0;
+	return 1;
+}
 
-	marshal_t *klass_name = decode(buf, cache);
-	CHECK_NULL(klass_name);
+/* returns the shared layout for klass and names (symbol indexes), cache
+   keeps a reference until it's freed */
+static marshal_shape_t *
+find_shape(cache_t *cache, int klass, int count, const int *names)
+{
+	char *local[LOCAL_NAMES];
+	char **strings = local;
+	const char *klass_name = cache->syms[klass]->symbol.name;
+	marshal_shape_t *shape = NULL;
+	shape_entry_t *entry;
+	unsigned int hash;
+	int i;
+
+	if (count > LOCAL_NAMES)
+	{
+		strings = mem_alloc(count * sizeof(char *));
+		if (!strings)
+			return NULL;
+	}
+	for (i = 0; i < count; i++)
+		strings[i] = cache->syms[names[i]]->symbol.name;
+	hash = shape_hash(klass_name, count, strings);
+
+	/* objects of a class usually come together, search backwards */
+	for (i = cache->shape_count-1; i >= 0; i--)
+	{
+		entry = &cache->shapes[i];
+		if (entry->hash == hash
+				&& same_shape(entry->shape, klass_name, count, strings))
+		{
+			shape = entry->shape;
+			goto done;
+		}
+	}
+
+	if (cache->shape_size <= cache->shape_count)
+	{
+		int grown_size = cache->shape_size ?
+			cache->shape_size * GROW_RATE : GROW_RATE;
+		shape_entry_t *grown = mem_realloc(cache->shapes,
+			grown_size * sizeof(shape_entry_t));
+		if (!grown)
+			goto done;
+		cache->shapes = grown;
+		cache->shape_size = grown_size;
+	}
+	shape = shape_new(klass_name, count, strings, NULL);
+	if (shape)
+	{
+		entry = &cache->shapes[cache->shape_count++];
+		entry->hash = hash;
+		entry->shape = shape;
+	}
+
+done:
+	if (strings != local)
+		mem_free(strings);
+	return shape;
+}
+
+/* objects and structs, whose members are read the same way */
+static int
+decode_members(marshal_t *m, buf_t *buf, cache_t *cache, int type)
+{
+	int local[LOCAL_NAMES];
+	int *names = local;
+	int klass, count, i;
+	void **vars = NULL;
+	marshal_t *klass_name = NULL;
+	marshal_shape_t *shape = NULL;
 
+	CHECK(add_object(cache, m));
+	klass = read_symbol(buf, cache);
 	count = read_integer(buf);
-	vars = decode_values(count*2, buf, cache);
+	/* every member takes a byte at least */
+	if (klass < 0 || count < 0 || !fits(count, buf))
+		return FAILED;
 
-	if (!vars || MARSHAL_SYMBOL != klass_name->type)
+	if (count > LOCAL_NAMES)
+		names = mem_alloc(count * sizeof(int));
+	/* no members, no vars, as in made objects */
+	if (count)
+		vars = mem_alloc(count * sizeof(void *));
+	/* only values are hosted, names go to the class' shape */
+	for (i = 0; names && vars && i < count; i++)
+	{
+		names[i] = read_symbol(buf, cache);
+		vars[i] = names[i] < 0 ? NULL : decode(buf, cache);
+		if (!vars[i])
+			break;
+	}
+	if (names && (vars || !count) && i == count)
 	{
+		shape = find_shape(cache, klass, count, names);
+		klass_name = marshal_clone(NULL, cache->syms[klass]);
+	}
+
+	if (names && names != local)
+		mem_free(names);
+	if (!shape || !klass_name)
+	{
+		int j;
+		for (j = 0; vars && j < i; j++)
+			marshal_free(vars[j]);
+		if (vars)
+			mem_free(vars);
 		marshal_free(klass_name);
 		return FAILED;
 	}
 
-	m->type = MARSHAL_OBJECT;
+	m->type = type;
 	m->object.count = count;
+	m->object.capacity = count;
 	m->object.klass = klass_name->symbol.name;
 	m->object.vars = vars;
 	m->object.symbol_instance = klass_name;
+	m->object.shape = shape_retain(shape);
+	m->object.digest = 0;
 	return OK;
 }
 
@@ -456,13 +817,24 @@ decode_userdef(marshal_t *m, buf_t *buf, cache_t *cache)
 {
 	int size;
 	void *data;
+	marshal_t *klass_name;
 
-	marshal_t *klass_name = decode(buf, cache);
+	CHECK(add_object(cache, m));
+	klass_name = decode(buf, cache);
 	CHECK_NULL(klass_name);
+	if (MARSHAL_SYMBOL != klass_name->type)
+	{
+		marshal_free(klass_name);
+		return FAILED;
+	}
 
 	size = read_integer(buf);
-	data = malloc(size);
-	CHECK_NULL(data);
+	data = size < 0 || !fits(size, buf) ? NULL : mem_alloc(size + 1);
+	if (!data)
+	{
+		marshal_free(klass_name);
+		return FAILED;
+	}
 	read(data, size, buf);
 
 	m->type = MARSHAL_USERDEF;
@@ -470,35 +842,123 @@ decode_userdef(marshal_t *m, buf_t *buf, cache_t *cache)
 	m->userdef.klass = klass_name->symbol.name;
 	m->userdef.data = data;
 	m->userdef.symbol_instance = klass_name;
+	m->userdef.count = 0;
+	m->userdef.pairs = NULL;
 	return OK;
 }
 
 static int
-decode_object_ref(marshal_t *m, buf_t *buf, cache_t *cache)
+decode_object(marshal_t *m, buf_t *buf, cache_t *cache)
 {
-	int index = read_integer(buf);
-	if (index >= cache->obj_count)
+	return decode_members(m, buf, cache, MARSHAL_OBJECT);
+}
+
+static int
+decode_struct(marshal_t *m, buf_t *buf, cache_t *cache)
+{
+	return decode_members(m, buf, cache, MARSHAL_STRUCT);
+}
+
+/* a class (or a module) then a value, ivars tells the value is a string
+   whose ivars come after it (I C ...) */
+static int
+decode_wrapped(marshal_t *m, buf_t *buf, cache_t *cache, char type,
+	int ivars)
+{
+	/* Ruby registers the value, which is the wrapper's own object */
+	int index = cache->obj_count;
+	int klass = read_symbol(buf, cache);
+	marshal_t *klass_name, *value;
+
+	if (klass < 0)
+		return FAILED;
+	value = ivars ? decode_as(buf, cache, M_IVAR) : decode(buf, cache);
+	CHECK_NULL(value);
+	klass_name = marshal_clone(NULL, cache->syms[klass]);
+	if (!klass_name)
+	{
+		marshal_free(value);
 		return FAILED;
-	CHECK_NULL(marshal_clone(m, cache->objs[index]));
+	}
+	if (index < cache->obj_count && value == cache->objs[index])
+		cache->objs[index] = m;
+
+	m->type = M_USERCLASS == type ? MARSHAL_USERCLASS : MARSHAL_EXTENDED;
+	m->wrapped.klass = klass_name->symbol.name;
+	m->wrapped.value = value;
+	m->wrapped.symbol_instance = klass_name;
 	return OK;
 }
 
 static int
-decode_type_case(marshal_t *m, buf_t *buf, cache_t *cache)
+decode_userclass(marshal_t *m, buf_t *buf, cache_t *cache)
 {
-	char type = 0;
-	read(&type, 1, buf);
+	return decode_wrapped(m, buf, cache, M_USERCLASS, 0);
+}
+
+static int
+decode_extended(marshal_t *m, buf_t *buf, cache_t *cache)
+{
+	return decode_wrapped(m, buf, cache, M_EXTENDED, 0);
+}
+
+/* U and d: a class and the value it dumped, registered before the value */
+static int
+decode_dumped(marshal_t *m, buf_t *buf, cache_t *cache, int type)
+{
+	int klass;
+	marshal_t *klass_name, *value;
 
+	CHECK(add_object(cache, m));
+	klass = read_symbol(buf, cache);
+	if (klass < 0)
+		return FAILED;
+	value = decode(buf, cache);
+	CHECK_NULL(value);
+	klass_name = marshal_clone(NULL, cache->syms[klass]);
+	if (!klass_name)
+	{
+		marshal_free(value);
+		return FAILED;
+	}
+
+	m->type = type;
+	m->wrapped.klass = klass_name->symbol.name;
+	m->wrapped.value = value;
+	m->wrapped.symbol_instance = klass_name;
+	return OK;
+}
+
+static int
+decode_usrmarshal(marshal_t *m, buf_t *buf, cache_t *cache)
+{
+	return decode_dumped(m, buf, cache, MARSHAL_USRMARSHAL);
+}
+
+static int
+decode_data(marshal_t *m, buf_t *buf, cache_t *cache)
+{
+	return decode_dumped(m, buf, cache, MARSHAL_DATA);
+}
+
+static marshal_t *
+decode_object_ref(buf_t *buf, cache_t *cache)
+{
+	int index = read_integer(buf);
+	if (index < 0 || index >= cache->obj_count)
+		return NULL;
+	STATS_ADD(objlinks, 1);
+	return marshal_clone(NULL, cache->objs[index]);
+}
+
+static int
+decode_type_case(marshal_t *m, char type, buf_t *buf, cache_t *cache)
+{
 	switch (type)
 	{
-		case M_NIL: return decode_nil(m);
-		case M_TRUE: return decode_true(m);
-		case M_FALSE: return decode_false(m);
-		case M_INTEGER: return decode_integer(m, buf);
 		case M_BIGNUM: return decode_bignum(m, buf, cache);
-		case M_FLOAT: return decode_float(m, buf);
+		case M_FLOAT: return decode_float(m, buf, cache);
 		case M_SYMBOL: return decode_symbol(m, buf, cache);
-		case M_SYMLINK: return decode_symlink(m, buf, cache);
 		case M_ARRAY: return decode_array(m, buf, cache);
 		case M_HASH: return decode_hash(m, buf, cache, 0);
 		case M_HASH_DEFAULT: return decode_hash(m, buf, cache, 1);
@@ -508,71 +968,298 @@ decode_type_case(marshal_t *m, buf_t *buf, cache_t *cache)
 		case M_MODULE: return decode_module(m, buf, cache);
 		case M_OBJECT: return decode_object(m, buf, cache);
 		case M_USERDEF: return decode_userdef(m, buf, cache);
-		case M_OBJECT_REF: return decode_object_ref(m, buf, cache);
+		case M_STRUCT: return decode_struct(m, buf, cache);
+		case M_USERCLASS: return decode_userclass(m, buf, cache);
+		case M_EXTENDED: return decode_extended(m, buf, cache);
+		case M_USRMARSHAL: return decode_usrmarshal(m, buf, cache);
+		case M_DATA: return decode_data(m, buf, cache);
 		default:
 			/* printf("%d (%c)\n", type, type); */
 			return FAILED;
 	}
 }
 
+/* bytes of the node a type byte makes, with room for inline bytes when
+   it may be a string or a symbol */
+static size_t
+type_size(char type)
+{
+	switch (type)
+	{
+		case M_BIGNUM: return node_size(MARSHAL_BIGNUM);
+		case M_FLOAT: return node_size(MARSHAL_FLOAT);
+		case M_SYMBOL: return node_size(MARSHAL_SYMBOL) + INLINE_SIZE;
+		case M_ARRAY: return node_size(MARSHAL_ARRAY);
+		case M_HASH:
+		case M_HASH_DEFAULT:
+			return node_size(MARSHAL_HASH);
+		/* I also makes regexes and wrappers, which are smaller */
+		case M_OLD_STRING:
+		case M_IVAR:
+			return node_size(MARSHAL_STRING) + INLINE_SIZE;
+		case M_CLASS: return node_size(MARSHAL_CLASS);
+		case M_MODULE: return node_size(MARSHAL_MODULE);
+		case M_OBJECT:
+		case M_STRUCT:
+			return node_size(MARSHAL_OBJECT);
+		case M_USERDEF: return node_size(MARSHAL_USERDEF);
+		case M_USERCLASS:
+		case M_EXTENDED:
+		case M_USRMARSHAL:
+		case M_DATA:
+			return node_size(MARSHAL_USERCLASS);
+		default:
+			return sizeof(marshal_t);
+	}
+}
+
+/* decodes a node by its type (already read) */
 static marshal_t *
-decode(buf_t *buf, cache_t *cache)
+decode_as(buf_t *buf, cache_t *cache, char type)
 {
-	marshal_t *marshal = malloc(sizeof(marshal_t));
+	marshal_t *marshal = mem_alloc(type_size(type));
+	int failed;
 	if (!marshal)
 		return NULL;
-	if (FAILED == decode_type_case(marshal, buf, cache))
+	/* it may be referenced before it's filled (e.g. a cyclic object) */
+	marshal->type = MARSHAL_NIL;
+	marshal->head.shared = 0;
+	cache->depth++;
+	if (stats_on && cache->depth > thread_stats.max_depth)
+		thread_stats.max_depth = cache->depth;
+	failed = decode_type_case(marshal, type, buf, cache);
+	cache->depth--;
+	if (FAILED == failed)
 	{
-		free(marshal);
+		mem_free(marshal);
 		return NULL;
 	}
+	STATS_ADD(nodes[marshal->type], 1);
 	return marshal;
 }
 
-marshal_t *
-marshal_decode(const void *data)
+static marshal_t *
+decode(buf_t *buf, cache_t *cache)
 {
-	marshal_t *marshal;
-	cache_t cache = {};
+	marshal_t *m;
+	char type = 0;
+	read(&type, 1, buf);
+	/* nil, booleans and small integers are shared, they aren't allocated,
+	   links are copies sized for what they point to */
+	switch (type)
+	{
+		case M_NIL: m = singleton(MARSHAL_NIL, 0); break;
+		case M_TRUE: m = singleton(MARSHAL_BOOLEAN, 1); break;
+		case M_FALSE: m = singleton(MARSHAL_BOOLEAN, 0); break;
+		case M_INTEGER: m = marshal_make_integer(read_integer(buf)); break;
+		case M_SYMLINK: m = decode_symlink(buf, cache); break;
+		case M_OBJECT_REF: m = decode_object_ref(buf, cache); break;
+		default: return decode_as(buf, cache, type);
+	}
+	if (!m)
+		return NULL;
+	if (stats_on && cache->depth + 1 > thread_stats.max_depth)
+		thread_stats.max_depth = cache->depth + 1;
+	STATS_ADD(nodes[m->type], 1);
+	return m;
+}
 
-	buf_t *buf = &data;
+/* empties the caches of a decode, keeping their memory, shapes are kept
+   for the next decodes */
+static void
+cache_reset(cache_t *cache)
+{
+	int i;
+	for (i = 0; i < cache->own_count; i++)
+		marshal_free(cache->own[i]);
+	cache->sym_count = 0;
+	cache->obj_count = 0;
+	cache->own_count = 0;
+	cache->depth = 0;
+}
+
+static void
+cache_free(cache_t *cache)
+{
+	int i;
+	cache_reset(cache);
+	for (i = 0; i < cache->shape_count; i++)
+		shape_release(cache->shapes[i].shape);
+	mem_free(cache->syms);
+	mem_free(cache->objs);
+	mem_free(cache->own);
+	mem_free(cache->shapes);
+}
+
+/* decodes buf with cache, which keeps only its shapes for the next call,
+   error gets a MARSHAL_ERROR_* */
+static marshal_t *
+decode_root(buf_t *buf, cache_t *cache, int *error)
+{
+	marshal_t *marshal;
+	double start = stats_on ? stats_clock() : 0;
 	char major = 0, minor = 0;
 
+	PROBE1(decode__entry, buf->cur);
 	read(&major, 1, buf);
 	read(&minor, 1, buf);
 	if (4 != major || 8 != minor)
+	{
+		PROBE2(decode__return, NULL, input_position(buf));
+		if (error)
+			*error = buf->overrun ? MARSHAL_ERROR_TRUNCATED
+				: MARSHAL_ERROR_VERSION;
 		return NULL;
+	}
 
-	marshal = decode(buf, &cache);
+	marshal = decode(buf, cache);
+	cache_reset(cache);
+	if (marshal && buf->overrun)
+	{
+		marshal_free(marshal);
+		marshal = NULL;
+	}
+	if (error)
+		*error = marshal ? MARSHAL_ERROR_NONE : buf->overrun
+			? MARSHAL_ERROR_TRUNCATED : MARSHAL_ERROR_INVALID;
 
-	/* free stuff */
-	if (cache.syms)
-		free(cache.syms);
-	if (cache.objs)
-		free(cache.objs);
+	/* a tree that couldn't be fully deduplicated is still valid */
+	if (marshal && cache->flags & MARSHAL_DECODE_DEDUP)
+		marshal_dedup(marshal);
+
+	PROBE2(decode__return, marshal, input_position(buf));
+	if (stats_on)
+	{
+		thread_stats.decodes++;
+		thread_stats.bytes_read += input_position(buf);
+		thread_stats.decode_seconds += stats_clock() - start;
+	}
 	return marshal;
 }
 
 marshal_t *
-marshal_decode_file(const char *path)
+marshal_decode(const void *data)
 {
-	marshal_t *marshal = NULL;
-	long len;
+	return marshal_decode_flags(data, 0);
+}
 
-	FILE *file = fopen(path, "rb");
-	if (!file)
+marshal_t *
+marshal_decode_flags(const void *data, int flags)
+{
+	marshal_t *marshal;
+	cache_t cache;
+	buf_t input;
+	memset(&cache, 0, sizeof(cache));
+	cache.flags = flags;
+	input_init(&input, data, NULL);
+	marshal = decode_root(&input, &cache, NULL);
+	cache_free(&cache);
+	return marshal;
+}
+
+marshal_t *
+decode_memory(const void *data, size_t size, int flags)
+{
+	marshal_t *marshal;
+	cache_t cache;
+	buf_t input;
+	memset(&cache, 0, sizeof(cache));
+	cache.flags = flags;
+	input_init(&input, data, (const char *)data + size);
+	marshal = decode_root(&input, &cache, NULL);
+	cache_free(&cache);
+	return marshal;
+}
+
+marshal_t *
+decode_chunks(chunk_fn next, void *source, int flags)
+{
+	marshal_t *marshal;
+	cache_t cache;
+	buf_t input;
+	memset(&cache, 0, sizeof(cache));
+	cache.flags = flags;
+	/* an empty chunk, so the first read asks for one */
+	input_init(&input, "", "");
+	input.next = next;
+	input.source = source;
+	marshal = decode_root(&input, &cache, NULL);
+	cache_free(&cache);
+	return marshal;
+}
+
+/* a decoder's caches outlive its calls */
+struct marshal_decoder_t
+{
+	const marshal_allocator_t *allocator;
+	cache_t cache;
+};
+
+marshal_decoder_t *
+marshal_decoder_new(int flags, const marshal_allocator_t *allocator)
+{
+	marshal_decoder_t *decoder;
+	const marshal_allocator_t *previous;
+	if (!allocator)
+		allocator = mem_allocator();
+	previous = marshal_use_allocator(allocator);
+	decoder = mem_calloc(1, sizeof(marshal_decoder_t));
+	marshal_use_allocator(previous);
+	if (!decoder)
 		return NULL;
-	fseek(file, 0, SEEK_END);
-	len = ftell(file);
-	fseek(file, 0, SEEK_SET);
+	decoder->allocator = allocator;
+	decoder->cache.flags = flags;
+	return decoder;
+}
 
-	void *data = malloc(len);
-	if (!data)
+marshal_t *
+marshal_decoder_decode(marshal_decoder_t *decoder, const void *data)
+{
+	const marshal_allocator_t *previous;
+	marshal_t *marshal;
+	buf_t input;
+	input_init(&input, data, NULL);
+	previous = marshal_use_allocator(decoder->allocator);
+	marshal = decode_root(&input, &decoder->cache, NULL);
+	marshal_use_allocator(previous);
+	return marshal;
+}
+
+marshal_t *
+decoder_decode(marshal_decoder_t *decoder, const void *data, size_t size,
+	int *error)
+{
+	buf_t input;
+	input_init(&input, data, (const char *)data + size);
+	return decode_root(&input, &decoder->cache, error);
+}
+
+void
+marshal_decoder_free(marshal_decoder_t *decoder)
+{
+	const marshal_allocator_t *previous;
+	if (!decoder)
+		return;
+	previous = marshal_use_allocator(decoder->allocator);
+	cache_free(&decoder->cache);
+	mem_free(decoder);
+	marshal_use_allocator(previous);
+}
+
+static size_t
+read_file(void *file, void *buffer, size_t size)
+{
+	return fread(buffer, 1, size, file);
+}
+
+marshal_t *
+marshal_decode_file(const char *path)
+{
+	marshal_t *marshal;
+	FILE *file = fopen(path, "rb");
+	if (!file)
 		return NULL;
-	/* check if data is successfully readed */
-	if ((size_t)len == fread(data, 1, len, file))
-		marshal = marshal_decode(data);
-	free(data);
+	marshal = marshal_decode_stream(read_file, file, 0);
 	fclose(file);
 	return marshal;
 }
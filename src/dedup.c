@@ -0,0 +1,287 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+#define OK 0
+#define FAILED 1
+#define CHECK(x) do { if (x) return FAILED; } while(0)
+
+#define MIN_SIZE 64
+
+typedef struct
+{
+	uint64_t hash;
+	marshal_t *node;
+} entry_t;
+
+/* canonical nodes met so far, open addressing by structural hash */
+typedef struct
+{
+	size_t size; /* power of two, kept at most half full */
+	size_t count;
+	entry_t *entries;
+} table_t;
+
+typedef int (*slot_fn)(table_t *table, void **slot);
+
+static void
+table_insert(table_t *table, uint64_t hash, marshal_t *node)
+{
+	size_t mask = table->size - 1;
+	size_t i = hash & mask;
+	while (table->entries[i].node)
+		i = (i+1) & mask;
+	table->entries[i].hash = hash;
+	table->entries[i].node = node;
+	table->count++;
+}
+
+static int
+table_grow(table_t *table)
+{
+	entry_t *old = table->entries;
+	size_t size = table->size, i;
+
+	table->size = size ? size * 2 : MIN_SIZE;
+	table->entries = mem_calloc(table->size, sizeof(entry_t));
+	if (!table->entries)
+	{
+		table->entries = old;
+		table->size = size;
+		return FAILED;
+	}
+	table->count = 0;
+	for (i = 0; i < size; i++)
+	{
+		if (old[i].node)
+			table_insert(table, old[i].hash, old[i].node);
+	}
+	if (old)
+		mem_free(old);
+	return OK;
+}
+
+static int
+same(const marshal_t *a, const marshal_t *b);
+
+static int
+same_values(int count, void *const *a, void *const *b)
+{
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		if (!same(a[i], b[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+same_shape(const marshal_shape_t *a, const marshal_shape_t *b)
+{
+	int i;
+	if (a == b)
+		return 1;
+	if (a->count != b->count || strcmp(a->klass, b->klass))
+		return 0;
+	for (i = 0; i < a->count; i++)
+	{
+		if (strcmp(a->names[i], b->names[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/* stricter than marshal_equal, nodes that encode the same way: floats by
+   their bits (0.0 isn't -0.0), hashes and ivars in the same order,
+   children are already deduplicated so most compare by address */
+static int
+same(const marshal_t *a, const marshal_t *b)
+{
+	if (a == b)
+		return 1;
+	if (!a || !b || a->type != b->type)
+		return 0;
+	switch (a->type)
+	{
+		case MARSHAL_FLOAT:
+			return 0 == memcmp(&a->float_no.value, &b->float_no.value,
+				sizeof(double));
+		case MARSHAL_ARRAY:
+			return a->array.count == b->array.count
+				&& same_values(a->array.count, a->array.values,
+					b->array.values);
+		case MARSHAL_HASH:
+			return a->hash.count == b->hash.count
+				&& same(a->hash.def, b->hash.def)
+				&& same_values(a->hash.count * 2, a->hash.pairs,
+					b->hash.pairs);
+		case MARSHAL_STRING:
+			return a->string.data_size == b->string.data_size
+				&& a->string.encoding == b->string.encoding
+				&& a->string.count == b->string.count
+				&& 0 == memcmp(a->string.data, b->string.data,
+					a->string.data_size)
+				&& same_values(a->string.count * 2, a->string.pairs,
+					b->string.pairs);
+		case MARSHAL_USERDEF:
+			return a->userdef.size == b->userdef.size
+				&& a->userdef.count == b->userdef.count
+				&& 0 == strcmp(a->userdef.klass, b->userdef.klass)
+				&& 0 == memcmp(a->userdef.data, b->userdef.data,
+					a->userdef.size)
+				&& same_values(a->userdef.count * 2, a->userdef.pairs,
+					b->userdef.pairs);
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			return same_shape(a->object.shape, b->object.shape)
+				&& same_values(a->object.count, a->object.vars,
+					b->object.vars);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			return 0 == strcmp(a->wrapped.klass, b->wrapped.klass)
+				&& same(a->wrapped.value, b->wrapped.value);
+		default:
+			return marshal_equal(a, b);
+	}
+}
+
+static marshal_t *
+table_find(const table_t *table, uint64_t hash, const marshal_t *node)
+{
+	size_t mask = table->size - 1;
+	size_t i;
+	if (!table->size)
+		return NULL;
+	for (i = hash & mask; table->entries[i].node; i = (i+1) & mask)
+	{
+		entry_t *entry = &table->entries[i];
+		if (entry->hash == hash && same(entry->node, node))
+			return entry->node;
+	}
+	return NULL;
+}
+
+/* calls fn on every child slot of m */
+static int
+each_slot(marshal_t *m, table_t *table, slot_fn fn)
+{
+	int i;
+	switch (m->type)
+	{
+		case MARSHAL_ARRAY:
+			for (i = 0; i < m->array.count; i++)
+				CHECK(fn(table, &m->array.values[i]));
+			break;
+		case MARSHAL_HASH:
+			for (i = 0; i < m->hash.count * 2; i++)
+				CHECK(fn(table, &m->hash.pairs[i]));
+			CHECK(fn(table, &m->hash.def));
+			break;
+		case MARSHAL_STRING:
+			for (i = 0; i < m->string.count * 2; i++)
+				CHECK(fn(table, &m->string.pairs[i]));
+			break;
+		case MARSHAL_USERDEF:
+			for (i = 0; i < m->userdef.count * 2; i++)
+				CHECK(fn(table, &m->userdef.pairs[i]));
+			break;
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			for (i = 0; i < m->object.count; i++)
+				CHECK(fn(table, &m->object.vars[i]));
+			break;
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			CHECK(fn(table, &m->wrapped.value));
+			break;
+	}
+	return OK;
+}
+
+/* a node that gets a second owner becomes immutable with its subtree,
+   each node below it still has a single owner, its parent */
+static int
+share(table_t *table, void **slot)
+{
+	marshal_t *m = *slot;
+	if (!m || m->head.shared)
+		return OK;
+	m->head.shared = 1;
+	return each_slot(m, table, share);
+}
+
+static int
+dedup(table_t *table, void **slot)
+{
+	marshal_t *m = *slot, *found;
+	uint64_t hash;
+	if (!m || SHARED_STATIC == m->head.shared)
+		return OK;
+	/* nil, booleans and small integers have their singleton */
+	found = singleton_of(m);
+	if (found)
+	{
+		marshal_free(m);
+		*slot = found;
+		return OK;
+	}
+	/* a shared subtree was deduplicated before */
+	if (!m->head.shared)
+		CHECK(each_slot(m, table, dedup));
+	/* regexes aren't compared, marshal_equal takes them all as equal */
+	if (MARSHAL_REGEX == m->type)
+		return OK;
+
+	/* children are done, so containers hash in O(their size) */
+	hash = marshal_hash_value_memo(m);
+	found = table_find(table, hash, m);
+	if (found && found != m)
+	{
+		share(NULL, (void **)&found);
+		ATOMIC_INC(found->head.shared);
+		marshal_free(m);
+		*slot = found;
+		return OK;
+	}
+	/* nodes of a compact block can't take more owners */
+	if (found || m->head.shared < 0)
+		return OK;
+	if ((table->count + 1) * 2 > table->size)
+		CHECK(table_grow(table));
+	table_insert(table, hash, m);
+	return OK;
+}
+
+marshal_t *
+marshal_dedup(marshal_t *marshal)
+{
+	table_t table = {0, 0, NULL};
+	int status;
+	if (!marshal)
+		return NULL;
+	status = marshal->head.shared ? OK : each_slot(marshal, &table, dedup);
+	if (table.entries)
+		mem_free(table.entries);
+	return OK == status ? marshal : NULL;
+}
@@ -14,14 +14,18 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <float.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "marshal.h"
+#include "internal.h"
 #include "format.h"
 
 #define BUFFER_GROW_RATE 4096 /* heap */
+#define SINK_BUFFER_SIZE 65536 /* heap, see encode_chunks */
 #define FLOAT_BUFFER_SIZE 256 /* stack */
+#define FLOAT_DIGITS 17 /* enough for any double to read back the same */
+#define SYMBOLS_MIN_SIZE 64
 
 #define OK 0
 #define FAILED 1
@@ -29,84 +33,116 @@
 #define CHECK(call) do { int _err = call ; if (_err) return _err; } while (0)
 #define CHECK_NULL(call) do { if (! call ) return FAILED; } while (0)
 
+/* a symbol already written, later ones are links (;) to its index */
+typedef struct
+{
+	const char *name; /* NULL for an empty slot */
+	int index;
+} sym_t;
+
 typedef struct
 {
 	size_t size;
 	size_t cur;
 	void *mem;
+	/* open addressing by name, emptied by every encode */
+	sym_t *syms;
+	int sym_size;
+	int sym_count;
+	/* takes mem once it's full instead of growing it */
+	sink_fn sink;
+	void *sink_data;
+	size_t done; /* bytes taken by sink */
 } buf_t;
 
 static int
 encode(const marshal_t *m, buf_t *buf);
 
+static int
+flush(buf_t *buf)
+{
+	int status = OK;
+	if (buf->cur)
+		status = buf->sink(buf->sink_data, buf->mem, buf->cur);
+	buf->done += buf->cur;
+	buf->cur = 0;
+	return status;
+}
+
 static int
 write(const void *ptr, size_t size, buf_t *buf)
 {
-	if (buf->cur + size >= buf->size)
+	if (buf->sink && buf->cur + size >= buf->size)
 	{
-		buf->size += BUFFER_GROW_RATE;
-		buf->mem = realloc(buf->mem, buf->size);
-		CHECK_NULL(buf->mem);
+		CHECK(flush(buf));
+		/* too big for the buffer, it goes straight through */
+		if (size >= buf->size)
+		{
+			buf->done += size;
+			return buf->sink(buf->sink_data, ptr, size);
+		}
 	}
-	memcpy(buf->mem + buf->cur, ptr, size);
+	else if (buf->cur + size >= buf->size)
+	{
+		/* doubles, so big outputs aren't copied over and over */
+		size_t grown = buf->size ? buf->size * 2 : BUFFER_GROW_RATE;
+		void *mem;
+		while (grown <= buf->cur + size)
+			grown *= 2;
+		mem = mem_realloc(buf->mem, grown);
+		CHECK_NULL(mem);
+		buf->mem = mem;
+		buf->size = grown;
+	}
+	memcpy((char *)buf->mem + buf->cur, ptr, size);
 	buf->cur += size;
 	return OK;
 }
 
-static int
-write_integer(buf_t *buf, int integer)
+/* same as Ruby's w_long */
+int
+encode_long(unsigned char *out, long x)
 {
-	if (0 == integer)
-	{
-		int zero = 0;
-		CHECK(write(&zero, 1, buf));
-	}
-	else if (integer > 0 && integer <= 122)
+	int i;
+	if (0 == x)
 	{
-		int number = integer + 5;
-		CHECK(write(&number, 1, buf));
+		out[0] = 0;
+		return 1;
 	}
-	else if (integer > 122)
+	if (0 < x && x < 123)
 	{
-		int bytes;
-		if (integer < 0xFF)
-			bytes = 1;
-		else if (integer < 0xFFFF)
-			bytes = 2;
-		else if (integer < 0xFFFFFF)
-			bytes = 3;
-		else
-			bytes = 4;
-		CHECK(write(&bytes, 1, buf));
-		CHECK(write(&integer, bytes, buf));
+		out[0] = (unsigned char)(x + 5);
+		return 1;
 	}
-	else if (integer >= -123)
+	if (-124 < x && x < 0)
 	{
-		int number = integer + 0xFB;
-		CHECK(write(&number, 1, buf));
+		out[0] = (unsigned char)((x - 5) & 0xFF);
+		return 1;
 	}
-	else if (integer < -123)
+	for (i = 1; i < (int)sizeof(long) + 1; i++)
 	{
-		int bytes;
-		int encoded_bytes;
-		int number;
-		int positive = -integer;
-		if (positive < 0xFF)
-			bytes = 1;
-		else if (positive < 0xFFFF)
-			bytes = 2;
-		else if (positive < 0xFFFFFF)
-			bytes = 3;
-		else
-			bytes = 4;
-		encoded_bytes = 0x100 - bytes;
-		number = integer + (1 << bytes * 8);
-		CHECK(write(&encoded_bytes, 1, buf));
-		CHECK(write(&number, bytes, buf));
+		out[i] = (unsigned char)(x & 0xFF);
+		/* shifting right keeps the sign with gcc and friends */
+		x >>= 8;
+		if (0 == x)
+		{
+			out[0] = (unsigned char)i;
+			break;
+		}
+		if (-1 == x)
+		{
+			out[0] = (unsigned char)-i;
+			break;
+		}
 	}
-	else
-		return FAILED;
-	return OK;
+	return i + 1;
+}
+
+static int
+write_integer(buf_t *buf, int integer)
+{
+	unsigned char out[ENCODED_LONG_SIZE];
+	return write(out, encode_long(out, integer), buf);
 }
 
 static int
@@ -149,21 +185,98 @@ encode_bignum(const marshal_t *m, buf_t *buf)
 
 	CHECK(write(&type, 1, buf));
 	CHECK(write(&sign, 1, buf));
-	CHECK(write_integer(buf, m->bignum.length));
+	/* the length is in 16 bits shorts, an odd byte count is padded */
+	CHECK(write_integer(buf, (m->bignum.length + 1) / 2));
 	CHECK(write(m->bignum.bytes, m->bignum.length, buf));
+	if (m->bignum.length % 2)
+		CHECK(write("", 1, buf));
 	return OK;
 }
 
+/* the shortest digits reading back as d (> 0), returns how many, decpt
+   gets the decimal point's position in them, like dtoa's */
+static int
+float_digits(double d, char *digits, int *decpt)
+{
+	char str[FLOAT_BUFFER_SIZE];
+	char *p;
+	int precision, count = 0;
+
+	for (precision = 1; ; precision++)
+	{
+		sprintf(str, "%.*e", precision - 1, d);
+		if (FLOAT_DIGITS == precision || strtod(str, NULL) == d)
+			break;
+	}
+	/* "d.ddde+x" whatever the locale's decimal point is */
+	for (p = str; *p != 'e'; p++)
+	{
+		if ('0' <= *p && *p <= '9')
+			digits[count++] = *p;
+	}
+	while (count > 1 && '0' == digits[count - 1])
+		count--;
+	*decpt = atoi(p + 1) + 1;
+	return count;
+}
+
+/* same as Ruby's w_float */
+static int
+format_float(double d, char *str)
+{
+	char digits[FLOAT_DIGITS + 1];
+	int count, decpt, len = 0;
+
+	if (d != d)
+		return sprintf(str, "nan");
+	if (d > DBL_MAX || d < -DBL_MAX)
+		return sprintf(str, d < 0 ? "-inf" : "inf");
+	if (0 == d)
+		return sprintf(str, 1 / d < 0 ? "-0" : "0");
+
+	if (d < 0)
+		str[len++] = '-';
+	count = float_digits(d < 0 ? -d : d, digits, &decpt);
+	if (decpt < -3 || decpt > count)
+	{
+		str[len++] = digits[0];
+		if (count > 1)
+		{
+			str[len++] = '.';
+			memcpy(str + len, digits + 1, count - 1);
+			len += count - 1;
+		}
+		len += sprintf(str + len, "e%d", decpt - 1);
+	}
+	else if (decpt > 0)
+	{
+		memcpy(str + len, digits, decpt);
+		len += decpt;
+		if (count > decpt)
+		{
+			str[len++] = '.';
+			memcpy(str + len, digits + decpt, count - decpt);
+			len += count - decpt;
+		}
+	}
+	else
+	{
+		str[len++] = '0';
+		str[len++] = '.';
+		memset(str + len, '0', -decpt);
+		len -= decpt;
+		memcpy(str + len, digits, count);
+		len += count;
+	}
+	return len;
+}
+
 static int
 encode_float(const marshal_t *m, buf_t *buf)
 {
 	int type = M_FLOAT;
 	char str[FLOAT_BUFFER_SIZE];
-	int len;
-
-	/* snprintf would be safer, but it's not ansi C */
-	sprintf(str, "%f", m->float_no.value);
-	len = (int)strlen(str); /* trust snprintf */
+	int len = format_float(m->float_no.value, str);
 
 	CHECK(write(&type, 1, buf));
 	CHECK(write_integer(buf, len));
@@ -172,16 +285,94 @@ encode_float(const marshal_t *m, buf_t *buf)
 }
 
 static int
-encode_symbol(const marshal_t *m, buf_t *buf)
+grow_symbols(buf_t *buf)
+{
+	sym_t *old = buf->syms;
+	int size = buf->sym_size, i;
+
+	buf->sym_size = size ? size * 2 : SYMBOLS_MIN_SIZE;
+	buf->syms = mem_calloc(buf->sym_size, sizeof(sym_t));
+	if (!buf->syms)
+	{
+		buf->syms = old;
+		buf->sym_size = size;
+		return FAILED;
+	}
+	for (i = 0; i < size; i++)
+	{
+		int j, mask = buf->sym_size - 1;
+		if (!old[i].name)
+			continue;
+		for (j = hash_symbol(old[i].name) & mask; buf->syms[j].name;
+				j = (j+1) & mask)
+			;
+		buf->syms[j] = old[i];
+	}
+	mem_free(old);
+	return OK;
+}
+
+/* finds name's slot, an empty one when it wasn't written yet */
+static sym_t *
+find_symbol(buf_t *buf, const char *name)
+{
+	int i, mask;
+	if ((buf->sym_count + 1) * 2 > buf->sym_size && grow_symbols(buf))
+		return NULL;
+	mask = buf->sym_size - 1;
+	for (i = hash_symbol(name) & mask; buf->syms[i].name; i = (i+1) & mask)
+	{
+		if (0 == strcmp(buf->syms[i].name, name))
+			break;
+	}
+	return &buf->syms[i];
+}
+
+/* the first time a symbol is written, then links to it like Ruby does
+   names out of ASCII are taken as UTF-8, Ruby tells it with an E ivar */
+static int
+write_symbol(const char *name, buf_t *buf)
 {
 	int type = M_SYMBOL;
-	int len = (int)strlen(m->symbol.name);
+	int len = (int)strlen(name);
+	int ascii = 1, i;
+	sym_t *sym = find_symbol(buf, name);
+	CHECK_NULL(sym);
+	if (sym->name)
+	{
+		type = M_SYMLINK;
+		CHECK(write(&type, 1, buf));
+		return write_integer(buf, sym->index);
+	}
+	sym->name = name;
+	sym->index = buf->sym_count++;
+	for (i = 0; i < len && ascii; i++)
+		ascii = !((unsigned char)name[i] & 0x80);
+	if (!ascii)
+	{
+		type = M_IVAR;
+		CHECK(write(&type, 1, buf));
+		type = M_SYMBOL;
+	}
 	CHECK(write(&type, 1, buf));
 	CHECK(write_integer(buf, len));
-	CHECK(write(m->symbol.name, len, buf));
+	CHECK(write(name, len, buf));
+	if (!ascii)
+	{
+		type = M_TRUE;
+		CHECK(write_integer(buf, 1));
+		CHECK(write_symbol("E", buf));
+		CHECK(write(&type, 1, buf));
+	}
 	return OK;
 }
 
+static int
+encode_symbol(const marshal_t *m, buf_t *buf)
+{
+	return write_symbol(m->symbol.name, buf);
+}
+
 static int
 encode_array(const marshal_t *m, buf_t *buf)
 {
@@ -204,31 +395,42 @@ encode_hash(const marshal_t *m, buf_t *buf)
 	return OK;
 }
 
+/* whether a string is written in an ivar (I), binary ones without ivars
+   are old strings */
+static int
+has_ivars(const marshal_t *m)
+{
+	return MARSHAL_STRING == m->type
+		&& (MARSHAL_ENCODING_ASCII_8BIT != m->string.encoding
+			|| m->string.count);
+}
+
+static int
+write_string_body(const marshal_t *m, buf_t *buf)
+{
+	int type = M_STRING;
+	CHECK(write(&type, 1, buf));
+	CHECK(write_integer(buf, m->string.data_size));
+	return write(m->string.data, m->string.data_size, buf);
+}
+
+static int
+write_string_ivars(const marshal_t *m, buf_t *buf)
+{
+	/* TODO encoding must be in pairs */
+	CHECK(write_integer(buf, m->string.count));
+	return write_values(buf, m->string.pairs, m->string.count*2);
+}
+
 static int
 encode_string(const marshal_t *m, buf_t *buf)
 {
-	/* old string */
-	if (MARSHAL_ENCODING_ASCII_8BIT == m->string.encoding)
-	{
-		int type = M_OLD_STRING;
-		CHECK(write(&type, 1, buf));
-		CHECK(write_integer(buf, m->string.data_size));
-		CHECK(write(m->string.data, m->string.data_size, buf));
-	}
-	/* ivar */
-	else
-	{
-		int type = M_IVAR;
-		int subtype = M_STRING;
-		CHECK(write(&type, 1, buf));
-		CHECK(write(&subtype, 1, buf));
-		CHECK(write_integer(buf, m->string.data_size));
-		CHECK(write(m->string.data, m->string.data_size, buf));
-		/* TODO encoding must be in pairs */
-		CHECK(write_integer(buf, m->string.count));
-		CHECK(write_values(buf, m->string.pairs, m->string.count*2));
-	}
-	return OK;
+	int type = M_IVAR;
+	if (!has_ivars(m))
+		return write_string_body(m, buf);
+	CHECK(write(&type, 1, buf));
+	CHECK(write_string_body(m, buf));
+	return write_string_ivars(m, buf);
 }
 
 static int
@@ -253,28 +455,85 @@ encode_module(const marshal_t *m, buf_t *buf)
 	return OK;
 }
 
+/* objects and structs */
 static int
 encode_object(const marshal_t *m, buf_t *buf)
 {
-	int type = M_OBJECT;
+	int type = MARSHAL_STRUCT == m->type ? M_STRUCT : M_OBJECT;
+	int i;
 	CHECK(write(&type, 1, buf));
 	/* write class type (e.g. MyClass) */
 	CHECK(encode(m->object.symbol_instance, buf));
 	CHECK(write_integer(buf, m->object.count));
-	CHECK(write_values(buf, m->object.vars, m->object.count*2));
+	for (i = 0; i < m->object.count; i++)
+	{
+		CHECK(write_symbol(m->object.shape->names[i], buf));
+		CHECK(encode(m->object.vars[i], buf));
+	}
 	return OK;
 }
 
 static int
 encode_userdef(const marshal_t *m, buf_t *buf)
 {
-	int type = M_USERDEF;
+	int type = M_USERDEF, ivar = M_IVAR;
+	if (m->userdef.count)
+		CHECK(write(&ivar, 1, buf));
 	CHECK(write(&type, 1, buf));
 	/* class name */
-	CHECK(encode(m->userdef.symbol_instance, buf));
+	CHECK(write_symbol(m->userdef.klass, buf));
 	CHECK(write_integer(buf, m->userdef.size));
 	CHECK(write(m->userdef.data, m->userdef.size, buf));
-	return OK;
+	if (!m->userdef.count)
+		return OK;
+	CHECK(write_integer(buf, m->userdef.count));
+	return write_values(buf, m->userdef.pairs, m->userdef.count*2);
+}
+
+static int
+wrapped_tag(const marshal_t *m)
+{
+	switch (m->type)
+	{
+		case MARSHAL_USERCLASS: return M_USERCLASS;
+		case MARSHAL_EXTENDED: return M_EXTENDED;
+		case MARSHAL_USRMARSHAL: return M_USRMARSHAL;
+		default: return M_DATA;
+	}
+}
+
+static int
+is_class_wrapper(const marshal_t *m)
+{
+	return MARSHAL_USERCLASS == m->type || MARSHAL_EXTENDED == m->type;
+}
+
+static int
+encode_wrapped(const marshal_t *m, buf_t *buf)
+{
+	const marshal_t *inner = m;
+	const marshal_t *w;
+	int type = M_IVAR;
+
+	/* a string's I goes before the wrappers around it, its ivars after */
+	while (is_class_wrapper(inner))
+		inner = inner->wrapped.value;
+	if (!has_ivars(inner))
+		inner = NULL;
+	else
+		CHECK(write(&type, 1, buf));
+	for (w = m; ; w = w->wrapped.value)
+	{
+		type = wrapped_tag(w);
+		CHECK(write(&type, 1, buf));
+		CHECK(encode(w->wrapped.symbol_instance, buf));
+		if (!inner || !is_class_wrapper(w->wrapped.value))
+			break;
+	}
+	if (!inner)
+		return encode(w->wrapped.value, buf);
+	CHECK(write_string_body(inner, buf));
+	return write_string_ivars(inner, buf);
 }
 
 static int
@@ -295,6 +554,12 @@ encode(const marshal_t *m, buf_t *buf)
 		case MARSHAL_MODULE: return encode_module(m, buf);
 		case MARSHAL_OBJECT: return encode_object(m, buf);
 		case MARSHAL_USERDEF: return encode_userdef(m, buf);
+		case MARSHAL_STRUCT: return encode_object(m, buf);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			return encode_wrapped(m, buf);
 		default:
 			/* fprintf(stderr, "not implemented %d\n", m->type); */
 			return FAILED;
@@ -311,39 +576,135 @@ begin_encode(const marshal_t *m, buf_t *buf)
 	return encode(m, buf);
 }
 
+/* encodes into buf from its start, keeping its memory
+   returns the output, NULL on failure */
+static void *
+encode_root(const marshal_t *marshal, buf_t *buf)
+{
+	double start = stats_on ? stats_clock() : 0;
+	int status;
+	PROBE1(encode__entry, marshal);
+	buf->cur = 0;
+	buf->done = 0;
+	if (buf->sym_count)
+		memset(buf->syms, 0, buf->sym_size * sizeof(sym_t));
+	buf->sym_count = 0;
+	status = begin_encode(marshal, buf);
+	if (OK == status && buf->sink)
+		status = flush(buf);
+	if (FAILED == status)
+		buf->cur = 0;
+	PROBE2(encode__return, status ? NULL : buf->mem, buf->done + buf->cur);
+	if (stats_on)
+	{
+		thread_stats.encodes++;
+		thread_stats.bytes_written += buf->done + buf->cur;
+		thread_stats.encode_seconds += stats_clock() - start;
+	}
+	return status ? NULL : buf->mem;
+}
+
 void *
 marshal_encode(const marshal_t *marshal, size_t *size)
 {
-	buf_t buf = {};
-	if (FAILED == begin_encode(marshal, &buf))
-	{
-		if (buf.mem)
-			free(buf.mem);
-		if (size)
-			*size = 0;
+	buf_t buf;
+	void *mem;
+	memset(&buf, 0, sizeof(buf));
+	mem = encode_root(marshal, &buf);
+	if (!mem && buf.mem)
+		mem_free(buf.mem);
+	mem_free(buf.syms);
+	/* last position (current cursor) is its size */
+	if (size)
+		*size = buf.cur;
+	return mem;
+}
+
+/* an encoder's buffer outlives its calls */
+struct marshal_encoder_t
+{
+	const marshal_allocator_t *allocator;
+	buf_t buf;
+};
+
+marshal_encoder_t *
+marshal_encoder_new(const marshal_allocator_t *allocator)
+{
+	marshal_encoder_t *encoder;
+	const marshal_allocator_t *previous;
+	if (!allocator)
+		allocator = mem_allocator();
+	previous = marshal_use_allocator(allocator);
+	encoder = mem_calloc(1, sizeof(marshal_encoder_t));
+	marshal_use_allocator(previous);
+	if (!encoder)
 		return NULL;
-	}
-	else
-	{
-		/* last position (current cursor) is its size */
-		if (size)
-			*size = buf.cur;
-		return buf.mem;
-	}
+	encoder->allocator = allocator;
+	return encoder;
+}
+
+const void *
+marshal_encoder_encode(marshal_encoder_t *encoder, const marshal_t *marshal,
+	size_t *size)
+{
+	const marshal_allocator_t *previous;
+	void *mem;
+	previous = marshal_use_allocator(encoder->allocator);
+	mem = encode_root(marshal, &encoder->buf);
+	marshal_use_allocator(previous);
+	if (size)
+		*size = encoder->buf.cur;
+	return mem;
+}
+
+void
+marshal_encoder_free(marshal_encoder_t *encoder)
+{
+	const marshal_allocator_t *previous;
+	if (!encoder)
+		return;
+	previous = marshal_use_allocator(encoder->allocator);
+	mem_free(encoder->buf.mem);
+	mem_free(encoder->buf.syms);
+	mem_free(encoder);
+	marshal_use_allocator(previous);
+}
+
+int
+encode_chunks(const marshal_t *marshal, sink_fn sink, void *data)
+{
+	buf_t buf;
+	int status;
+	memset(&buf, 0, sizeof(buf));
+	buf.mem = mem_alloc(SINK_BUFFER_SIZE);
+	CHECK_NULL(buf.mem);
+	buf.size = SINK_BUFFER_SIZE;
+	buf.sink = sink;
+	buf.sink_data = data;
+	status = encode_root(marshal, &buf) ? OK : FAILED;
+	mem_free(buf.mem);
+	mem_free(buf.syms);
+	return status;
+}
+
+static int
+write_file(void *file, const void *buffer, size_t size)
+{
+	return size == fwrite(buffer, 1, size, file) ? OK : FAILED;
 }
 
 int
 marshal_encode_file(const char *path, const marshal_t *marshal)
 {
-	size_t size, written;
-	void *mem = marshal_encode(marshal, &size);
-	FILE *file;
-	if (!mem)
-		return FAILED;
-	file = fopen(path, "wb");
+	int status;
+	FILE *file = fopen(path, "wb");
 	if (!file)
 		return FAILED;
-	written = fwrite(mem, 1, size, file);
-	fclose(file);
-	return size == written ? OK : FAILED;
+	status = encode_chunks(marshal, write_file, file);
+	if (fclose(file))
+		status = FAILED;
+	/* no half written files */
+	if (FAILED == status)
+		remove(path);
+	return status;
 }
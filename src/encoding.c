@@ -17,17 +17,15 @@
 #include <string.h>
 #include "marshal.h"
 
-static struct pair
+static const struct pair
 {
-	char *name;
+	const char *name;
 	int id;
 }
 pairs[] = {
 	{ "", MARSHAL_ENCODING_ASCII_8BIT },
 	{ "T", MARSHAL_ENCODING_UTF_8 },
-	{ "UTF-8", MARSHAL_ENCODING_UTF_8 },
 	{ "F", MARSHAL_ENCODING_US_ASCII },
-	{ "US-ASCII", MARSHAL_ENCODING_US_ASCII },
 	{ "UTF-16BE", MARSHAL_ENCODING_UTF_16BE },
 	{ "UTF-16LE", MARSHAL_ENCODING_UTF_16LE },
 	{ "UTF-32BE", MARSHAL_ENCODING_UTF_32BE },
@@ -64,7 +62,7 @@ pairs[] = {
 	{ "ISO-8859-16", MARSHAL_ENCODING_ISO_8859_16 },
 	{ "KOI8-R", MARSHAL_ENCODING_KOI8_R },
 	{ "KOI8-U", MARSHAL_ENCODING_KOI8_U },
-	{ "Shift-JIS", MARSHAL_ENCODING_Shift_JIS },
+	{ "Shift_JIS", MARSHAL_ENCODING_Shift_JIS },
 	{ "Windows-1250", MARSHAL_ENCODING_Windows_1250 },
 	{ "Windows-1251", MARSHAL_ENCODING_Windows_1251 },
 	{ "Windows-1252", MARSHAL_ENCODING_Windows_1252 },
@@ -103,7 +101,7 @@ pairs[] = {
 	{ "CP950", MARSHAL_ENCODING_CP950 },
 	{ "CP951", MARSHAL_ENCODING_CP951 },
 	{ "IBM037", MARSHAL_ENCODING_IBM037 },
-	{ "stateless-ISO_2022-JP", MARSHAL_ENCODING_stateless_ISO_2022_JP },
+	{ "stateless-ISO-2022-JP", MARSHAL_ENCODING_stateless_ISO_2022_JP },
 	{ "eucJP-ms", MARSHAL_ENCODING_eucJP_ms },
 	{ "CP51932", MARSHAL_ENCODING_CP51932 },
 	{ "EUC-JIS-2004", MARSHAL_ENCODING_EUC_JIS_2004 },
@@ -125,32 +123,74 @@ pairs[] = {
 	{ "ISO-2022-JP-KDDI", MARSHAL_ENCODING_ISO_2022_JP_KDDI },
 	{ "stateless-ISO-2022-JP-KDDI", MARSHAL_ENCODING_stateless_ISO_2022_JP_KDDI },
 	{ "UTF8-SoftBank", MARSHAL_ENCODING_UTF8_SoftBank },
-	{ "SJIS-SoftBank", MARSHAL_ENCODING_SJIS_SoftBank }
+	{ "SJIS-SoftBank", MARSHAL_ENCODING_SJIS_SoftBank },
+	/* aliases */
+	{ "UTF-8", MARSHAL_ENCODING_UTF_8 },
+	{ "US-ASCII", MARSHAL_ENCODING_US_ASCII }
 };
 
+/* a perfect hash of every name in pairs: the slot of a name is the top
+   SLOT_BITS of its FNV-1a hash seeded with SLOT_SEED, holding its pair's
+   index plus one; regenerate it if pairs change */
+#define SLOT_SEED 1137UL
+#define SLOT_BITS 9
+
+static const unsigned char slots[1 << SLOT_BITS] = {
+	1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 66, 0, 0, 0, 0,
+	14, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 71,
+	0, 0, 73, 0, 0, 8, 0, 0, 93, 0, 16, 50, 0, 72, 97, 52,
+	76, 54, 77, 0, 0, 0, 0, 78, 0, 0, 0, 0, 79, 91, 102, 51,
+	0, 0, 0, 0, 0, 0, 98, 0, 0, 55, 2, 0, 0, 53, 0, 0,
+	0, 0, 0, 40, 0, 0, 0, 0, 0, 0, 0, 70, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0,
+	0, 65, 0, 0, 0, 0, 48, 0, 0, 0, 0, 0, 75, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 21, 0, 0, 0, 0, 0, 0, 0, 0, 0, 47, 0, 19,
+	0, 0, 82, 0, 0, 83, 0, 0, 0, 0, 67, 0, 0, 0, 0, 0,
+	10, 0, 90, 0, 0, 0, 0, 0, 99, 0, 0, 0, 69, 0, 0, 80,
+	0, 0, 0, 0, 0, 18, 96, 0, 0, 0, 0, 0, 30, 11, 31, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 24, 0, 25, 0, 0, 0, 23, 0,
+	28, 0, 29, 0, 26, 0, 27, 0, 0, 0, 20, 0, 0, 4, 0, 0,
+	0, 0, 74, 0, 5, 0, 0, 0, 0, 0, 0, 0, 0, 9, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 0, 0,
+	0, 0, 0, 0, 6, 13, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 101, 0, 0, 0, 0, 0, 12, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 49, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 63, 0, 0, 85, 0, 0, 62, 0, 61, 0, 60,
+	87, 59, 86, 58, 0, 57, 0, 56, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 95, 0, 0, 0, 0, 0, 17, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 68, 15, 0, 0, 0, 0, 64, 0, 0, 0, 0,
+	0, 0, 0, 100, 0, 0, 0, 0, 0, 42, 94, 41, 0, 44, 22, 43,
+	0, 89, 0, 45, 0, 46, 0, 88, 0, 0, 0, 0, 0, 92, 0, 0,
+	0, 0, 0, 0, 33, 0, 32, 0, 34, 0, 0, 0, 36, 103, 35, 0,
+	0, 0, 37, 0, 39, 0, 0, 81, 0, 0, 0, 84, 0, 0, 0, 0,
+	0, 0, 38, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* canonical names come first in id order, so pairs[id] is id's name */
+#define NAME_COUNT (MARSHAL_ENCODING_SJIS_SoftBank + 1)
+
 int
 marshal_encoding_name_to_id(const char *name)
 {
-	int i;
-	for (i = 0; i < (int)(sizeof(pairs) / sizeof(pairs[0])); i++)
-	{
-		struct pair *p = &pairs[i];
-		if (0 == strcmp(name, p->name))
-			return p->id;
-	}
+	const unsigned char *c = (const unsigned char *)name;
+	unsigned long h = SLOT_SEED;
+	int slot;
+	while (*c)
+		h = ((h ^ *c++) * 16777619UL) & 0xFFFFFFFFUL;
+	slot = slots[h >> (32 - SLOT_BITS)];
+	if (slot && 0 == strcmp(name, pairs[slot - 1].name))
+		return pairs[slot - 1].id;
 	return -1;
 }
 
 const char *
 marshal_encoding_id_to_name(int id)
 {
-	int i;
-	for (i = 0; i < (int)(sizeof(pairs) / sizeof(pairs[0])); i++)
-	{
-		struct pair *p = &pairs[i];
-		if (id == p->id)
-			return p->name;
-	}
-	return NULL;
+	if (id < 0 || id >= NAME_COUNT)
+		return NULL;
+	return pairs[id].name;
 }
-
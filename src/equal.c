@@ -120,18 +120,24 @@ static int
 equal_object(const marshal_t *a, const marshal_t *b)
 {
 	int i;
+	const marshal_shape_t *shape = a->object.shape;
 	if (a->object.count != b->object.count
 			|| 0 != strcmp(a->object.klass, b->object.klass))
 		return 0;
+	/* same layout, compare slot by slot */
+	if (shape == b->object.shape)
+	{
+		for (i = 0; i < a->object.count; i++)
+		{
+			if (!equal(a->object.vars[i], b->object.vars[i]))
+				return 0;
+		}
+		return 1;
+	}
 	for (i = 0; i < a->object.count; i++)
 	{
-		marshal_t *found;
-		marshal_t *key = a->object.vars[i*2];
-
-		if (MARSHAL_SYMBOL != key->type)
-			return 0;
-		found = marshal_object_get(b, key->symbol.name);
-		if (!found || !equal(a->object.vars[i*2+1], found))
+		marshal_t *found = marshal_object_get(b, shape->names[i]);
+		if (!found || !equal(a->object.vars[i], found))
 			return 0;
 	}
 	return 1;
@@ -140,10 +146,26 @@ equal_object(const marshal_t *a, const marshal_t *b)
 static int
 equal_userdef(const marshal_t *a, const marshal_t *b)
 {
-	int size = a->userdef.size;
-	return a->userdef.size == b->userdef.size
-		&& 0 == strcmp(a->userdef.klass, b->userdef.klass)
-		&& 0 == memcmp(a->userdef.data, b->userdef.data, size);
+	int i;
+	if (a->userdef.size != b->userdef.size
+			|| a->userdef.count != b->userdef.count
+			|| 0 != strcmp(a->userdef.klass, b->userdef.klass)
+			|| 0 != memcmp(a->userdef.data, b->userdef.data,
+				a->userdef.size))
+		return 0;
+	for (i = 0; i < a->userdef.count*2; i++)
+	{
+		if (!equal(a->userdef.pairs[i], b->userdef.pairs[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+equal_wrapped(const marshal_t *a, const marshal_t *b)
+{
+	return 0 == strcmp(a->wrapped.klass, b->wrapped.klass)
+		&& equal(a->wrapped.value, b->wrapped.value);
 }
 
 static int
@@ -169,6 +191,12 @@ equal(const marshal_t *a, const marshal_t *b)
 		case MARSHAL_MODULE: return equal_module(a, b);
 		case MARSHAL_OBJECT: return equal_object(a, b);
 		case MARSHAL_USERDEF: return equal_userdef(a, b);
+		case MARSHAL_STRUCT: return equal_object(a, b);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			return equal_wrapped(a, b);
 		default:
 			/* fprintf(stderr, "not implemented %d\n", m->type); */
 			return 1;
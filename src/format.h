@@ -33,6 +33,12 @@
 #define M_MODULE 'm'
 #define M_OBJECT 'o'
 #define M_USERDEF 'u'
+#define M_STRUCT 'S'
+#define M_USERCLASS 'C'
+#define M_EXTENDED 'e'
+#define M_USRMARSHAL 'U'
+#define M_DATA 'd'
+#define M_OLD_MODULE 'M'
 
 #define M_SYMLINK ';'
 #define M_OBJECT_REF '@'
@@ -14,65 +14,88 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <stdlib.h>
-#include "marshal.h"
-
-/* I think some libc implementations do not take free(NULL) as a nop */
-static void
-sfree(void *mem)
-{
-	if (mem)
-		free(mem);
-}
+#include "internal.h"
 
 void
-marshal_free(marshal_t *marshal)
+node_clear(marshal_t *marshal)
 {
 	int i;
-	if (!marshal)
-		return;
 	switch (marshal->type)
 	{
 		case MARSHAL_SYMBOL:
-			sfree(marshal->symbol.name);
+			if (!IS_INLINE_SYMBOL(marshal))
+				mem_free(marshal->symbol.name);
 			break;
 		case MARSHAL_BIGNUM:
-			sfree(marshal->bignum.bytes);
+			mem_free(marshal->bignum.bytes);
 			break;
 		case MARSHAL_ARRAY:
 			for (i = 0; i < marshal->array.count; i++)
 				marshal_free(marshal->array.values[i]);
-			sfree(marshal->array.values);
+			mem_free(marshal->array.values);
 			break;
 		case MARSHAL_HASH:
 			for (i = 0; i < marshal->hash.count * 2; i++)
 				marshal_free(marshal->hash.pairs[i]);
-			sfree(marshal->hash.pairs);
+			mem_free(marshal->hash.pairs);
+			marshal_free(marshal->hash.def);
+			mem_free(marshal->hash.index);
 			break;
 		case MARSHAL_STRING:
-			sfree(marshal->string.data);
+			if (!IS_INLINE_STRING(marshal))
+				mem_free(marshal->string.data);
 			for (i = 0; i < marshal->string.count * 2; i++)
 				marshal_free(marshal->string.pairs[i]);
-			sfree(marshal->string.pairs);
+			mem_free(marshal->string.pairs);
 			break;
 		case MARSHAL_REGEX:
 			/* TODO */
 			break;
 		case MARSHAL_CLASS:
-			sfree(marshal->klass.name);
+			mem_free(marshal->klass.name);
 			break;
 		case MARSHAL_MODULE:
-			sfree(marshal->module.name);
+			mem_free(marshal->module.name);
 			break;
 		case MARSHAL_OBJECT:
-			for (i = 0; i < marshal->object.count * 2; i++)
+		case MARSHAL_STRUCT:
+			for (i = 0; i < marshal->object.count; i++)
 				marshal_free(marshal->object.vars[i]);
-			sfree(marshal->object.vars);
+			mem_free(marshal->object.vars);
 			marshal_free(marshal->object.symbol_instance);
+			shape_release(marshal->object.shape);
 			break;
 		case MARSHAL_USERDEF:
-			sfree(marshal->userdef.data);
+			mem_free(marshal->userdef.data);
 			marshal_free(marshal->userdef.symbol_instance);
+			for (i = 0; i < marshal->userdef.count * 2; i++)
+				marshal_free(marshal->userdef.pairs[i]);
+			mem_free(marshal->userdef.pairs);
+			break;
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			marshal_free(marshal->wrapped.value);
+			marshal_free(marshal->wrapped.symbol_instance);
+	}
+}
+
+void
+marshal_free(marshal_t *marshal)
+{
+	if (!marshal)
+		return;
+	/* nodes of a block go away with it, singletons never do */
+	if (marshal->head.shared < 0)
+	{
+		if (SHARED_BLOCK == marshal->head.shared)
+			block_free(marshal);
+		return;
 	}
-	free(marshal);
+	/* shared nodes go away with their last reference */
+	if (marshal->head.shared && ATOMIC_DEC(marshal->head.shared) > 0)
+		return;
+	node_clear(marshal);
+	mem_free(marshal);
 }
@@ -0,0 +1,1442 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+#include "internal.h"
+
+/* A frozen image is a header followed by nodes, every reference in it is
+   self-relative (the referenced address minus the reference's own one, 0
+   for none), so an image works wherever it's mapped. Numbers are in the
+   writer's byte order, the header tells it. Hash indexes use
+   marshal_hash_value, so the format version changes along with it. */
+
+#define MAGIC "MARSHFZ"
+#define FROZEN_VERSION 2
+#define BYTE_ORDER_MARK 0x01020304u
+
+#define OK 0
+#define FAILED 1
+
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint64_t size;
+	int64_t root; /* from the image's start */
+} header_t;
+
+/* data holds the value of integers, booleans and floats, it refers to
+   the payload of the rest:
+   bignum: bytes (flags is 1 when negative), count is the length
+   symbol, class, module: name, count is its length
+   string: string_body_t, then bytes (NUL terminated), count is their size
+   array: refs[count]
+   hash: hash_body_t, then refs[count*2] (key, value) and the index
+   object, struct: object_body_t, then refs[count] (values)
+   userdef: userdef_body_t, then bytes[count]
+   userclass, extended, usrmarshal, data: klass ref, then the value's */
+struct marshal_fnode_t
+{
+	uint8_t type;
+	uint8_t flags;
+	uint16_t encoding;
+	uint32_t count;
+	int64_t data;
+};
+
+typedef struct marshal_fnode_t fnode_t;
+
+typedef struct
+{
+	int64_t def;
+	uint32_t index_size; /* slots, 0 when there's no index */
+	uint32_t pad;
+} hash_body_t;
+
+typedef struct
+{
+	uint32_t hash; /* low half of the key's marshal_hash_value */
+	uint32_t pair; /* pair index + 1, 0 when empty */
+} slot_t;
+
+typedef struct
+{
+	int64_t pairs; /* refs[count*2] to the ivars, the encoding's among them */
+	uint32_t count;
+	uint32_t pad;
+} string_body_t;
+
+typedef struct
+{
+	int64_t klass;
+	int64_t names; /* refs[count] to ivar names, shared by a shape */
+} object_body_t;
+
+typedef struct
+{
+	int64_t klass;
+	int64_t pairs; /* refs[count*2] to the ivars of the dumped string */
+	uint32_t count;
+	uint32_t pad;
+} userdef_body_t;
+
+struct marshal_frozen_t
+{
+	const char *base;
+	size_t size;
+	int mapped;
+	void *owned; /* read instead of mapped */
+};
+
+static const void *
+follow(const int64_t *ref)
+{
+	return *ref ? (const char *)ref + *ref : NULL;
+}
+
+/* writing */
+
+/* names, shapes and shared nodes already written */
+typedef struct
+{
+	uint64_t hash;
+	const void *key; /* the shape or the node, NULL for names */
+	int64_t offset;
+} intern_t;
+
+typedef struct
+{
+	char *mem;
+	size_t size;
+	size_t cur;
+	intern_t *interns;
+	size_t intern_size;
+	size_t intern_count;
+} writer_t;
+
+/* returns the offset of size zeroed bytes, -1 on failure */
+static int64_t
+reserve(writer_t *w, size_t size, int aligned)
+{
+	size_t at = aligned ? ALIGN(w->cur) : w->cur;
+	if (at + size > w->size)
+	{
+		size_t grown = w->size ? w->size : 4096;
+		char *mem;
+		while (grown < at + size)
+			grown *= 2;
+		mem = mem_realloc(w->mem, grown);
+		if (!mem)
+			return -1;
+		w->mem = mem;
+		w->size = grown;
+	}
+	memset(w->mem + w->cur, 0, at + size - w->cur);
+	w->cur = at + size;
+	return at;
+}
+
+static int64_t
+put(writer_t *w, const void *data, size_t size, int aligned)
+{
+	int64_t at = reserve(w, size, aligned);
+	if (at >= 0)
+		memcpy(w->mem + at, data, size);
+	return at;
+}
+
+static void
+set_ref(writer_t *w, int64_t ref, int64_t target)
+{
+	int64_t rel = target - ref;
+	memcpy(w->mem + ref, &rel, sizeof(rel));
+}
+
+static fnode_t *
+node_at(writer_t *w, int64_t at)
+{
+	return (fnode_t *)(w->mem + at);
+}
+
+static int
+intern_grow(writer_t *w)
+{
+	intern_t *old = w->interns;
+	size_t size = w->intern_size, i;
+
+	w->intern_size = size ? size * 2 : 256;
+	w->interns = mem_calloc(w->intern_size, sizeof(intern_t));
+	if (!w->interns)
+	{
+		w->interns = old;
+		w->intern_size = size;
+		return FAILED;
+	}
+	for (i = 0; i < size; i++)
+	{
+		size_t j, mask = w->intern_size - 1;
+		if (!old[i].offset)
+			continue;
+		for (j = old[i].hash & mask; w->interns[j].offset; j = (j+1) & mask)
+			;
+		w->interns[j] = old[i];
+	}
+	if (old)
+		mem_free(old);
+	return OK;
+}
+
+/* finds a name (key NULL), a shape's names or a node, offset 0 when
+   missing */
+static intern_t *
+intern_find(writer_t *w, uint64_t hash, const void *key, const char *name)
+{
+	size_t i, mask;
+	if ((w->intern_count + 1) * 2 > w->intern_size && intern_grow(w))
+		return NULL;
+	mask = w->intern_size - 1;
+	for (i = hash & mask; w->interns[i].offset; i = (i+1) & mask)
+	{
+		intern_t *entry = &w->interns[i];
+		if (entry->hash != hash || entry->key != key)
+			continue;
+		if (key || 0 == strcmp(w->mem + entry->offset, name))
+			return entry;
+	}
+	w->interns[i].hash = hash;
+	w->interns[i].key = key;
+	return &w->interns[i];
+}
+
+/* names are written once, returns their offset, -1 on failure */
+static int64_t
+put_name(writer_t *w, const char *name)
+{
+	intern_t *entry = intern_find(w, hash_symbol(name), NULL, name);
+	int64_t at;
+	if (!entry)
+		return -1;
+	if (entry->offset)
+		return entry->offset;
+	at = put(w, name, strlen(name) + 1, 0);
+	if (at < 0)
+		return -1;
+	entry->offset = at;
+	w->intern_count++;
+	return at;
+}
+
+static int64_t
+put_shape(writer_t *w, const marshal_shape_t *shape)
+{
+	intern_t *entry = intern_find(w, (uint64_t)shape->id, shape, NULL);
+	int64_t at;
+	int i;
+	if (!entry)
+		return -1;
+	if (entry->offset)
+		return entry->offset;
+	at = reserve(w, shape->count * sizeof(int64_t), 1);
+	if (at < 0)
+		return -1;
+	/* the entry may move while names are added */
+	entry->offset = at;
+	w->intern_count++;
+	for (i = 0; i < shape->count; i++)
+	{
+		int64_t name = put_name(w, shape->names[i]);
+		if (name < 0)
+			return -1;
+		set_ref(w, at + i * sizeof(int64_t), name);
+	}
+	return at;
+}
+
+static int64_t
+freeze(writer_t *w, const marshal_t *m);
+
+/* freezes children into refs[count] at body */
+static int
+freeze_values(writer_t *w, int64_t body, int count, void **values)
+{
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		int64_t child;
+		if (!values[i])
+			continue;
+		child = freeze(w, values[i]);
+		if (child < 0)
+			return FAILED;
+		set_ref(w, body + i * sizeof(int64_t), child);
+	}
+	return OK;
+}
+
+static int
+freeze_hash(writer_t *w, int64_t at, const marshal_t *m)
+{
+	int count = m->hash.count;
+	uint32_t size = 0;
+	int64_t body, pairs;
+	slot_t *slots;
+	int i;
+
+	if (count >= INDEX_MIN_COUNT)
+		for (size = 16; size < (uint32_t)count * 2; size *= 2)
+			;
+	body = reserve(w, sizeof(hash_body_t) + count * 2 * sizeof(int64_t)
+		+ size * sizeof(slot_t), 1);
+	if (body < 0)
+		return FAILED;
+	set_ref(w, at + offsetof(fnode_t, data), body);
+	pairs = body + sizeof(hash_body_t);
+
+	/* fill the index before the buffer moves */
+	((hash_body_t *)(w->mem + body))->index_size = size;
+	slots = (slot_t *)(w->mem + pairs + count * 2 * sizeof(int64_t));
+	for (i = 0; size && i < count; i++)
+	{
+		uint32_t hash = (uint32_t)marshal_hash_value(m->hash.pairs[i*2]);
+		uint32_t j = hash & (size - 1);
+		while (slots[j].pair)
+			j = (j+1) & (size - 1);
+		slots[j].hash = hash;
+		slots[j].pair = i + 1;
+	}
+
+	if (freeze_values(w, pairs, count * 2, m->hash.pairs))
+		return FAILED;
+	if (m->hash.def)
+	{
+		int64_t def = freeze(w, m->hash.def);
+		if (def < 0)
+			return FAILED;
+		set_ref(w, body + offsetof(hash_body_t, def), def);
+	}
+	return OK;
+}
+
+static int
+freeze_object(writer_t *w, int64_t at, const marshal_t *m)
+{
+	int64_t body, klass, names;
+	body = reserve(w, sizeof(object_body_t)
+		+ m->object.count * sizeof(int64_t), 1);
+	if (body < 0)
+		return FAILED;
+	set_ref(w, at + offsetof(fnode_t, data), body);
+	klass = put_name(w, m->object.klass);
+	names = put_shape(w, m->object.shape);
+	if (klass < 0 || names < 0)
+		return FAILED;
+	set_ref(w, body + offsetof(object_body_t, klass), klass);
+	set_ref(w, body + offsetof(object_body_t, names), names);
+	return freeze_values(w, body + sizeof(object_body_t), m->object.count,
+		m->object.vars);
+}
+
+static int
+freeze_string(writer_t *w, int64_t at, const marshal_t *m)
+{
+	int count = m->string.count;
+	int64_t body, pairs;
+	body = reserve(w, sizeof(string_body_t) + m->string.data_size + 1, 1);
+	if (body < 0)
+		return FAILED;
+	memcpy(w->mem + body + sizeof(string_body_t), m->string.data,
+		m->string.data_size);
+	set_ref(w, at + offsetof(fnode_t, data), body);
+	if (!count)
+		return OK;
+	((string_body_t *)(w->mem + body))->count = count;
+	pairs = reserve(w, count * 2 * sizeof(int64_t), 1);
+	if (pairs < 0)
+		return FAILED;
+	set_ref(w, body + offsetof(string_body_t, pairs), pairs);
+	return freeze_values(w, pairs, count * 2, m->string.pairs);
+}
+
+static int
+freeze_userdef(writer_t *w, int64_t at, const marshal_t *m)
+{
+	int count = m->userdef.count;
+	int64_t body, klass, pairs;
+	body = reserve(w, sizeof(userdef_body_t) + m->userdef.size, 1);
+	if (body < 0)
+		return FAILED;
+	memcpy(w->mem + body + sizeof(userdef_body_t), m->userdef.data,
+		m->userdef.size);
+	set_ref(w, at + offsetof(fnode_t, data), body);
+	klass = put_name(w, m->userdef.klass);
+	if (klass < 0)
+		return FAILED;
+	set_ref(w, body + offsetof(userdef_body_t, klass), klass);
+	if (!count)
+		return OK;
+	((userdef_body_t *)(w->mem + body))->count = count;
+	pairs = reserve(w, count * 2 * sizeof(int64_t), 1);
+	if (pairs < 0)
+		return FAILED;
+	set_ref(w, body + offsetof(userdef_body_t, pairs), pairs);
+	return freeze_values(w, pairs, count * 2, m->userdef.pairs);
+}
+
+static int
+freeze_wrapped(writer_t *w, int64_t at, const marshal_t *m)
+{
+	int64_t body, klass, value;
+	body = reserve(w, 2 * sizeof(int64_t), 1);
+	if (body < 0)
+		return FAILED;
+	set_ref(w, at + offsetof(fnode_t, data), body);
+	klass = put_name(w, m->wrapped.klass);
+	if (klass < 0)
+		return FAILED;
+	set_ref(w, body, klass);
+	value = freeze(w, m->wrapped.value);
+	if (value < 0)
+		return FAILED;
+	set_ref(w, body + sizeof(int64_t), value);
+	return OK;
+}
+
+static int
+freeze_bytes(writer_t *w, int64_t at, const void *data, size_t size)
+{
+	int64_t body = put(w, data, size, 0);
+	if (body < 0)
+		return FAILED;
+	set_ref(w, at + offsetof(fnode_t, data), body);
+	return OK;
+}
+
+static int
+freeze_name(writer_t *w, int64_t at, const char *name)
+{
+	int64_t body = put_name(w, name);
+	if (body < 0)
+		return FAILED;
+	node_at(w, at)->count = strlen(name);
+	set_ref(w, at + offsetof(fnode_t, data), body);
+	return OK;
+}
+
+/* returns the node's offset, -1 on failure */
+static int64_t
+freeze(writer_t *w, const marshal_t *m)
+{
+	intern_t *entry = NULL;
+	int64_t at, body;
+	fnode_t *node;
+	int status = OK;
+
+	/* a shared node is written once, its other parents refer to it, so
+	   a dag doesn't grow into a tree */
+	if (m->head.shared > 0 || SHARED_STATIC == m->head.shared)
+	{
+		entry = intern_find(w, (uint64_t)((size_t)m / sizeof(void *)), m,
+			NULL);
+		if (!entry)
+			return -1;
+		if (entry->offset)
+			return entry->offset;
+	}
+	at = reserve(w, sizeof(fnode_t), 1);
+	if (at < 0)
+		return -1;
+	if (entry)
+	{
+		entry->offset = at;
+		w->intern_count++;
+	}
+	node = node_at(w, at);
+	node->type = m->type;
+	switch (m->type)
+	{
+		case MARSHAL_NIL:
+			break;
+		case MARSHAL_BOOLEAN:
+			node->data = m->boolean.value;
+			break;
+		case MARSHAL_INTEGER:
+			node->data = m->integer.value;
+			break;
+		case MARSHAL_FLOAT:
+			memcpy(&node->data, &m->float_no.value, sizeof(double));
+			break;
+		case MARSHAL_BIGNUM:
+			node->flags = m->bignum.sign < 0;
+			node->count = m->bignum.length;
+			status = freeze_bytes(w, at, m->bignum.bytes,
+				m->bignum.length);
+			break;
+		case MARSHAL_SYMBOL:
+			status = freeze_name(w, at, m->symbol.name);
+			break;
+		case MARSHAL_CLASS:
+			status = freeze_name(w, at, m->klass.name);
+			break;
+		case MARSHAL_MODULE:
+			status = freeze_name(w, at, m->module.name);
+			break;
+		case MARSHAL_STRING:
+			node->encoding = m->string.encoding;
+			node->count = m->string.data_size;
+			status = freeze_string(w, at, m);
+			break;
+		case MARSHAL_ARRAY:
+			node->count = m->array.count;
+			body = reserve(w, m->array.count * sizeof(int64_t), 1);
+			if (body < 0)
+				return -1;
+			set_ref(w, at + offsetof(fnode_t, data), body);
+			status = freeze_values(w, body, m->array.count,
+				m->array.values);
+			break;
+		case MARSHAL_HASH:
+			node->count = m->hash.count;
+			status = freeze_hash(w, at, m);
+			break;
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			node->count = m->object.count;
+			status = freeze_object(w, at, m);
+			break;
+		case MARSHAL_USERDEF:
+			node->count = m->userdef.size;
+			status = freeze_userdef(w, at, m);
+			break;
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			node->count = 1;
+			status = freeze_wrapped(w, at, m);
+			break;
+		default:
+			return -1;
+	}
+	return OK == status ? at : -1;
+}
+
+void *
+marshal_freeze(const marshal_t *marshal, size_t *size)
+{
+	writer_t w;
+	header_t *header;
+	int64_t root;
+
+	memset(&w, 0, sizeof(w));
+	if (reserve(&w, sizeof(header_t), 1) < 0)
+		return NULL;
+	root = freeze(&w, marshal);
+	if (w.interns)
+		mem_free(w.interns);
+	if (root < 0)
+	{
+		mem_free(w.mem);
+		return NULL;
+	}
+
+	header = (header_t *)w.mem;
+	memcpy(header->magic, MAGIC, sizeof(header->magic));
+	header->version = FROZEN_VERSION;
+	header->order = BYTE_ORDER_MARK;
+	header->size = w.cur;
+	header->root = root;
+	if (size)
+		*size = w.cur;
+	return w.mem;
+}
+
+int
+marshal_freeze_to_file(const marshal_t *marshal, const char *path)
+{
+	size_t size, written;
+	void *mem = marshal_freeze(marshal, &size);
+	FILE *file;
+	if (!mem)
+		return FAILED;
+	file = fopen(path, "wb");
+	if (!file)
+	{
+		mem_free(mem);
+		return FAILED;
+	}
+	written = fwrite(mem, 1, size, file);
+	if (fclose(file))
+		written = 0;
+	mem_free(mem);
+	return size == written ? OK : FAILED;
+}
+
+/* reading */
+
+static int
+check_header(const void *image, size_t size)
+{
+	const header_t *header = image;
+	if (size < sizeof(header_t)
+			|| 0 != memcmp(header->magic, MAGIC, sizeof(header->magic))
+			|| FROZEN_VERSION != header->version
+			|| BYTE_ORDER_MARK != header->order
+			|| header->size != size
+			|| header->root < (int64_t)sizeof(header_t)
+			|| header->root % 8
+			|| (uint64_t)header->root + sizeof(fnode_t) > size)
+		return FAILED;
+	return OK;
+}
+
+/* every node reachable from the root is checked once before the image is
+   used, so the accessors can follow its references blindly */
+typedef struct
+{
+	const char *base;
+	uint64_t size;
+	unsigned char *marks; /* 2 bits for each 8 bytes, see check_node */
+} checker_t;
+
+#define BEING_CHECKED 1
+#define CHECKED 2
+
+static int
+check_node(checker_t *c, uint64_t at);
+
+/* returns the offset the reference at at points to, where size bytes
+   must fit (8 bytes aligned when aligned), 0 for none, -1 when it's out of
+   the image */
+static int64_t
+check_ref(const checker_t *c, uint64_t at, uint64_t size, int aligned)
+{
+	int64_t rel;
+	uint64_t target;
+	memcpy(&rel, c->base + at, sizeof(rel));
+	if (!rel)
+		return 0;
+	/* wraps around for references out of the image */
+	target = at + (uint64_t)rel;
+	if (target < sizeof(header_t) || target > c->size
+			|| size > c->size - target || (aligned && target % 8))
+		return -1;
+	return (int64_t)target;
+}
+
+/* names must be there and end within the image */
+static int
+check_name(const checker_t *c, uint64_t at)
+{
+	int64_t name = check_ref(c, at, 1, 0);
+	if (name <= 0 || !memchr(c->base + name, 0, c->size - name))
+		return FAILED;
+	return OK;
+}
+
+/* refs[count] at at, none of them can be 0 when required */
+static int
+check_refs(checker_t *c, uint64_t at, uint64_t count, int required)
+{
+	uint64_t i;
+	for (i = 0; i < count; i++)
+	{
+		int64_t child = check_ref(c, at + i * sizeof(int64_t),
+			sizeof(fnode_t), 1);
+		if (child < 0 || (!child && required)
+				|| (child && check_node(c, child)))
+			return FAILED;
+	}
+	return OK;
+}
+
+/* a node's body, size bytes at its data reference */
+static int64_t
+check_body(const checker_t *c, uint64_t at, uint64_t size)
+{
+	int64_t body = check_ref(c, at + offsetof(fnode_t, data), size, 1);
+	return body ? body : -1;
+}
+
+static int
+check_hash(checker_t *c, uint64_t at, const fnode_t *node)
+{
+	uint64_t pairs_size = (uint64_t)node->count * 2 * sizeof(int64_t);
+	int64_t body = check_body(c, at, sizeof(hash_body_t) + pairs_size);
+	const hash_body_t *hash;
+	const slot_t *slots;
+	uint32_t i, empty = 0;
+
+	if (body < 0)
+		return FAILED;
+	hash = (const hash_body_t *)(c->base + body);
+	/* lookups probe until an empty slot */
+	if (hash->index_size)
+	{
+		if (hash->index_size & (hash->index_size - 1)
+				|| (uint64_t)hash->index_size * sizeof(slot_t)
+					> c->size - body - sizeof(hash_body_t) - pairs_size)
+			return FAILED;
+		slots = (const slot_t *)(c->base + body + sizeof(hash_body_t)
+			+ pairs_size);
+		for (i = 0; i < hash->index_size; i++)
+		{
+			if (slots[i].pair > node->count)
+				return FAILED;
+			empty += !slots[i].pair;
+		}
+		if (!empty)
+			return FAILED;
+	}
+	if (check_refs(c, body + offsetof(hash_body_t, def), 1, 0))
+		return FAILED;
+	return check_refs(c, body + sizeof(hash_body_t), node->count * 2, 1);
+}
+
+static int
+check_object(checker_t *c, uint64_t at, const fnode_t *node)
+{
+	int64_t body = check_body(c, at, sizeof(object_body_t)
+		+ (uint64_t)node->count * sizeof(int64_t));
+	int64_t names;
+	uint32_t i;
+
+	if (body < 0 || check_name(c, body + offsetof(object_body_t, klass)))
+		return FAILED;
+	names = check_ref(c, body + offsetof(object_body_t, names),
+		(uint64_t)node->count * sizeof(int64_t), 1);
+	if (names < 0 || (!names && node->count))
+		return FAILED;
+	for (i = 0; i < node->count; i++)
+	{
+		if (check_name(c, names + i * sizeof(int64_t)))
+			return FAILED;
+	}
+	return check_refs(c, body + sizeof(object_body_t), node->count, 0);
+}
+
+/* ivars of strings and userdefs, refs[count*2] */
+static int
+check_pairs(checker_t *c, uint64_t at, uint32_t count)
+{
+	int64_t pairs;
+	if (!count)
+		return OK;
+	pairs = check_ref(c, at, (uint64_t)count * 2 * sizeof(int64_t), 1);
+	if (pairs <= 0)
+		return FAILED;
+	return check_refs(c, pairs, (uint64_t)count * 2, 0);
+}
+
+static int
+check_type(checker_t *c, uint64_t at, const fnode_t *node)
+{
+	int64_t body;
+	switch (node->type)
+	{
+		case MARSHAL_NIL:
+		case MARSHAL_BOOLEAN:
+		case MARSHAL_INTEGER:
+		case MARSHAL_FLOAT:
+			return OK;
+		case MARSHAL_BIGNUM:
+			return check_ref(c, at + offsetof(fnode_t, data), node->count,
+				0) > 0 ? OK : FAILED;
+		case MARSHAL_SYMBOL:
+		case MARSHAL_CLASS:
+		case MARSHAL_MODULE:
+			return check_name(c, at + offsetof(fnode_t, data));
+		case MARSHAL_STRING:
+			/* bytes are NUL terminated */
+			body = check_body(c, at, sizeof(string_body_t)
+				+ (uint64_t)node->count + 1);
+			if (body < 0
+					|| c->base[body + sizeof(string_body_t) + node->count])
+				return FAILED;
+			return check_pairs(c, body + offsetof(string_body_t, pairs),
+				((const string_body_t *)(c->base + body))->count);
+		case MARSHAL_ARRAY:
+			body = check_body(c, at,
+				(uint64_t)node->count * sizeof(int64_t));
+			return body < 0 ? FAILED : check_refs(c, body, node->count, 0);
+		case MARSHAL_HASH:
+			return check_hash(c, at, node);
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			return check_object(c, at, node);
+		case MARSHAL_USERDEF:
+			body = check_body(c, at, sizeof(userdef_body_t)
+				+ (uint64_t)node->count);
+			if (body < 0
+					|| check_name(c, body + offsetof(userdef_body_t, klass)))
+				return FAILED;
+			return check_pairs(c, body + offsetof(userdef_body_t, pairs),
+				((const userdef_body_t *)(c->base + body))->count);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			body = check_body(c, at, 2 * sizeof(int64_t));
+			if (body < 0 || check_name(c, body))
+				return FAILED;
+			return check_refs(c, body + sizeof(int64_t), 1, 1);
+		default:
+			return FAILED;
+	}
+}
+
+/* shared nodes are checked once, a node met while it's being checked
+   makes a cycle, which the format can't have */
+static int
+check_node(checker_t *c, uint64_t at)
+{
+	uint64_t slot = at / 8;
+	unsigned char *mark = &c->marks[slot / 4];
+	int shift = (int)(slot % 4) * 2;
+	int state = (*mark >> shift) & 3;
+
+	if (CHECKED == state)
+		return OK;
+	if (BEING_CHECKED == state)
+		return FAILED;
+	*mark |= BEING_CHECKED << shift;
+	if (check_type(c, at, (const fnode_t *)(c->base + at)))
+		return FAILED;
+	*mark ^= (BEING_CHECKED ^ CHECKED) << shift;
+	return OK;
+}
+
+static int
+check_image(const void *image, size_t size)
+{
+	const header_t *header = image;
+	checker_t c;
+	int status;
+
+	if (check_header(image, size))
+		return FAILED;
+	c.base = image;
+	c.size = size;
+	c.marks = mem_calloc(size / 32 + 1, 1);
+	if (!c.marks)
+		return FAILED;
+	status = check_node(&c, header->root);
+	mem_free(c.marks);
+	return status;
+}
+
+marshal_frozen_t *
+marshal_frozen_load(const void *image, size_t size)
+{
+	marshal_frozen_t *frozen;
+	if (!image || check_image(image, size))
+		return NULL;
+	frozen = mem_calloc(1, sizeof(marshal_frozen_t));
+	if (!frozen)
+		return NULL;
+	frozen->base = image;
+	frozen->size = size;
+	return frozen;
+}
+
+#ifndef _WIN32
+marshal_frozen_t *
+marshal_frozen_open(const char *path)
+{
+	marshal_frozen_t *frozen;
+	struct stat st;
+	void *image;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(header_t))
+	{
+		close(fd);
+		return NULL;
+	}
+	/* pages are shared between every process mapping the image */
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == image)
+		return NULL;
+	frozen = marshal_frozen_load(image, st.st_size);
+	if (!frozen)
+	{
+		munmap(image, st.st_size);
+		return NULL;
+	}
+	frozen->mapped = 1;
+	return frozen;
+}
+#else
+marshal_frozen_t *
+marshal_frozen_open(const char *path)
+{
+	marshal_frozen_t *frozen;
+	void *image;
+	long size;
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	image = size > 0 ? mem_alloc(size) : NULL;
+	if (!image || (size_t)size != fread(image, 1, size, file))
+	{
+		if (image)
+			mem_free(image);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	frozen = marshal_frozen_load(image, size);
+	if (!frozen)
+	{
+		mem_free(image);
+		return NULL;
+	}
+	frozen->owned = image;
+	return frozen;
+}
+#endif
+
+void
+marshal_frozen_close(marshal_frozen_t *frozen)
+{
+	if (!frozen)
+		return;
+#ifndef _WIN32
+	if (frozen->mapped)
+		munmap((void *)frozen->base, frozen->size);
+#endif
+	if (frozen->owned)
+		mem_free(frozen->owned);
+	mem_free(frozen);
+}
+
+const marshal_fnode_t *
+marshal_frozen_root(const marshal_frozen_t *frozen)
+{
+	const header_t *header = (const header_t *)frozen->base;
+	return (const fnode_t *)(frozen->base + header->root);
+}
+
+int
+marshal_fnode_type(const marshal_fnode_t *node)
+{
+	return node->type;
+}
+
+int
+marshal_fnode_count(const marshal_fnode_t *node)
+{
+	switch (node->type)
+	{
+		case MARSHAL_NIL:
+		case MARSHAL_BOOLEAN:
+		case MARSHAL_INTEGER:
+		case MARSHAL_FLOAT:
+			return 0;
+		default:
+			return node->count;
+	}
+}
+
+int
+marshal_fnode_int(const marshal_fnode_t *node)
+{
+	if (MARSHAL_BIGNUM == node->type)
+		return node->flags ? -1 : 1;
+	return (int)node->data;
+}
+
+double
+marshal_fnode_float(const marshal_fnode_t *node)
+{
+	double value;
+	memcpy(&value, &node->data, sizeof(value));
+	return value;
+}
+
+const char *
+marshal_fnode_name(const marshal_fnode_t *node)
+{
+	const int64_t *body;
+	switch (node->type)
+	{
+		case MARSHAL_SYMBOL:
+		case MARSHAL_CLASS:
+		case MARSHAL_MODULE:
+			return follow(&node->data);
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+		case MARSHAL_USERDEF:
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			/* klass comes first in their bodies */
+			body = follow(&node->data);
+			return follow(body);
+		default:
+			return NULL;
+	}
+}
+
+const void *
+marshal_fnode_data(const marshal_fnode_t *node, size_t *size)
+{
+	const char *body;
+	switch (node->type)
+	{
+		case MARSHAL_STRING:
+			body = (const char *)follow(&node->data) + sizeof(string_body_t);
+			break;
+		case MARSHAL_BIGNUM:
+			body = follow(&node->data);
+			break;
+		case MARSHAL_USERDEF:
+			body = (const char *)follow(&node->data)
+				+ sizeof(userdef_body_t);
+			break;
+		default:
+			return NULL;
+	}
+	if (size)
+		*size = node->count;
+	return body;
+}
+
+int
+marshal_fnode_encoding(const marshal_fnode_t *node)
+{
+	return MARSHAL_STRING == node->type ? node->encoding : -1;
+}
+
+const marshal_fnode_t *
+marshal_fnode_array_get(const marshal_fnode_t *node, int index)
+{
+	const int64_t *refs;
+	if (MARSHAL_ARRAY != node->type || index < 0
+			|| (uint32_t)index >= node->count)
+		return NULL;
+	refs = follow(&node->data);
+	return follow(&refs[index]);
+}
+
+static const int64_t *
+hash_pairs(const marshal_fnode_t *node)
+{
+	return (const int64_t *)((const char *)follow(&node->data)
+		+ sizeof(hash_body_t));
+}
+
+/* compares a frozen key to a regular one, like marshal_equal */
+static int
+match(const fnode_t *frozen, const marshal_t *key)
+{
+	const void *data;
+	marshal_t *thawed;
+	int equal;
+
+	if (!frozen || !key)
+		return !frozen && !key;
+	if (frozen->type != key->type)
+		return 0;
+	data = follow(&frozen->data);
+	switch (key->type)
+	{
+		case MARSHAL_NIL:
+			return 1;
+		case MARSHAL_BOOLEAN:
+			return frozen->data == key->boolean.value;
+		case MARSHAL_INTEGER:
+			return frozen->data == key->integer.value;
+		case MARSHAL_FLOAT:
+			return marshal_fnode_float(frozen) == key->float_no.value;
+		case MARSHAL_BIGNUM:
+			return frozen->count == (uint32_t)key->bignum.length
+				&& frozen->flags == (key->bignum.sign < 0)
+				&& 0 == memcmp(data, key->bignum.bytes, frozen->count);
+		case MARSHAL_SYMBOL:
+			return 0 == strcmp(data, key->symbol.name);
+		case MARSHAL_CLASS:
+			return 0 == strcmp(data, key->klass.name);
+		case MARSHAL_MODULE:
+			return 0 == strcmp(data, key->module.name);
+		case MARSHAL_STRING:
+			if (frozen->encoding != key->string.encoding
+					|| frozen->count != (uint32_t)key->string.data_size
+					|| ((const string_body_t *)data)->count
+						!= (uint32_t)key->string.count)
+				return 0;
+			if (0 != memcmp(marshal_fnode_data(frozen, NULL),
+					key->string.data, frozen->count))
+				return 0;
+			if (!key->string.count)
+				return 1;
+			/* with ivars, compare the rest thawed */
+			/* fall through */
+		default:
+			/* containers as keys are rare, compare them thawed */
+			thawed = marshal_fnode_thaw(frozen);
+			equal = thawed && marshal_equal(thawed, key);
+			marshal_free(thawed);
+			return equal;
+	}
+}
+
+const marshal_fnode_t *
+marshal_fnode_hash_get(const marshal_fnode_t *node, const marshal_t *key)
+{
+	const hash_body_t *body;
+	const int64_t *pairs;
+	uint32_t i;
+
+	if (MARSHAL_HASH != node->type)
+		return NULL;
+	body = follow(&node->data);
+	pairs = hash_pairs(node);
+	if (body->index_size)
+	{
+		const slot_t *slots = (const slot_t *)(pairs + node->count * 2);
+		uint32_t hash = (uint32_t)marshal_hash_value(key);
+		uint32_t mask = body->index_size - 1;
+		for (i = hash & mask; slots[i].pair; i = (i+1) & mask)
+		{
+			const int64_t *pair = &pairs[(slots[i].pair-1) * 2];
+			if (slots[i].hash == hash && match(follow(pair), key))
+				return follow(pair + 1);
+		}
+	}
+	else
+	{
+		for (i = 0; i < node->count; i++)
+		{
+			if (match(follow(&pairs[i*2]), key))
+				return follow(&pairs[i*2+1]);
+		}
+	}
+	return follow(&body->def);
+}
+
+const marshal_fnode_t *
+marshal_fnode_hash_pair(const marshal_fnode_t *node, int index,
+	const marshal_fnode_t **key)
+{
+	const int64_t *pairs;
+	if (MARSHAL_HASH != node->type || index < 0
+			|| (uint32_t)index >= node->count)
+		return NULL;
+	pairs = hash_pairs(node);
+	if (key)
+		*key = follow(&pairs[index*2]);
+	return follow(&pairs[index*2+1]);
+}
+
+const marshal_fnode_t *
+marshal_fnode_hash_default(const marshal_fnode_t *node)
+{
+	const hash_body_t *body;
+	if (MARSHAL_HASH != node->type)
+		return NULL;
+	body = follow(&node->data);
+	return follow(&body->def);
+}
+
+const marshal_fnode_t *
+marshal_fnode_object_ivar(const marshal_fnode_t *node, int index,
+	const char **name)
+{
+	const object_body_t *body;
+	const int64_t *values;
+	if ((MARSHAL_OBJECT != node->type && MARSHAL_STRUCT != node->type)
+			|| index < 0 || (uint32_t)index >= node->count)
+		return NULL;
+	body = follow(&node->data);
+	values = (const int64_t *)(body + 1);
+	if (name)
+		*name = follow((const int64_t *)follow(&body->names) + index);
+	return follow(&values[index]);
+}
+
+const marshal_fnode_t *
+marshal_fnode_object_get(const marshal_fnode_t *node, const char *name)
+{
+	const object_body_t *body;
+	const int64_t *names;
+	uint32_t i;
+	if (MARSHAL_OBJECT != node->type && MARSHAL_STRUCT != node->type)
+		return NULL;
+	body = follow(&node->data);
+	names = follow(&body->names);
+	for (i = 0; i < node->count; i++)
+	{
+		if (0 == strcmp(follow(&names[i]), name))
+			return follow((const int64_t *)(body + 1) + i);
+	}
+	return NULL;
+}
+
+const marshal_fnode_t *
+marshal_fnode_value(const marshal_fnode_t *node)
+{
+	const int64_t *body;
+	switch (node->type)
+	{
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			body = follow(&node->data);
+			return follow(body + 1);
+		default:
+			return NULL;
+	}
+}
+
+/* thawing */
+
+static marshal_t *
+thaw_string(const fnode_t *node)
+{
+	const string_body_t *body = follow(&node->data);
+	const int64_t *pairs = follow(&body->pairs);
+	int fits = node->count <= INLINE_SIZE - 4;
+	marshal_t *m = mem_calloc(1, node_size(MARSHAL_STRING)
+		+ (fits ? INLINE_SIZE : 0));
+	uint32_t i;
+
+	if (!m)
+		return NULL;
+	m->type = MARSHAL_STRING;
+	m->string.data_size = node->count;
+	m->string.data = fits ? STRING_INLINE(m) : mem_alloc(node->count + 4);
+	m->string.encoding = node->encoding;
+	m->string.is_ascii = -1;
+	m->string.is_valid_utf8 = -1;
+	m->string.pairs = mem_calloc(body->count * 2 + 1, sizeof(void *));
+	if (!m->string.data || !m->string.pairs)
+		goto failed;
+	memcpy(m->string.data, body + 1, node->count);
+	memset((char *)m->string.data + node->count, 0, 4);
+	m->string.count = body->count;
+	for (i = 0; i < body->count * 2; i++)
+	{
+		const fnode_t *child = follow(&pairs[i]);
+		if (child && !(m->string.pairs[i] = marshal_fnode_thaw(child)))
+			goto failed;
+	}
+	return m;
+
+failed:
+	marshal_free(m);
+	return NULL;
+}
+
+static marshal_t *
+thaw_object(const fnode_t *node)
+{
+	const object_body_t *body = follow(&node->data);
+	const int64_t *names = follow(&body->names);
+	char **list = mem_alloc(node->count * sizeof(char *) + 1);
+	marshal_t *m = marshal_make_object(follow(&body->klass));
+	marshal_shape_t *shape;
+	uint32_t i;
+
+	if (!list || !m)
+		goto failed;
+	m->type = node->type;
+	for (i = 0; i < node->count; i++)
+		list[i] = (char *)follow(&names[i]);
+	shape = shape_new(m->object.klass, node->count, list, NULL);
+	m->object.vars = mem_calloc(node->count + 1, sizeof(void *));
+	if (!shape || !m->object.vars)
+	{
+		shape_release(shape);
+		goto failed;
+	}
+	shape_release(m->object.shape);
+	m->object.shape = shape;
+	m->object.capacity = node->count;
+	for (i = 0; i < node->count; i++)
+	{
+		const fnode_t *value = follow((const int64_t *)(body + 1) + i);
+		m->object.count++;
+		if (value && !(m->object.vars[i] = marshal_fnode_thaw(value)))
+			goto failed;
+	}
+	mem_free(list);
+	return m;
+
+failed:
+	if (list)
+		mem_free(list);
+	marshal_free(m);
+	return NULL;
+}
+
+static marshal_t *
+thaw_userdef(const fnode_t *node)
+{
+	const userdef_body_t *body = follow(&node->data);
+	const int64_t *pairs = follow(&body->pairs);
+	marshal_t *m = marshal_make_userdef(marshal_fnode_name(node), node->count,
+		body + 1);
+	uint32_t i;
+
+	if (!m || !body->count)
+		return m;
+	m->userdef.pairs = mem_calloc(body->count * 2 + 1, sizeof(void *));
+	if (!m->userdef.pairs)
+		goto failed;
+	m->userdef.count = body->count;
+	for (i = 0; i < body->count * 2; i++)
+	{
+		const fnode_t *child = follow(&pairs[i]);
+		if (child && !(m->userdef.pairs[i] = marshal_fnode_thaw(child)))
+			goto failed;
+	}
+	return m;
+
+failed:
+	marshal_free(m);
+	return NULL;
+}
+
+static marshal_t *
+thaw_wrapped(const fnode_t *node)
+{
+	marshal_t *m = mem_calloc(1, node_size(node->type));
+	if (!m)
+		return NULL;
+	m->type = node->type;
+	m->wrapped.symbol_instance =
+		marshal_make_symbol(marshal_fnode_name(node));
+	m->wrapped.value = marshal_fnode_thaw(marshal_fnode_value(node));
+	if (!m->wrapped.symbol_instance || !m->wrapped.value)
+	{
+		marshal_free(m->wrapped.symbol_instance);
+		marshal_free(m->wrapped.value);
+		mem_free(m);
+		return NULL;
+	}
+	m->wrapped.klass =
+		((marshal_t *)m->wrapped.symbol_instance)->symbol.name;
+	return m;
+}
+
+static marshal_t *
+thaw_hash(const fnode_t *node)
+{
+	const fnode_t *def = marshal_fnode_hash_default(node);
+	marshal_t *m = marshal_make_hash(NULL);
+	uint32_t i;
+
+	if (!m || !marshal_hash_reserve(m, node->count))
+		goto failed;
+	if (def && !(m->hash.def = marshal_fnode_thaw(def)))
+		goto failed;
+	for (i = 0; i < node->count; i++)
+	{
+		const fnode_t *key;
+		const fnode_t *value = marshal_fnode_hash_pair(node, i, &key);
+		marshal_t *k = marshal_fnode_thaw(key);
+		marshal_t *v = marshal_fnode_thaw(value);
+		if (!k || !v || !marshal_hash_set(m, k, v))
+		{
+			marshal_free(k);
+			marshal_free(v);
+			goto failed;
+		}
+	}
+	return m;
+
+failed:
+	marshal_free(m);
+	return NULL;
+}
+
+marshal_t *
+marshal_fnode_thaw(const marshal_fnode_t *node)
+{
+	marshal_t *m;
+	size_t size;
+	const void *data;
+	uint32_t i;
+
+	switch (node->type)
+	{
+		case MARSHAL_NIL: return marshal_make_nil();
+		case MARSHAL_BOOLEAN: return marshal_make_boolean((int)node->data);
+		case MARSHAL_INTEGER: return marshal_make_integer((int)node->data);
+		case MARSHAL_FLOAT:
+			return marshal_make_float(marshal_fnode_float(node));
+		case MARSHAL_BIGNUM:
+			data = marshal_fnode_data(node, &size);
+			return marshal_make_bignum(marshal_fnode_int(node), size,
+				(unsigned char *)data);
+		case MARSHAL_SYMBOL:
+			return marshal_make_symbol(follow(&node->data));
+		case MARSHAL_CLASS:
+			return marshal_make_class(follow(&node->data));
+		case MARSHAL_MODULE:
+			return marshal_make_module(follow(&node->data));
+		case MARSHAL_STRING: return thaw_string(node);
+		case MARSHAL_ARRAY:
+			m = marshal_make_array();
+			if (!m || !marshal_array_reserve(m, node->count))
+				break;
+			for (i = 0; i < node->count; i++)
+			{
+				marshal_t *value = NULL;
+				const fnode_t *child = marshal_fnode_array_get(node, i);
+				if (child && !(value = marshal_fnode_thaw(child)))
+					break;
+				marshal_array_add(m, value);
+			}
+			if (i == node->count)
+				return m;
+			break;
+		case MARSHAL_HASH: return thaw_hash(node);
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			return thaw_object(node);
+		case MARSHAL_USERDEF: return thaw_userdef(node);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			return thaw_wrapped(node);
+		default:
+			return NULL;
+	}
+	marshal_free(m);
+	return NULL;
+}
@@ -0,0 +1,315 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "internal.h"
+
+/* wyhash (https://github.com/wangyi-fudan/wyhash, public domain),
+   the digests never leave the process so byte order doesn't matter */
+static const uint64_t secret[4] = {
+	UINT64_C(0x2d358dccaa6c78a5), UINT64_C(0x8bb84b93962eacc9),
+	UINT64_C(0x4b33a62ed433d4a3), UINT64_C(0x4d5a2da51de1aa47)
+};
+
+static void
+mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = *a;
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32;
+	uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo;
+	*b = hi;
+#endif
+}
+
+static uint64_t
+mix(uint64_t a, uint64_t b)
+{
+	mum(&a, &b);
+	return a ^ b;
+}
+
+static uint64_t
+read8(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static uint64_t
+read4(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint64_t
+wyhash(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	uint64_t a, b;
+
+	seed ^= mix(seed ^ secret[0], secret[1]);
+	if (len <= 16)
+	{
+		if (len >= 4)
+		{
+			size_t step = (len >> 3) << 2;
+			a = (read4(p) << 32) | read4(p + step);
+			b = (read4(p + len - 4) << 32) | read4(p + len - 4 - step);
+		}
+		else if (len > 0)
+		{
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8)
+				| p[len - 1];
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else
+	{
+		size_t i = len;
+		if (i > 48)
+		{
+			uint64_t see1 = seed, see2 = seed;
+			do
+			{
+				seed = mix(read8(p) ^ secret[1], read8(p+8) ^ seed);
+				see1 = mix(read8(p+16) ^ secret[2], read8(p+24) ^ see1);
+				see2 = mix(read8(p+32) ^ secret[3], read8(p+40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16)
+		{
+			seed = mix(read8(p) ^ secret[1], read8(p+8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = read8(p + i - 16);
+		b = read8(p + i - 8);
+	}
+	a ^= secret[1];
+	b ^= seed;
+	mum(&a, &b);
+	return mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+/* order matters: [a, b] and [b, a] differ */
+static uint64_t
+combine(uint64_t h, uint64_t child)
+{
+	return mix(h ^ secret[2], child ^ secret[3]);
+}
+
+static uint64_t
+hash(const marshal_t *m, int memo);
+
+static uint64_t
+hash_int(int type, int value)
+{
+	return wyhash(&value, sizeof(value), type);
+}
+
+static uint64_t
+hash_name(int type, const char *name)
+{
+	return wyhash(name, strlen(name), type);
+}
+
+static uint64_t
+hash_bignum(const marshal_t *m)
+{
+	uint64_t h = hash_int(MARSHAL_BIGNUM, m->bignum.sign);
+	return wyhash(m->bignum.bytes, m->bignum.length, h);
+}
+
+static uint64_t
+hash_float(const marshal_t *m)
+{
+	/* 0.0 and -0.0 are equal */
+	double value = m->float_no.value ? m->float_no.value : 0.0;
+	return wyhash(&value, sizeof(value), MARSHAL_FLOAT);
+}
+
+static uint64_t
+hash_array(const marshal_t *m, int memo)
+{
+	uint64_t h = hash_int(MARSHAL_ARRAY, m->array.count);
+	int i;
+	for (i = 0; i < m->array.count; i++)
+		h = combine(h, hash(m->array.values[i], memo));
+	return h;
+}
+
+/* pairs are summed, so their order doesn't matter */
+static uint64_t
+hash_hash(const marshal_t *m, int memo)
+{
+	uint64_t sum = 0;
+	int i;
+	for (i = 0; i < m->hash.count; i++)
+		sum += combine(hash(m->hash.pairs[i*2], memo),
+			hash(m->hash.pairs[i*2+1], memo));
+	sum = combine(hash_int(MARSHAL_HASH, m->hash.count), sum);
+	return combine(sum, hash(m->hash.def, memo));
+}
+
+static uint64_t
+hash_string(const marshal_t *m, int memo)
+{
+	uint64_t h = hash_int(MARSHAL_STRING, m->string.encoding);
+	int i;
+	h = wyhash(m->string.data, m->string.data_size, h);
+	for (i = 0; i < m->string.count*2; i++)
+		h = combine(h, hash(m->string.pairs[i], memo));
+	return h;
+}
+
+static uint64_t
+hash_object(const marshal_t *m, int memo)
+{
+	const marshal_shape_t *shape = m->object.shape;
+	uint64_t sum = 0;
+	int i;
+	for (i = 0; i < m->object.count; i++)
+		sum += combine(hash_name(MARSHAL_SYMBOL, shape->names[i]),
+			hash(m->object.vars[i], memo));
+	return combine(hash_name(m->type, m->object.klass), sum);
+}
+
+static uint64_t
+hash_userdef(const marshal_t *m, int memo)
+{
+	uint64_t h = hash_name(MARSHAL_USERDEF, m->userdef.klass);
+	int i;
+	h = wyhash(m->userdef.data, m->userdef.size, h);
+	for (i = 0; i < m->userdef.count*2; i++)
+		h = combine(h, hash(m->userdef.pairs[i], memo));
+	return h;
+}
+
+static uint64_t
+hash_wrapped(const marshal_t *m, int memo)
+{
+	return combine(hash_name(m->type, m->wrapped.klass),
+		hash(m->wrapped.value, memo));
+}
+
+static uint64_t
+hash_container(const marshal_t *m, int memo)
+{
+	switch (m->type)
+	{
+		case MARSHAL_ARRAY: return hash_array(m, memo);
+		case MARSHAL_HASH: return hash_hash(m, memo);
+		case MARSHAL_STRING: return hash_string(m, memo);
+		default: return hash_object(m, memo);
+	}
+}
+
+/* 0 means "not computed" in digest fields */
+static uint64_t
+memoize(marshal_t *m, uint64_t *digest)
+{
+	if (!*digest)
+	{
+		uint64_t h = hash_container(m, 1);
+		*digest = h ? h : 1;
+	}
+	return *digest;
+}
+
+static uint64_t
+hash(const marshal_t *m, int memo)
+{
+	marshal_t *w = (marshal_t *)m;
+	if (!m)
+		return secret[0];
+	switch (m->type)
+	{
+		case MARSHAL_BOOLEAN:
+			return hash_int(m->type, m->boolean.value);
+		case MARSHAL_INTEGER:
+			return hash_int(m->type, m->integer.value);
+		case MARSHAL_BIGNUM: return hash_bignum(m);
+		case MARSHAL_FLOAT: return hash_float(m);
+		case MARSHAL_SYMBOL: return hash_name(m->type, m->symbol.name);
+		case MARSHAL_CLASS: return hash_name(m->type, m->klass.name);
+		case MARSHAL_MODULE: return hash_name(m->type, m->module.name);
+		case MARSHAL_USERDEF: return hash_userdef(m, memo);
+		case MARSHAL_ARRAY:
+			return memo ? memoize(w, &w->array.digest)
+				: hash_container(m, 0);
+		case MARSHAL_HASH:
+			return memo ? memoize(w, &w->hash.digest)
+				: hash_container(m, 0);
+		case MARSHAL_STRING:
+			return memo ? memoize(w, &w->string.digest)
+				: hash_container(m, 0);
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			return memo ? memoize(w, &w->object.digest)
+				: hash_container(m, 0);
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			return hash_wrapped(m, memo);
+		default:
+			/* nil and regexes (marshal_equal doesn't compare them) */
+			return hash_int(m->type, 0);
+	}
+}
+
+uint64_t
+hash_symbol(const char *name)
+{
+	return hash_name(MARSHAL_SYMBOL, name);
+}
+
+uint64_t
+hash_integer(int value)
+{
+	return hash_int(MARSHAL_INTEGER, value);
+}
+
+uint64_t
+marshal_hash_value(const marshal_t *marshal)
+{
+	return hash(marshal, 0);
+}
+
+uint64_t
+marshal_hash_value_memo(marshal_t *marshal)
+{
+	return hash(marshal, 1);
+}
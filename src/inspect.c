@@ -0,0 +1,518 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+#define ELLIPSIS "..."
+
+typedef struct
+{
+	char *buf;
+	size_t cap;
+	size_t len; /* bytes produced, even those not fitting in buf */
+	size_t limit; /* max_bytes */
+	int full; /* limit was reached, nothing else is produced */
+	int max_depth;
+	int max_elements;
+	size_t max_string;
+} out_t;
+
+static void
+copy(out_t *o, const char *s, size_t n)
+{
+	if (o->len + 1 < o->cap)
+	{
+		size_t room = o->cap - 1 - o->len;
+		memcpy(o->buf + o->len, s, n < room ? n : room);
+	}
+	o->len += n;
+}
+
+static void
+put(out_t *o, const char *s, size_t n)
+{
+	if (o->full)
+		return;
+	if (n > o->limit - o->len)
+	{
+		copy(o, s, o->limit - o->len);
+		copy(o, ELLIPSIS, 3);
+		o->full = 1;
+		return;
+	}
+	copy(o, s, n);
+}
+
+static void
+puts_(out_t *o, const char *s)
+{
+	put(o, s, strlen(s));
+}
+
+static void
+put_long(out_t *o, long value)
+{
+	char text[24];
+	char *p = text + sizeof(text);
+	unsigned long u = value < 0
+		? 0UL - (unsigned long)value : (unsigned long)value;
+	do
+	{
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (value < 0)
+		*--p = '-';
+	put(o, p, text + sizeof(text) - p);
+}
+
+/* Ruby's Float#inspect: shortest digits that read back the same value,
+   exponent notation out of 1e-4...1e15 */
+static void
+put_float(out_t *o, double value)
+{
+	char text[32], digits[20], out[48];
+	char *p = out, *e;
+	int precision, count = 0, point, i;
+
+	if (value != value)
+	{
+		puts_(o, "NaN");
+		return;
+	}
+	if (value == 0)
+	{
+		puts_(o, 1 / value < 0 ? "-0.0" : "0.0");
+		return;
+	}
+	if (value - value != 0)
+	{
+		puts_(o, value < 0 ? "-Infinity" : "Infinity");
+		return;
+	}
+
+	for (precision = 1; precision < 17; precision++)
+	{
+		sprintf(text, "%.*e", precision - 1, value);
+		if (strtod(text, NULL) == value)
+			break;
+	}
+	if (17 == precision)
+		sprintf(text, "%.16e", value);
+	/* text is [-]d.ddde[+-]xx */
+	for (e = text; *e != 'e'; e++)
+	{
+		if (*e >= '0' && *e <= '9')
+			digits[count++] = *e;
+	}
+	while (count > 1 && '0' == digits[count-1])
+		count--;
+	point = atoi(e + 1) + 1;
+
+	if (value < 0)
+		*p++ = '-';
+	if (point < -3 || point > 15)
+	{
+		int exp = point - 1;
+		*p++ = digits[0];
+		*p++ = '.';
+		if (count > 1)
+			for (i = 1; i < count; i++)
+				*p++ = digits[i];
+		else
+			*p++ = '0';
+		*p++ = 'e';
+		*p++ = exp < 0 ? '-' : '+';
+		exp = exp < 0 ? -exp : exp;
+		if (exp >= 100)
+			*p++ = '0' + exp / 100;
+		*p++ = '0' + exp / 10 % 10;
+		*p++ = '0' + exp % 10;
+	}
+	else if (point <= 0)
+	{
+		*p++ = '0';
+		*p++ = '.';
+		for (i = point; i < 0; i++)
+			*p++ = '0';
+		for (i = 0; i < count; i++)
+			*p++ = digits[i];
+	}
+	else
+	{
+		for (i = 0; i < point; i++)
+			*p++ = i < count ? digits[i] : '0';
+		*p++ = '.';
+		if (point < count)
+			for (i = point; i < count; i++)
+				*p++ = digits[i];
+		else
+			*p++ = '0';
+	}
+	put(o, out, p - out);
+}
+
+/* bytes are a little-endian magnitude, divided by 10000 until empty */
+int
+bignum_decimal(const unsigned char *bytes, int length, int sign, char *out)
+{
+	int top = length, count = 0, i;
+	unsigned char *n = mem_alloc(length + 1);
+
+	if (!n)
+		return -1;
+	memcpy(n, bytes, length);
+	while (top && !n[top-1])
+		top--;
+	while (top)
+	{
+		unsigned long rem = 0;
+		for (i = top; i-- > 0;)
+		{
+			unsigned long cur = (rem << 8) | n[i];
+			n[i] = (unsigned char)(cur / 10000);
+			rem = cur % 10000;
+		}
+		while (top && !n[top-1])
+			top--;
+		for (i = 0; i < 4; i++, rem /= 10)
+			out[count++] = '0' + rem % 10;
+	}
+	mem_free(n);
+	while (count > 1 && '0' == out[count-1])
+		count--;
+	if (!count)
+		out[count++] = '0';
+	if (sign < 0)
+		out[count++] = '-';
+	for (i = 0; i < count / 2; i++)
+	{
+		char c = out[i];
+		out[i] = out[count-1-i];
+		out[count-1-i] = c;
+	}
+	return count;
+}
+
+static void
+put_bignum(out_t *o, const marshal_t *m)
+{
+	char *digits = mem_alloc(BIGNUM_DIGITS(m->bignum.length));
+	int count = digits ? bignum_decimal(m->bignum.bytes, m->bignum.length,
+		m->bignum.sign, digits) : -1;
+	if (count < 0)
+		puts_(o, "bignum");
+	else
+		put(o, digits, count);
+	if (digits)
+		mem_free(digits);
+}
+
+static int
+is_name_char(int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+		|| (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+/* :name, :@ivar, :$global, :name? ... are printed without quotes */
+static int
+is_plain_symbol(const unsigned char *p)
+{
+	if ('$' == *p)
+		p++;
+	else if ('@' == *p)
+		p += '@' == p[1] ? 2 : 1;
+	if (!*p || (*p >= '0' && *p <= '9'))
+		return 0;
+	while (is_name_char(*p))
+		p++;
+	if ('?' == *p || '!' == *p || '=' == *p)
+		p++;
+	return !*p;
+}
+
+/* length of the UTF-8 character at p, 0 if it's not valid */
+static size_t
+utf8_char(const unsigned char *p, size_t size)
+{
+	size_t n, i;
+	if (*p < 0x80)
+		return 1;
+	if (*p >= 0xC2 && *p <= 0xDF)
+		n = 2;
+	else if (*p >= 0xE0 && *p <= 0xEF)
+		n = 3;
+	else if (*p >= 0xF0 && *p <= 0xF4)
+		n = 4;
+	else
+		return 0;
+	if (n > size)
+		return 0;
+	for (i = 1; i < n; i++)
+	{
+		if ((p[i] & 0xC0) != 0x80)
+			return 0;
+	}
+	return n;
+}
+
+/* prints "data" escaped like Ruby does, multibyte characters are kept
+   only for UTF-8 */
+static void
+put_quoted(out_t *o, const void *data, size_t size, int utf8)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const unsigned char *p = data;
+	size_t shown = size, i = 0, start = 0;
+	char esc[8];
+
+	if (o->max_string && shown > o->max_string)
+		shown = o->max_string;
+	put(o, "\"", 1);
+	while (i < shown && !o->full)
+	{
+		unsigned char c = p[i];
+		size_t n = 1;
+		const char *e = NULL;
+
+		switch (c)
+		{
+			case '"': e = "\\\""; break;
+			case '\\': e = "\\\\"; break;
+			case '\n': e = "\\n"; break;
+			case '\t': e = "\\t"; break;
+			case '\r': e = "\\r"; break;
+			case '\f': e = "\\f"; break;
+			case '\v': e = "\\v"; break;
+			case '\a': e = "\\a"; break;
+			case '\b': e = "\\b"; break;
+			case 27: e = "\\e"; break;
+			case '#':
+				/* "#{", "#$" and "#@" would interpolate */
+				if (i + 1 < size
+						&& ('{' == p[i+1] || '$' == p[i+1] || '@' == p[i+1]))
+					e = "\\#";
+				break;
+			default:
+				if (c >= 0x80 && utf8)
+					n = utf8_char(p + i, size - i);
+				if (c < 0x20 || 0x7F == c || 0 == n || (c >= 0x80 && !utf8))
+				{
+					if (utf8 && c < 0x80)
+						strcpy(esc, "\\u00XX");
+					else
+						strcpy(esc, "\\xXX");
+					esc[strlen(esc) - 2] = hex[c >> 4];
+					esc[strlen(esc) - 1] = hex[c & 15];
+					e = esc;
+					n = 1;
+				}
+		}
+		if (!e)
+		{
+			/* plain characters are written in runs */
+			if (i + n > shown)
+				break; /* a character cut by max_string */
+			i += n;
+			continue;
+		}
+		put(o, (const char *)p + start, i - start);
+		puts_(o, e);
+		i += n;
+		start = i;
+	}
+	put(o, (const char *)p + start, i - start);
+	if (shown < size)
+		put(o, ELLIPSIS, 3);
+	put(o, "\"", 1);
+}
+
+static void
+inspect(out_t *o, const marshal_t *m, int depth);
+
+/* prints count children separated by ", ", a pair takes two */
+static void
+put_children(out_t *o, void **values, int count, int pairs, int depth)
+{
+	int i, n = pairs ? count / 2 : count;
+	for (i = 0; i < n && !o->full; i++)
+	{
+		if (i)
+			put(o, ", ", 2);
+		if (o->max_elements && i == o->max_elements)
+		{
+			put(o, ELLIPSIS, 3);
+			break;
+		}
+		if (pairs)
+		{
+			inspect(o, values[i*2], depth + 1);
+			put(o, "=>", 2);
+			inspect(o, values[i*2+1], depth + 1);
+		}
+		else
+			inspect(o, values[i], depth + 1);
+	}
+}
+
+static void
+inspect(out_t *o, const marshal_t *m, int depth)
+{
+	const char *name;
+	int i;
+
+	if (o->full)
+		return;
+	if (!m)
+	{
+		puts_(o, "nil");
+		return;
+	}
+	switch (m->type)
+	{
+		case MARSHAL_NIL:
+			puts_(o, "nil");
+			break;
+		case MARSHAL_BOOLEAN:
+			puts_(o, m->boolean.value ? "true" : "false");
+			break;
+		case MARSHAL_INTEGER:
+			put_long(o, m->integer.value);
+			break;
+		case MARSHAL_BIGNUM:
+			put_bignum(o, m);
+			break;
+		case MARSHAL_FLOAT:
+			put_float(o, m->float_no.value);
+			break;
+		case MARSHAL_SYMBOL:
+			name = m->symbol.name;
+			put(o, ":", 1);
+			if (is_plain_symbol((const unsigned char *)name))
+				puts_(o, name);
+			else
+				put_quoted(o, name, strlen(name), 1);
+			break;
+		case MARSHAL_CLASS:
+			puts_(o, m->klass.name);
+			break;
+		case MARSHAL_MODULE:
+			puts_(o, m->module.name);
+			break;
+		case MARSHAL_STRING:
+			put_quoted(o, m->string.data, m->string.data_size,
+				MARSHAL_ENCODING_UTF_8 == m->string.encoding
+				|| MARSHAL_ENCODING_US_ASCII == m->string.encoding);
+			break;
+		case MARSHAL_REGEX:
+			put(o, "/", 1);
+			put(o, m->regex.data, m->regex.data_size);
+			put(o, "/", 1);
+			break;
+		case MARSHAL_ARRAY:
+			if (depth >= o->max_depth && m->array.count)
+			{
+				puts_(o, "[...]");
+				break;
+			}
+			put(o, "[", 1);
+			put_children(o, m->array.values, m->array.count, 0, depth);
+			put(o, "]", 1);
+			break;
+		case MARSHAL_HASH:
+			if (depth >= o->max_depth && m->hash.count)
+			{
+				puts_(o, "{...}");
+				break;
+			}
+			put(o, "{", 1);
+			put_children(o, m->hash.pairs, m->hash.count * 2, 1, depth);
+			put(o, "}", 1);
+			break;
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			put(o, "#<", 2);
+			if (MARSHAL_STRUCT == m->type)
+				puts_(o, "struct ");
+			puts_(o, m->object.klass);
+			if (m->object.count && depth >= o->max_depth)
+				put(o, " ...", 4);
+			for (i = 0; depth < o->max_depth && i < m->object.count; i++)
+			{
+				if (o->full)
+					return;
+				put(o, i ? ", " : " ", i ? 2 : 1);
+				if (o->max_elements && i == o->max_elements)
+				{
+					put(o, ELLIPSIS, 3);
+					break;
+				}
+				puts_(o, m->object.shape->names[i]);
+				put(o, "=", 1);
+				inspect(o, m->object.vars[i], depth + 1);
+			}
+			put(o, ">", 1);
+			break;
+		case MARSHAL_USERDEF:
+			put(o, "#<", 2);
+			puts_(o, m->userdef.klass);
+			put(o, " (", 2);
+			put_long(o, m->userdef.size);
+			put(o, " bytes)>", 8);
+			break;
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+			/* like Ruby, the class or the module doesn't show */
+			inspect(o, m->wrapped.value, depth);
+			break;
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			put(o, "#<", 2);
+			puts_(o, m->wrapped.klass);
+			put(o, " ", 1);
+			inspect(o, m->wrapped.value, depth + 1);
+			put(o, ">", 1);
+			break;
+		default:
+			puts_(o, "unknown");
+	}
+}
+
+size_t
+marshal_inspect(const marshal_t *marshal, char *buf, size_t cap,
+	const marshal_inspect_opts_t *opts)
+{
+	out_t o;
+	o.buf = buf;
+	o.cap = buf ? cap : 0;
+	o.len = 0;
+	o.full = 0;
+	o.limit = opts && opts->max_bytes ? opts->max_bytes : (size_t)-1 - 3;
+	o.max_depth = opts && opts->max_depth > 0
+		&& opts->max_depth < MARSHAL_INSPECT_DEPTH
+		? opts->max_depth : MARSHAL_INSPECT_DEPTH;
+	o.max_elements = opts ? opts->max_elements : 0;
+	o.max_string = opts ? opts->max_string : 0;
+
+	inspect(&o, marshal, 0);
+	if (o.cap)
+		o.buf[o.len < o.cap ? o.len : o.cap - 1] = 0;
+	return o.len;
+}
@@ -0,0 +1,253 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MARSHAL_INTERNAL_H_
+#define _MARSHAL_INTERNAL_H_
+
+/* helpers shared between the library's modules, they are not exported */
+
+#include "marshal.h"
+
+/* reference counts may be touched from different threads */
+#ifdef __GNUC__
+  #define ATOMIC_INC(x) __sync_add_and_fetch(&(x), 1)
+  #define ATOMIC_DEC(x) __sync_sub_and_fetch(&(x), 1)
+  #define ATOMIC_CAS(x, old, new) __sync_bool_compare_and_swap(&(x), old, new)
+  #define ATOMIC_ADD(x, n) __sync_fetch_and_add(&(x), n)
+#else
+  #define ATOMIC_INC(x) (++(x))
+  #define ATOMIC_DEC(x) (--(x))
+  #define ATOMIC_CAS(x, old, new) ((x) == (old) ? ((x) = (new), 1) : 0)
+  #define ATOMIC_ADD(x, n) (((x) += (n)) - (n))
+#endif
+
+#ifdef __GNUC__
+  #define THREAD_LOCAL __thread
+#else
+  #define THREAD_LOCAL
+#endif
+
+/* optional tracepoints, see marshal_stats_enable */
+#ifdef MARSHAL_USDT
+  #include <sys/sdt.h>
+  #define PROBE1(name, a) DTRACE_PROBE1(marshal, name, a)
+  #define PROBE2(name, a, b) DTRACE_PROBE2(marshal, name, a, b)
+#else
+  #define PROBE1(name, a)
+  #define PROBE2(name, a, b)
+#endif
+
+/* shared values below zero are nodes of a block made by marshal_compact */
+#define SHARED_PINNED -1 /* released along with the block */
+#define SHARED_BLOCK  -2 /* the block's root, freeing it frees the block */
+#define SHARED_STATIC -3 /* a singleton of make.c, in read-only memory */
+
+/* nodes laid out as a marshal_object_t */
+#define IS_OBJECT(m) \
+	(MARSHAL_OBJECT == (m)->type || MARSHAL_STRUCT == (m)->type)
+
+/* nodes laid out as a marshal_wrapped_t */
+#define IS_WRAPPED(m) \
+	(MARSHAL_USERCLASS <= (m)->type && (m)->type <= MARSHAL_DATA)
+
+/* stats.c */
+
+/* the calling thread's counters, they're only kept when stats_on is set */
+extern THREAD_LOCAL int stats_on;
+extern THREAD_LOCAL marshal_stats_t thread_stats;
+
+#define STATS_ADD(field, n) \
+	do { if (stats_on) thread_stats.field += (n); } while (0)
+
+/* seconds from some fixed point, for the timers */
+double
+stats_clock(void);
+
+/* decode.c */
+
+/* hands the decoder the input's next chunk, which stays valid until the
+   next call, returns its size, 0 at the end */
+typedef size_t (*chunk_fn)(void *source, const void **chunk);
+
+/* decodes size bytes of data, their end is known so bogus counts fail
+   before allocating */
+marshal_t *
+decode_memory(const void *data, size_t size, int flags);
+
+/* decodes an input made of chunks */
+marshal_t *
+decode_chunks(chunk_fn next, void *source, int flags);
+
+/* decodes size bytes of data without switching allocators (the caller sets
+   the decoder's), error gets a MARSHAL_ERROR_* */
+marshal_t *
+decoder_decode(marshal_decoder_t *decoder, const void *data, size_t size,
+	int *error);
+
+/* alloc.c */
+
+/* malloc, calloc, realloc and free through the calling thread's allocator
+   (see marshal_use_allocator), counted in its stats, mem_free(NULL) does
+   nothing */
+void *
+mem_alloc(size_t size);
+
+void *
+mem_calloc(size_t count, size_t size);
+
+void *
+mem_realloc(void *mem, size_t size);
+
+void
+mem_free(void *mem);
+
+/* the calling thread's override, NULL when it uses the default allocator */
+const marshal_allocator_t *
+mem_allocator(void);
+
+/* shape.c */
+
+/* makes a shape of klass with names[0...count] plus name (it can be NULL)
+   returns NULL on failure */
+marshal_shape_t *
+shape_new(const char *klass, int count, char *const *names, const char *name);
+
+/* takes a reference, returns shape */
+marshal_shape_t *
+shape_retain(marshal_shape_t *shape);
+
+/* drops a reference, the last one frees shape */
+void
+shape_release(marshal_shape_t *shape);
+
+/* make.c */
+
+/* bytes of a node of type, its struct rounded up to keep the next node
+   aligned, without inline bytes */
+size_t
+node_size(int type);
+
+/* short strings and symbols keep their bytes past their struct, in
+   INLINE_SIZE more bytes allocated with the node (strings take 4 of them
+   for their NULs) */
+#define INLINE_SIZE 16
+#define STRING_INLINE(m) ((char *)(m) + sizeof(marshal_string_t))
+#define SYMBOL_INLINE(m) ((char *)(m) + sizeof(marshal_symbol_t))
+#define IS_INLINE_STRING(m) ((void *)STRING_INLINE(m) == (m)->string.data)
+#define IS_INLINE_SYMBOL(m) (SYMBOL_INLINE(m) == (m)->symbol.name)
+
+/* integers with a singleton */
+#define SMALL_INT_MIN -256
+#define SMALL_INT_MAX 1023
+
+/* the node shared by every tree for nil, a boolean or a small integer
+   (value is ignored for nil), NULL for other values */
+marshal_t *
+singleton(int type, int value);
+
+/* singleton() for m's type and value */
+marshal_t *
+singleton_of(const marshal_t *m);
+
+/* clone.c */
+
+/* frees what a private node owns but not the node, counts must match the
+   arrays, so partly made nodes can be cleared */
+void
+node_clear(marshal_t *node);
+
+/* takes a reference to node (it can be NULL), making it shared */
+marshal_t *
+node_retain(marshal_t *node);
+
+/* compact.c */
+
+/* releases the block whose root is marshal */
+void
+block_free(marshal_t *marshal);
+
+/* hash.c */
+
+/* marshal_hash_value of a symbol or an integer, without a node */
+uint64_t
+hash_symbol(const char *name);
+
+uint64_t
+hash_integer(int value);
+
+/* access.c */
+
+typedef int (*key_match_fn)(const marshal_t *key, const void *data);
+
+/* finds the pair whose key matches, hashed is the key's marshal_hash_value
+   (only used by indexed hashes), returns the pair index or -1 */
+int
+hash_find(const marshal_t *hash, uint64_t hashed, key_match_fn match,
+	const void *data);
+
+/* hashes with fewer pairs are scanned, hashing a key costs about as much as
+   comparing a dozen of them (see the wide corpus of make bench) */
+#define INDEX_MIN_COUNT 16
+
+/* bytes taken by a hash index, 0 for NULL */
+size_t
+index_size(const void *index);
+
+/* copies a hash index into mem, which has index_size bytes */
+void *
+index_copy(void *mem, const void *index);
+
+/* encode.c */
+
+/* takes the encoder's output as it's made, returns 0 on success */
+typedef int (*sink_fn)(void *sink, const void *data, size_t size);
+
+/* encodes through sink in chunks, returns 0 on success */
+int
+encode_chunks(const marshal_t *marshal, sink_fn sink, void *data);
+
+/* bytes encode_long may write */
+#define ENCODED_LONG_SIZE 9
+
+/* writes an integer in marshal's format into out, returns its size */
+int
+encode_long(unsigned char *out, long x);
+
+/* utf8.c */
+
+/* bytes the UTF-8 character at p takes, 0 if it's invalid or cut by end,
+   p isn't ASCII */
+int
+utf8_char_size(const unsigned char *p, const unsigned char *end);
+
+/* transcode.c */
+
+/* marshal_string_to_utf8 handing back the encoding ivar's key and value
+   it replaced in old (NULL when there was none) instead of freeing them */
+int
+string_to_utf8(marshal_t *string, marshal_t **old);
+
+/* inspect.c */
+
+/* room bignum_decimal needs for length bytes */
+#define BIGNUM_DIGITS(length) ((length) * 3 + 6)
+
+/* writes a bignum's magnitude (little-endian bytes) in decimal into out,
+   returns the number of characters, -1 on failure */
+int
+bignum_decimal(const unsigned char *bytes, int length, int sign, char *out);
+
+#endif /* _MARSHAL_INTERNAL_H_ */
@@ -0,0 +1,228 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* -1 for leaves */
+static int
+child_count(const marshal_t *m)
+{
+	switch (m->type)
+	{
+		case MARSHAL_ARRAY: return m->array.count;
+		case MARSHAL_HASH: return m->hash.count*2 + (m->hash.def ? 1 : 0);
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			return m->object.count;
+		default: return IS_WRAPPED(m) ? 1 : -1;
+	}
+}
+
+static void **
+child_slot(marshal_t *m, int i)
+{
+	switch (m->type)
+	{
+		case MARSHAL_ARRAY: return &m->array.values[i];
+		case MARSHAL_HASH:
+			return i < m->hash.count*2 ? &m->hash.pairs[i] : &m->hash.def;
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			return &m->object.vars[i];
+		default: return &m->wrapped.value;
+	}
+}
+
+/* fills the public fields for the i-th child of parent */
+static void
+describe(marshal_iter_t *iter, marshal_t *parent, int i)
+{
+	iter->index = i;
+	iter->is_key = 0;
+	iter->key = NULL;
+	iter->name = NULL;
+	if (!parent)
+		iter->index = -1;
+	else if (MARSHAL_HASH == parent->type)
+	{
+		iter->index = i < parent->hash.count*2 ? i / 2 : -1;
+		iter->is_key = iter->index >= 0 && 0 == i % 2;
+		if (iter->index >= 0 && !iter->is_key)
+			iter->key = parent->hash.pairs[i-1];
+	}
+	else if (IS_OBJECT(parent))
+		iter->name = parent->object.shape->names[i];
+	else if (IS_WRAPPED(parent))
+		iter->index = -1;
+}
+
+static int
+push(marshal_iter_t *iter, marshal_t *node, void **slot, int index,
+	int count)
+{
+	marshal_iter_frame_t *frame;
+	if (iter->top == iter->size)
+	{
+		int size = iter->size * 2;
+		marshal_iter_frame_t *stack;
+		if (iter->stack == iter->frames)
+		{
+			stack = mem_alloc(size * sizeof(marshal_iter_frame_t));
+			if (stack)
+				memcpy(stack, iter->frames, sizeof(iter->frames));
+		}
+		else
+			stack = mem_realloc(iter->stack,
+				size * sizeof(marshal_iter_frame_t));
+		if (!stack)
+			return 0;
+		iter->stack = stack;
+		iter->size = size;
+	}
+	frame = &iter->stack[iter->top++];
+	frame->node = node;
+	frame->slot = slot;
+	frame->index = index;
+	frame->next = 0;
+	frame->count = count;
+	return 1;
+}
+
+/* reports node, pushing it when it's a container */
+static int
+visit(marshal_iter_t *iter, marshal_t *parent, int i, void **slot)
+{
+	marshal_t *node = slot ? *slot : iter->root;
+	int count = node ? child_count(node) : -1;
+
+	describe(iter, parent, i);
+	iter->node = node;
+	iter->slot = slot;
+	iter->depth = iter->top;
+	if (count < 0)
+		return MARSHAL_ITER_LEAF;
+	if (!push(iter, node, slot, i, count))
+		return MARSHAL_ITER_ERROR;
+	return MARSHAL_ITER_ENTER;
+}
+
+void
+marshal_iter_init(marshal_iter_t *iter, const marshal_t *root)
+{
+	iter->node = NULL;
+	iter->slot = NULL;
+	iter->depth = -1;
+	iter->root = (marshal_t *)root;
+	iter->top = 0;
+	iter->size = MARSHAL_ITER_DEPTH;
+	iter->skip = 0;
+	iter->stack = iter->frames;
+}
+
+int
+marshal_iter_next(marshal_iter_t *iter)
+{
+	marshal_iter_frame_t *frame;
+	if (iter->root)
+	{
+		/* first call */
+		int event = visit(iter, NULL, 0, NULL);
+		iter->root = NULL;
+		return event;
+	}
+	if (!iter->top)
+		return MARSHAL_ITER_END;
+
+	frame = &iter->stack[iter->top-1];
+	if (iter->skip)
+	{
+		frame->next = frame->count;
+		iter->skip = 0;
+	}
+	if (frame->next < frame->count)
+	{
+		int i = frame->next++;
+		return visit(iter, frame->node, i, child_slot(frame->node, i));
+	}
+
+	/* every child was walked */
+	iter->top--;
+	describe(iter, iter->top ? iter->stack[iter->top-1].node : NULL,
+		frame->index);
+	/* the node may have been replaced before it was skipped */
+	iter->node = frame->slot ? *frame->slot : frame->node;
+	iter->slot = frame->slot;
+	iter->depth = iter->top;
+	return MARSHAL_ITER_LEAVE;
+}
+
+void
+marshal_iter_skip(marshal_iter_t *iter)
+{
+	iter->skip = 1;
+}
+
+void
+marshal_iter_done(marshal_iter_t *iter)
+{
+	if (iter->stack != iter->frames)
+		mem_free(iter->stack);
+	iter->stack = iter->frames;
+	iter->size = MARSHAL_ITER_DEPTH;
+	iter->top = 0;
+	iter->root = NULL;
+}
+
+int
+marshal_visit(const marshal_t *root, const marshal_visitor_t *visitor,
+	void *data)
+{
+	marshal_iter_t iter;
+	marshal_visit_fn fn;
+	int event, result = 0;
+
+	marshal_iter_init(&iter, root);
+	while ((event = marshal_iter_next(&iter)) > 0)
+	{
+		int type;
+		if (!iter.node)
+			continue;
+		type = iter.node->type;
+		if (type < 0 || type >= MARSHAL_TYPE_COUNT)
+			continue;
+		fn = MARSHAL_ITER_LEAVE == event
+			? visitor->leave[type] : visitor->enter[type];
+		if (!fn)
+			continue;
+		switch (fn(&iter, data))
+		{
+			case MARSHAL_VISIT_SKIP:
+				if (MARSHAL_ITER_ENTER == event)
+					marshal_iter_skip(&iter);
+				break;
+			case MARSHAL_VISIT_STOP:
+				result = 1;
+				goto done;
+		}
+	}
+	if (MARSHAL_ITER_ERROR == event)
+		result = -1;
+done:
+	marshal_iter_done(&iter);
+	return result;
+}
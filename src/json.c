@@ -0,0 +1,961 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "format.h"
+
+/* Marshal bytes are transcoded as they are read, no tree is built. Links
+   to objects (@) read the linked object's bytes again, so the table of
+   objects only keeps where each one starts. */
+
+#define OK 0
+#define FAILED 1
+
+#define CHECK(x) do { if (x) return FAILED; } while(0)
+
+#define GROW_RATE 8
+#define OUT_SIZE 65536
+#define MAX_DEPTH 1000
+
+#define DEFAULT_CLASS_KEY "__class"
+#define DEFAULT_DATA_KEY "__data"
+
+#define STRING_UTF8   0 /* valid bytes are copied */
+#define STRING_BINARY 1 /* bytes go through MARSHAL_JSON_BINARY_* */
+
+typedef struct
+{
+	const char *name; /* not terminated, it points into the input */
+	size_t size;
+} sym_t;
+
+typedef struct
+{
+	size_t start;
+	int open; /* being written, links to it are cycles */
+} obj_t;
+
+typedef struct
+{
+	const unsigned char *data;
+	const unsigned char *p;
+	const unsigned char *end;
+	sym_t *syms;
+	int sym_size;
+	int sym_count;
+	obj_t *objs;
+	int obj_size;
+	int obj_count;
+	int replay; /* > 0 while a linked object is read again */
+	int depth;
+
+	int flags;
+	const char *class_key;
+	const char *data_key;
+
+	int mute; /* > 0 while reading values that aren't written */
+	marshal_sink_t sink;
+	size_t len;
+	char out[OUT_SIZE];
+} json_t;
+
+static int
+value(json_t *j);
+
+static int
+typed(json_t *j, size_t start);
+
+static int
+skip_ivars(json_t *j);
+
+/* output */
+
+static int
+flush(json_t *j)
+{
+	if (j->len && j->sink.write(j->sink.data, j->out, j->len))
+		return FAILED;
+	j->len = 0;
+	return OK;
+}
+
+static int
+put(json_t *j, const void *data, size_t size)
+{
+	if (j->mute)
+		return OK;
+	if (size > OUT_SIZE - j->len)
+	{
+		CHECK(flush(j));
+		/* big runs skip the buffer */
+		if (size >= OUT_SIZE / 2)
+			return j->sink.write(j->sink.data, data, size) ? FAILED : OK;
+	}
+	memcpy(j->out + j->len, data, size);
+	j->len += size;
+	return OK;
+}
+
+static int
+put_long(json_t *j, long value)
+{
+	char text[24];
+	char *p = text + sizeof(text);
+	unsigned long u = value < 0
+		? 0UL - (unsigned long)value : (unsigned long)value;
+	do
+	{
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (value < 0)
+		*--p = '-';
+	return put(j, p, text + sizeof(text) - p);
+}
+
+/* bytes that are copied as they are inside a JSON string */
+#define PLAIN(c) ((c) >= 0x20 && '"' != (c) && '\\' != (c))
+
+static int
+put_escape(json_t *j, unsigned char c)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[7];
+	switch (c)
+	{
+		case '"': return put(j, "\\\"", 2);
+		case '\\': return put(j, "\\\\", 2);
+		case '\n': return put(j, "\\n", 2);
+		case '\t': return put(j, "\\t", 2);
+		case '\r': return put(j, "\\r", 2);
+		case '\b': return put(j, "\\b", 2);
+		case '\f': return put(j, "\\f", 2);
+	}
+	memcpy(esc, "\\u00", 4);
+	esc[4] = hex[c >> 4];
+	esc[5] = hex[c & 15];
+	return put(j, esc, 6);
+}
+
+/* length of the UTF-8 character at p, 0 if it's not valid */
+static size_t
+utf8_char(const unsigned char *p, size_t size)
+{
+	size_t n, i;
+	if (*p >= 0xC2 && *p <= 0xDF)
+		n = 2;
+	else if (*p >= 0xE0 && *p <= 0xEF)
+		n = 3;
+	else if (*p >= 0xF0 && *p <= 0xF4)
+		n = 4;
+	else
+		return 0;
+	if (n > size)
+		return 0;
+	for (i = 1; i < n; i++)
+	{
+		if ((p[i] & 0xC0) != 0x80)
+			return 0;
+	}
+	/* overlong, surrogates and beyond U+10FFFF */
+	if ((0xE0 == p[0] && p[1] < 0xA0) || (0xED == p[0] && p[1] > 0x9F)
+			|| (0xF0 == p[0] && p[1] < 0x90) || (0xF4 == p[0] && p[1] > 0x8F))
+		return 0;
+	return n;
+}
+
+static int
+put_base64(json_t *j, const unsigned char *p, size_t size)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char chunk[256];
+	size_t i, n = 0;
+
+	for (i = 0; i < size; i += 3)
+	{
+		unsigned long v = (unsigned long)p[i] << 16;
+		if (i + 1 < size)
+			v |= (unsigned long)p[i+1] << 8;
+		if (i + 2 < size)
+			v |= p[i+2];
+		chunk[n++] = digits[v >> 18 & 63];
+		chunk[n++] = digits[v >> 12 & 63];
+		chunk[n++] = i + 1 < size ? digits[v >> 6 & 63] : '=';
+		chunk[n++] = i + 2 < size ? digits[v & 63] : '=';
+		if (n == sizeof(chunk))
+		{
+			CHECK(put(j, chunk, n));
+			n = 0;
+		}
+	}
+	return put(j, chunk, n);
+}
+
+/* skips bytes that need no escaping, 8 at a time while none of them is
+   below 0x20, a quote or a backslash */
+static const unsigned char *
+skip_plain(const unsigned char *p, const unsigned char *end)
+{
+	const uint64_t ones = UINT64_C(0x0101010101010101);
+	const uint64_t high = ones * 0x80;
+	while (end - p >= 8)
+	{
+		uint64_t x, quote, slash;
+		memcpy(&x, p, 8);
+		quote = x ^ (ones * '"');
+		slash = x ^ (ones * '\\');
+		if ((((x - ones * 0x20) & ~x) | ((quote - ones) & ~quote)
+				| ((slash - ones) & ~slash)) & high)
+			break;
+		p += 8;
+	}
+	while (p < end && PLAIN(*p))
+		p++;
+	return p;
+}
+
+/* writes bytes escaped for a JSON string, runs of plain bytes are
+   copied at once */
+static int
+put_chars(json_t *j, const unsigned char *p, size_t size, int kind)
+{
+	const unsigned char *end = p + size, *run;
+	int is_ascii;
+	int valid = marshal_utf8_validate(p, size, &is_ascii);
+	int latin1 = STRING_BINARY == kind
+		&& j->flags & MARSHAL_JSON_BINARY_LATIN1;
+
+	if (latin1)
+		valid = is_ascii;
+	while (p < end)
+	{
+		run = p;
+		if (valid)
+			p = skip_plain(p, end);
+		else
+			while (p < end && PLAIN(*p) && *p < 0x80)
+				p++;
+		CHECK(put(j, run, p - run));
+		if (p == end)
+			break;
+		if (*p < 0x80)
+			CHECK(put_escape(j, *p++));
+		else if (latin1)
+		{
+			/* the byte as a code point */
+			char pair[2];
+			pair[0] = (char)(0xC0 | *p >> 6);
+			pair[1] = (char)(0x80 | (*p & 0x3F));
+			CHECK(put(j, pair, 2));
+			p++;
+		}
+		else
+		{
+			size_t n = utf8_char(p, end - p);
+			/* invalid bytes become U+FFFD */
+			CHECK(n ? put(j, p, n) : put(j, "\xEF\xBF\xBD", 3));
+			p += n ? n : 1;
+		}
+	}
+	return OK;
+}
+
+static int
+put_string(json_t *j, const void *data, size_t size, int kind)
+{
+	if (j->mute)
+		return OK;
+	CHECK(put(j, "\"", 1));
+	if (STRING_BINARY == kind && j->flags & MARSHAL_JSON_BINARY_BASE64
+			&& !marshal_utf8_validate(data, size, NULL))
+		CHECK(put_base64(j, data, size));
+	else
+		CHECK(put_chars(j, data, size, kind));
+	return put(j, "\"", 1);
+}
+
+/* input */
+
+static int
+read_byte(json_t *j)
+{
+	if (j->p >= j->end)
+		return -1;
+	return *j->p++;
+}
+
+/* same as Ruby's r_long */
+static int
+read_long(json_t *j, long *value)
+{
+	int c = read_byte(j), i;
+	long x;
+
+	if (c < 0)
+		return FAILED;
+	c = (signed char)c;
+	if (0 == c)
+		x = 0;
+	else if (c > 4)
+		x = c - 5;
+	else if (c < -4)
+		x = c + 5;
+	else if (c > 0)
+	{
+		if (j->end - j->p < c)
+			return FAILED;
+		for (x = 0, i = 0; i < c; i++)
+			x |= (long)*j->p++ << (8 * i);
+	}
+	else
+	{
+		c = -c;
+		if (j->end - j->p < c)
+			return FAILED;
+		for (x = -1, i = 0; i < c; i++)
+		{
+			x &= ~(0xFFL << (8 * i));
+			x |= (long)*j->p++ << (8 * i);
+		}
+	}
+	*value = x;
+	return OK;
+}
+
+static int
+read_count(json_t *j, long *count)
+{
+	CHECK(read_long(j, count));
+	return *count < 0 || *count > j->end - j->p ? FAILED : OK;
+}
+
+/* a length then as many bytes */
+static const unsigned char *
+read_bytes(json_t *j, size_t *size)
+{
+	const unsigned char *bytes;
+	long len;
+	if (read_long(j, &len) || len < 0 || len > j->end - j->p)
+		return NULL;
+	bytes = j->p;
+	j->p += len;
+	*size = len;
+	return bytes;
+}
+
+static int
+append(void **list, int *size, int count, size_t item_size)
+{
+	if (*size <= count)
+	{
+		int grown_size = *size ? *size * GROW_RATE : GROW_RATE;
+		void *grown = mem_realloc(*list, grown_size * item_size);
+		if (!grown)
+			return FAILED;
+		*list = grown;
+		*size = grown_size;
+	}
+	return OK;
+}
+
+/* registers an object starting at start, returns its index
+   -1 while replaying (it was registered the first time) or on failure */
+static int
+add_object(json_t *j, size_t start)
+{
+	if (j->replay)
+		return -1;
+	if (append((void **)&j->objs, &j->obj_size, j->obj_count, sizeof(obj_t)))
+		return -1;
+	j->objs[j->obj_count].start = start;
+	j->objs[j->obj_count].open = 0;
+	return j->obj_count++;
+}
+
+static void
+set_open(json_t *j, int index, int open)
+{
+	if (index >= 0)
+		j->objs[index].open += open;
+}
+
+/* reads a symbol or a symlink into sym, a symbol's encoding is dropped */
+static int
+read_symbol(json_t *j, sym_t *sym)
+{
+	int type = read_byte(j);
+	int has_ivars = 0;
+	long index;
+
+	if (M_SYMLINK == type)
+	{
+		if (read_long(j, &index) || index < 0 || index >= j->sym_count)
+			return FAILED;
+		*sym = j->syms[index];
+		return OK;
+	}
+	if (M_IVAR == type)
+	{
+		has_ivars = 1;
+		type = read_byte(j);
+	}
+	if (M_SYMBOL != type)
+		return FAILED;
+	sym->name = (const char *)read_bytes(j, &sym->size);
+	if (!sym->name)
+		return FAILED;
+	/* symbols read again were registered the first time */
+	if (!j->replay)
+	{
+		if (append((void **)&j->syms, &j->sym_size, j->sym_count,
+				sizeof(sym_t)))
+			return FAILED;
+		j->syms[j->sym_count++] = *sym;
+	}
+	return has_ivars ? skip_ivars(j) : OK;
+}
+
+static int
+is_sym(const sym_t *sym, const char *name)
+{
+	return sym->size == strlen(name) && 0 == memcmp(sym->name, name, sym->size);
+}
+
+/* transcoding */
+
+static int
+put_symbol(json_t *j, const sym_t *sym)
+{
+	if (!(j->flags & MARSHAL_JSON_SYMBOL_COLON))
+		return put_string(j, sym->name, sym->size, STRING_UTF8);
+	if (j->mute)
+		return OK;
+	CHECK(put(j, "\":", 2));
+	CHECK(put_chars(j, (const unsigned char *)sym->name, sym->size,
+		STRING_UTF8));
+	return put(j, "\"", 1);
+}
+
+/* "key": with a class or data key */
+static int
+put_key(json_t *j, const char *key)
+{
+	CHECK(put_string(j, key, strlen(key), STRING_UTF8));
+	return put(j, ":", 1);
+}
+
+/* ivar names as keys: "@name" loses its '@' */
+static int
+put_ivar_key(json_t *j, const sym_t *name)
+{
+	sym_t key = *name;
+	if (!(j->flags & MARSHAL_JSON_KEEP_AT) && key.size && '@' == *key.name)
+	{
+		key.name++;
+		key.size--;
+	}
+	CHECK(put_string(j, key.name, key.size, STRING_UTF8));
+	return put(j, ":", 1);
+}
+
+/* reads count ivars (name, value) without writing them */
+static int
+skip_ivars(json_t *j)
+{
+	long count, i;
+	CHECK(read_count(j, &count));
+	j->mute++;
+	for (i = 0; i < count; i++)
+	{
+		sym_t name;
+		if (read_symbol(j, &name) || value(j))
+		{
+			j->mute--;
+			return FAILED;
+		}
+	}
+	j->mute--;
+	return OK;
+}
+
+static int
+put_float(json_t *j, const unsigned char *text, size_t size)
+{
+	size_t i;
+	/* old dumps keep mantissa bytes after a NUL */
+	for (i = 0; i < size && text[i]; i++)
+	{
+		unsigned char c = text[i];
+		if (!((c >= '0' && c <= '9') || '-' == c || '+' == c || '.' == c
+				|| 'e' == c || 'E' == c))
+			break;
+	}
+	/* inf, -inf and nan have no JSON form */
+	if (!i || (i < size && text[i]) || '.' == text[0])
+		return put(j, "null", 4);
+	return put(j, text, i);
+}
+
+static int
+bignum(json_t *j, size_t start)
+{
+	int sign = read_byte(j), count;
+	long len;
+	char *digits;
+
+	if (('+' != sign && '-' != sign) || read_long(j, &len) || len < 0
+			|| len > (j->end - j->p) / 2)
+		return FAILED;
+	add_object(j, start);
+	if (j->mute)
+	{
+		j->p += len * 2;
+		return OK;
+	}
+	digits = mem_alloc(BIGNUM_DIGITS(len * 2));
+	if (!digits)
+		return FAILED;
+	count = bignum_decimal(j->p, len * 2, '-' == sign ? -1 : 1, digits);
+	j->p += len * 2;
+	if (count < 0 || put(j, digits, count))
+	{
+		mem_free(digits);
+		return FAILED;
+	}
+	mem_free(digits);
+	return OK;
+}
+
+static int
+array(json_t *j, size_t start)
+{
+	int index = add_object(j, start);
+	long count, i;
+
+	CHECK(read_count(j, &count));
+	set_open(j, index, 1);
+	CHECK(put(j, "[", 1));
+	for (i = 0; i < count; i++)
+	{
+		if (i)
+			CHECK(put(j, ",", 1));
+		CHECK(value(j));
+	}
+	set_open(j, index, -1);
+	return put(j, "]", 1);
+}
+
+/* strings and symbols are keys as they are, anything else is written
+   into a string */
+static int
+hash_key(json_t *j)
+{
+	int type = j->p < j->end ? *j->p : -1;
+	int inner = j->p + 1 < j->end ? j->p[1] : -1;
+	marshal_sink_t sink;
+	marshal_buffer_t buf;
+	int status;
+
+	if (M_SYMBOL == type || M_SYMLINK == type || M_STRING == type
+			|| (M_IVAR == type && (M_STRING == inner || M_SYMBOL == inner))
+			|| j->mute)
+		return value(j);
+
+	/* the key's JSON goes into buf */
+	CHECK(flush(j));
+	sink = j->sink;
+	memset(&buf, 0, sizeof(buf));
+	j->sink.write = marshal_buffer_write;
+	j->sink.data = &buf;
+	status = value(j);
+	if (OK == status)
+		status = flush(j);
+	j->sink = sink;
+	j->len = 0;
+	if (OK == status)
+	{
+		if (buf.size && '"' == buf.data[0])
+			status = put(j, buf.data, buf.size);
+		else
+			status = put_string(j, buf.data, buf.size, STRING_UTF8);
+	}
+	if (buf.data)
+		mem_free(buf.data);
+	return status;
+}
+
+static int
+hash(json_t *j, size_t start, int has_default)
+{
+	int index = add_object(j, start);
+	long count, i;
+
+	CHECK(read_count(j, &count));
+	set_open(j, index, 1);
+	CHECK(put(j, "{", 1));
+	for (i = 0; i < count; i++)
+	{
+		if (i)
+			CHECK(put(j, ",", 1));
+		CHECK(hash_key(j));
+		CHECK(put(j, ":", 1));
+		CHECK(value(j));
+	}
+	if (has_default)
+	{
+		/* defaults have no JSON form */
+		j->mute++;
+		i = value(j);
+		j->mute--;
+		CHECK(i);
+	}
+	set_open(j, index, -1);
+	return put(j, "}", 1);
+}
+
+/* a string, its encoding comes from the ivars that follow it */
+static int
+string(json_t *j, size_t start, int has_ivars)
+{
+	const unsigned char *bytes;
+	size_t size;
+	int kind = STRING_BINARY;
+	long count, i;
+
+	add_object(j, start);
+	bytes = read_bytes(j, &size);
+	if (!bytes)
+		return FAILED;
+	if (has_ivars)
+	{
+		CHECK(read_count(j, &count));
+		for (i = 0; i < count; i++)
+		{
+			const unsigned char *p;
+			sym_t name;
+			int status;
+			CHECK(read_symbol(j, &name));
+			p = j->p;
+			j->mute++;
+			status = value(j);
+			j->mute--;
+			CHECK(status);
+			/* E is true for UTF-8 and false for US-ASCII */
+			if (is_sym(&name, "E"))
+				kind = STRING_UTF8;
+			else if (is_sym(&name, "encoding") && M_STRING == *p)
+			{
+				const unsigned char *after = j->p, *encoding;
+				size_t len = 0;
+				j->p = p + 1;
+				encoding = read_bytes(j, &len);
+				kind = 5 == len && 0 == memcmp(encoding, "UTF-8", 5)
+					? STRING_UTF8 : STRING_BINARY;
+				j->p = after;
+			}
+		}
+	}
+	return put_string(j, bytes, size, kind);
+}
+
+static int
+regex(json_t *j, size_t start, int has_ivars)
+{
+	const unsigned char *bytes;
+	size_t size;
+	add_object(j, start);
+	bytes = read_bytes(j, &size);
+	if (!bytes || read_byte(j) < 0)
+		return FAILED;
+	if (has_ivars)
+		CHECK(skip_ivars(j));
+	return put_string(j, bytes, size, STRING_UTF8);
+}
+
+static int
+name(json_t *j, size_t start)
+{
+	const unsigned char *bytes;
+	size_t size;
+	add_object(j, start);
+	bytes = read_bytes(j, &size);
+	if (!bytes)
+		return FAILED;
+	return put_string(j, bytes, size, STRING_UTF8);
+}
+
+/* objects and structs: { "__class": "Klass", "ivar": value ... } */
+static int
+object(json_t *j, size_t start, int is_struct)
+{
+	int index = add_object(j, start);
+	sym_t klass;
+	long count, i;
+
+	if (read_symbol(j, &klass) || read_count(j, &count))
+		return FAILED;
+	set_open(j, index, 1);
+	CHECK(put(j, "{", 1));
+	if (!(j->flags & MARSHAL_JSON_OBJECT_BARE))
+	{
+		CHECK(put_key(j, j->class_key));
+		CHECK(put_symbol(j, &klass));
+	}
+	for (i = 0; i < count; i++)
+	{
+		sym_t name;
+		CHECK(read_symbol(j, &name));
+		if (i || !(j->flags & MARSHAL_JSON_OBJECT_BARE))
+			CHECK(put(j, ",", 1));
+		if (is_struct)
+		{
+			CHECK(put_string(j, name.name, name.size, STRING_UTF8));
+			CHECK(put(j, ":", 1));
+		}
+		else
+			CHECK(put_ivar_key(j, &name));
+		CHECK(value(j));
+	}
+	set_open(j, index, -1);
+	return put(j, "}", 1);
+}
+
+/* _dump data: { "__class": "Klass", "__data": "base64" } */
+static int
+userdef(json_t *j, size_t start, int has_ivars)
+{
+	const unsigned char *bytes;
+	size_t size;
+	sym_t klass;
+
+	CHECK(read_symbol(j, &klass));
+	bytes = read_bytes(j, &size);
+	if (!bytes)
+		return FAILED;
+	add_object(j, start);
+	if (!(j->flags & MARSHAL_JSON_OBJECT_BARE))
+	{
+		CHECK(put(j, "{", 1));
+		CHECK(put_key(j, j->class_key));
+		CHECK(put_symbol(j, &klass));
+		CHECK(put(j, ",", 1));
+		CHECK(put_key(j, j->data_key));
+	}
+	CHECK(put(j, "\"", 1));
+	if (!j->mute)
+		CHECK(put_base64(j, bytes, size));
+	CHECK(put(j, "\"", 1));
+	if (!(j->flags & MARSHAL_JSON_OBJECT_BARE))
+		CHECK(put(j, "}", 1));
+	return has_ivars ? skip_ivars(j) : OK;
+}
+
+/* marshal_dump and _dump_data: the class and a dumped value */
+static int
+usrmarshal(json_t *j, size_t start)
+{
+	int index = add_object(j, start);
+	sym_t klass;
+
+	CHECK(read_symbol(j, &klass));
+	set_open(j, index, 1);
+	if (!(j->flags & MARSHAL_JSON_OBJECT_BARE))
+	{
+		CHECK(put(j, "{", 1));
+		CHECK(put_key(j, j->class_key));
+		CHECK(put_symbol(j, &klass));
+		CHECK(put(j, ",", 1));
+		CHECK(put_key(j, j->data_key));
+	}
+	CHECK(value(j));
+	set_open(j, index, -1);
+	return j->flags & MARSHAL_JSON_OBJECT_BARE ? OK : put(j, "}", 1);
+}
+
+/* reads a linked object again, links to an object being written are
+   cycles and become null */
+static int
+object_ref(json_t *j)
+{
+	const unsigned char *resume;
+	long index;
+	int status;
+
+	if (read_long(j, &index) || index < 0 || index >= j->obj_count)
+		return FAILED;
+	if (j->objs[index].open)
+		return put(j, "null", 4);
+	if (j->mute)
+	{
+		/* nothing in it is registered again, it needn't be read */
+		return OK;
+	}
+	resume = j->p;
+	j->p = j->data + j->objs[index].start;
+	j->replay++;
+	j->objs[index].open++;
+	status = value(j);
+	j->objs[index].open--;
+	j->replay--;
+	j->p = resume;
+	return status;
+}
+
+/* reads a value whose type byte is next, start is where it begins (before
+   its wrappers) */
+static int
+typed(json_t *j, size_t start)
+{
+	const unsigned char *bytes;
+	size_t size;
+	sym_t sym;
+	long n;
+	int type = read_byte(j);
+
+	switch (type)
+	{
+		case M_NIL: return put(j, "null", 4);
+		case M_TRUE: return put(j, "true", 4);
+		case M_FALSE: return put(j, "false", 5);
+		case M_INTEGER:
+			CHECK(read_long(j, &n));
+			return put_long(j, n);
+		case M_BIGNUM: return bignum(j, start);
+		case M_FLOAT:
+			add_object(j, start);
+			bytes = read_bytes(j, &size);
+			return bytes ? put_float(j, bytes, size) : FAILED;
+		case M_SYMBOL:
+		case M_SYMLINK:
+			j->p--;
+			CHECK(read_symbol(j, &sym));
+			return put_symbol(j, &sym);
+		case M_ARRAY: return array(j, start);
+		case M_HASH: return hash(j, start, 0);
+		case M_HASH_DEFAULT: return hash(j, start, 1);
+		case M_STRING: return string(j, start, 0);
+		case M_REGEX: return regex(j, start, 0);
+		case M_CLASS:
+		case M_MODULE:
+		case M_OLD_MODULE:
+			return name(j, start);
+		case M_OBJECT: return object(j, start, 0);
+		case M_STRUCT: return object(j, start, 1);
+		case M_USERDEF: return userdef(j, start, 0);
+		case M_USRMARSHAL:
+		case M_DATA:
+			return usrmarshal(j, start);
+		case M_EXTENDED:
+		case M_USERCLASS:
+			/* the module or the subclass is dropped */
+			CHECK(read_symbol(j, &sym));
+			return typed(j, start);
+		case M_OBJECT_REF: return object_ref(j);
+		case M_IVAR:
+			if (j->p >= j->end)
+				return FAILED;
+			switch (*j->p)
+			{
+				case M_STRING:
+					j->p++;
+					return string(j, start, 1);
+				case M_REGEX:
+					j->p++;
+					return regex(j, start, 1);
+				case M_USERDEF:
+					j->p++;
+					return userdef(j, start, 1);
+				default:
+					CHECK(typed(j, start));
+					return skip_ivars(j);
+			}
+		default:
+			return FAILED;
+	}
+}
+
+static int
+value(json_t *j)
+{
+	int status;
+	if (++j->depth > MAX_DEPTH)
+		return FAILED;
+	status = typed(j, j->p - j->data);
+	j->depth--;
+	return status;
+}
+
+int
+marshal_buffer_write(void *data, const void *bytes, size_t size)
+{
+	marshal_buffer_t *buf = data;
+	if (!size)
+		return OK;
+	if (size > buf->capacity - buf->size)
+	{
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		char *grown;
+		while (capacity - buf->size < size)
+			capacity *= 2;
+		grown = mem_realloc(buf->data, capacity);
+		if (!grown)
+			return FAILED;
+		buf->data = grown;
+		buf->capacity = capacity;
+	}
+	memcpy(buf->data + buf->size, bytes, size);
+	buf->size += size;
+	return OK;
+}
+
+int
+marshal_to_json(const void *data, size_t size, const marshal_sink_t *sink,
+	const marshal_json_opts_t *opts)
+{
+	json_t *j;
+	int status;
+
+	if (!data || size < 2 || 4 != ((const unsigned char *)data)[0]
+			|| 8 != ((const unsigned char *)data)[1])
+		return FAILED;
+	j = mem_alloc(sizeof(json_t));
+	if (!j)
+		return FAILED;
+	memset(j, 0, sizeof(json_t) - OUT_SIZE);
+	j->data = data;
+	j->p = j->data + 2;
+	j->end = j->data + size;
+	j->sink = *sink;
+	j->flags = opts ? opts->flags : 0;
+	j->class_key = opts && opts->class_key ? opts->class_key
+		: DEFAULT_CLASS_KEY;
+	j->data_key = opts && opts->data_key ? opts->data_key
+		: DEFAULT_DATA_KEY;
+
+	status = value(j);
+	if (OK == status)
+		status = flush(j);
+
+	if (j->syms)
+		mem_free(j->syms);
+	if (j->objs)
+		mem_free(j->objs);
+	mem_free(j);
+	return status;
+}
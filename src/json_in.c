@@ -0,0 +1,710 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "format.h"
+
+/* JSON is written out as Marshal while it is parsed, no tree is built.
+   Arrays and hashes leave room for the largest count and move their
+   bytes back once the count is known. Objects are numbered the way Ruby
+   numbers them on load, so repeated keys can be links. */
+
+#define OK 0
+#define FAILED 1
+
+#define CHECK(x) do { if (x) return FAILED; } while(0)
+
+#define MAX_DEPTH 1000
+#define COUNT_ROOM 5 /* bytes a count of up to 2^31 takes */
+#define KEYS_SIZE 64 /* first size of the key table, a power of 2 */
+
+/* Ruby dumps integers outside of these as bignums */
+#define FIXNUM_MAX 1073741823L
+#define FIXNUM_MIN (-1073741824L)
+
+#define PLAIN(c) ((c) >= 0x20 && (c) < 0x80 && '"' != (c) && '\\' != (c))
+#define DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+typedef struct
+{
+	size_t name; /* offset into names */
+	size_t size;
+	unsigned long hashed;
+	long index; /* symbol or object index, -1 for a free slot */
+} entry_t;
+
+typedef struct
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	marshal_buffer_t *out;
+	int symbol_keys;
+	int depth;
+
+	long objects;
+	long symbols;
+	long encoding; /* symbol index of E, -1 until it's written */
+
+	marshal_buffer_t text; /* strings with escapes, bignum bytes */
+	marshal_buffer_t names; /* key bytes */
+	entry_t *keys;
+	size_t key_size;
+	size_t key_count;
+} reader_t;
+
+static int
+value(reader_t *r);
+
+/* output */
+
+/* most writes fit, only growing goes through marshal_buffer_write */
+static int
+put(reader_t *r, const void *bytes, size_t size)
+{
+	marshal_buffer_t *out = r->out;
+	if (size > out->capacity - out->size)
+		return marshal_buffer_write(out, bytes, size);
+	memcpy(out->data + out->size, bytes, size);
+	out->size += size;
+	return OK;
+}
+
+static int
+put_byte(reader_t *r, unsigned char c)
+{
+	marshal_buffer_t *out = r->out;
+	if (out->size == out->capacity)
+		return marshal_buffer_write(out, &c, 1);
+	out->data[out->size++] = c;
+	return OK;
+}
+
+static int
+put_long(reader_t *r, long x)
+{
+	unsigned char bytes[ENCODED_LONG_SIZE];
+	if (x > 0 && x < 123)
+		return put_byte(r, (unsigned char)(x + 5));
+	return put(r, bytes, encode_long(bytes, x));
+}
+
+/* a string's only ivar, JSON is UTF-8 */
+static int
+put_encoding(reader_t *r)
+{
+	CHECK(put_long(r, 1));
+	if (r->encoding < 0)
+	{
+		r->encoding = r->symbols++;
+		CHECK(put(r, ":\006E", 3));
+	}
+	else
+	{
+		CHECK(put_byte(r, M_SYMLINK));
+		CHECK(put_long(r, r->encoding));
+	}
+	return put_byte(r, M_TRUE);
+}
+
+static int
+put_string(reader_t *r, const unsigned char *s, size_t size)
+{
+	r->objects++;
+	CHECK(put_byte(r, M_IVAR));
+	CHECK(put_byte(r, M_STRING));
+	CHECK(put_long(r, (long)size));
+	CHECK(put(r, s, size));
+	return put_encoding(r);
+}
+
+/* writes the count where room was left at start and moves what follows
+   it back */
+static int
+put_count(reader_t *r, size_t start, long count)
+{
+	unsigned char bytes[ENCODED_LONG_SIZE];
+	char *at = r->out->data + start;
+	int n = encode_long(bytes, count);
+	memcpy(at, bytes, n);
+	memmove(at + n, at + COUNT_ROOM, r->out->size - start - COUNT_ROOM);
+	r->out->size -= COUNT_ROOM - n;
+	return OK;
+}
+
+static int
+reserve_count(reader_t *r, size_t *start)
+{
+	static const unsigned char room[COUNT_ROOM];
+	*start = r->out->size;
+	return put(r, room, COUNT_ROOM);
+}
+
+/* input */
+
+static void
+skip_space(reader_t *r)
+{
+	while (r->p < r->end && (' ' == *r->p || '\n' == *r->p
+			|| '\r' == *r->p || '\t' == *r->p))
+		r->p++;
+}
+
+/* skips ASCII bytes that need no unescaping, 8 at a time while none of
+   them is below 0x20, past 0x7F, a quote or a backslash */
+static const unsigned char *
+skip_plain(const unsigned char *p, const unsigned char *end)
+{
+	const uint64_t ones = UINT64_C(0x0101010101010101);
+	const uint64_t high = ones * 0x80;
+	while (end - p >= 8)
+	{
+		uint64_t x, quote, slash;
+		memcpy(&x, p, 8);
+		quote = x ^ (ones * '"');
+		slash = x ^ (ones * '\\');
+		if ((x | (x - ones * 0x20) | ((quote - ones) & ~quote)
+				| ((slash - ones) & ~slash)) & high)
+			break;
+		p += 8;
+	}
+	while (p < end && PLAIN(*p))
+		p++;
+	return p;
+}
+
+static int
+read_hex(reader_t *r, unsigned long *code)
+{
+	int i;
+	if (r->end - r->p < 4)
+		return FAILED;
+	*code = 0;
+	for (i = 0; i < 4; i++)
+	{
+		unsigned char c = *r->p++;
+		*code <<= 4;
+		if (DIGIT(c))
+			*code |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			*code |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			*code |= c - 'A' + 10;
+		else
+			return FAILED;
+	}
+	return OK;
+}
+
+/* \u escapes, lone surrogates become U+FFFD */
+static int
+unescape_unicode(reader_t *r)
+{
+	unsigned long code, low;
+	unsigned char utf8[4];
+	int n;
+
+	CHECK(read_hex(r, &code));
+	if (code >= 0xD800 && code < 0xDC00 && r->end - r->p >= 6
+			&& '\\' == r->p[0] && 'u' == r->p[1])
+	{
+		const unsigned char *back = r->p;
+		r->p += 2;
+		CHECK(read_hex(r, &low));
+		if (low >= 0xDC00 && low < 0xE000)
+			code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+		else
+			r->p = back;
+	}
+	if (code >= 0xD800 && code < 0xE000)
+		code = 0xFFFD;
+
+	if (code < 0x80)
+	{
+		utf8[0] = (unsigned char)code;
+		n = 1;
+	}
+	else if (code < 0x800)
+	{
+		utf8[0] = (unsigned char)(0xC0 | code >> 6);
+		utf8[1] = (unsigned char)(0x80 | (code & 0x3F));
+		n = 2;
+	}
+	else if (code < 0x10000)
+	{
+		utf8[0] = (unsigned char)(0xE0 | code >> 12);
+		utf8[1] = (unsigned char)(0x80 | (code >> 6 & 0x3F));
+		utf8[2] = (unsigned char)(0x80 | (code & 0x3F));
+		n = 3;
+	}
+	else
+	{
+		utf8[0] = (unsigned char)(0xF0 | code >> 18);
+		utf8[1] = (unsigned char)(0x80 | (code >> 12 & 0x3F));
+		utf8[2] = (unsigned char)(0x80 | (code >> 6 & 0x3F));
+		utf8[3] = (unsigned char)(0x80 | (code & 0x3F));
+		n = 4;
+	}
+	return marshal_buffer_write(&r->text, utf8, n);
+}
+
+/* reads the string at the opening quote, s points into the input unless
+   the string has escapes, ascii tells whether it's all ASCII */
+static int
+read_string(reader_t *r, const unsigned char **s, size_t *size, int *ascii)
+{
+	const unsigned char *run;
+	int escaped = 0;
+
+	*ascii = 1;
+	run = ++r->p;
+	for (;;)
+	{
+		unsigned char c;
+		r->p = skip_plain(r->p, r->end);
+		if (r->p == r->end)
+			return FAILED;
+		c = *r->p;
+		if ('"' == c)
+			break;
+		if (c >= 0x80)
+		{
+			int n = utf8_char_size(r->p, r->end);
+			if (!n)
+				return FAILED;
+			r->p += n;
+			*ascii = 0;
+			continue;
+		}
+		if ('\\' != c)
+			return FAILED;
+
+		/* everything after the first escape goes through text */
+		if (!escaped)
+			r->text.size = 0;
+		escaped = 1;
+		CHECK(marshal_buffer_write(&r->text, run, r->p - run));
+		if (r->end - r->p < 2)
+			return FAILED;
+		r->p += 2;
+		switch (r->p[-1])
+		{
+			case '"': c = '"'; break;
+			case '\\': c = '\\'; break;
+			case '/': c = '/'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'u':
+				c = 0;
+				CHECK(unescape_unicode(r));
+				if ((unsigned char)r->text.data[r->text.size - 1] >= 0x80)
+					*ascii = 0;
+				break;
+			default:
+				return FAILED;
+		}
+		if (c)
+			CHECK(marshal_buffer_write(&r->text, &c, 1));
+		run = r->p;
+	}
+	if (escaped)
+	{
+		CHECK(marshal_buffer_write(&r->text, run, r->p - run));
+		*s = (const unsigned char *)r->text.data;
+		*size = r->text.size;
+	}
+	else
+	{
+		*s = run;
+		*size = r->p - run;
+	}
+	r->p++;
+	return OK;
+}
+
+/* the key table, repeated keys are written as links */
+
+static unsigned long
+hash_key(const unsigned char *s, size_t size)
+{
+	/* FNV-1a */
+	unsigned long h = 2166136261UL;
+	size_t i;
+	for (i = 0; i < size; i++)
+		h = ((h ^ s[i]) * 16777619UL) & 0xFFFFFFFFUL;
+	return h;
+}
+
+static entry_t *
+find_key(reader_t *r, const unsigned char *s, size_t size,
+	unsigned long hashed)
+{
+	size_t mask = r->key_size - 1;
+	size_t i = hashed & mask;
+	for (;;)
+	{
+		entry_t *key = r->keys + i;
+		if (key->index < 0 || (key->hashed == hashed && key->size == size
+				&& !memcmp(r->names.data + key->name, s, size)))
+			return key;
+		i = (i + 1) & mask;
+	}
+}
+
+static int
+grow_keys(reader_t *r)
+{
+	entry_t *old = r->keys;
+	size_t old_size = r->key_size, i;
+
+	r->key_size = old_size ? old_size * 2 : KEYS_SIZE;
+	r->keys = mem_alloc(r->key_size * sizeof(entry_t));
+	if (!r->keys)
+	{
+		r->keys = old;
+		r->key_size = old_size;
+		return FAILED;
+	}
+	for (i = 0; i < r->key_size; i++)
+		r->keys[i].index = -1;
+	for (i = 0; i < old_size; i++)
+	{
+		if (old[i].index >= 0)
+		{
+			size_t j = old[i].hashed & (r->key_size - 1);
+			while (r->keys[j].index >= 0)
+				j = (j + 1) & (r->key_size - 1);
+			r->keys[j] = old[i];
+		}
+	}
+	mem_free(old);
+	return OK;
+}
+
+static int
+key(reader_t *r)
+{
+	const unsigned char *s;
+	size_t size;
+	unsigned long hashed;
+	entry_t *found;
+	int ascii;
+
+	if (r->p == r->end || '"' != *r->p)
+		return FAILED;
+	CHECK(read_string(r, &s, &size, &ascii));
+
+	if (2 * (r->key_count + 1) > r->key_size)
+		CHECK(grow_keys(r));
+	hashed = hash_key(s, size);
+	found = find_key(r, s, size, hashed);
+	if (found->index >= 0)
+	{
+		CHECK(put_byte(r, r->symbol_keys ? M_SYMLINK : M_OBJECT_REF));
+		return put_long(r, found->index);
+	}
+
+	found->name = r->names.size;
+	found->size = size;
+	found->hashed = hashed;
+	CHECK(marshal_buffer_write(&r->names, s, size));
+	r->key_count++;
+	if (!r->symbol_keys)
+	{
+		/* Ruby shares equal frozen keys, Marshal links them */
+		found->index = r->objects;
+		return put_string(r, s, size);
+	}
+
+	found->index = r->symbols++;
+	if (!ascii)
+		CHECK(put_byte(r, M_IVAR));
+	CHECK(put_byte(r, M_SYMBOL));
+	CHECK(put_long(r, (long)size));
+	CHECK(put(r, s, size));
+	if (!ascii)
+		CHECK(put_encoding(r));
+	return OK;
+}
+
+/* values */
+
+/* the digits of a big integer into little endian bytes, padded to
+   shorts */
+static int
+bignum(reader_t *r, const unsigned char *digits, size_t count, int negative)
+{
+	unsigned char *bytes;
+	size_t size = 0, i, j;
+
+	r->text.size = 0;
+	for (i = 0; i < count; i++)
+	{
+		unsigned carry = digits[i] - '0';
+		bytes = (unsigned char *)r->text.data;
+		for (j = 0; j < size; j++)
+		{
+			carry += bytes[j] * 10;
+			bytes[j] = (unsigned char)carry;
+			carry >>= 8;
+		}
+		if (carry)
+		{
+			unsigned char c = (unsigned char)carry;
+			CHECK(marshal_buffer_write(&r->text, &c, 1));
+			size++;
+		}
+	}
+	if (size % 2)
+	{
+		CHECK(marshal_buffer_write(&r->text, "", 1));
+		size++;
+	}
+
+	r->objects++;
+	CHECK(put_byte(r, M_BIGNUM));
+	CHECK(put_byte(r, negative ? '-' : '+'));
+	CHECK(put_long(r, (long)(size / 2)));
+	return put(r, r->text.data, size);
+}
+
+static int
+number(reader_t *r)
+{
+	const unsigned char *start = r->p, *digits;
+	int negative = 0, integer = 1;
+	size_t count;
+
+	if ('-' == *r->p)
+	{
+		negative = 1;
+		r->p++;
+	}
+	digits = r->p;
+	if (r->p == r->end || !DIGIT(*r->p))
+		return FAILED;
+	if ('0' == *r->p)
+		r->p++;
+	else
+		while (r->p < r->end && DIGIT(*r->p))
+			r->p++;
+	count = r->p - digits;
+
+	if (r->p < r->end && '.' == *r->p)
+	{
+		integer = 0;
+		r->p++;
+		if (r->p == r->end || !DIGIT(*r->p))
+			return FAILED;
+		while (r->p < r->end && DIGIT(*r->p))
+			r->p++;
+	}
+	if (r->p < r->end && ('e' == *r->p || 'E' == *r->p))
+	{
+		integer = 0;
+		r->p++;
+		if (r->p < r->end && ('+' == *r->p || '-' == *r->p))
+			r->p++;
+		if (r->p == r->end || !DIGIT(*r->p))
+			return FAILED;
+		while (r->p < r->end && DIGIT(*r->p))
+			r->p++;
+	}
+
+	if (!integer)
+	{
+		/* Ruby reads floats back with strtod, the text is kept */
+		r->objects++;
+		CHECK(put_byte(r, M_FLOAT));
+		CHECK(put_long(r, (long)(r->p - start)));
+		return put(r, start, r->p - start);
+	}
+	/* past 1073741824 it's a bignum anyway, and would overflow 32 bits */
+	if (count < 10 || (10 == count && memcmp(digits, "1073741824", 10) <= 0))
+	{
+		long x = 0;
+		size_t i;
+		for (i = 0; i < count; i++)
+			x = x * 10 + (digits[i] - '0');
+		if (negative)
+			x = -x;
+		if (x >= FIXNUM_MIN && x <= FIXNUM_MAX)
+		{
+			CHECK(put_byte(r, M_INTEGER));
+			return put_long(r, x);
+		}
+	}
+	return bignum(r, digits, count, negative);
+}
+
+static int
+literal(reader_t *r, const char *word, size_t size, unsigned char type)
+{
+	if ((size_t)(r->end - r->p) < size || memcmp(r->p, word, size))
+		return FAILED;
+	r->p += size;
+	return put_byte(r, type);
+}
+
+static int
+array(reader_t *r)
+{
+	size_t start;
+	long count = 0;
+
+	r->objects++;
+	r->p++;
+	CHECK(put_byte(r, M_ARRAY));
+	CHECK(reserve_count(r, &start));
+	skip_space(r);
+	if (r->p < r->end && ']' == *r->p)
+		r->p++;
+	else
+		for (;;)
+		{
+			CHECK(value(r));
+			count++;
+			skip_space(r);
+			if (r->p == r->end)
+				return FAILED;
+			if (']' == *r->p++)
+				break;
+			if (',' != r->p[-1])
+				return FAILED;
+		}
+	return put_count(r, start, count);
+}
+
+static int
+hash(reader_t *r)
+{
+	size_t start;
+	long count = 0;
+
+	r->objects++;
+	r->p++;
+	CHECK(put_byte(r, M_HASH));
+	CHECK(reserve_count(r, &start));
+	skip_space(r);
+	if (r->p < r->end && '}' == *r->p)
+		r->p++;
+	else
+		for (;;)
+		{
+			skip_space(r);
+			CHECK(key(r));
+			skip_space(r);
+			if (r->p == r->end || ':' != *r->p++)
+				return FAILED;
+			CHECK(value(r));
+			count++;
+			skip_space(r);
+			if (r->p == r->end)
+				return FAILED;
+			if ('}' == *r->p++)
+				break;
+			if (',' != r->p[-1])
+				return FAILED;
+		}
+	return put_count(r, start, count);
+}
+
+static int
+value(reader_t *r)
+{
+	int status;
+
+	skip_space(r);
+	if (r->p == r->end)
+		return FAILED;
+	if (++r->depth > MAX_DEPTH)
+		return FAILED;
+	switch (*r->p)
+	{
+		case '{':
+			status = hash(r);
+			break;
+		case '[':
+			status = array(r);
+			break;
+		case '"':
+		{
+			const unsigned char *s;
+			size_t size;
+			int ascii;
+			status = read_string(r, &s, &size, &ascii);
+			if (OK == status)
+				status = put_string(r, s, size);
+			break;
+		}
+		case 't':
+			status = literal(r, "true", 4, M_TRUE);
+			break;
+		case 'f':
+			status = literal(r, "false", 5, M_FALSE);
+			break;
+		case 'n':
+			status = literal(r, "null", 4, M_NIL);
+			break;
+		default:
+			status = number(r);
+	}
+	r->depth--;
+	return status;
+}
+
+int
+marshal_from_json(const void *json, size_t size, marshal_buffer_t *out,
+	const marshal_json_opts_t *opts)
+{
+	reader_t r;
+	size_t mark;
+	int status;
+
+	if (!json || !out)
+		return FAILED;
+	memset(&r, 0, sizeof(reader_t));
+	r.p = json;
+	r.end = r.p + size;
+	r.out = out;
+	r.symbol_keys = opts && (opts->flags & MARSHAL_JSON_SYMBOL_KEYS);
+	r.encoding = -1;
+
+	mark = out->size;
+	status = put(&r, "\004\010", 2);
+	if (OK == status)
+		status = value(&r);
+	if (OK == status)
+	{
+		skip_space(&r);
+		if (r.p != r.end)
+			status = FAILED;
+	}
+	if (status)
+		out->size = mark;
+
+	if (r.text.data)
+		mem_free(r.text.data);
+	if (r.names.data)
+		mem_free(r.names.data);
+	if (r.keys)
+		mem_free(r.keys);
+	return status;
+}
@@ -16,12 +16,111 @@
  */
 #include <stdlib.h>
 #include <string.h>
-#include "marshal.h"
+#include "internal.h"
 
+/* nil, booleans and small integers take no memory, every tree points to
+   these nodes, which are never freed nor modified (writing them faults) */
+#define INT1(n) {{MARSHAL_INTEGER, SHARED_STATIC, (n)}}
+#define INT4(n) INT1(n), INT1((n)+1), INT1((n)+2), INT1((n)+3)
+#define INT16(n) INT4(n), INT4((n)+4), INT4((n)+8), INT4((n)+12)
+#define INT64(n) INT16(n), INT16((n)+16), INT16((n)+32), INT16((n)+48)
+#define INT256(n) INT64(n), INT64((n)+64), INT64((n)+128), INT64((n)+192)
+
+/* aligned like marshal_t, they're read through its pointers, nil and
+   booleans share the integer's layout */
+typedef union
+{
+	marshal_integer_t node;
+	double align;
+	void *align_pointer;
+} static_node_t;
+
+static const static_node_t nil_node = {{MARSHAL_NIL, SHARED_STATIC, 0}};
+
+static const static_node_t boolean_nodes[2] = {
+	{{MARSHAL_BOOLEAN, SHARED_STATIC, 0}},
+	{{MARSHAL_BOOLEAN, SHARED_STATIC, 1}}
+};
+
+/* SMALL_INT_MIN to SMALL_INT_MAX */
+static const static_node_t integer_nodes[] = {
+	INT256(SMALL_INT_MIN),
+	INT256(SMALL_INT_MIN + 256),
+	INT256(SMALL_INT_MIN + 512),
+	INT256(SMALL_INT_MIN + 768),
+	INT256(SMALL_INT_MIN + 1024)
+};
+
+/* keeps pointers and doubles of the next node aligned */
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* by MARSHAL_* type */
+static const size_t node_sizes[MARSHAL_TYPE_COUNT] = {
+	ALIGN(sizeof(marshal_nil_t)),
+	ALIGN(sizeof(marshal_boolean_t)),
+	ALIGN(sizeof(marshal_integer_t)),
+	ALIGN(sizeof(marshal_bignum_t)),
+	ALIGN(sizeof(marshal_float_t)),
+	ALIGN(sizeof(marshal_symbol_t)),
+	ALIGN(sizeof(marshal_array_t)),
+	ALIGN(sizeof(marshal_hash_t)),
+	ALIGN(sizeof(marshal_string_t)),
+	ALIGN(sizeof(marshal_regex_t)),
+	ALIGN(sizeof(marshal_class_t)),
+	ALIGN(sizeof(marshal_module_t)),
+	ALIGN(sizeof(marshal_object_t)),
+	ALIGN(sizeof(marshal_userdef_t)),
+	ALIGN(sizeof(marshal_object_t)), /* struct */
+	ALIGN(sizeof(marshal_wrapped_t)),
+	ALIGN(sizeof(marshal_wrapped_t)),
+	ALIGN(sizeof(marshal_wrapped_t)),
+	ALIGN(sizeof(marshal_wrapped_t))
+};
+
+size_t
+node_size(int type)
+{
+	return type >= 0 && type < MARSHAL_TYPE_COUNT ? node_sizes[type]
+		: sizeof(marshal_t);
+}
+
+marshal_t *
+singleton(int type, int value)
+{
+	switch (type)
+	{
+		case MARSHAL_NIL:
+			return (marshal_t *)&nil_node;
+		case MARSHAL_BOOLEAN:
+			return (marshal_t *)&boolean_nodes[value ? 1 : 0];
+		case MARSHAL_INTEGER:
+			if (value < SMALL_INT_MIN || value > SMALL_INT_MAX)
+				return NULL;
+			return (marshal_t *)&integer_nodes[value - SMALL_INT_MIN];
+		default:
+			return NULL;
+	}
+}
+
+marshal_t *
+singleton_of(const marshal_t *m)
+{
+	switch (m->type)
+	{
+		case MARSHAL_NIL: return singleton(MARSHAL_NIL, 0);
+		case MARSHAL_BOOLEAN:
+			return singleton(MARSHAL_BOOLEAN, m->boolean.value);
+		case MARSHAL_INTEGER:
+			return singleton(MARSHAL_INTEGER, m->integer.value);
+		default: return NULL;
+	}
+}
+
+/* room: inline bytes past the type's struct */
 static marshal_t *
-alloc(int type)
+alloc(int type, size_t room)
 {
-	marshal_t *m = calloc(1, sizeof(marshal_t));
+	marshal_t *m = mem_calloc(1, node_size(type) + room);
 	if (m)
 		m->type = type;
 	return m;
@@ -31,7 +130,7 @@ static char *
 string_clone(const char *src)
 {
 	size_t len = strlen(src);
-	char *clone = malloc(len + 1);
+	char *clone = mem_alloc(len + 1);
 	if (!clone)
 		return NULL;
 	memcpy(clone, src, len);
@@ -42,22 +141,22 @@ string_clone(const char *src)
 marshal_t *
 marshal_make_nil()
 {
-	return alloc(MARSHAL_NIL);
+	return singleton(MARSHAL_NIL, 0);
 }
 
 marshal_t *
 marshal_make_boolean(int value)
 {
-	marshal_t *m = alloc(MARSHAL_BOOLEAN);
-	if (m)
-		m->boolean.value = value;
-	return m;
+	return singleton(MARSHAL_BOOLEAN, value);
 }
 
 marshal_t *
 marshal_make_integer(int value)
 {
-	marshal_t *m = alloc(MARSHAL_INTEGER);
+	marshal_t *m = singleton(MARSHAL_INTEGER, value);
+	if (m)
+		return m;
+	m = alloc(MARSHAL_INTEGER, 0);
 	if (m)
 		m->integer.value = value;
 	return m;
@@ -66,14 +165,14 @@ marshal_make_integer(int value)
 marshal_t *
 marshal_make_bignum(int sign, int length, unsigned char *bytes)
 {
-	marshal_t *m = alloc(MARSHAL_BIGNUM);
-	unsigned char *fresh = malloc(length);
+	marshal_t *m = alloc(MARSHAL_BIGNUM, 0);
+	unsigned char *fresh = mem_alloc(length);
 	if (!m || !fresh)
 	{
 		if (m)
-			free(m);
+			mem_free(m);
 		if (fresh)
-			free(fresh);
+			mem_free(fresh);
 		return NULL;
 	}
 	memcpy(fresh, bytes, length);
@@ -87,7 +186,7 @@ marshal_make_bignum(int sign, int length, unsigned char *bytes)
 marshal_t *
 marshal_make_float(double value)
 {
-	marshal_t *m = alloc(MARSHAL_FLOAT);
+	marshal_t *m = alloc(MARSHAL_FLOAT, 0);
 	if (m)
 		m->float_no.value = value;
 	return m;
@@ -96,13 +195,16 @@ marshal_make_float(double value)
 marshal_t *
 marshal_make_symbol(const char *name)
 {
-	marshal_t *m = alloc(MARSHAL_SYMBOL);
+	size_t len = strlen(name) + 1;
+	int fits = len <= INLINE_SIZE;
+	marshal_t *m = alloc(MARSHAL_SYMBOL, fits ? INLINE_SIZE : 0);
 	if (m)
 	{
-		m->symbol.name = string_clone(name);
+		m->symbol.name = fits ? memcpy(SYMBOL_INLINE(m), name, len)
+			: string_clone(name);
 		if (!m->symbol.name)
 		{
-			free(m);
+			mem_free(m);
 			return NULL;
 		}
 	}
@@ -112,13 +214,13 @@ marshal_make_symbol(const char *name)
 marshal_t *
 marshal_make_array()
 {
-	return alloc(MARSHAL_ARRAY);
+	return alloc(MARSHAL_ARRAY, 0);
 }
 
 marshal_t *
 marshal_make_hash(marshal_t *def)
 {
-	marshal_t *m = alloc(MARSHAL_HASH);
+	marshal_t *m = alloc(MARSHAL_HASH, 0);
 	if (m)
 		m->hash.def = def;
 	return m;
@@ -127,15 +229,21 @@ marshal_make_hash(marshal_t *def)
 marshal_t *
 marshal_make_ascii(const char *string)
 {
-	marshal_t *m = alloc(MARSHAL_STRING);
+	size_t len = strlen(string);
+	int fits = len + 4 <= INLINE_SIZE;
+	marshal_t *m = alloc(MARSHAL_STRING, fits ? INLINE_SIZE : 0);
 	if (m)
 	{
-		m->string.data_size = strlen(string);
-		m->string.data = string_clone(string);
+		m->string.data_size = len;
+		/* calloc zeroed the NULs */
+		m->string.data = fits ? memcpy(STRING_INLINE(m), string, len)
+			: string_clone(string);
 		m->string.encoding = MARSHAL_ENCODING_ASCII_8BIT;
+		m->string.is_ascii = -1;
+		m->string.is_valid_utf8 = -1;
 		if (!m->string.data)
 		{
-			free(m);
+			mem_free(m);
 			return NULL;
 		}
 	}
@@ -145,13 +253,13 @@ marshal_make_ascii(const char *string)
 marshal_t *
 marshal_make_class(const char *name)
 {
-	marshal_t *m = alloc(MARSHAL_CLASS);
+	marshal_t *m = alloc(MARSHAL_CLASS, 0);
 	if (m)
 	{
 		m->klass.name = string_clone(name);
 		if (!m->klass.name)
 		{
-			free(m);
+			mem_free(m);
 			return NULL;
 		}
 	}
@@ -161,13 +269,13 @@ marshal_make_class(const char *name)
 marshal_t *
 marshal_make_module(const char *name)
 {
-	marshal_t *m = alloc(MARSHAL_MODULE);
+	marshal_t *m = alloc(MARSHAL_MODULE, 0);
 	if (m)
 	{
 		m->module.name = string_clone(name);
 		if (!m->module.name)
 		{
-			free(m);
+			mem_free(m);
 			return NULL;
 		}
 	}
@@ -177,16 +285,20 @@ marshal_make_module(const char *name)
 marshal_t *
 marshal_make_object(const char *klass)
 {
-	marshal_t *m = alloc(MARSHAL_OBJECT);
+	marshal_t *m = alloc(MARSHAL_OBJECT, 0);
 	if (m)
 	{
-		m->object.klass = string_clone(klass);
-		if (!m->object.klass)
+		m->object.symbol_instance = marshal_make_symbol(klass);
+		m->object.shape = shape_new(klass, 0, NULL, NULL);
+		if (!m->object.symbol_instance || !m->object.shape)
 		{
-			free(m);
+			marshal_free(m->object.symbol_instance);
+			shape_release(m->object.shape);
+			mem_free(m);
 			return NULL;
 		}
-
+		m->object.klass =
+			((marshal_t *)m->object.symbol_instance)->symbol.name;
 	}
 	return m;
 }
@@ -194,24 +306,23 @@ marshal_make_object(const char *klass)
 marshal_t *
 marshal_make_userdef(const char *klass, int size, const void *data)
 {
-	marshal_t *m = alloc(MARSHAL_USERDEF);
+	marshal_t *m = alloc(MARSHAL_USERDEF, 0);
 	if (m)
 	{
-		m->userdef.klass = string_clone(klass);
-		if (!m->userdef.klass)
+		/* the class is a symbol like decoded ones, encode writes it */
+		m->userdef.symbol_instance = marshal_make_symbol(klass);
+		m->userdef.data = mem_alloc(size + 1);
+		if (!m->userdef.symbol_instance || !m->userdef.data)
 		{
-			free(m);
+			marshal_free(m->userdef.symbol_instance);
+			mem_free(m->userdef.data);
+			mem_free(m);
 			return NULL;
 		}
+		m->userdef.klass =
+			((marshal_t *)m->userdef.symbol_instance)->symbol.name;
 		m->userdef.size = size;
-		m->userdef.data = malloc(size);
-		if (!m->userdef.data)
-		{
-			free(m->userdef.klass);
-			free(m);
-			return NULL;
-		}
 		memcpy(m->userdef.data, data, size);
-	};
+	}
 	return m;
 }
@@ -18,6 +18,7 @@
 #define _MARSHAL_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* from http://gcc.gnu.org/wiki/Visibility */
 #if defined _WIN32 || defined __CYGWIN__
@@ -60,6 +61,12 @@ extern "C" {
 #define MARSHAL_MODULE  11
 #define MARSHAL_OBJECT  12
 #define MARSHAL_USERDEF 13
+#define MARSHAL_STRUCT  14 /* a marshal_object_t, see below */
+#define MARSHAL_USERCLASS  15 /* the marshal_wrapped_t ones */
+#define MARSHAL_EXTENDED   16
+#define MARSHAL_USRMARSHAL 17
+#define MARSHAL_DATA       18
+#define MARSHAL_TYPE_COUNT 19
 
 /* http://ruby_doc.org/core_2.4.2/Encoding.html#method_c_list */
 #define MARSHAL_ENCODING_ASCII_8BIT                 0 /* aka OLD_STRING */
@@ -164,26 +171,42 @@ extern "C" {
 #define MARSHAL_ENCODING_UTF8_SoftBank              99
 #define MARSHAL_ENCODING_SJIS_SoftBank              100
 
+/* common head of every node
+   shared is 0 for nodes owned by their parent, otherwise the node is
+   immutable and shared counts its references (see marshal_dedup)
+   nil, booleans and integers from -256 to 1023 are decoded, made and
+   cloned as singletons every tree points to, they take no memory and
+   marshal_free leaves them alone, marshal_unshare gives a private copy */
+typedef struct marshal_head_t
+{
+	int type;
+	int shared;
+} marshal_head_t;
+
 typedef struct marshal_nil_t
 {
 	int type;
+	int shared;
 } marshal_nil_t;
 
 typedef struct marshal_boolean_t
 {
 	int type;
+	int shared;
 	int value;
 } marshal_boolean_t;
 
 typedef struct marshal_integer_t
 {
 	int type;
+	int shared;
 	int value;
 } marshal_integer_t;
 
 typedef struct marshal_bignum_t
 {
 	int type;
+	int shared;
 	int sign; /* 1: positive, -1: negative */
 	int length;
 	unsigned char *bytes;
@@ -192,46 +215,64 @@ typedef struct marshal_bignum_t
 typedef struct marshal_float_t
 {
 	int type;
+	int shared;
 	double value;
 } marshal_float_t;
 
 typedef struct marshal_symbol_t
 {
 	int type;
+	int shared;
 	char *name;
 } marshal_symbol_t;
 
 typedef struct marshal_array_t
 {
 	int type;
+	int shared;
 	int count;
+	int capacity; /* allocated values */
 	void **values;
+	uint64_t digest; /* see marshal_hash_value_memo, 0: unknown */
 } marshal_array_t;
 
 typedef struct marshal_hash_t
 {
 	int type;
+	int shared;
 	int count;
+	int capacity; /* allocated pairs */
 	void **pairs; /* even key, odd value */
 	void *def;
+	void *index; /* optional lookup table, see marshal_hash_index */
+	uint64_t digest;
 } marshal_hash_t;
 
+/* short strings and symbols may keep their bytes in their node's own
+   allocation (data or name points right after the struct), they go away
+   with it, data and name must not be freed nor reallocated on their own */
 typedef struct marshal_string_t
 {
 	int type;
+	int shared;
 	int data_size;
-	void *data;
 	int count;
+	void *data;
 	void **pairs; /* even key, odd value */
 	int encoding;
+	/* cached checks of data, -1: unknown, 0: no, 1: yes */
+	int is_ascii;
+	int is_valid_utf8;
+	uint64_t digest;
 } marshal_string_t;
 
 typedef struct marshal_regex_t
 {
 	int type;
+	int shared;
 	int data_size;
-	void *data;
 	int count;
+	void *data;
 	void **pairs;
 	/* TODO */
 } marshal_regex_t;
@@ -239,36 +280,76 @@ typedef struct marshal_regex_t
 typedef struct marshal_class_t
 {
 	int type;
+	int shared;
 	char *name;
 } marshal_class_t;
 
 typedef struct marshal_module_t
 {
 	int type;
+	int shared;
 	char *name;
 } marshal_module_t;
 
+/* instance variables layout, objects of a class with the same ivars
+   (in the same order) share one shape, it must not be modified */
+typedef struct marshal_shape_t
+{
+	int refs;
+	int count;
+	unsigned long id; /* unique while the process lives */
+	char *klass;
+	char **names; /* ivar names (e.g. "@var"), index is the slot */
+} marshal_shape_t;
+
+/* objects and structs, a struct's member names have no '@' (e.g. "name") */
 typedef struct marshal_object_t
 {
 	int type;
+	int shared;
 	int count;
+	int capacity; /* allocated vars */
 	char *klass;
-	void **vars; /* even name, odd value */
+	void **vars; /* values, their names are in shape */
 	void *symbol_instance;
+	marshal_shape_t *shape;
+	uint64_t digest;
 } marshal_object_t;
 
+/* what klass#_dump returned, the string's ivars (I u, e.g. its encoding)
+   are in pairs */
 typedef struct marshal_userdef_t
 {
 	int type;
+	int shared;
 	int size;
+	int count;
 	char *klass;
 	void *data;
 	void *symbol_instance;
+	void **pairs; /* even key, odd value */
 } marshal_userdef_t;
 
+/* a value seen through a class, they are:
+   userclass: an instance of klass, a subclass of value's class
+   extended: value extended by the module klass, several modules nest
+   usrmarshal: what klass#marshal_dump returned
+   data: what klass#_dump_data returned */
+typedef struct marshal_wrapped_t
+{
+	int type;
+	int shared;
+	char *klass;
+	void *value;
+	void *symbol_instance;
+} marshal_wrapped_t;
+
+/* a node is allocated with its type's struct size only, so it can't be
+   copied as a whole marshal_t nor take another type */
 typedef union marshal_t
 {
 	int type;
+	marshal_head_t head;
 	marshal_nil_t nil;
 	marshal_boolean_t boolean;
 	marshal_integer_t integer;
@@ -283,19 +364,228 @@ typedef union marshal_t
 	marshal_module_t module;
 	marshal_object_t object;
 	marshal_userdef_t userdef;
+	marshal_wrapped_t wrapped;
 } marshal_t;
 
+/* an instance variable resolved once and read in O(1) from any object
+   sharing the shape, fill name and leave the rest zeroed */
+typedef struct marshal_field_t
+{
+	const char *name;
+	unsigned long shape_id;
+	int slot;
+} marshal_field_t;
+
+/* iterator events */
+#define MARSHAL_ITER_END   0 /* no more nodes */
+#define MARSHAL_ITER_ENTER 1 /* a container, its children come next */
+#define MARSHAL_ITER_LEAVE 2 /* a container, after its children */
+#define MARSHAL_ITER_LEAF  3 /* a node without children */
+#define MARSHAL_ITER_ERROR -1
+
+/* frames kept inside the iterator, deeper trees allocate more */
+#define MARSHAL_ITER_DEPTH 32
+
+typedef struct marshal_iter_frame_t
+{
+	marshal_t *node;
+	void **slot;
+	int index;
+	int next; /* next child */
+	int count; /* children */
+} marshal_iter_frame_t;
+
+/* depth-first walk over a tree, see marshal_iter_next
+   the public fields describe the node of the last event */
+typedef struct marshal_iter_t
+{
+	marshal_t *node;
+	void **slot; /* where the parent points to node, NULL for the root */
+	int depth; /* the root's is 0 */
+	int index; /* array index, hash pair or object slot, -1 otherwise */
+	int is_key; /* node is a hash key */
+	marshal_t *key; /* the key when node is a hash value, or NULL */
+	const char *name; /* the ivar name when node is an object's, or NULL */
+
+	/* private */
+	marshal_t *root;
+	int top; /* frames in use */
+	int size; /* frames available */
+	int skip;
+	marshal_iter_frame_t *stack;
+	marshal_iter_frame_t frames[MARSHAL_ITER_DEPTH];
+} marshal_iter_t;
+
+/* visitor callbacks, they return one of these */
+#define MARSHAL_VISIT_CONTINUE 0
+#define MARSHAL_VISIT_SKIP     1 /* don't visit the node's children */
+#define MARSHAL_VISIT_STOP     2
+
+typedef int (*marshal_visit_fn)(marshal_iter_t *iter, void *data);
+
+/* callbacks by node type, NULL ones are not called
+   leave is only called for containers */
+typedef struct marshal_visitor_t
+{
+	marshal_visit_fn enter[MARSHAL_TYPE_COUNT];
+	marshal_visit_fn leave[MARSHAL_TYPE_COUNT];
+} marshal_visitor_t;
+
+/* a compiled query, see marshal_path_compile */
+typedef struct marshal_path_t marshal_path_t;
+
+/* decoding and encoding state kept warm between calls, see
+   marshal_decoder_new and marshal_encoder_new */
+typedef struct marshal_decoder_t marshal_decoder_t;
+typedef struct marshal_encoder_t marshal_encoder_t;
+
+/* a marshal byte stream of known size, see marshal_decode_batch */
+typedef struct marshal_slice_t
+{
+	const void *data;
+	size_t size;
+} marshal_slice_t;
+
+/* stream callbacks, see marshal_decode_stream and marshal_encode_stream
+   a reader fills buffer with up to size bytes and returns how many, 0 at
+   the end or on failure, a writer takes size bytes and returns 0 on
+   success */
+typedef size_t (*marshal_read_fn)(void *data, void *buffer, size_t size);
+typedef int (*marshal_write_fn)(void *data, const void *buffer, size_t size);
+
+/* a frozen image and its nodes, see marshal_freeze */
+typedef struct marshal_frozen_t marshal_frozen_t;
+typedef struct marshal_fnode_t marshal_fnode_t;
+
+/* background reclaimer counters, see marshal_free_async */
+typedef struct marshal_free_stats_t
+{
+	unsigned long submitted; /* trees handed to marshal_free_async */
+	unsigned long freed;
+	unsigned long batches;
+	unsigned long queued; /* trees waiting now */
+	unsigned long peak; /* most trees waiting at once */
+	unsigned long stalls; /* calls that waited for room in the queue */
+} marshal_free_stats_t;
+
+typedef void (*marshal_free_hook_fn)(const marshal_free_stats_t *stats,
+	void *data);
+
+/* trees queued at most, unless marshal_free_start says otherwise */
+#define MARSHAL_FREE_QUEUE 1024
+
+/* what the library did on one thread since its counters were reset, see
+   marshal_stats_enable */
+typedef struct marshal_stats_t
+{
+	unsigned long decodes; /* marshal_decode* calls */
+	unsigned long encodes; /* marshal_encode* calls */
+	unsigned long nodes[MARSHAL_TYPE_COUNT]; /* decoded, by MARSHAL_* type */
+	unsigned long bytes_read; /* marshal input consumed by the decoder */
+	unsigned long bytes_written; /* marshal output of the encoder */
+	unsigned long allocations; /* malloc, calloc and realloc calls */
+	unsigned long allocated_bytes; /* asked by those calls */
+	unsigned long symlinks; /* symbol links (;) resolved by the decoder */
+	unsigned long objlinks; /* object links (@) resolved by the decoder */
+	unsigned long cloned_bytes; /* copied by marshal_clone, links included */
+	int max_depth; /* deepest node decoded */
+	double decode_seconds; /* wall clock time in marshal_decode* */
+	double encode_seconds;
+} marshal_stats_t;
+
+/* marshal_inspect limits, 0 fields mean no limit */
+typedef struct marshal_inspect_opts_t
+{
+	int max_depth; /* deeper containers print as [...], {...} */
+	int max_elements; /* by container, then "..." */
+	size_t max_string; /* bytes shown of each string */
+	size_t max_bytes; /* whole output, then "..." */
+} marshal_inspect_opts_t;
+
+/* containers are never printed deeper, whatever max_depth says */
+#define MARSHAL_INSPECT_DEPTH 64
+
+/* where streamed output goes, write returns 0 on success */
+typedef struct marshal_sink_t
+{
+	int (*write)(void *data, const void *bytes, size_t size);
+	void *data;
+} marshal_sink_t;
+
+/* where the library's memory comes from, data is passed to the functions
+   which behave like malloc, realloc and free */
+typedef struct marshal_allocator_t
+{
+	void *(*malloc)(void *data, size_t size);
+	void *(*realloc)(void *data, void *mem, size_t size);
+	void (*free)(void *data, void *mem);
+	void *data;
+} marshal_allocator_t;
+
+/* a growing memory buffer, a sink's data for marshal_buffer_write
+   zero it before use, release data with marshal_free_memory after */
+typedef struct marshal_buffer_t
+{
+	char *data;
+	size_t size;
+	size_t capacity;
+} marshal_buffer_t;
+
+/* marshal_to_json flags, strings are UTF-8 by default with invalid bytes
+   replaced by U+FFFD */
+#define MARSHAL_JSON_SYMBOL_COLON  0x01 /* symbols as ":name" */
+#define MARSHAL_JSON_OBJECT_BARE   0x02 /* objects without their class key,
+                                           userdefs only as their data */
+#define MARSHAL_JSON_KEEP_AT       0x04 /* ivar keys keep their '@' */
+#define MARSHAL_JSON_BINARY_LATIN1 0x08 /* non UTF-8 strings: a character
+                                           by byte */
+#define MARSHAL_JSON_BINARY_BASE64 0x10 /* non UTF-8 strings: base64 */
+#define MARSHAL_JSON_SYMBOL_KEYS   0x20 /* marshal_from_json: hash keys are
+                                           symbols, not strings */
+
+typedef struct marshal_json_opts_t
+{
+	int flags; /* MARSHAL_JSON_* */
+	const char *class_key; /* NULL for "__class" */
+	const char *data_key; /* userdef's base64 bytes, NULL for "__data" */
+} marshal_json_opts_t;
+
+/* decode flags */
+#define MARSHAL_DECODE_VALIDATE_UTF8 0x1 /* fill string's UTF-8 checks */
+#define MARSHAL_DECODE_INDEX_HASHES  0x2 /* index non-trivial hashes */
+#define MARSHAL_DECODE_DEDUP         0x4 /* see marshal_dedup */
+#define MARSHAL_DECODE_UTF8          0x8 /* strings in an encoding
+                                            marshal_to_utf8 handles become
+                                            UTF-8 */
+
+/* marshal_encode_stream formats, compressed ones need zlib */
+#define MARSHAL_STREAM_PLAIN 0
+#define MARSHAL_STREAM_ZLIB  1 /* deflate with a zlib header, as Ruby's
+                                  Zlib::Deflate.deflate */
+#define MARSHAL_STREAM_GZIP  2
+
+/* why a batch item failed to decode, see marshal_decode_batch */
+#define MARSHAL_ERROR_NONE      0
+#define MARSHAL_ERROR_VERSION   1 /* not a 4.8 stream */
+#define MARSHAL_ERROR_TRUNCATED 2 /* it ends before its last value */
+#define MARSHAL_ERROR_INVALID   3 /* unknown type, bad link or no memory */
+
 /* decodes a marshal byte stream
    returns NULL on failure */
 MARSHAL_API marshal_t *
 marshal_decode(const void *data);
 
-/* decodes a marshal file
+/* same as marshal_decode with MARSHAL_DECODE_* flags */
+MARSHAL_API marshal_t *
+marshal_decode_flags(const void *data, int flags);
+
+/* decodes a marshal file, which may be zlib or gzip compressed
    returns NULL on failure */
 MARSHAL_API marshal_t *
 marshal_decode_file(const char *path);
 
-/* encodes a marshal C structure into a malloc_allocated buffer
+/* encodes a marshal C structure into a buffer from the current allocator
+   (see marshal_free_memory)
    buffer's size is returned in size argument (it can be NULL)
    returns NULL on failure */
 MARSHAL_API void *
@@ -306,28 +596,346 @@ marshal_encode(const marshal_t *marshal, size_t *size);
 MARSHAL_API int
 marshal_encode_file(const char *path, const marshal_t *marshal);
 
+/* decodes what read gives, inflating it on the way when it starts with a
+   zlib or gzip header, so only a chunk of the input is held at a time
+   flags are MARSHAL_DECODE_*
+   returns NULL on failure */
+MARSHAL_API marshal_t *
+marshal_decode_stream(marshal_read_fn read, void *data, int flags);
+
+/* same as marshal_decode_stream on size bytes of memory, a compressed input
+   isn't inflated as a whole first */
+MARSHAL_API marshal_t *
+marshal_decode_buffer(const void *data, size_t size, int flags);
+
+/* encodes into write in chunks, deflating them on the way for a
+   MARSHAL_STREAM_* format other than MARSHAL_STREAM_PLAIN
+   returns 0 on success */
+MARSHAL_API int
+marshal_encode_stream(const marshal_t *marshal, marshal_write_fn write,
+	void *data, int format);
+
+/* a decoder keeps its symbol, object and layout tables between decodes,
+   which saves their setup on many small inputs, it must be used by one
+   thread at a time
+   flags are MARSHAL_DECODE_* for every decode, allocator is used by its
+   calls and for the trees they make (NULL for the calling thread's)
+   returns NULL on failure */
+MARSHAL_API marshal_decoder_t *
+marshal_decoder_new(int flags, const marshal_allocator_t *allocator);
+
+/* same as marshal_decode_flags with the decoder's flags */
+MARSHAL_API marshal_t *
+marshal_decoder_decode(marshal_decoder_t *decoder, const void *data);
+
+MARSHAL_API void
+marshal_decoder_free(marshal_decoder_t *decoder);
+
+/* decodes in[0...n] into out[0...n] with MARSHAL_DECODE_* flags on nthreads
+   threads (the caller's included, 0 or less for one per CPU), each with its
+   own decoder, taking the calling thread's allocator
+   inputs are bounds checked, a failed one gets NULL in out and its
+   MARSHAL_ERROR_* in errors (it can be NULL), the rest MARSHAL_ERROR_NONE
+   returns how many failed */
+MARSHAL_API size_t
+marshal_decode_batch(const marshal_slice_t *in, size_t n, marshal_t **out,
+	int *errors, int flags, int nthreads);
+
+/* an encoder keeps its output buffer between encodes, it must be used by
+   one thread at a time, allocator is the same as marshal_decoder_new's
+   returns NULL on failure */
+MARSHAL_API marshal_encoder_t *
+marshal_encoder_new(const marshal_allocator_t *allocator);
+
+/* same as marshal_encode, the output belongs to the encoder and stays valid
+   until its next call */
+MARSHAL_API const void *
+marshal_encoder_encode(marshal_encoder_t *encoder, const marshal_t *marshal,
+	size_t *size);
+
+MARSHAL_API void
+marshal_encoder_free(marshal_encoder_t *encoder);
+
 /* deallocates memory used by a marshal C struct, include the pointer itself
    it should never fail with a cloned or decoded structure */
 MARSHAL_API void
 marshal_free(marshal_t *marshal);
 
-/* makes a deep copy (hosted in fresh memory) of a marshal C structure
-   returns NULL on failure */
+/* hands a tree to a background thread which frees it along with everything
+   queued meanwhile, the caller must not touch it anymore
+   when the queue is full the caller waits for room, if the thread can't be
+   started the tree is freed right away */
+MARSHAL_API void
+marshal_free_async(marshal_t *marshal);
+
+/* starts the background thread with room for capacity trees (0 for
+   MARSHAL_FREE_QUEUE), marshal_free_async starts it on demand otherwise
+   returns 0 on success or if it's already running */
+MARSHAL_API int
+marshal_free_start(int capacity);
+
+/* waits until every tree queued before the call is freed */
+MARSHAL_API void
+marshal_free_flush(void);
+
+/* frees what's queued and stops the thread, a later marshal_free_async
+   starts it again */
+MARSHAL_API void
+marshal_free_stop(void);
+
+/* copies the reclaimer's counters into stats */
+MARSHAL_API void
+marshal_free_stats(marshal_free_stats_t *stats);
+
+/* calls hook (NULL to remove it) from the background thread after each
+   batch, with the counters at that moment */
+MARSHAL_API void
+marshal_free_hook(marshal_free_hook_fn hook, void *data);
+
+/* makes allocator (copied, every function must be set) the default one of
+   every thread, NULL restores libc's, memory must be freed by the allocator
+   that gave it so it's meant to be called before anything is allocated
+   returns 0 on success */
+MARSHAL_API int
+marshal_set_allocator(const marshal_allocator_t *allocator);
+
+/* the calling thread allocates (and frees) through allocator until it's
+   called again, NULL goes back to the default one, allocator must stay
+   valid meanwhile and have every function set
+   trees must be freed under the allocator that made them, including those
+   given to marshal_free_async, and nodes must not be moved between trees
+   of different allocators
+   returns the previous override (NULL if there was none) */
+MARSHAL_API const marshal_allocator_t *
+marshal_use_allocator(const marshal_allocator_t *allocator);
+
+/* frees memory the library hands out (marshal_encode's buffer, the data of
+   a marshal_buffer_t...) through the current allocator */
+MARSHAL_API void
+marshal_free_memory(void *mem);
+
+/* turns counting on (or off, keeping the counters) for the calling thread,
+   it's off by default and costs a test per counter then
+   build with -DMARSHAL_USDT for sys/sdt.h probes instead, they're named
+   marshal:decode__entry (data), marshal:decode__return (tree, bytes read),
+   marshal:encode__entry (tree) and marshal:encode__return (data, size) */
+MARSHAL_API void
+marshal_stats_enable(int enable);
+
+/* copies the calling thread's counters into stats */
+MARSHAL_API void
+marshal_stats_snapshot(marshal_stats_t *stats);
+
+/* zeroes the calling thread's counters */
+MARSHAL_API void
+marshal_stats_reset(void);
+
+/* bytes taken by the nodes of a tree, its strings and children arrays
+   (without malloc's overhead), a node shared by n owners counts 1/n of its
+   subtree in each (see marshal_dedup), shapes and singletons aren't
+   counted */
+MARSHAL_API size_t
+marshal_memory_usage(const marshal_t *marshal);
+
+/* makes a deep copy (hosted in fresh memory) of a marshal C structure,
+   into dest when it isn't NULL (a whole marshal_t, strings and symbols
+   keep their bytes outside of it), returns NULL on failure */
 MARSHAL_API marshal_t *
 marshal_clone(marshal_t *dest, const marshal_t *src);
 
+/* copies a tree into a single memory block: nodes in depth-first order,
+   each one followed by its children arrays, and strings packed at the end
+   nodes shared in marshal are copied once, the result is immutable like a
+   shared tree, marshal_free on it releases the whole block and does nothing
+   on the nodes inside, marshal_unshare and marshal_clone_cow copy them
+   returns NULL on failure */
+MARSHAL_API marshal_t *
+marshal_compact(const marshal_t *marshal);
+
+/* copy-on-write clone in O(1), src and the result share every node, both
+   become immutable (see marshal_dedup) until they are made private again
+   with marshal_unshare or marshal_path_unshare, which copy only the nodes
+   being modified, each of them is freed with marshal_free */
+MARSHAL_API marshal_t *
+marshal_clone_cow(const marshal_t *src);
+
+/* makes *node modifiable: if it's shared it's replaced by a private copy
+   whose children are shared with the original
+   returns *node, NULL on failure */
+MARSHAL_API marshal_t *
+marshal_unshare(marshal_t **node);
+
+/* writes a tree into an image from the current allocator that holds no
+   pointers, it can be mapped anywhere and read in place with marshal_fnode_*
+   without being parsed, nodes shared in marshal (see marshal_dedup and
+   marshal_clone_cow) are written once and referred to by each parent
+   size is returned in size argument (it can be NULL)
+   returns NULL on failure (regexes can't be frozen) */
+MARSHAL_API void *
+marshal_freeze(const marshal_t *marshal, size_t *size);
+
+/* writes marshal_freeze's image into a file
+   returns 0 on success */
+MARSHAL_API int
+marshal_freeze_to_file(const marshal_t *marshal, const char *path);
+
+/* maps a frozen image read-only, its pages are shared by every process
+   opening the same file; every node is checked to lie in the image
+   (see marshal_frozen_load)
+   returns NULL on failure */
+MARSHAL_API marshal_frozen_t *
+marshal_frozen_open(const char *path);
+
+/* reads an image in memory, which must stay valid until the frozen image
+   is closed and be 8 bytes aligned, the nodes reachable from the root are
+   checked once (in O(size)), so a truncated or corrupt image is rejected
+   rather than read out of bounds
+   returns NULL on failure */
+MARSHAL_API marshal_frozen_t *
+marshal_frozen_load(const void *image, size_t size);
+
+/* unmaps an image, its nodes can't be used anymore */
+MARSHAL_API void
+marshal_frozen_close(marshal_frozen_t *frozen);
+
+MARSHAL_API const marshal_fnode_t *
+marshal_frozen_root(const marshal_frozen_t *frozen);
+
+/* frozen nodes mirror marshal_t: MARSHAL_* type, children count (string,
+   bignum and userdef: their data size, symbols: their name's length,
+   wrapped values: 1) */
+MARSHAL_API int
+marshal_fnode_type(const marshal_fnode_t *node);
+
+MARSHAL_API int
+marshal_fnode_count(const marshal_fnode_t *node);
+
+/* integer and boolean values, sign of bignums */
+MARSHAL_API int
+marshal_fnode_int(const marshal_fnode_t *node);
+
+MARSHAL_API double
+marshal_fnode_float(const marshal_fnode_t *node);
+
+/* symbol, class or module name, class of objects, structs, userdefs and
+   wrapped values (the module of extended ones)
+   returns NULL for other types */
+MARSHAL_API const char *
+marshal_fnode_name(const marshal_fnode_t *node);
+
+/* string, bignum or userdef bytes (strings are NUL terminated)
+   returns NULL for other types */
+MARSHAL_API const void *
+marshal_fnode_data(const marshal_fnode_t *node, size_t *size);
+
+/* string encoding (MARSHAL_ENCODING_*), -1 for other types */
+MARSHAL_API int
+marshal_fnode_encoding(const marshal_fnode_t *node);
+
+/* same as marshal_array_get, without negative indexes */
+MARSHAL_API const marshal_fnode_t *
+marshal_fnode_array_get(const marshal_fnode_t *node, int index);
+
+/* same as marshal_hash_get, big hashes are looked up through an index */
+MARSHAL_API const marshal_fnode_t *
+marshal_fnode_hash_get(const marshal_fnode_t *node, const marshal_t *key);
+
+/* index-th pair's value, its key goes in key (it can be NULL) */
+MARSHAL_API const marshal_fnode_t *
+marshal_fnode_hash_pair(const marshal_fnode_t *node, int index,
+	const marshal_fnode_t **key);
+
+MARSHAL_API const marshal_fnode_t *
+marshal_fnode_hash_default(const marshal_fnode_t *node);
+
+/* same as marshal_object_get */
+MARSHAL_API const marshal_fnode_t *
+marshal_fnode_object_get(const marshal_fnode_t *node, const char *name);
+
+/* index-th ivar's value, its name goes in name (it can be NULL) */
+MARSHAL_API const marshal_fnode_t *
+marshal_fnode_object_ivar(const marshal_fnode_t *node, int index,
+	const char **name);
+
+/* the value of a userclass, extended, usrmarshal or data node
+   returns NULL for other types */
+MARSHAL_API const marshal_fnode_t *
+marshal_fnode_value(const marshal_fnode_t *node);
+
+/* copies a frozen node back into a regular tree
+   returns NULL on failure */
+MARSHAL_API marshal_t *
+marshal_fnode_thaw(const marshal_fnode_t *node);
+
 /* compares two marshal C structs, returns 1 if they are equal
    (something like Common Lisp's #'equal and not #'eq)
    strings must share encoding to be equal */
 MARSHAL_API int
 marshal_equal(const marshal_t *marshal1, const marshal_t *marshal2);
 
+/* returns a 64-bit structural hash, structs that are marshal_equal hash
+   equally (hashes and objects don't depend on their order), it is meant
+   for lookup tables and may change between library versions */
+MARSHAL_API uint64_t
+marshal_hash_value(const marshal_t *marshal);
+
+/* same as marshal_hash_value, but containers keep their digest so hashing
+   them again is O(1), the functions of this API modifying a container drop
+   its digest yet changes made below it go unseen, use it on subtrees that
+   are not modified anymore */
+MARSHAL_API uint64_t
+marshal_hash_value_memo(marshal_t *marshal);
+
+/* hash-consing: structurally equal subtrees below marshal that encode the
+   same way (floats by their bits, hashes and ivars in the same order) are
+   replaced by a single node shared between them (nil, booleans and small
+   integers by their singleton), shared nodes (and their subtrees) are
+   immutable, the functions of this API modifying them fail, but they may
+   be freed as usual, marshal_clone makes a private copy of them
+   returns marshal, NULL on failure (the tree is still valid) */
+MARSHAL_API marshal_t *
+marshal_dedup(marshal_t *marshal);
+
 /* prints a marshal C struct like Ruby's "p" function would do
    stream NULL uses stdout
    "void *" type is used here to avoid including stdio.h */
 MARSHAL_API void
 marshal_print(const marshal_t *marshal, void *stream);
 
+/* formats a marshal C struct like Ruby's inspect into buf, truncated to
+   cap bytes including the terminator (snprintf-like), opts can be NULL
+   returns the output's length without truncation by cap, so buf NULL
+   measures it */
+MARSHAL_API size_t
+marshal_inspect(const marshal_t *marshal, char *buf, size_t cap,
+	const marshal_inspect_opts_t *opts);
+
+/* transcodes a marshal byte stream into JSON written to sink, without
+   decoding it into a tree; opts can be NULL
+   hashes become JSON objects whose keys that aren't strings or symbols are
+   written as JSON in a string, objects and structs become
+   {"__class": "Klass", "ivar": value ...}, userdefs
+   {"__class": "Klass", "__data": "base64"}, links are resolved (those that
+   would loop are null) and hash defaults, infinite floats and NaN are lost
+   returns 0 on success */
+MARSHAL_API int
+marshal_to_json(const void *data, size_t size, const marshal_sink_t *sink,
+	const marshal_json_opts_t *opts);
+
+/* parses JSON and appends it to out as marshal bytes, without building a
+   tree; opts can be NULL, only its flags are read
+   strings are UTF-8, integers past 30 bits become bignums and numbers
+   with a fraction or an exponent floats; repeated hash keys are written
+   as links, out is left as it was on failure
+   returns 0 on success */
+MARSHAL_API int
+marshal_from_json(const void *json, size_t size, marshal_buffer_t *out,
+	const marshal_json_opts_t *opts);
+
+/* a sink writing into a marshal_buffer_t */
+MARSHAL_API int
+marshal_buffer_write(void *buffer, const void *bytes, size_t size);
+
 /* translates a Ruby encoding name into an integer id */
 MARSHAL_API int
 marshal_encoding_name_to_id(const char *name);
@@ -336,20 +944,68 @@ marshal_encoding_name_to_id(const char *name);
 MARSHAL_API const char *
 marshal_encoding_id_to_name(int id);
 
+/* returns 1 when data is valid UTF-8, is_ascii (it can be NULL)
+   is set to 1 when every byte is 7-bit */
+MARSHAL_API int
+marshal_utf8_validate(const void *data, size_t size, int *is_ascii);
+
+/* fills string's is_ascii and is_valid_utf8 if they are unknown
+   returns is_valid_utf8, -1 if a non-string is provided */
+MARSHAL_API int
+marshal_string_validate(marshal_t *string);
+
+/* appends size bytes of data in encoding (MARSHAL_ENCODING_*) to out as
+   UTF-8; it handles US-ASCII, UTF-8, ISO-8859-1, Windows-1252, UTF-16,
+   UTF-16LE, UTF-16BE, UTF-32, UTF-32LE and UTF-32BE, invalid sequences
+   and undefined bytes become U+FFFD
+   returns 0 on success, non zero for other encodings */
+MARSHAL_API int
+marshal_to_utf8(int encoding, const void *data, size_t size,
+	marshal_buffer_t *out);
+
+/* converts string's data to UTF-8 with marshal_to_utf8 and makes its
+   encoding ivar E=true, UTF-8 strings are left alone
+   returns 0 on success, non zero for other encodings or shared nodes */
+MARSHAL_API int
+marshal_string_to_utf8(marshal_t *string);
+
 /* returns array[index] and NULL on failure */
 MARSHAL_API marshal_t *
 marshal_array_get(const marshal_t *array, int index);
 
+/* makes room for capacity values, so adding up to it won't reallocate
+   containers grow geometrically anyway, this only saves the regrowths
+   returns array on success, NULL on failure */
+MARSHAL_API marshal_t *
+marshal_array_reserve(marshal_t *array, int capacity);
+
 /* array += [value]
    returns array on success, NULL on failure */
 MARSHAL_API marshal_t *
 marshal_array_add(marshal_t *array, marshal_t *value);
 
-/* array.delete_index(index)
+/* array += values[0...count], array takes the values
+   returns array on success, NULL on failure (array is left untouched) */
+MARSHAL_API marshal_t *
+marshal_array_extend(marshal_t *array, marshal_t **values, int count);
+
+/* array.delete_at(index)
    returns array on success, NULL on failure */
 MARSHAL_API marshal_t *
 marshal_array_del(marshal_t *array, int index);
 
+/* array.slice!(index, count), removed values are freed
+   returns array on success, NULL on failure */
+MARSHAL_API marshal_t *
+marshal_array_del_range(marshal_t *array, int index, int count);
+
+/* array[index, del] = values[0...count], removed values are freed and
+   array takes the new ones, the tail is moved only once
+   returns array on success, NULL on failure (array is left untouched) */
+MARSHAL_API marshal_t *
+marshal_array_splice(marshal_t *array, int index, int del,
+	marshal_t **values, int count);
+
 /* returns hash[key] and NULL on failure */
 MARSHAL_API marshal_t *
 marshal_hash_get(const marshal_t *hash, const marshal_t *key);
@@ -359,12 +1015,105 @@ marshal_hash_get(const marshal_t *hash, const marshal_t *key);
 MARSHAL_API marshal_t *
 marshal_hash_set(marshal_t *hash, marshal_t *key, marshal_t *value);
 
-/* finds an instance variable in a marshal object,
+/* makes room for capacity pairs (and their index, if any)
+   returns hash on success, NULL on failure */
+MARSHAL_API marshal_t *
+marshal_hash_reserve(marshal_t *hash, int capacity);
+
+/* builds an open addressing index over hash's keys, making marshal_hash_get
+   and marshal_hash_set O(1) on average while pairs keep insertion order
+   marshal_hash_set keeps it updated and builds it for growing hashes,
+   keys must not be modified in place while indexed
+   returns hash on success, NULL on failure */
+MARSHAL_API marshal_t *
+marshal_hash_index(marshal_t *hash);
+
+/* finds an instance variable in a marshal object (or a struct's member),
    returns NULL when it's not found or a non-object is provided */
 MARSHAL_API marshal_t *
 marshal_object_get(const marshal_t *marshal, const char *name);
 
-/* make functions */
+/* object.instance_variable_set(name, value), a struct's members can be
+   replaced but not added
+   returns value on success, NULL on failure */
+MARSHAL_API marshal_t *
+marshal_object_set(marshal_t *object, const char *name, marshal_t *value);
+
+/* same as marshal_object_get, field caches the slot for the object's shape
+   so objects sharing it are read without searching */
+MARSHAL_API marshal_t *
+marshal_object_field(const marshal_t *object, marshal_field_t *field);
+
+/* skips the userclass and extended nodes around a value
+   returns the value (marshal itself when it isn't wrapped) */
+MARSHAL_API marshal_t *
+marshal_unwrap(const marshal_t *marshal);
+
+/* returns the slot of an instance variable name, -1 if there's none */
+MARSHAL_API int
+marshal_shape_slot(const marshal_shape_t *shape, const char *name);
+
+/* compiles a path such as "@user.profile[:tags][0]", its steps are:
+   @name   instance variable
+   .name   instance variable @name of an object, member of a struct,
+           key :name (or else "name") of a hash
+   [:name] symbol key, [:"any name"] quotes it
+   ["str"] string key, compared by bytes whatever its encoding
+   [n]     array index (negative counts from the end) or integer key
+   steps go through wrapped values (userclass, extended...)
+   returns NULL on failure or on a syntax error */
+MARSHAL_API marshal_path_t *
+marshal_path_compile(const char *path);
+
+/* runs a compiled path from root, it doesn't allocate memory and a path
+   can be run by several threads at once
+   missing hash keys give the hash's default like marshal_hash_get does
+   returns NULL when a step can't be followed */
+MARSHAL_API marshal_t *
+marshal_path_eval(const marshal_path_t *path, const marshal_t *root);
+
+/* unshares every node from *root to the one path leads to, so it can be
+   modified (e.g. by marshal_hash_set) without touching other trees sharing
+   it, subtrees off the path stay shared
+   returns the node path leads to, NULL on failure or when it's missing */
+MARSHAL_API marshal_t *
+marshal_path_unshare(marshal_t **root, const marshal_path_t *path);
+
+MARSHAL_API void
+marshal_path_free(marshal_path_t *path);
+
+/* starts a walk over root, it needs no memory unless the tree is deeper
+   than MARSHAL_ITER_DEPTH */
+MARSHAL_API void
+marshal_iter_init(marshal_iter_t *iter, const marshal_t *root);
+
+/* moves to the next node depth-first: containers are entered, then their
+   children (hash keys before their value, the default last, object ivars)
+   are walked and then they are left, other nodes are leaves
+   string, regex and userdef ivars (their encoding) are not walked
+   a node may be replaced through slot on its enter event if marshal_iter_skip
+   is called too, the tree must not be modified otherwise
+   returns a MARSHAL_ITER_* event */
+MARSHAL_API int
+marshal_iter_next(marshal_iter_t *iter);
+
+/* after an enter event, leaves the container without walking its children */
+MARSHAL_API void
+marshal_iter_skip(marshal_iter_t *iter);
+
+/* releases what the iterator allocated, it can be called at any time */
+MARSHAL_API void
+marshal_iter_done(marshal_iter_t *iter);
+
+/* walks root calling visitor's callbacks for each node
+   returns 0 when every node was visited, 1 if a callback stopped the walk
+   and -1 on failure */
+MARSHAL_API int
+marshal_visit(const marshal_t *root, const marshal_visitor_t *visitor,
+	void *data);
+
+/* make functions, nil, booleans and small integers give singletons (see
+   marshal_head_t) which must not be modified */
 MARSHAL_API marshal_t *
 marshal_make_nil();
 
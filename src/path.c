@@ -0,0 +1,326 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "internal.h"
+
+#define STEP_FIELD  0 /* .name, @name ivar or :name / "name" key */
+#define STEP_IVAR   1 /* @name */
+#define STEP_SYMBOL 2 /* [:name] */
+#define STEP_STRING 3 /* ["name"] */
+#define STEP_INDEX  4 /* [-1], array index or integer key */
+
+typedef struct
+{
+	int kind;
+	int index;
+	uint64_t hash; /* of the symbol or integer key, for indexed hashes */
+	size_t size;
+	char *name; /* fields keep their '@', name+1 is the key */
+} step_t;
+
+struct marshal_path_t
+{
+	int count;
+	step_t *steps;
+};
+
+static int
+is_name_char(int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+		|| (c >= '0' && c <= '9') || c == '_' || c == '?' || c == '!'
+		|| c == '=' || c >= 0x80;
+}
+
+/* copies a name into out, returns the text after it or NULL if empty */
+static const char *
+parse_name(const char *p, char *out, size_t *size)
+{
+	const char *start = p;
+	while (is_name_char((unsigned char)*p))
+		p++;
+	if (p == start)
+		return NULL;
+	*size = p - start;
+	memcpy(out, start, *size);
+	out[*size] = 0;
+	return p;
+}
+
+/* "text" or 'text', \ escapes the next character */
+static const char *
+parse_quoted(const char *p, char *out, size_t *size)
+{
+	char quote = *p++;
+	size_t len = 0;
+	while (*p != quote)
+	{
+		if (!*p)
+			return NULL;
+		if ('\\' == *p && p[1])
+			p++;
+		out[len++] = *p++;
+	}
+	out[len] = 0;
+	*size = len;
+	return p + 1;
+}
+
+static const char *
+parse_index(const char *p, int *index)
+{
+	int negative = '-' == *p;
+	long value = 0;
+	if (negative)
+		p++;
+	if (*p < '0' || *p > '9')
+		return NULL;
+	while (*p >= '0' && *p <= '9')
+	{
+		value = value * 10 + (*p++ - '0');
+		if (value > INT_MAX)
+			return NULL;
+	}
+	*index = negative ? (int)-value : (int)value;
+	return p;
+}
+
+static const char *
+parse_bracket(const char *p, step_t *step)
+{
+	if (':' == *p)
+	{
+		step->kind = STEP_SYMBOL;
+		p++;
+		p = '"' == *p || '\'' == *p
+			? parse_quoted(p, step->name, &step->size)
+			: parse_name(p, step->name, &step->size);
+		if (p)
+			step->hash = hash_symbol(step->name);
+	}
+	else if ('"' == *p || '\'' == *p)
+	{
+		step->kind = STEP_STRING;
+		p = parse_quoted(p, step->name, &step->size);
+	}
+	else
+	{
+		step->kind = STEP_INDEX;
+		p = parse_index(p, &step->index);
+		if (p)
+			step->hash = hash_integer(step->index);
+	}
+	return p && ']' == *p ? p + 1 : NULL;
+}
+
+/* .name, .@name or @name */
+static const char *
+parse_field(const char *p, step_t *step)
+{
+	if ('.' == *p)
+		p++;
+	step->kind = '@' == *p ? STEP_IVAR : STEP_FIELD;
+	if ('@' == *p)
+		p++;
+	step->name[0] = '@';
+	p = parse_name(p, step->name + 1, &step->size);
+	step->size++;
+	if (p && STEP_FIELD == step->kind)
+		step->hash = hash_symbol(step->name + 1);
+	return p;
+}
+
+marshal_path_t *
+marshal_path_compile(const char *text)
+{
+	marshal_path_t *path;
+	size_t len;
+	char *names;
+	const char *p = text;
+
+	if (!text)
+		return NULL;
+	/* there can't be more steps than characters, and a name takes at most
+	   its text plus '@' and the terminator */
+	len = strlen(text);
+	path = mem_alloc(sizeof(marshal_path_t) + len * sizeof(step_t)
+		+ len * 3 + 1);
+	if (!path)
+		return NULL;
+	path->count = 0;
+	path->steps = (step_t *)(path + 1);
+	names = (char *)(path->steps + len);
+
+	while (p && *p)
+	{
+		step_t *step = &path->steps[path->count];
+		memset(step, 0, sizeof(step_t));
+		step->name = names;
+		if ('[' == *p)
+			p = parse_bracket(p + 1, step);
+		else if ('.' == *p || '@' == *p || 0 == path->count)
+			p = parse_field(p, step);
+		else
+			p = NULL;
+		names += step->size + 1;
+		path->count++;
+	}
+	if (!p)
+	{
+		mem_free(path);
+		return NULL;
+	}
+	return path;
+}
+
+void
+marshal_path_free(marshal_path_t *path)
+{
+	if (path)
+		mem_free(path);
+}
+
+static int
+match_symbol(const marshal_t *key, const void *name)
+{
+	return MARSHAL_SYMBOL == key->type
+		&& 0 == strcmp(key->symbol.name, name);
+}
+
+static int
+match_integer(const marshal_t *key, const void *value)
+{
+	return MARSHAL_INTEGER == key->type
+		&& key->integer.value == *(const int *)value;
+}
+
+/* string keys match on their bytes, whatever their encoding is */
+static int
+find_string(const marshal_t *hash, const char *name, size_t size)
+{
+	int i;
+	for (i = 0; i < hash->hash.count; i++)
+	{
+		const marshal_t *key = hash->hash.pairs[i*2];
+		if (MARSHAL_STRING == key->type
+				&& (size_t)key->string.data_size == size
+				&& 0 == memcmp(key->string.data, name, size))
+			return i;
+	}
+	return -1;
+}
+
+static int
+find_pair(const marshal_t *hash, const step_t *step)
+{
+	int pair;
+	switch (step->kind)
+	{
+		case STEP_FIELD:
+			pair = hash_find(hash, step->hash, match_symbol, step->name + 1);
+			if (pair < 0)
+				pair = find_string(hash, step->name + 1, step->size - 1);
+			return pair;
+		case STEP_SYMBOL:
+			return hash_find(hash, step->hash, match_symbol, step->name);
+		case STEP_STRING:
+			return find_string(hash, step->name, step->size);
+		case STEP_INDEX:
+			return hash_find(hash, step->hash, match_integer, &step->index);
+		default:
+			return -1;
+	}
+}
+
+/* where m points to the step's node, NULL if it has none */
+static void **
+step_slot(marshal_t *m, const step_t *step)
+{
+	int index;
+	switch (m->type)
+	{
+		case MARSHAL_OBJECT:
+			if (STEP_FIELD != step->kind && STEP_IVAR != step->kind)
+				return NULL;
+			index = marshal_shape_slot(m->object.shape, step->name);
+			return index < 0 ? NULL : &m->object.vars[index];
+		case MARSHAL_STRUCT:
+			/* members are named without '@' */
+			if (STEP_FIELD != step->kind)
+				return NULL;
+			index = marshal_shape_slot(m->object.shape, step->name + 1);
+			return index < 0 ? NULL : &m->object.vars[index];
+		case MARSHAL_HASH:
+			index = find_pair(m, step);
+			return index < 0 ? NULL : &m->hash.pairs[index*2+1];
+		case MARSHAL_ARRAY:
+			if (STEP_INDEX != step->kind)
+				return NULL;
+			index = step->index < 0
+				? m->array.count + step->index : step->index;
+			if (index < 0 || index >= m->array.count)
+				return NULL;
+			return &m->array.values[index];
+		default:
+			return NULL;
+	}
+}
+
+marshal_t *
+marshal_path_eval(const marshal_path_t *path, const marshal_t *root)
+{
+	marshal_t *m = (marshal_t *)root;
+	int i;
+	for (i = 0; m && i < path->count; i++)
+	{
+		void **slot;
+		/* steps go through wrappers to the value */
+		while (IS_WRAPPED(m))
+			m = m->wrapped.value;
+		slot = step_slot(m, &path->steps[i]);
+		/* missing keys give the default, like marshal_hash_get */
+		if (slot)
+			m = *slot;
+		else
+			m = MARSHAL_HASH == m->type ? m->hash.def : NULL;
+	}
+	return m;
+}
+
+marshal_t *
+marshal_path_unshare(marshal_t **root, const marshal_path_t *path)
+{
+	void **slot = (void **)root;
+	int i;
+	for (i = 0; i < path->count; i++)
+	{
+		if (!marshal_unshare((marshal_t **)slot))
+			return NULL;
+		while (IS_WRAPPED((marshal_t *)*slot))
+		{
+			slot = &((marshal_t *)*slot)->wrapped.value;
+			if (!marshal_unshare((marshal_t **)slot))
+				return NULL;
+		}
+		slot = step_slot(*slot, &path->steps[i]);
+		if (!slot)
+			return NULL;
+	}
+	return marshal_unshare((marshal_t **)slot);
+}
@@ -15,91 +15,30 @@
  * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
-#include "marshal.h"
+#include <stdlib.h>
+#include "internal.h"
 
 void
 marshal_print(const marshal_t *m, void *stream)
 {
 	FILE *s = stream ? stream : stdout;
-	int i;
+	char local[4096];
+	char *buf = local;
+	size_t size = marshal_inspect(m, local, sizeof(local), NULL);
 
-	switch (m->type)
+	if (size >= sizeof(local))
 	{
-		case MARSHAL_NIL:
-			fprintf(s, "nil");
-			break;
-		case MARSHAL_BOOLEAN:
-			fprintf(s, "%s", m->boolean.value ? "true" : "false");
-			break;
-		case MARSHAL_INTEGER:
-			fprintf(s, "%d", m->integer.value);
-			break;
-		case MARSHAL_BIGNUM:
-			fprintf(s, m->bignum.sign >= 0 ? "+" : "-");
-			fprintf(s, "bignum(");
-			for (i = 0; i < m->bignum.length; i++)
-			{
-				fprintf(s, "0x%02X", m->bignum.bytes[i]);
-				if (i+1 < m->bignum.length)
-					fprintf(s, " ");
-			}
-			fprintf(s, ")");
-			break;
-		case MARSHAL_SYMBOL:
-			fprintf(s, ":%s", m->symbol.name);
-			break;
-		case MARSHAL_ARRAY:
-			fprintf(s, "[");
-			for (i = 0; i < m->array.count; i++)
-			{
-				marshal_print(m->array.values[i], s);
-				if (i + 1 < m->array.count)
-					fprintf(s, ", ");
-			}
-			fprintf(s, "]");
-			break;
-		case MARSHAL_HASH:
-			fprintf(s, "{");
-			for (i = 0; i < m->hash.count; i++)
-			{
-				marshal_print(m->array.values[i*2], s);
-				fprintf(s, "=>");
-				marshal_print(m->array.values[i*2+1], s);
-				if (i + 1 < m->array.count)
-					fprintf(s, ", ");
-			}
-			fprintf(s, "}");
-			break;
-		case MARSHAL_FLOAT:
-			fprintf(s, "%f", m->float_no.value);
-			break;
-		case MARSHAL_CLASS:
-			fprintf(s, "%s", m->klass.name);
-			break;
-		case MARSHAL_MODULE:
-			fprintf(s, "%s", m->module.name);
-			break;
-		case MARSHAL_STRING:
-			fprintf(s, "\"%s\"", (char *)m->string.data);
-			break;
-		case MARSHAL_OBJECT:
-			fprintf(s, "#<%s:%p ", m->object.klass, m);
-			for (i = 0; i < m->object.count; i++)
-			{
-				marshal_t *sym = m->object.vars[i*2];
-				fprintf(s, "%s=", sym->symbol.name);
-				marshal_print(m->object.vars[i*2+1], s);
-				if (i+1 < m->object.count)
-					fprintf(s, ", ");
-			}
-			fprintf(s, ">");
-			break;
-		case MARSHAL_USERDEF:
-			fprintf(s, "#<%s:%p>", m->userdef.klass,
-				m->userdef.data);
-			break;
-		default:
-			fprintf(s, "unknown");
-			break;
+		buf = mem_alloc(size + 1);
+		if (!buf)
+		{
+			/* print what fits */
+			buf = local;
+			size = sizeof(local) - 1;
+		}
+		else
+			marshal_inspect(m, buf, size + 1, NULL);
 	}
+	fwrite(buf, 1, size, s);
+	if (buf != local)
+		mem_free(buf);
 }
@@ -0,0 +1,304 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+#define OK 0
+#define FAILED 1
+
+#ifndef _WIN32
+#include <pthread.h>
+
+/* a tree and the allocator which made it (NULL for the default one) */
+typedef struct
+{
+	marshal_t *tree;
+	const marshal_allocator_t *allocator;
+} pending_t;
+
+/* trees waiting to be freed, in a ring, and the reclaimer's state */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty; /* the reclaimer waits on it */
+	pthread_cond_t room;     /* producers wait on it while the queue's full */
+	pthread_cond_t done;     /* flushes wait on it */
+	pthread_t thread;
+	int started;
+	int stopping;
+
+	pending_t *queue;
+	pending_t *batch; /* what the reclaimer is freeing */
+	int capacity;
+	int head;
+	int count;
+
+	marshal_free_stats_t stats;
+	marshal_free_hook_fn hook;
+	void *hook_data;
+} reclaim = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	0, /* thread, only meaningful once started */
+	0,
+	0,
+	NULL,
+	NULL,
+	0,
+	0,
+	0,
+	{0, 0, 0, 0, 0, 0},
+	NULL,
+	NULL
+};
+
+static void *
+reclaimer(void *unused)
+{
+	(void)unused;
+	pthread_mutex_lock(&reclaim.lock);
+	for (;;)
+	{
+		marshal_free_stats_t stats;
+		marshal_free_hook_fn hook;
+		int i, count, first;
+
+		while (!reclaim.count && !reclaim.stopping)
+			pthread_cond_wait(&reclaim.nonempty, &reclaim.lock);
+		if (!reclaim.count)
+			break;
+
+		/* takes everything queued, so producers get the whole ring back */
+		count = reclaim.count;
+		first = reclaim.capacity - reclaim.head;
+		if (first > count)
+			first = count;
+		memcpy(reclaim.batch, reclaim.queue + reclaim.head,
+			first * sizeof(pending_t));
+		memcpy(reclaim.batch + first, reclaim.queue,
+			(count - first) * sizeof(pending_t));
+		reclaim.head = (reclaim.head + count) % reclaim.capacity;
+		reclaim.count = 0;
+		reclaim.stats.queued = 0;
+		pthread_cond_broadcast(&reclaim.room);
+		pthread_mutex_unlock(&reclaim.lock);
+
+		for (i = 0; i < count; i++)
+		{
+			marshal_use_allocator(reclaim.batch[i].allocator);
+			marshal_free(reclaim.batch[i].tree);
+		}
+		marshal_use_allocator(NULL);
+
+		pthread_mutex_lock(&reclaim.lock);
+		reclaim.stats.freed += count;
+		reclaim.stats.batches++;
+		stats = reclaim.stats;
+		hook = reclaim.hook;
+		pthread_cond_broadcast(&reclaim.done);
+		if (hook)
+		{
+			void *data = reclaim.hook_data;
+			pthread_mutex_unlock(&reclaim.lock);
+			hook(&stats, data);
+			pthread_mutex_lock(&reclaim.lock);
+		}
+	}
+	pthread_mutex_unlock(&reclaim.lock);
+	return NULL;
+}
+
+/* the lock must be held */
+static int
+start(int capacity)
+{
+	if (reclaim.started)
+		return OK;
+	if (capacity <= 0)
+		capacity = MARSHAL_FREE_QUEUE;
+	/* the queue is the library's own, it stays out of the callers'
+	   allocators */
+	reclaim.queue = malloc(capacity * sizeof(pending_t));
+	reclaim.batch = malloc(capacity * sizeof(pending_t));
+	if (!reclaim.queue || !reclaim.batch)
+		goto failed;
+	reclaim.capacity = capacity;
+	reclaim.head = 0;
+	reclaim.count = 0;
+	if (pthread_create(&reclaim.thread, NULL, reclaimer, NULL))
+		goto failed;
+	reclaim.started = 1;
+	return OK;
+
+failed:
+	if (reclaim.queue)
+		free(reclaim.queue);
+	if (reclaim.batch)
+		free(reclaim.batch);
+	reclaim.queue = reclaim.batch = NULL;
+	return FAILED;
+}
+
+int
+marshal_free_start(int capacity)
+{
+	int status;
+	pthread_mutex_lock(&reclaim.lock);
+	status = reclaim.stopping ? FAILED : start(capacity);
+	pthread_mutex_unlock(&reclaim.lock);
+	return status;
+}
+
+void
+marshal_free_async(marshal_t *marshal)
+{
+	int tail;
+	if (!marshal)
+		return;
+	pthread_mutex_lock(&reclaim.lock);
+	if (reclaim.stopping || start(0))
+	{
+		/* no reclaimer, the caller pays */
+		pthread_mutex_unlock(&reclaim.lock);
+		marshal_free(marshal);
+		return;
+	}
+	if (reclaim.count == reclaim.capacity)
+	{
+		reclaim.stats.stalls++;
+		while (reclaim.count == reclaim.capacity)
+			pthread_cond_wait(&reclaim.room, &reclaim.lock);
+	}
+	tail = (reclaim.head + reclaim.count) % reclaim.capacity;
+	reclaim.queue[tail].tree = marshal;
+	reclaim.queue[tail].allocator = mem_allocator();
+	reclaim.count++;
+	reclaim.stats.submitted++;
+	reclaim.stats.queued = reclaim.count;
+	if ((unsigned long)reclaim.count > reclaim.stats.peak)
+		reclaim.stats.peak = reclaim.count;
+	pthread_cond_signal(&reclaim.nonempty);
+	pthread_mutex_unlock(&reclaim.lock);
+}
+
+void
+marshal_free_flush(void)
+{
+	unsigned long target;
+	pthread_mutex_lock(&reclaim.lock);
+	target = reclaim.stats.submitted;
+	while (reclaim.started && reclaim.stats.freed < target)
+		pthread_cond_wait(&reclaim.done, &reclaim.lock);
+	pthread_mutex_unlock(&reclaim.lock);
+}
+
+void
+marshal_free_stop(void)
+{
+	pthread_mutex_lock(&reclaim.lock);
+	if (!reclaim.started || reclaim.stopping)
+	{
+		pthread_mutex_unlock(&reclaim.lock);
+		return;
+	}
+	/* the reclaimer drains the queue before leaving */
+	reclaim.stopping = 1;
+	pthread_cond_signal(&reclaim.nonempty);
+	pthread_mutex_unlock(&reclaim.lock);
+	pthread_join(reclaim.thread, NULL);
+
+	pthread_mutex_lock(&reclaim.lock);
+	free(reclaim.queue);
+	free(reclaim.batch);
+	reclaim.queue = reclaim.batch = NULL;
+	reclaim.started = 0;
+	reclaim.stopping = 0;
+	pthread_cond_broadcast(&reclaim.done);
+	pthread_mutex_unlock(&reclaim.lock);
+}
+
+void
+marshal_free_stats(marshal_free_stats_t *stats)
+{
+	pthread_mutex_lock(&reclaim.lock);
+	*stats = reclaim.stats;
+	pthread_mutex_unlock(&reclaim.lock);
+}
+
+void
+marshal_free_hook(marshal_free_hook_fn hook, void *data)
+{
+	pthread_mutex_lock(&reclaim.lock);
+	reclaim.hook = hook;
+	reclaim.hook_data = data;
+	pthread_mutex_unlock(&reclaim.lock);
+}
+
+#else
+/* without threads trees are freed right away */
+
+static marshal_free_stats_t stats;
+static marshal_free_hook_fn stats_hook;
+static void *stats_data;
+
+int
+marshal_free_start(int capacity)
+{
+	(void)capacity;
+	return OK;
+}
+
+void
+marshal_free_async(marshal_t *marshal)
+{
+	if (!marshal)
+		return;
+	marshal_free(marshal);
+	stats.submitted++;
+	stats.freed++;
+	stats.batches++;
+	if (stats_hook)
+		stats_hook(&stats, stats_data);
+}
+
+void
+marshal_free_flush(void)
+{
+}
+
+void
+marshal_free_stop(void)
+{
+}
+
+void
+marshal_free_stats(marshal_free_stats_t *out)
+{
+	*out = stats;
+}
+
+void
+marshal_free_hook(marshal_free_hook_fn hook, void *data)
+{
+	stats_hook = hook;
+	stats_data = data;
+}
+#endif
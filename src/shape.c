@@ -0,0 +1,89 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+/* ids let marshal_field_t tell shapes apart even if an address is reused */
+static unsigned long last_id;
+
+marshal_shape_t *
+shape_new(const char *klass, int count, char *const *names, const char *name)
+{
+	marshal_shape_t *shape;
+	size_t size;
+	char *cur;
+	int total = count + (name ? 1 : 0);
+	int i;
+
+	/* shape, names and every string go in a single block */
+	size = sizeof(marshal_shape_t) + total * sizeof(char *);
+	size += strlen(klass) + 1;
+	for (i = 0; i < count; i++)
+		size += strlen(names[i]) + 1;
+	if (name)
+		size += strlen(name) + 1;
+
+	shape = mem_alloc(size);
+	if (!shape)
+		return NULL;
+	shape->refs = 1;
+	shape->count = total;
+	shape->id = ATOMIC_INC(last_id);
+	shape->names = (char **)(shape + 1);
+	cur = (char *)(shape->names + total);
+
+	shape->klass = cur;
+	strcpy(cur, klass);
+	cur += strlen(klass) + 1;
+	for (i = 0; i < total; i++)
+	{
+		const char *src = i < count ? names[i] : name;
+		shape->names[i] = cur;
+		strcpy(cur, src);
+		cur += strlen(src) + 1;
+	}
+	return shape;
+}
+
+marshal_shape_t *
+shape_retain(marshal_shape_t *shape)
+{
+	ATOMIC_INC(shape->refs);
+	return shape;
+}
+
+void
+shape_release(marshal_shape_t *shape)
+{
+	if (shape && 0 == ATOMIC_DEC(shape->refs))
+		mem_free(shape);
+}
+
+int
+marshal_shape_slot(const marshal_shape_t *shape, const char *name)
+{
+	int i;
+	if (!shape)
+		return -1;
+	for (i = 0; i < shape->count; i++)
+	{
+		if (0 == strcmp(shape->names[i], name))
+			return i;
+	}
+	return -1;
+}
@@ -0,0 +1,137 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <string.h>
+#include <time.h>
+#include "internal.h"
+
+THREAD_LOCAL int stats_on;
+THREAD_LOCAL marshal_stats_t thread_stats;
+
+double
+stats_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec now;
+	if (0 == clock_gettime(CLOCK_MONOTONIC, &now))
+		return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+	/* processor time is better than nothing */
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+void
+marshal_stats_enable(int enable)
+{
+	stats_on = enable != 0;
+}
+
+void
+marshal_stats_snapshot(marshal_stats_t *stats)
+{
+	memcpy(stats, &thread_stats, sizeof(marshal_stats_t));
+}
+
+void
+marshal_stats_reset(void)
+{
+	memset(&thread_stats, 0, sizeof(marshal_stats_t));
+}
+
+static size_t
+strsize(const char *s)
+{
+	return s ? strlen(s) + 1 : 0;
+}
+
+static size_t
+children_usage(int count, void **nodes)
+{
+	size_t size = count * sizeof(void *);
+	int i;
+	for (i = 0; i < count; i++)
+		size += marshal_memory_usage(nodes[i]);
+	return size;
+}
+
+size_t
+marshal_memory_usage(const marshal_t *marshal)
+{
+	size_t size;
+	if (!marshal || SHARED_STATIC == marshal->head.shared)
+		return 0;
+	size = node_size(marshal->type);
+	switch (marshal->type)
+	{
+		case MARSHAL_BIGNUM:
+			size += marshal->bignum.length;
+			break;
+		case MARSHAL_SYMBOL:
+			size += IS_INLINE_SYMBOL(marshal) ? INLINE_SIZE
+				: strsize(marshal->symbol.name);
+			break;
+		case MARSHAL_ARRAY:
+			size += children_usage(marshal->array.count,
+				marshal->array.values);
+			break;
+		case MARSHAL_HASH:
+			size += children_usage(marshal->hash.count * 2,
+				marshal->hash.pairs);
+			size += marshal_memory_usage(marshal->hash.def);
+			size += index_size(marshal->hash.index);
+			break;
+		case MARSHAL_STRING:
+			/* see the string allocations in decode.c */
+			size += IS_INLINE_STRING(marshal) ? INLINE_SIZE
+				: (size_t)marshal->string.data_size + 4;
+			size += children_usage(marshal->string.count * 2,
+				marshal->string.pairs);
+			break;
+		case MARSHAL_REGEX:
+			size += marshal->regex.data_size;
+			size += children_usage(marshal->regex.count * 2,
+				marshal->regex.pairs);
+			break;
+		case MARSHAL_CLASS:
+			size += strsize(marshal->klass.name);
+			break;
+		case MARSHAL_MODULE:
+			size += strsize(marshal->module.name);
+			break;
+		case MARSHAL_OBJECT:
+		case MARSHAL_STRUCT:
+			size += children_usage(marshal->object.count,
+				marshal->object.vars);
+			size += marshal_memory_usage(marshal->object.symbol_instance);
+			break;
+		case MARSHAL_USERDEF:
+			size += marshal->userdef.size;
+			size += marshal_memory_usage(marshal->userdef.symbol_instance);
+			size += children_usage(marshal->userdef.count * 2,
+				marshal->userdef.pairs);
+			break;
+		case MARSHAL_USERCLASS:
+		case MARSHAL_EXTENDED:
+		case MARSHAL_USRMARSHAL:
+		case MARSHAL_DATA:
+			size += marshal_memory_usage(marshal->wrapped.value);
+			size += marshal_memory_usage(marshal->wrapped.symbol_instance);
+	}
+	if (marshal->head.shared > 0)
+		size /= marshal->head.shared;
+	return size;
+}
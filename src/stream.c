@@ -0,0 +1,295 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <limits.h>
+#include <string.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "internal.h"
+
+#define OK 0
+#define FAILED 1
+
+#define CHECK(call) do { int _err = call ; if (_err) return _err; } while (0)
+#define CHECK_NULL(call) do { if (! call ) return FAILED; } while (0)
+
+/* bytes read, inflated or deflated at once */
+#define CHUNK_SIZE 65536
+
+typedef struct
+{
+	marshal_read_fn read; /* NULL for memory */
+	void *data;
+	unsigned char *in; /* read's buffer */
+	/* input nobody took yet */
+	const unsigned char *pending;
+	size_t pending_size;
+#ifdef HAVE_LIBZ
+	z_stream z;
+	int status; /* inflate's last one */
+	unsigned char *out;
+#endif
+} source_t;
+
+/* makes sure there's pending input, returns its size (0 at the end) */
+static size_t
+refill(source_t *s)
+{
+	if (!s->pending_size && s->read)
+	{
+		s->pending = s->in;
+		s->pending_size = s->read(s->data, s->in, CHUNK_SIZE);
+	}
+	return s->pending_size;
+}
+
+/* whether the input starts with a zlib or gzip header, marshal's 4.8
+   version looks like neither */
+static int
+compressed(source_t *s)
+{
+	const unsigned char *p;
+	refill(s);
+	/* a reader may hand a single byte */
+	if (s->read && 1 == s->pending_size)
+		s->pending_size += s->read(s->data, s->in + 1, CHUNK_SIZE - 1);
+	if (s->pending_size < 2)
+		return 0;
+	p = s->pending;
+	return (0x1f == p[0] && 0x8b == p[1])
+		|| (8 == (p[0] & 0x0f) && 0 == (p[0] << 8 | p[1]) % 31);
+}
+
+static size_t
+next_plain(void *source, const void **chunk)
+{
+	source_t *s = source;
+	size_t size = refill(s);
+	*chunk = s->pending;
+	s->pending_size = 0;
+	return size;
+}
+
+#ifdef HAVE_LIBZ
+static voidpf
+z_alloc(voidpf opaque, uInt items, uInt size)
+{
+	(void)opaque;
+	return mem_calloc(items, size);
+}
+
+static void
+z_free(voidpf opaque, voidpf mem)
+{
+	(void)opaque;
+	mem_free(mem);
+}
+
+static void
+z_init(z_stream *z)
+{
+	memset(z, 0, sizeof(z_stream));
+	z->zalloc = z_alloc;
+	z->zfree = z_free;
+}
+
+/* inflates into the window until it's full or the input is over */
+static size_t
+next_inflated(void *source, const void **chunk)
+{
+	source_t *s = source;
+	s->z.next_out = s->out;
+	s->z.avail_out = CHUNK_SIZE;
+	while (s->z.avail_out && Z_OK == s->status)
+	{
+		if (!s->z.avail_in && refill(s))
+		{
+			uInt size = s->pending_size > UINT_MAX ? UINT_MAX
+				: (uInt)s->pending_size;
+			s->z.next_in = (Bytef *)s->pending;
+			s->z.avail_in = size;
+			s->pending += size;
+			s->pending_size -= size;
+		}
+		/* Z_BUF_ERROR means the input was cut */
+		s->status = inflate(&s->z, Z_NO_FLUSH);
+	}
+	*chunk = s->out;
+	return CHUNK_SIZE - s->z.avail_out;
+}
+
+static marshal_t *
+decode_inflated(source_t *s, int flags)
+{
+	marshal_t *marshal;
+	const void *chunk;
+	z_init(&s->z);
+	s->status = Z_OK;
+	s->out = mem_alloc(CHUNK_SIZE);
+	if (!s->out)
+		return NULL;
+	/* 32 takes either header */
+	if (Z_OK != inflateInit2(&s->z, 15 + 32))
+	{
+		mem_free(s->out);
+		return NULL;
+	}
+	marshal = decode_chunks(next_inflated, s, flags);
+	/* the checksum is after the last value */
+	while (marshal && Z_OK == s->status)
+		next_inflated(s, &chunk);
+	if (marshal && Z_STREAM_END != s->status)
+	{
+		marshal_free(marshal);
+		marshal = NULL;
+	}
+	inflateEnd(&s->z);
+	mem_free(s->out);
+	return marshal;
+}
+#else
+/* compressed inputs can't be read without zlib */
+#define decode_inflated(s, flags) NULL
+#endif
+
+static marshal_t *
+decode_source(source_t *s, int flags)
+{
+	if (compressed(s))
+		return decode_inflated(s, flags);
+	if (!s->read)
+		return decode_memory(s->pending, s->pending_size, flags);
+	return decode_chunks(next_plain, s, flags);
+}
+
+marshal_t *
+marshal_decode_stream(marshal_read_fn read, void *data, int flags)
+{
+	source_t s;
+	marshal_t *marshal;
+	s.read = read;
+	s.data = data;
+	s.pending = NULL;
+	s.pending_size = 0;
+	s.in = mem_alloc(CHUNK_SIZE);
+	if (!s.in)
+		return NULL;
+	marshal = decode_source(&s, flags);
+	mem_free(s.in);
+	return marshal;
+}
+
+marshal_t *
+marshal_decode_buffer(const void *data, size_t size, int flags)
+{
+	source_t s;
+	s.read = NULL;
+	s.data = NULL;
+	s.in = NULL;
+	s.pending = data;
+	s.pending_size = size;
+	return decode_source(&s, flags);
+}
+
+#ifdef HAVE_LIBZ
+typedef struct
+{
+	marshal_write_fn write;
+	void *data;
+	z_stream z;
+	unsigned char *out;
+} deflater_t;
+
+/* deflates size bytes of data, handing the output to write */
+static int
+pump(deflater_t *d, const void *data, size_t size, int flush)
+{
+	const unsigned char *p = data;
+	do
+	{
+		uInt piece = size > CHUNK_SIZE ? CHUNK_SIZE : (uInt)size;
+		d->z.next_in = (Bytef *)p;
+		d->z.avail_in = piece;
+		p += piece;
+		size -= piece;
+		do
+		{
+			size_t have;
+			d->z.next_out = d->out;
+			d->z.avail_out = CHUNK_SIZE;
+			if (Z_STREAM_ERROR == deflate(&d->z, size ? Z_NO_FLUSH : flush))
+				return FAILED;
+			have = CHUNK_SIZE - d->z.avail_out;
+			if (have)
+				CHECK(d->write(d->data, d->out, have));
+		} while (!d->z.avail_out);
+	} while (size);
+	return OK;
+}
+
+static int
+deflate_sink(void *sink, const void *data, size_t size)
+{
+	return pump(sink, data, size, Z_NO_FLUSH);
+}
+
+static int
+encode_deflated(const marshal_t *marshal, marshal_write_fn write, void *data,
+	int format)
+{
+	deflater_t d;
+	int status;
+	/* 16 asks for a gzip header */
+	int bits = MARSHAL_STREAM_GZIP == format ? 15 + 16 : 15;
+
+	d.write = write;
+	d.data = data;
+	z_init(&d.z);
+	d.out = mem_alloc(CHUNK_SIZE);
+	CHECK_NULL(d.out);
+	if (Z_OK != deflateInit2(&d.z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, bits,
+			8, Z_DEFAULT_STRATEGY))
+	{
+		mem_free(d.out);
+		return FAILED;
+	}
+	status = encode_chunks(marshal, deflate_sink, &d);
+	if (OK == status)
+		status = pump(&d, NULL, 0, Z_FINISH);
+	deflateEnd(&d.z);
+	mem_free(d.out);
+	return status;
+}
+#else
+#define encode_deflated(marshal, write, data, format) FAILED
+#endif
+
+int
+marshal_encode_stream(const marshal_t *marshal, marshal_write_fn write,
+	void *data, int format)
+{
+	switch (format)
+	{
+		case MARSHAL_STREAM_PLAIN:
+			return encode_chunks(marshal, write, data);
+		case MARSHAL_STREAM_ZLIB:
+		case MARSHAL_STREAM_GZIP:
+			return encode_deflated(marshal, write, data, format);
+		default:
+			return FAILED;
+	}
+}
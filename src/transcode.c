@@ -0,0 +1,570 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+  #define HAVE_X86_SIMD
+  #include <immintrin.h>
+#endif
+
+#define OK 0
+#define FAILED 1
+
+#define REPLACEMENT 0xFFFD
+
+/* a byte of Windows-1252 or a UTF-16 unit takes up to 3 bytes, vector
+   kernels store 16 bytes at once */
+#define UTF8_ROOM(size) ((size) * 3 + 16)
+
+/* a machine word with the high bit of every byte set */
+#define HIGH_BITS ((size_t)-1 / 0xFF * 0x80)
+
+#define UNIT16(p, big) ((big) ? (unsigned long)(p)[0] << 8 | (p)[1] \
+	: (unsigned long)(p)[1] << 8 | (p)[0])
+
+typedef unsigned char *(*single_fn)(const unsigned char *s, size_t size,
+	unsigned char *out, const unsigned short *c1);
+typedef unsigned char *(*utf16_fn)(const unsigned char *s, size_t size,
+	unsigned char *out, int big);
+
+/* Windows-1252 0x80...0x9F, the rest is ISO-8859-1 */
+static const unsigned short cp1252[32] = {
+	0x20AC, 0xFFFD, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+	0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+	0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+	0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0xFFFD, 0x017E, 0x0178
+};
+
+static unsigned char *
+put_char(unsigned long c, unsigned char *out)
+{
+	if (c < 0x80)
+		*out++ = (unsigned char)c;
+	else if (c < 0x800)
+	{
+		*out++ = (unsigned char)(0xC0 | c >> 6);
+		*out++ = (unsigned char)(0x80 | (c & 0x3F));
+	}
+	else if (c < 0x10000)
+	{
+		*out++ = (unsigned char)(0xE0 | c >> 12);
+		*out++ = (unsigned char)(0x80 | (c >> 6 & 0x3F));
+		*out++ = (unsigned char)(0x80 | (c & 0x3F));
+	}
+	else
+	{
+		*out++ = (unsigned char)(0xF0 | c >> 18);
+		*out++ = (unsigned char)(0x80 | (c >> 12 & 0x3F));
+		*out++ = (unsigned char)(0x80 | (c >> 6 & 0x3F));
+		*out++ = (unsigned char)(0x80 | (c & 0x3F));
+	}
+	return out;
+}
+
+/* scalar kernels */
+
+/* ISO-8859-1, or Windows-1252 with its C1 table */
+static unsigned char *
+single_scalar(const unsigned char *s, size_t size, unsigned char *out,
+	const unsigned short *c1)
+{
+	size_t i = 0;
+	while (i < size)
+	{
+		unsigned char c = s[i];
+		if (c < 0x80)
+		{
+			/* copies whole words of ascii */
+			size_t word;
+			*out++ = c;
+			i++;
+			while (i + sizeof(word) <= size)
+			{
+				memcpy(&word, s + i, sizeof(word));
+				if (word & HIGH_BITS)
+					break;
+				memcpy(out, &word, sizeof(word));
+				out += sizeof(word);
+				i += sizeof(word);
+			}
+			continue;
+		}
+		if (c1 && c < 0xA0)
+			out = put_char(c1[c - 0x80], out);
+		else
+		{
+			*out++ = (unsigned char)(0xC0 | c >> 6);
+			*out++ = (unsigned char)(0x80 | (c & 0x3F));
+		}
+		i++;
+	}
+	return out;
+}
+
+/* a UTF-16 character, returns the bytes it took, lone surrogates and a
+   cut unit become U+FFFD */
+static size_t
+utf16_char(const unsigned char *s, size_t left, unsigned char **out,
+	int big)
+{
+	unsigned long c;
+	if (left < 2)
+	{
+		*out = put_char(REPLACEMENT, *out);
+		return left;
+	}
+	c = UNIT16(s, big);
+	if (c >= 0xD800 && c < 0xDC00 && left >= 4)
+	{
+		unsigned long low = UNIT16(s + 2, big);
+		if (low >= 0xDC00 && low < 0xE000)
+		{
+			c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+			*out = put_char(c, *out);
+			return 4;
+		}
+	}
+	if (c >= 0xD800 && c < 0xE000)
+		c = REPLACEMENT;
+	*out = put_char(c, *out);
+	return 2;
+}
+
+static unsigned char *
+utf16_scalar(const unsigned char *s, size_t size, unsigned char *out,
+	int big)
+{
+	size_t i = 0;
+	while (i < size)
+		i += utf16_char(s + i, size - i, &out, big);
+	return out;
+}
+
+static unsigned char *
+utf32_scalar(const unsigned char *s, size_t size, unsigned char *out,
+	int big)
+{
+	size_t i;
+	for (i = 0; i + 4 <= size; i += 4)
+	{
+		unsigned long c = big ?
+			(unsigned long)s[i] << 24 | (unsigned long)s[i+1] << 16
+				| (unsigned long)s[i+2] << 8 | s[i+3] :
+			(unsigned long)s[i+3] << 24 | (unsigned long)s[i+2] << 16
+				| (unsigned long)s[i+1] << 8 | s[i];
+		if (c > 0x10FFFF || (c >= 0xD800 && c < 0xE000))
+			c = REPLACEMENT;
+		out = put_char(c, out);
+	}
+	if (i < size)
+		out = put_char(REPLACEMENT, out);
+	return out;
+}
+
+/* US-ASCII, bytes past 0x7F become U+FFFD */
+static unsigned char *
+ascii_scalar(const unsigned char *s, size_t size, unsigned char *out)
+{
+	size_t i;
+	for (i = 0; i < size; i++)
+		out = s[i] < 0x80 ? (*out = s[i], out + 1) :
+			put_char(REPLACEMENT, out);
+	return out;
+}
+
+/* UTF-8 with invalid bytes, each of them becomes U+FFFD */
+static unsigned char *
+utf8_scalar(const unsigned char *s, size_t size, unsigned char *out)
+{
+	const unsigned char *end = s + size;
+	while (s < end)
+	{
+		int n = *s < 0x80 ? 1 : utf8_char_size(s, end);
+		if (n)
+		{
+			memcpy(out, s, n);
+			out += n;
+			s += n;
+		}
+		else
+		{
+			out = put_char(REPLACEMENT, out);
+			s++;
+		}
+	}
+	return out;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* for each mask of 8 lanes taking one byte (the others take two), the
+   shuffle packing their bytes and how many there are */
+static unsigned char compact[256][16];
+static unsigned char compact_size[256];
+
+static void
+init_compact(void)
+{
+	int mask, lane, n;
+	for (mask = 0; mask < 256; mask++)
+	{
+		n = 0;
+		for (lane = 0; lane < 8; lane++)
+		{
+			compact[mask][n++] = (unsigned char)(2 * lane);
+			if (!(mask >> lane & 1))
+				compact[mask][n++] = (unsigned char)(2 * lane + 1);
+		}
+		compact_size[mask] = (unsigned char)n;
+		while (n < 16)
+			compact[mask][n++] = 0x80;
+	}
+}
+
+/* 8 code points below U+0800 in 16 bits lanes into 8 to 16 bytes */
+__attribute__ ((target ("ssse3")))
+static unsigned char *
+two_byte_ssse3(__m128i v, unsigned char *out)
+{
+	__m128i one = _mm_cmplt_epi16(v, _mm_set1_epi16(0x80));
+	__m128i lead = _mm_or_si128(_mm_srli_epi16(v, 6), _mm_set1_epi16(0xC0));
+	__m128i trail = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi16(0x3F)),
+		_mm_set1_epi16(0x80));
+	__m128i two = _mm_or_si128(lead, _mm_slli_epi16(trail, 8));
+	__m128i bytes = _mm_or_si128(_mm_and_si128(one, v),
+		_mm_andnot_si128(one, two));
+	int mask = _mm_movemask_epi8(_mm_packs_epi16(one, _mm_setzero_si128()));
+	_mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(bytes,
+		_mm_loadu_si128((const __m128i *)compact[mask])));
+	return out + compact_size[mask];
+}
+
+__attribute__ ((target ("ssse3")))
+static unsigned char *
+single_ssse3(const unsigned char *s, size_t size, unsigned char *out,
+	const unsigned short *c1)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+	for (i = 0; i + 16 <= size; i += 16)
+	{
+		__m128i input = _mm_loadu_si128((const __m128i *)(s + i));
+		if (!_mm_movemask_epi8(input))
+		{
+			_mm_storeu_si128((__m128i *)out, input);
+			out += 16;
+			continue;
+		}
+		if (c1)
+		{
+			/* 0x80...0x9F are 0...31 once flipped, the rest is out of it */
+			__m128i flipped = _mm_xor_si128(input, _mm_set1_epi8((char)0x80));
+			__m128i in_c1 = _mm_and_si128(
+				_mm_cmpgt_epi8(flipped, _mm_set1_epi8(-1)),
+				_mm_cmplt_epi8(flipped, _mm_set1_epi8(32)));
+			if (_mm_movemask_epi8(in_c1))
+			{
+				out = single_scalar(s + i, 16, out, c1);
+				continue;
+			}
+		}
+		out = two_byte_ssse3(_mm_unpacklo_epi8(input, zero), out);
+		out = two_byte_ssse3(_mm_unpackhi_epi8(input, zero), out);
+	}
+	return single_scalar(s + i, size - i, out, c1);
+}
+
+__attribute__ ((target ("ssse3")))
+static unsigned char *
+utf16_ssse3(const unsigned char *s, size_t size, unsigned char *out, int big)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	while (i + 16 <= size)
+	{
+		__m128i units = _mm_loadu_si128((const __m128i *)(s + i));
+		if (big)
+			units = _mm_or_si128(_mm_slli_epi16(units, 8),
+				_mm_srli_epi16(units, 8));
+		if (0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi16(zero,
+				_mm_and_si128(units, _mm_set1_epi16((short)0xFF80)))))
+		{
+			_mm_storel_epi64((__m128i *)out, _mm_packus_epi16(units, zero));
+			out += 8;
+			i += 16;
+		}
+		else if (0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi16(zero,
+				_mm_and_si128(units, _mm_set1_epi16((short)0xF800)))))
+		{
+			out = two_byte_ssse3(units, out);
+			i += 16;
+		}
+		else
+		{
+			/* a surrogate pair may end past the block */
+			size_t stop = i + 16;
+			while (i < stop)
+				i += utf16_char(s + i, size - i, &out, big);
+		}
+	}
+	return utf16_scalar(s + i, size - i, out, big);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static unsigned char *
+single_dispatch(const unsigned char *s, size_t size, unsigned char *out,
+	const unsigned short *c1);
+
+static unsigned char *
+utf16_dispatch(const unsigned char *s, size_t size, unsigned char *out,
+	int big);
+
+/* they are set once, racing threads would store the same values */
+static single_fn single = single_dispatch;
+static utf16_fn utf16 = utf16_dispatch;
+
+static void
+pick_kernels(void)
+{
+	single_fn best_single = single_scalar;
+	utf16_fn best_utf16 = utf16_scalar;
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("ssse3"))
+	{
+		init_compact();
+		best_single = single_ssse3;
+		best_utf16 = utf16_ssse3;
+	}
+#endif
+	single = best_single;
+	utf16 = best_utf16;
+}
+
+static unsigned char *
+single_dispatch(const unsigned char *s, size_t size, unsigned char *out,
+	const unsigned short *c1)
+{
+	pick_kernels();
+	return single(s, size, out, c1);
+}
+
+static unsigned char *
+utf16_dispatch(const unsigned char *s, size_t size, unsigned char *out,
+	int big)
+{
+	pick_kernels();
+	return utf16(s, size, out, big);
+}
+
+static int
+reserve(marshal_buffer_t *out, size_t room)
+{
+	if (room > out->capacity - out->size)
+	{
+		size_t capacity = out->capacity ? out->capacity : 4096;
+		char *grown;
+		while (capacity - out->size < room)
+			capacity *= 2;
+		grown = mem_realloc(out->data, capacity);
+		if (!grown)
+			return FAILED;
+		out->data = grown;
+		out->capacity = capacity;
+	}
+	return OK;
+}
+
+int
+marshal_to_utf8(int encoding, const void *data, size_t size,
+	marshal_buffer_t *out)
+{
+	const unsigned char *s = data;
+	unsigned char *start, *end;
+
+	switch (encoding)
+	{
+		case MARSHAL_ENCODING_UTF_8:
+		case MARSHAL_ENCODING_US_ASCII:
+		case MARSHAL_ENCODING_ISO_8859_1:
+		case MARSHAL_ENCODING_Windows_1252:
+		case MARSHAL_ENCODING_UTF_16:
+		case MARSHAL_ENCODING_UTF_16LE:
+		case MARSHAL_ENCODING_UTF_16BE:
+		case MARSHAL_ENCODING_UTF_32:
+		case MARSHAL_ENCODING_UTF_32LE:
+		case MARSHAL_ENCODING_UTF_32BE:
+			break;
+		default:
+			return FAILED;
+	}
+	if (!out || (size && !data) || size > ((size_t)-1 - 16) / 3
+			|| reserve(out, UTF8_ROOM(size)))
+		return FAILED;
+	start = end = (unsigned char *)out->data + out->size;
+
+	/* without a byte order mark UTF-16 and UTF-32 are big endian */
+	if (MARSHAL_ENCODING_UTF_16 == encoding)
+	{
+		encoding = MARSHAL_ENCODING_UTF_16BE;
+		if (size >= 2 && 0xFF == s[0] && 0xFE == s[1])
+			encoding = MARSHAL_ENCODING_UTF_16LE;
+		if (size >= 2 && ((0xFE == s[0] && 0xFF == s[1])
+				|| (0xFF == s[0] && 0xFE == s[1])))
+		{
+			s += 2;
+			size -= 2;
+		}
+	}
+	else if (MARSHAL_ENCODING_UTF_32 == encoding)
+	{
+		encoding = MARSHAL_ENCODING_UTF_32BE;
+		if (size >= 4 && !memcmp(s, "\377\376\0\0", 4))
+			encoding = MARSHAL_ENCODING_UTF_32LE;
+		if (size >= 4 && (!memcmp(s, "\0\0\376\377", 4)
+				|| !memcmp(s, "\377\376\0\0", 4)))
+		{
+			s += 4;
+			size -= 4;
+		}
+	}
+
+	switch (encoding)
+	{
+		case MARSHAL_ENCODING_UTF_8:
+			if (marshal_utf8_validate(s, size, NULL))
+			{
+				memcpy(start, s, size);
+				end = start + size;
+			}
+			else
+				end = utf8_scalar(s, size, start);
+			break;
+		case MARSHAL_ENCODING_US_ASCII:
+			end = ascii_scalar(s, size, start);
+			break;
+		case MARSHAL_ENCODING_ISO_8859_1:
+			end = single(s, size, start, NULL);
+			break;
+		case MARSHAL_ENCODING_Windows_1252:
+			end = single(s, size, start, cp1252);
+			break;
+		case MARSHAL_ENCODING_UTF_16LE:
+		case MARSHAL_ENCODING_UTF_16BE:
+			end = utf16(s, size, start,
+				MARSHAL_ENCODING_UTF_16BE == encoding);
+			break;
+		case MARSHAL_ENCODING_UTF_32LE:
+		case MARSHAL_ENCODING_UTF_32BE:
+			end = utf32_scalar(s, size, start,
+				MARSHAL_ENCODING_UTF_32BE == encoding);
+			break;
+	}
+	out->size += end - start;
+	return OK;
+}
+
+/* the string's encoding ivar becomes E=true, the one it replaces is
+   handed back in old */
+static int
+set_utf8(marshal_string_t *s, marshal_t **old)
+{
+	marshal_t *key = marshal_make_symbol("E");
+	marshal_t *value = marshal_make_boolean(1);
+	int i;
+
+	if (!key || !value)
+		goto failed;
+	for (i = 0; i < s->count; i++)
+	{
+		marshal_t *pair = s->pairs[i*2];
+		if (MARSHAL_SYMBOL == pair->type
+				&& (0 == strcmp("E", pair->symbol.name)
+				|| 0 == strcmp("encoding", pair->symbol.name)))
+			break;
+	}
+	old[0] = old[1] = NULL;
+	if (i == s->count)
+	{
+		void **pairs = mem_realloc(s->pairs,
+			(s->count + 1) * 2 * sizeof(void *));
+		if (!pairs)
+			goto failed;
+		s->pairs = pairs;
+		s->count++;
+	}
+	else
+	{
+		old[0] = s->pairs[i*2];
+		old[1] = s->pairs[i*2+1];
+	}
+	s->pairs[i*2] = key;
+	s->pairs[i*2+1] = value;
+	return OK;
+
+failed:
+	marshal_free(key);
+	marshal_free(value);
+	return FAILED;
+}
+
+int
+string_to_utf8(marshal_t *string, marshal_t **old)
+{
+	marshal_string_t *s = (marshal_string_t *)string;
+	marshal_buffer_t buf = { NULL, 0, 0 };
+	size_t size;
+
+	old[0] = old[1] = NULL;
+	if (!s || MARSHAL_STRING != s->type || s->shared)
+		return FAILED;
+	if (MARSHAL_ENCODING_UTF_8 == s->encoding)
+		return OK;
+	/* strings are NUL terminated like decode makes them */
+	if (marshal_to_utf8(s->encoding, s->data, s->data_size, &buf)
+			|| buf.size > INT_MAX
+			|| marshal_buffer_write(&buf, "\0\0\0", 4)
+			|| set_utf8(s, old))
+	{
+		if (buf.data)
+			mem_free(buf.data);
+		return FAILED;
+	}
+	size = buf.size - 4;
+	if (s->data && !IS_INLINE_STRING(string))
+		mem_free(s->data);
+	s->data = buf.data;
+	s->data_size = (int)size;
+	s->encoding = MARSHAL_ENCODING_UTF_8;
+	s->is_ascii = -1;
+	s->is_valid_utf8 = 1;
+	s->digest = 0;
+	return OK;
+}
+
+int
+marshal_string_to_utf8(marshal_t *string)
+{
+	marshal_t *old[2];
+	int status = string_to_utf8(string, old);
+	marshal_free(old[0]);
+	marshal_free(old[1]);
+	return status;
+}
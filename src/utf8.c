@@ -0,0 +1,357 @@
+/*
+ * This file is part of Marshal.
+ *
+ * Marshal is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Marshal is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Marshal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "internal.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+  #define HAVE_X86_SIMD
+  #include <immintrin.h>
+#endif
+
+/* below this size the vector setup costs more than it saves */
+#define SIMD_MIN_SIZE 64
+
+typedef int (*validator_t)(const unsigned char *s, size_t size, int *ascii);
+
+/* a machine word with the high bit of every byte set */
+#define HIGH_BITS ((size_t)-1 / 0xFF * 0x80)
+
+static int
+validate_scalar(const unsigned char *s, size_t size, int *ascii)
+{
+	size_t i = 0;
+	*ascii = 1;
+	while (i < size)
+	{
+		unsigned char c = s[i];
+		unsigned char c1;
+
+		if (c < 0x80)
+		{
+			/* skip whole words of ascii */
+			size_t word;
+			i++;
+			while (i + sizeof(word) <= size)
+			{
+				memcpy(&word, s + i, sizeof(word));
+				if (word & HIGH_BITS)
+					break;
+				i += sizeof(word);
+			}
+			continue;
+		}
+		*ascii = 0;
+
+		/* continuation bytes and overlong two byte leads */
+		if (c < 0xC2)
+			return 0;
+		if (c < 0xE0)
+		{
+			if (i + 1 >= size || (s[i+1] & 0xC0) != 0x80)
+				return 0;
+			i += 2;
+			continue;
+		}
+		if (c < 0xF0)
+		{
+			if (i + 2 >= size)
+				return 0;
+			c1 = s[i+1];
+			if ((c1 & 0xC0) != 0x80 || (s[i+2] & 0xC0) != 0x80)
+				return 0;
+			/* overlong and surrogates */
+			if ((0xE0 == c && c1 < 0xA0) || (0xED == c && c1 >= 0xA0))
+				return 0;
+			i += 3;
+			continue;
+		}
+		if (c < 0xF5)
+		{
+			if (i + 3 >= size)
+				return 0;
+			c1 = s[i+1];
+			if ((c1 & 0xC0) != 0x80 || (s[i+2] & 0xC0) != 0x80
+					|| (s[i+3] & 0xC0) != 0x80)
+				return 0;
+			/* overlong and beyond U+10FFFF */
+			if ((0xF0 == c && c1 < 0x90) || (0xF4 == c && c1 >= 0x90))
+				return 0;
+			i += 4;
+			continue;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/* vector kernels only check byte pairs inside the processed prefix,
+   so the last (maybe cut) sequence is checked again by the scalar code
+   starting from its lead byte */
+static int
+validate_tail(const unsigned char *s, size_t done, size_t size, int *ascii)
+{
+	size_t start = done;
+	size_t t;
+	for (t = 1; t <= 3 && t <= done; t++)
+	{
+		unsigned char c = s[done-t];
+		if (c < 0x80)
+			break;
+		if (c >= 0xC0)
+		{
+			start = done - t;
+			break;
+		}
+	}
+	return validate_scalar(s + start, size - start, ascii);
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* "Validating UTF-8 In Less Than One Instruction Per Byte"
+   (Keiser, Lemire), lookup algorithm */
+#define TOO_SHORT      (1<<0)
+#define TOO_LONG       (1<<1)
+#define OVERLONG_3     (1<<2)
+#define TOO_LARGE      (1<<3)
+#define SURROGATE      (1<<4)
+#define OVERLONG_2     (1<<5)
+#define TOO_LARGE_1000 (1<<6)
+#define OVERLONG_4     (1<<6)
+#define TWO_CONTS      (-0x80) /* bit 7, negative to fit in a char */
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH \
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+	TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+	TOO_SHORT | OVERLONG_2, \
+	TOO_SHORT, \
+	TOO_SHORT | OVERLONG_3 | SURROGATE, \
+	TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+	CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+	CARRY | OVERLONG_2, \
+	CARRY, \
+	CARRY, \
+	CARRY | TOO_LARGE, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000, \
+	CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH \
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 \
+		| TOO_LARGE_1000 | OVERLONG_4, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+__attribute__ ((target ("sse4.1")))
+static int
+validate_sse4(const unsigned char *s, size_t size, int *ascii)
+{
+	const __m128i table1 = _mm_setr_epi8(BYTE_1_HIGH);
+	const __m128i table2 = _mm_setr_epi8(BYTE_1_LOW);
+	const __m128i table3 = _mm_setr_epi8(BYTE_2_HIGH);
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i prev_input = _mm_setzero_si128();
+	__m128i error = _mm_setzero_si128();
+	__m128i any = _mm_setzero_si128();
+	size_t i;
+	int tail_ascii;
+
+	for (i = 0; i + 16 <= size; i += 16)
+	{
+		__m128i input = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+		__m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+		__m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+		__m128i byte_1_high = _mm_shuffle_epi8(table1,
+			_mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+		__m128i byte_1_low = _mm_shuffle_epi8(table2,
+			_mm_and_si128(prev1, nibble));
+		__m128i byte_2_high = _mm_shuffle_epi8(table3,
+			_mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+		__m128i special = _mm_and_si128(
+			_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+		__m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+		__m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+		__m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth),
+			_mm_set1_epi8((char)0x80));
+
+		error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+		any = _mm_or_si128(any, input);
+		prev_input = input;
+	}
+	if (!_mm_testz_si128(error, error))
+	{
+		*ascii = 0;
+		return 0;
+	}
+	if (!validate_tail(s, i, size, &tail_ascii))
+	{
+		*ascii = 0;
+		return 0;
+	}
+	*ascii = tail_ascii && 0 == _mm_movemask_epi8(any);
+	return 1;
+}
+
+/* prev<N> for 256 bits registers, lanes are stitched with permute */
+#define PREV_AVX2(input, prev_input, n) \
+	_mm256_alignr_epi8(input, \
+		_mm256_permute2x128_si256(prev_input, input, 0x21), 16 - (n))
+
+__attribute__ ((target ("avx2")))
+static int
+validate_avx2(const unsigned char *s, size_t size, int *ascii)
+{
+	const __m256i table1 = _mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH);
+	const __m256i table2 = _mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW);
+	const __m256i table3 = _mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH);
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i prev_input = _mm256_setzero_si256();
+	__m256i error = _mm256_setzero_si256();
+	__m256i any = _mm256_setzero_si256();
+	size_t i;
+	int tail_ascii;
+
+	for (i = 0; i + 32 <= size; i += 32)
+	{
+		__m256i input = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i prev1 = PREV_AVX2(input, prev_input, 1);
+		__m256i prev2 = PREV_AVX2(input, prev_input, 2);
+		__m256i prev3 = PREV_AVX2(input, prev_input, 3);
+		__m256i byte_1_high = _mm256_shuffle_epi8(table1,
+			_mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+		__m256i byte_1_low = _mm256_shuffle_epi8(table2,
+			_mm256_and_si256(prev1, nibble));
+		__m256i byte_2_high = _mm256_shuffle_epi8(table3,
+			_mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+		__m256i special = _mm256_and_si256(
+			_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+		__m256i third = _mm256_subs_epu8(prev2,
+			_mm256_set1_epi8(0xE0 - 0x80));
+		__m256i fourth = _mm256_subs_epu8(prev3,
+			_mm256_set1_epi8(0xF0 - 0x80));
+		__m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+			_mm256_set1_epi8((char)0x80));
+
+		error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+		any = _mm256_or_si256(any, input);
+		prev_input = input;
+	}
+	if (!_mm256_testz_si256(error, error))
+	{
+		*ascii = 0;
+		return 0;
+	}
+	if (!validate_tail(s, i, size, &tail_ascii))
+	{
+		*ascii = 0;
+		return 0;
+	}
+	*ascii = tail_ascii && 0 == _mm256_movemask_epi8(any);
+	return 1;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static int
+validate_dispatch(const unsigned char *s, size_t size, int *ascii);
+
+/* it's set once, racing threads would store the same value */
+static validator_t validator = validate_dispatch;
+
+static int
+validate_dispatch(const unsigned char *s, size_t size, int *ascii)
+{
+	validator_t best = validate_scalar;
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		best = validate_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		best = validate_sse4;
+#endif
+	validator = best;
+	return best(s, size, ascii);
+}
+
+/* bytes the UTF-8 character at p takes, 0 if it's invalid, p isn't
+   ASCII */
+int
+utf8_char_size(const unsigned char *p, const unsigned char *end)
+{
+	unsigned char c = p[0];
+	int size, i;
+	if (c < 0xC2)
+		return 0;
+	else if (c < 0xE0)
+		size = 2;
+	else if (c < 0xF0)
+		size = 3;
+	else if (c < 0xF5)
+		size = 4;
+	else
+		return 0;
+	if (end - p < size)
+		return 0;
+	for (i = 1; i < size; i++)
+		if (0x80 != (p[i] & 0xC0))
+			return 0;
+	/* overlongs, surrogates and past U+10FFFF */
+	if ((0xE0 == c && p[1] < 0xA0) || (0xED == c && p[1] >= 0xA0)
+			|| (0xF0 == c && p[1] < 0x90) || (0xF4 == c && p[1] >= 0x90))
+		return 0;
+	return size;
+}
+
+int
+marshal_utf8_validate(const void *data, size_t size, int *is_ascii)
+{
+	int ascii;
+	int valid = size < SIMD_MIN_SIZE ?
+		validate_scalar(data, size, &ascii) :
+		validator(data, size, &ascii);
+	if (is_ascii)
+		*is_ascii = ascii;
+	return valid;
+}
+
+int
+marshal_string_validate(marshal_t *string)
+{
+	marshal_string_t *s = (marshal_string_t *)string;
+	if (!s || MARSHAL_STRING != s->type)
+		return -1;
+	if (s->is_valid_utf8 < 0)
+		s->is_valid_utf8 = marshal_utf8_validate(s->data, s->data_size,
+			&s->is_ascii);
+	return s->is_valid_utf8;
+}
@@ -0,0 +1,90 @@
+# encoding: utf-8
+# Writes the marshal files of tests/fixtures, run it from any directory
+# with Ruby 2.x or 3.x: ruby tests/fixtures.rb
+# The files are checked in, marshal-test only reads them.
+
+Point = Struct.new(:x, :y)
+
+class Node
+  def initialize(id, label, nxt)
+    @id = id
+    @label = label
+    @next = nxt
+  end
+end
+
+class MyStr < String; end
+class MyArr < Array; end
+class MyHash < Hash; end
+module Ext; end
+module Ext2; end
+
+# marshal_dump/marshal_load, a U
+class Pair
+  def initialize(a, b)
+    @a = a
+    @b = b
+  end
+
+  def marshal_dump
+    [@a, @b]
+  end
+
+  def marshal_load(v)
+    @a, @b = v
+  end
+end
+
+# _dump/_load, a u, carrying the string's encoding when it has one
+class Token
+  def initialize(s)
+    @s = s
+  end
+
+  def _dump(level)
+    @s
+  end
+
+  def self._load(s)
+    new(s)
+  end
+end
+
+shared = "shared"
+node = Node.new(1, "first", nil)
+table = {}
+40.times { |i| table["field_#{i}"] = i * i }
+deep = 0
+100.times { deep = [deep] }
+
+fixtures = {
+  "integers" => [0, 1, -1, 122, 123, -123, -124, 255, 256, -256, -257,
+                 65535, 65536, -65536, -65537, 2**24, -2**24,
+                 2**30 - 1, -2**30, 2**30, -2**30 - 1, 2**31, 2**62,
+                 -(2**64) + 1, 2**100, -(2**99)],
+  "floats" => [1.5, 100.0, 0.001, 1e-5, 1.0 / 3, -2.5e100, 0.0, -0.0,
+               Float::INFINITY, -Float::INFINITY, 123456789.125, 1e16, 0.1],
+  "strings" => ["ascii", "café", "bin\xff\x00".b, shared, shared, "",
+                "café".encode("ISO-8859-1"),
+                "hi é".encode("UTF-16LE"),
+                "日本".encode("Shift_JIS"), "a" * 100],
+  "symbols" => [:a, :b, :a, :"café", { a: :b }, [:b, :c]],
+  "hashes" => [{ "id" => 1, :name => "x", 2 => nil, nil => true },
+               Hash.new(5).merge!(1 => 2), table, {}],
+  "objects" => [node, Node.new(2, "second", node), Node.new(3, shared, node),
+                shared],
+  "structs" => [Point.new(1, 2.5), Point.new(nil, [1, 2]), Point.new(:x, 3)],
+  "wrapped" => [MyStr.new("hello"), MyArr.new([1, MyStr.new("z")]),
+                MyHash[{ a: 1 }], "abc".extend(Ext),
+                [1].extend(Ext).extend(Ext2), Pair.new(5, "x")],
+  "userdef" => [Token.new("raw".b), Token.new("café"),
+                Time.at(1_600_000_000, 123_456_789, :nsec).utc],
+  "classes" => [String, Kernel, Comparable, Point],
+  "deep" => deep,
+}
+
+dir = File.join(File.dirname(__FILE__), "fixtures")
+Dir.mkdir(dir) unless Dir.exist?(dir)
+fixtures.each do |name, value|
+  File.binwrite(File.join(dir, "#{name}.marshal"), Marshal.dump(value))
+end
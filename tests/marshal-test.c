@@ -0,0 +1,1380 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks the library against Ruby: the fixtures written by
+   tests/fixtures.rb are decoded and encoded back, then each API runs on
+   them and on cases whose results are known.
+   Failed checks are printed, the exit status is their count (capped). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "marshal.h"
+
+static int checks;
+static int failures;
+
+#define CHECK(cond) check((cond) != 0, #cond, __LINE__)
+
+static void
+check(int ok, const char *what, int line)
+{
+	checks++;
+	if (ok)
+		return;
+	failures++;
+	fprintf(stderr, "marshal-test.c:%d: %s\n", line, what);
+}
+
+/* fixtures, those with object links don't come back byte for byte since
+   links are decoded as copies */
+static const struct
+{
+	const char *name;
+	int exact;
+}
+fixtures[] = {
+	{ "integers", 1 },
+	{ "floats", 1 },
+	{ "strings", 0 },
+	{ "symbols", 1 },
+	{ "hashes", 1 },
+	{ "objects", 0 },
+	{ "structs", 1 },
+	{ "wrapped", 1 },
+	{ "userdef", 1 },
+	{ "classes", 1 },
+	{ "deep", 1 }
+};
+
+#define FIXTURE_COUNT ((int)(sizeof(fixtures) / sizeof(fixtures[0])))
+
+static char *
+fixture_path(const char *name)
+{
+	static char path[4096];
+	const char *srcdir = getenv("srcdir");
+	sprintf(path, "%.4000s/tests/fixtures/%.32s.marshal",
+		srcdir ? srcdir : ".", name);
+	return path;
+}
+
+static void *
+read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	char *data = NULL;
+	long length;
+
+	if (!file)
+	{
+		fprintf(stderr, "Can't open %s.\n", path);
+		exit(1);
+	}
+	if (0 == fseek(file, 0, SEEK_END) && (length = ftell(file)) > 0
+			&& 0 == fseek(file, 0, SEEK_SET)
+			&& (data = malloc(length)) != NULL
+			&& (size_t)length == fread(data, 1, length, file))
+		*size = length;
+	else
+	{
+		fprintf(stderr, "Can't read %s.\n", path);
+		exit(1);
+	}
+	fclose(file);
+	return data;
+}
+
+static marshal_t *
+load(const char *name)
+{
+	marshal_t *m = marshal_decode_file(fixture_path(name));
+	if (!m)
+	{
+		fprintf(stderr, "Can't decode %s.\n", name);
+		exit(1);
+	}
+	return m;
+}
+
+/* a fixture's bytes, its tree and the tree encoded again */
+typedef struct
+{
+	const char *name;
+	int exact;
+	char *data;
+	size_t size;
+	marshal_t *m;
+	void *encoded;
+	size_t n;
+} fixture_t;
+
+static void
+fixture_open(fixture_t *f, int i)
+{
+	f->name = fixtures[i].name;
+	f->exact = fixtures[i].exact;
+	f->data = read_file(fixture_path(f->name), &f->size);
+	f->m = load(f->name);
+	f->encoded = marshal_encode(f->m, &f->n);
+	if (!f->encoded)
+	{
+		fprintf(stderr, "Can't encode %s.\n", f->name);
+		exit(1);
+	}
+}
+
+static void
+fixture_close(fixture_t *f)
+{
+	marshal_free_memory(f->encoded);
+	marshal_free(f->m);
+	free(f->data);
+}
+
+static int
+is_string(const marshal_t *m, const char *data)
+{
+	return m && MARSHAL_STRING == m->type
+		&& m->string.data_size == (int)strlen(data)
+		&& 0 == memcmp(m->string.data, data, m->string.data_size);
+}
+
+/* Ruby's bytes come back from the tree, and the tree from them */
+static void
+test_fixtures(void)
+{
+	fixture_t f;
+	marshal_t *copy;
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		if (f.exact)
+			CHECK(f.n == f.size && 0 == memcmp(f.encoded, f.data, f.size));
+		copy = marshal_decode(f.encoded);
+		CHECK(marshal_equal(f.m, copy));
+		marshal_free(copy);
+		copy = marshal_decode(f.data);
+		CHECK(marshal_equal(f.m, copy));
+		marshal_free(copy);
+		fixture_close(&f);
+	}
+}
+
+static void
+test_utf8(void)
+{
+	static const char long_ascii[] =
+		"the quick brown fox jumps over the lazy dog, "
+		"the quick brown fox jumps over the lazy dog";
+	marshal_t *m = load("strings");
+	marshal_t *s;
+	char text[256];
+	size_t size;
+	void *data;
+	int ascii;
+
+	s = marshal_array_get(m, 0);
+	CHECK(is_string(s, "ascii")
+		&& MARSHAL_ENCODING_UTF_8 == s->string.encoding);
+	CHECK(1 == marshal_string_validate(s) && 1 == s->string.is_ascii);
+	s = marshal_array_get(m, 1);
+	CHECK(is_string(s, "caf\xc3\xa9"));
+	CHECK(1 == marshal_string_validate(s) && 0 == s->string.is_ascii);
+	s = marshal_array_get(m, 2);
+	CHECK(s && MARSHAL_ENCODING_ASCII_8BIT == s->string.encoding
+		&& 5 == s->string.data_size);
+	CHECK(0 == marshal_string_validate(s));
+	CHECK(-1 == marshal_string_validate(marshal_make_nil()));
+	marshal_free(m);
+
+	/* checked while decoding */
+	data = read_file(fixture_path("strings"), &size);
+	m = marshal_decode_flags(data, MARSHAL_DECODE_VALIDATE_UTF8);
+	s = m ? marshal_array_get(m, 1) : NULL;
+	CHECK(s && 1 == s->string.is_valid_utf8 && 0 == s->string.is_ascii);
+	marshal_free(m);
+	free(data);
+
+	CHECK(marshal_utf8_validate(long_ascii, strlen(long_ascii), &ascii)
+		&& ascii);
+	CHECK(marshal_utf8_validate("\xf0\x9f\x98\x80", 4, &ascii) && !ascii);
+	CHECK(!marshal_utf8_validate("\xc0\xaf", 2, NULL));
+	CHECK(!marshal_utf8_validate("\xed\xa0\x80", 3, NULL));
+	CHECK(!marshal_utf8_validate("\xf4\x90\x80\x80", 4, NULL));
+	CHECK(!marshal_utf8_validate("\xe2\x82", 2, NULL));
+	/* errors past the vectorized blocks, and inside them */
+	sprintf(text, "%s\xc3", long_ascii);
+	CHECK(!marshal_utf8_validate(text, strlen(text), NULL));
+	sprintf(text, "%.20s\x80%s", long_ascii, long_ascii);
+	CHECK(!marshal_utf8_validate(text, strlen(text), NULL));
+}
+
+/* a UTF-8 string, as Ruby dumps them */
+static marshal_t *
+utf8(const char *text)
+{
+	char data[128];
+	size_t len = strlen(text);
+	if (len > 100)
+		return NULL;
+	sprintf(data, "\004\010I\"%c%s\006:\006ET", (int)len + 5, text);
+	return marshal_decode(data);
+}
+
+static int
+is_integer(const marshal_t *m, int value)
+{
+	return m && MARSHAL_INTEGER == m->type && value == m->integer.value;
+}
+
+static void
+test_hash_index(void)
+{
+	marshal_t *m = load("hashes");
+	marshal_t *small = marshal_array_get(m, 0);
+	marshal_t *with_default = marshal_array_get(m, 1);
+	marshal_t *table = marshal_array_get(m, 2);
+	marshal_t *key, *value, *hash;
+	char name[32];
+	void *data;
+	size_t size;
+	int i;
+
+	key = marshal_make_symbol("name");
+	CHECK(is_string(marshal_hash_get(small, key), "x"));
+	marshal_free(key);
+	key = utf8("id");
+	CHECK(is_integer(marshal_hash_get(small, key), 1));
+	marshal_free(key);
+	key = marshal_make_ascii("id");
+	CHECK(!marshal_hash_get(small, key));
+	marshal_free(key);
+	CHECK(MARSHAL_BOOLEAN == marshal_hash_get(small, marshal_make_nil())->type);
+
+	key = marshal_make_integer(7);
+	CHECK(is_integer(marshal_hash_get(with_default, key), 5));
+	marshal_free(key);
+
+	/* looked up with and without an index */
+	CHECK(!table->hash.index);
+	for (i = 0; i < 2; i++)
+	{
+		int j, found = 0;
+		for (j = 0; j < 40; j++)
+		{
+			sprintf(name, "field_%d", j);
+			key = utf8(name);
+			found += is_integer(marshal_hash_get(table, key), j * j);
+			marshal_free(key);
+		}
+		CHECK(40 == found);
+		CHECK(marshal_hash_index(table) == table && table->hash.index);
+	}
+	marshal_free(m);
+
+	data = read_file(fixture_path("hashes"), &size);
+	m = marshal_decode_flags(data, MARSHAL_DECODE_INDEX_HASHES);
+	CHECK(m && marshal_array_get(m, 2)->hash.index
+		&& !marshal_array_get(m, 0)->hash.index);
+	marshal_free(m);
+	free(data);
+
+	/* growing past a few pairs builds the index */
+	hash = marshal_make_hash(NULL);
+	for (i = 0; i < 100; i++)
+	{
+		sprintf(name, "k%d", i);
+		CHECK(marshal_hash_set(hash, marshal_make_ascii(name),
+			marshal_make_integer(i)));
+	}
+	CHECK(100 == hash->hash.count && hash->hash.index);
+	key = marshal_make_ascii("k42");
+	value = marshal_make_integer(-42);
+	CHECK(marshal_hash_set(hash, key, value) == value
+		&& 100 == hash->hash.count);
+	key = marshal_make_ascii("k42");
+	CHECK(is_integer(marshal_hash_get(hash, key), -42));
+	marshal_free(key);
+	CHECK(!marshal_hash_index(NULL));
+	marshal_free(hash);
+}
+
+static void
+test_containers(void)
+{
+	marshal_t *a = marshal_make_array();
+	marshal_t *hash = marshal_make_hash(NULL);
+	marshal_t *values[3];
+	char name[32];
+	int i;
+
+	CHECK(marshal_array_reserve(a, 16) == a && 16 <= a->array.capacity);
+	for (i = 0; i < 10; i++)
+		CHECK(marshal_array_add(a, marshal_make_integer(i)) == a);
+	values[0] = marshal_make_ascii("x");
+	values[1] = marshal_make_ascii("y");
+	CHECK(marshal_array_extend(a, values, 2) == a && 12 == a->array.count);
+	/* [0, 1, 2, 3, 4, 5, 6, 7, 8, 9, "x", "y"][2, 3] = [-1] */
+	values[0] = marshal_make_integer(-1);
+	CHECK(marshal_array_splice(a, 2, 3, values, 1) == a);
+	CHECK(10 == a->array.count && is_integer(marshal_array_get(a, 2), -1)
+		&& is_integer(marshal_array_get(a, 3), 5));
+	CHECK(marshal_array_del_range(a, 0, 2) == a && 8 == a->array.count);
+	CHECK(marshal_array_del(a, 7) == a && 7 == a->array.count
+		&& is_string(marshal_array_get(a, 6), "x"));
+	/* out of range changes nothing */
+	CHECK(!marshal_array_splice(a, 3, 9, NULL, 0) && 7 == a->array.count);
+	CHECK(!marshal_array_get(a, 7));
+	CHECK(!marshal_array_reserve(NULL, 1) && !marshal_array_add(NULL, a)
+		&& !marshal_array_extend(NULL, values, 0)
+		&& !marshal_array_splice(NULL, 0, 0, NULL, 0));
+	marshal_free(a);
+
+	/* filling a reserved hash doesn't grow it */
+	CHECK(marshal_hash_reserve(hash, 64) == hash && 64 <= hash->hash.capacity);
+	values[0] = (marshal_t *)hash->hash.pairs;
+	for (i = 0; i < 64; i++)
+	{
+		sprintf(name, "k%d", i);
+		CHECK(marshal_hash_set(hash, marshal_make_ascii(name),
+			marshal_make_integer(i)));
+	}
+	CHECK(64 == hash->hash.count && values[0] == (marshal_t *)hash->hash.pairs);
+	CHECK(!marshal_hash_reserve(NULL, 1));
+	marshal_free(hash);
+}
+
+static void
+test_shapes(void)
+{
+	marshal_t *m = load("objects");
+	marshal_t *first = marshal_array_get(m, 0);
+	marshal_t *value;
+	marshal_field_t field;
+	int i;
+
+	CHECK(first && MARSHAL_OBJECT == first->type
+		&& 0 == strcmp("Node", first->object.klass));
+	CHECK(is_string(marshal_object_get(first, "@label"), "first"));
+	CHECK(MARSHAL_NIL == marshal_object_get(first, "@next")->type);
+	CHECK(!marshal_object_get(first, "@missing"));
+	CHECK(1 == marshal_shape_slot(first->object.shape, "@label"));
+	CHECK(first->object.shape == marshal_array_get(m, 1)->object.shape);
+
+	memset(&field, 0, sizeof(field));
+	field.name = "@id";
+	for (i = 0; i < 3; i++)
+		CHECK(is_integer(marshal_object_field(marshal_array_get(m, i),
+			&field), i + 1));
+	CHECK(field.shape_id == first->object.shape->id);
+
+	value = marshal_make_ascii("changed");
+	CHECK(marshal_object_set(first, "@label", value) == value);
+	CHECK(marshal_object_get(first, "@label") == value);
+	value = marshal_make_integer(9);
+	CHECK(marshal_object_set(first, "@extra", value) == value
+		&& 4 == first->object.count);
+	CHECK(first->object.shape != marshal_array_get(m, 1)->object.shape);
+	CHECK(is_integer(marshal_object_field(first, &field), 1));
+	marshal_free(m);
+
+	/* made ones equal Ruby's */
+	m = marshal_make_object("Node");
+	marshal_object_set(m, "@id", marshal_make_integer(1));
+	marshal_object_set(m, "@label", utf8("first"));
+	marshal_object_set(m, "@next", marshal_make_nil());
+	first = load("objects");
+	CHECK(marshal_equal(m, marshal_array_get(first, 0)));
+	marshal_free(first);
+	marshal_free(m);
+}
+
+static void
+test_hash_value(void)
+{
+	fixture_t f;
+	marshal_t *copy, *a, *b;
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		copy = marshal_decode(f.encoded);
+		CHECK(marshal_hash_value(f.m) == marshal_hash_value(copy));
+		CHECK(marshal_hash_value_memo(copy) == marshal_hash_value(f.m));
+		marshal_free(copy);
+		fixture_close(&f);
+	}
+
+	a = utf8("a");
+	b = utf8("b");
+	CHECK(marshal_hash_value(a) != marshal_hash_value(b));
+	marshal_free(a);
+	marshal_free(b);
+}
+
+static void
+test_dedup(void)
+{
+	fixture_t f;
+	marshal_t *m, *copy;
+	size_t size;
+	void *data;
+	int i;
+
+	/* a dedup'd tree writes shared nodes as links, only the tree compares */
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		copy = marshal_clone(NULL, f.m);
+		CHECK(marshal_dedup(copy) == copy && marshal_equal(f.m, copy));
+		marshal_free(copy);
+		fixture_close(&f);
+	}
+
+	/* "shared" twice, decoded as copies */
+	m = load("strings");
+	CHECK(marshal_array_get(m, 3) != marshal_array_get(m, 4));
+	CHECK(marshal_dedup(m) == m);
+	CHECK(marshal_array_get(m, 3) == marshal_array_get(m, 4));
+	CHECK(!marshal_array_add(marshal_array_get(m, 3), marshal_make_nil()));
+	marshal_free(m);
+
+	/* the same while decoding */
+	data = read_file(fixture_path("objects"), &size);
+	m = marshal_decode_flags(data, MARSHAL_DECODE_DEDUP);
+	CHECK(m && marshal_array_get(m, 3)
+		== marshal_object_get(marshal_array_get(m, 2), "@label"));
+	marshal_free(m);
+	free(data);
+
+	/* equal but written differently: 0.0 and -0.0, ivars out of order */
+	for (i = 0; i < 2; i++)
+	{
+		const char *in = i ? "\004\010[\007o:\010Foo\007:\007@ai\006:\007@bi"
+			"\007o;\000\007;\007i\007;\006i\006" : "\004\010[\007f\0060f\007-0";
+		size_t n = i ? 35 : 11;
+		m = marshal_decode(in);
+		CHECK(marshal_equal(marshal_array_get(m, 0), marshal_array_get(m, 1)));
+		CHECK(marshal_dedup(m) == m);
+		CHECK(marshal_array_get(m, 0) != marshal_array_get(m, 1));
+		data = marshal_encode(m, &size);
+		CHECK(data && size == n && 0 == memcmp(data, in, n));
+		free(data);
+		marshal_free(m);
+	}
+}
+
+static void
+test_paths(void)
+{
+	marshal_t *m = load("objects");
+	marshal_t *hashes = load("hashes");
+	marshal_path_t *path = marshal_path_compile("[1]@next@label");
+	marshal_path_t *other = marshal_path_compile("[2].label");
+
+	CHECK(path && other);
+	CHECK(is_string(marshal_path_eval(path, m), "first"));
+	CHECK(is_string(marshal_path_eval(other, m), "shared"));
+	CHECK(!marshal_path_compile("[1"));
+	marshal_path_free(other);
+
+	other = marshal_path_compile("[2][:name]");
+	CHECK(!marshal_path_eval(other, hashes));
+	marshal_path_free(other);
+	other = marshal_path_compile("[0].name");
+	CHECK(is_string(marshal_path_eval(other, hashes), "x"));
+	marshal_path_free(other);
+	other = marshal_path_compile("[2][\"field_3\"]");
+	CHECK(is_integer(marshal_path_eval(other, hashes), 9));
+	marshal_path_free(other);
+	other = marshal_path_compile("[-1]");
+	CHECK(is_string(marshal_path_eval(other, m), "shared"));
+	marshal_path_free(other);
+
+	marshal_path_free(path);
+	marshal_free(hashes);
+	marshal_free(m);
+}
+
+static int
+count_enter(marshal_iter_t *iter, void *data)
+{
+	(void)iter;
+	(*(int *)data)++;
+	return MARSHAL_VISIT_CONTINUE;
+}
+
+/* nodes and leave events of a tree */
+static int
+count_nodes(const marshal_t *m, int *leaves)
+{
+	marshal_iter_t iter;
+	int event, nodes = 0;
+	*leaves = 0;
+	marshal_iter_init(&iter, m);
+	while ((event = marshal_iter_next(&iter)) > 0)
+	{
+		if (MARSHAL_ITER_LEAVE == event)
+			(*leaves)++;
+		else
+			nodes++;
+	}
+	marshal_iter_done(&iter);
+	return event < 0 ? -1 : nodes;
+}
+
+static void
+test_walks(void)
+{
+	marshal_visitor_t visitor;
+	fixture_t f;
+	int i, j, nodes, leaves, visited;
+
+	memset(&visitor, 0, sizeof(visitor));
+	for (j = 0; j < MARSHAL_TYPE_COUNT; j++)
+		visitor.enter[j] = count_enter;
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		nodes = count_nodes(f.m, &leaves);
+		CHECK(nodes > 0);
+		visited = 0;
+		CHECK(0 == marshal_visit(f.m, &visitor, &visited)
+			&& visited == nodes);
+		fixture_close(&f);
+	}
+}
+
+static int
+encodes_to(const marshal_t *m, const void *data, size_t size)
+{
+	size_t n;
+	void *mem = marshal_encode(m, &n);
+	int same = mem && n == size && 0 == memcmp(mem, data, size);
+	marshal_free_memory(mem);
+	return same;
+}
+
+static void
+test_cow(void)
+{
+	marshal_t *m = load("objects");
+	marshal_t *cow, *target;
+	marshal_path_t *path = marshal_path_compile("[1]@next@label");
+	fixture_t f;
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		cow = marshal_clone_cow(f.m);
+		CHECK(marshal_equal(f.m, cow) && encodes_to(cow, f.encoded, f.n));
+		CHECK(marshal_hash_value_memo(cow) == marshal_hash_value(f.m));
+		marshal_free(cow);
+		fixture_close(&f);
+	}
+
+	/* only the path is copied */
+	cow = marshal_clone_cow(m);
+	target = marshal_path_unshare(&cow, path);
+	CHECK(target && !target->head.shared);
+	CHECK(cow != m && marshal_array_get(cow, 0) == marshal_array_get(m, 0));
+	CHECK(!marshal_array_get(cow, 1)->head.shared);
+	CHECK(marshal_object_set(marshal_object_get(marshal_array_get(cow, 1),
+		"@next"), "@label", marshal_make_ascii("other")));
+	CHECK(is_string(marshal_path_eval(path, m), "first"));
+	CHECK(is_string(marshal_path_eval(path, cow), "other"));
+	marshal_free(cow);
+
+	/* a shared node can't be modified until it's unshared */
+	cow = marshal_clone_cow(m);
+	CHECK(!marshal_array_add(cow, marshal_make_nil()));
+	CHECK(marshal_unshare(&cow) && marshal_array_add(cow, marshal_make_nil()));
+	CHECK(5 == cow->array.count && 4 == m->array.count);
+	marshal_free(cow);
+
+	marshal_path_free(path);
+	marshal_free(m);
+}
+
+static void
+test_compact(void)
+{
+	fixture_t f;
+	marshal_t *copy;
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		copy = marshal_compact(f.m);
+		CHECK(marshal_equal(f.m, copy) && encodes_to(copy, f.encoded, f.n));
+		marshal_free(copy);
+		fixture_close(&f);
+	}
+}
+
+static void
+test_frozen(void)
+{
+	marshal_t *m = load("objects");
+	marshal_t *hashes = load("hashes");
+	marshal_t *copy, *lookup;
+	marshal_frozen_t *frozen;
+	const marshal_fnode_t *root, *node, *key;
+	const char *name;
+	unsigned char *corrupt;
+	uint64_t cut;
+	void *image;
+	size_t size, k;
+	fixture_t f;
+	int i, rejected;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		image = marshal_freeze(f.m, &size);
+		frozen = image ? marshal_frozen_load(image, size) : NULL;
+		CHECK(frozen);
+		if (frozen)
+		{
+			copy = marshal_fnode_thaw(marshal_frozen_root(frozen));
+			CHECK(marshal_equal(f.m, copy)
+				&& encodes_to(copy, f.encoded, f.n));
+			marshal_free(copy);
+			marshal_frozen_close(frozen);
+		}
+		marshal_free_memory(image);
+		fixture_close(&f);
+	}
+
+	CHECK(0 == marshal_freeze_to_file(m, "marshal-test.frozen"));
+	frozen = marshal_frozen_open("marshal-test.frozen");
+	CHECK(frozen);
+	if (frozen)
+	{
+		root = marshal_frozen_root(frozen);
+		CHECK(MARSHAL_ARRAY == marshal_fnode_type(root)
+			&& 4 == marshal_fnode_count(root));
+		node = marshal_fnode_array_get(root, 1);
+		CHECK(MARSHAL_OBJECT == marshal_fnode_type(node)
+			&& 0 == strcmp("Node", marshal_fnode_name(node)));
+		CHECK(2 == marshal_fnode_int(marshal_fnode_object_get(node, "@id")));
+		CHECK(marshal_fnode_object_ivar(node, 1, &name)
+			&& 0 == strcmp("@label", name));
+		node = marshal_fnode_object_get(node, "@next");
+		node = marshal_fnode_object_get(node, "@label");
+		CHECK(0 == strcmp("first", marshal_fnode_data(node, &size))
+			&& 5 == size);
+		CHECK(MARSHAL_ENCODING_UTF_8 == marshal_fnode_encoding(node));
+		CHECK(!marshal_fnode_array_get(root, 4));
+		marshal_frozen_close(frozen);
+	}
+	remove("marshal-test.frozen");
+
+	/* hashes are looked up in place, through an index for wide ones */
+	image = marshal_freeze(hashes, &size);
+	frozen = image ? marshal_frozen_load(image, size) : NULL;
+	CHECK(frozen);
+	if (frozen)
+	{
+		root = marshal_frozen_root(frozen);
+		lookup = utf8("field_33");
+		node = marshal_fnode_hash_get(marshal_fnode_array_get(root, 2),
+			lookup);
+		CHECK(33 * 33 == marshal_fnode_int(node));
+		marshal_free(lookup);
+		lookup = marshal_make_integer(1);
+		node = marshal_fnode_array_get(root, 1);
+		CHECK(2 == marshal_fnode_int(marshal_fnode_hash_get(node, lookup)));
+		CHECK(5 == marshal_fnode_int(marshal_fnode_hash_default(node)));
+		CHECK(marshal_fnode_hash_pair(node, 0, &key)
+			&& 1 == marshal_fnode_int(key));
+		marshal_free(lookup);
+		marshal_frozen_close(frozen);
+	}
+	marshal_free_memory(image);
+
+	/* a corrupt image is rejected or read within its bounds */
+	image = marshal_freeze(m, &size);
+	corrupt = malloc(size);
+	rejected = 0;
+	for (k = 32; image && corrupt && k < size; k++)
+	{
+		memcpy(corrupt, image, size);
+		corrupt[k] ^= 0x80;
+		frozen = marshal_frozen_load(corrupt, size);
+		rejected += !frozen;
+		if (frozen)
+			marshal_free(marshal_fnode_thaw(marshal_frozen_root(frozen)));
+		marshal_frozen_close(frozen);
+	}
+	CHECK(rejected > 0);
+	/* a truncated one whose header (its size at 16) was made to match */
+	for (k = 1; image && corrupt && k < 4; k++)
+	{
+		memcpy(corrupt, image, size);
+		cut = size - k * 8;
+		memcpy(corrupt + 16, &cut, sizeof(cut));
+		CHECK(!marshal_frozen_load(corrupt, cut));
+	}
+	free(corrupt);
+	marshal_free_memory(image);
+
+	/* a shared subtree is written once, a dag doesn't grow into a tree */
+	copy = utf8("leaf");
+	for (i = 0; i < 40; i++)
+	{
+		lookup = marshal_make_array();
+		marshal_array_add(lookup, copy);
+		marshal_array_add(lookup, marshal_clone_cow(copy));
+		copy = lookup;
+	}
+	image = marshal_freeze(copy, &size);
+	CHECK(image && size < 4096);
+	frozen = image ? marshal_frozen_load(image, size) : NULL;
+	CHECK(frozen);
+	if (frozen)
+	{
+		node = marshal_frozen_root(frozen);
+		for (i = 0; node && i < 40; i++)
+			node = marshal_fnode_array_get(node, i % 2);
+		CHECK(node && 0 == strcmp("leaf", marshal_fnode_data(node, NULL)));
+		marshal_frozen_close(frozen);
+	}
+	marshal_free_memory(image);
+	marshal_free(copy);
+	marshal_free(hashes);
+	marshal_free(m);
+}
+
+static void
+test_free_async(void)
+{
+	marshal_free_stats_t reclaimed;
+	int i;
+
+	/* trees freed in the background */
+	CHECK(0 == marshal_free_start(4));
+	for (i = 0; i < 20; i++)
+		marshal_free_async(load("hashes"));
+	marshal_free_flush();
+	marshal_free_stats(&reclaimed);
+	CHECK(20 <= reclaimed.submitted && reclaimed.submitted == reclaimed.freed
+		&& 0 == reclaimed.queued && 4 >= reclaimed.peak);
+	marshal_free_stop();
+}
+
+static void
+test_inspect(void)
+{
+	marshal_t *m = load("structs");
+	marshal_inspect_opts_t opts;
+	char text[256];
+
+	CHECK(marshal_inspect(m, text, sizeof(text), NULL) < sizeof(text));
+	CHECK(0 == strcmp("[#<struct Point x=1, y=2.5>, "
+		"#<struct Point x=nil, y=[1, 2]>, #<struct Point x=:x, y=3>]", text));
+	memset(&opts, 0, sizeof(opts));
+	opts.max_elements = 1;
+	marshal_inspect(m, text, sizeof(text), &opts);
+	CHECK(0 == strcmp("[#<struct Point x=1, ...>, ...]", text));
+	/* truncated, the full length is returned */
+	CHECK(88 == marshal_inspect(m, text, 6, NULL)
+		&& 0 == strcmp("[#<st", text));
+	CHECK(88 == marshal_inspect(m, NULL, 0, NULL));
+	marshal_free(m);
+}
+
+static int
+to_json(const void *data, size_t size, marshal_buffer_t *json)
+{
+	marshal_sink_t sink;
+	memset(json, 0, sizeof(*json));
+	sink.write = marshal_buffer_write;
+	sink.data = json;
+	return marshal_to_json(data, size, &sink, NULL);
+}
+
+static void
+test_to_json(void)
+{
+	marshal_buffer_t json;
+	fixture_t f;
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		CHECK(0 == to_json(f.data, f.size, &json) && json.size);
+		marshal_free_memory(json.data);
+		fixture_close(&f);
+	}
+
+	fixture_open(&f, 6);
+	CHECK(0 == to_json(f.data, f.size, &json));
+	CHECK(json.size && 0 == strncmp("[{\"__class\":\"Point\",\"x\":1,"
+		"\"y\":2.5},{\"__class\":\"Point\",\"x\":null,\"y\":[1,2]},"
+		"{\"__class\":\"Point\",\"x\":\"x\",\"y\":3}]", json.data, json.size));
+	marshal_free_memory(json.data);
+	fixture_close(&f);
+	/* cut short */
+	CHECK(0 != to_json("\x04\x08[\x07i\x06", 6, &json));
+	marshal_free_memory(json.data);
+}
+
+static void
+test_from_json(void)
+{
+	static const char input[] = "{\"a\": [1, 2.5, null, true, 12345678901],"
+		" \"b\": \"x\\u00e9\"}";
+	marshal_buffer_t json, out;
+	marshal_t *m, *key;
+
+	memset(&out, 0, sizeof(out));
+	CHECK(0 == marshal_from_json(input, strlen(input), &out, NULL));
+	m = marshal_decode_buffer(out.data, out.size, 0);
+	CHECK(m && MARSHAL_HASH == m->type && 2 == m->hash.count);
+	if (m)
+	{
+		key = utf8("b");
+		CHECK(is_string(marshal_hash_get(m, key), "x\xc3\xa9"));
+		marshal_free(key);
+	}
+	CHECK(0 == to_json(out.data, out.size, &json));
+	CHECK(json.size && 0 == strncmp("{\"a\":[1,2.5,null,true,12345678901],"
+		"\"b\":\"x\xc3\xa9\"}", json.data, json.size));
+	marshal_free(m);
+	marshal_free_memory(out.data);
+	marshal_free_memory(json.data);
+
+	memset(&out, 0, sizeof(out));
+	CHECK(0 != marshal_from_json("{\"a\":", 5, &out, NULL) && !out.size);
+	marshal_free_memory(out.data);
+}
+
+static void
+test_transcode(void)
+{
+	marshal_t *m = load("strings");
+	marshal_t *s;
+	marshal_buffer_t out;
+
+	s = marshal_array_get(m, 6);
+	CHECK(is_string(s, "caf\xe9")
+		&& MARSHAL_ENCODING_ISO_8859_1 == s->string.encoding);
+	CHECK(0 == marshal_string_to_utf8(s) && is_string(s, "caf\xc3\xa9")
+		&& MARSHAL_ENCODING_UTF_8 == s->string.encoding);
+	s = marshal_array_get(m, 8);
+	CHECK(s && marshal_encoding_name_to_id("Shift_JIS") == s->string.encoding);
+	CHECK(0 != marshal_string_to_utf8(s));
+	marshal_free(m);
+
+	/* every string marshal_to_utf8 handles comes as UTF-8 */
+	m = marshal_decode_buffer("\x04\x08[\x07I\"\x09h\x00i\x00\x06:\x0d"
+		"encoding\"\x0dUTF-16LEI\"\x07h\xe9\x06:\x0d"
+		"encoding\"\x0fISO-8859-1", 61, MARSHAL_DECODE_UTF8);
+	CHECK(m);
+	if (m)
+	{
+		CHECK(is_string(marshal_array_get(m, 0), "hi"));
+		CHECK(is_string(marshal_array_get(m, 1), "h\xc3\xa9"));
+	}
+	marshal_free(m);
+
+	memset(&out, 0, sizeof(out));
+	CHECK(0 == marshal_to_utf8(MARSHAL_ENCODING_ISO_8859_1, "caf\xe9", 4,
+		&out));
+	CHECK(5 == out.size && 0 == memcmp(out.data, "caf\xc3\xa9", 5));
+	out.size = 0;
+	CHECK(0 == marshal_to_utf8(MARSHAL_ENCODING_UTF_16BE, "\xd8\x3d\xde\x00",
+		4, &out));
+	CHECK(4 == out.size && 0 == memcmp(out.data, "\xf0\x9f\x98\x80", 4));
+	out.size = 0;
+	CHECK(0 == marshal_to_utf8(MARSHAL_ENCODING_UTF_8, "a\xffz", 3, &out));
+	CHECK(5 == out.size && 0 == memcmp(out.data, "a\xef\xbf\xbdz", 5));
+	marshal_free_memory(out.data);
+
+	CHECK(MARSHAL_ENCODING_UTF_8 == marshal_encoding_name_to_id("UTF-8"));
+	CHECK(0 == strcmp("ISO-8859-1",
+		marshal_encoding_id_to_name(MARSHAL_ENCODING_ISO_8859_1)));
+}
+
+static void
+test_stats(void)
+{
+	marshal_stats_t stats;
+	marshal_t *m;
+	size_t before;
+
+	marshal_stats_enable(1);
+	marshal_stats_reset();
+	m = load("objects");
+	marshal_stats_snapshot(&stats);
+	/* the first node is linked twice, each link decodes a copy */
+	CHECK(1 == stats.decodes && 104 == stats.bytes_read
+		&& 5 == stats.nodes[MARSHAL_OBJECT] && 3 == stats.objlinks);
+	marshal_free(m);
+	marshal_stats_enable(0);
+
+	/* shared subtrees are counted once */
+	m = load("strings");
+	before = marshal_memory_usage(m);
+	CHECK(before > 0 && marshal_dedup(m) == m);
+	CHECK(marshal_memory_usage(m) < before);
+	marshal_free(m);
+}
+
+/* an allocator counting what's still allocated */
+static long live;
+
+static void *
+counting_malloc(void *data, size_t size)
+{
+	size_t *mem = malloc(size + sizeof(double));
+	(void)data;
+	if (!mem)
+		return NULL;
+	live++;
+	return (double *)mem + 1;
+}
+
+static void *
+counting_realloc(void *data, void *mem, size_t size)
+{
+	double *grown;
+	(void)data;
+	if (!mem)
+		return counting_malloc(data, size);
+	grown = realloc((double *)mem - 1, size + sizeof(double));
+	return grown ? grown + 1 : NULL;
+}
+
+static void
+counting_free(void *data, void *mem)
+{
+	(void)data;
+	if (!mem)
+		return;
+	live--;
+	free((double *)mem - 1);
+}
+
+static const marshal_allocator_t *
+use_counting(void)
+{
+	static marshal_allocator_t allocator;
+	allocator.malloc = counting_malloc;
+	allocator.realloc = counting_realloc;
+	allocator.free = counting_free;
+	allocator.data = NULL;
+	return marshal_use_allocator(&allocator);
+}
+
+static void
+test_allocator(void)
+{
+	const marshal_allocator_t *previous = use_counting();
+	marshal_t *m;
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		m = marshal_decode_file(fixture_path(fixtures[i].name));
+		CHECK(m && live > 0);
+		marshal_free(m);
+		CHECK(0 == live);
+	}
+	marshal_use_allocator(previous);
+}
+
+/* malloc(0) may return NULL */
+static void *
+strict_malloc(void *data, size_t size)
+{
+	return size ? counting_malloc(data, size) : NULL;
+}
+
+static void
+test_empty(void)
+{
+	const marshal_allocator_t *previous;
+	static marshal_allocator_t allocator;
+	marshal_t *m, *copy, *cow;
+	int i;
+
+	allocator.malloc = strict_malloc;
+	allocator.realloc = counting_realloc;
+	allocator.free = counting_free;
+	previous = marshal_use_allocator(&allocator);
+
+	/* [[], {}, Foo.new, "a" with no ivars] */
+	m = marshal_decode("\004\010[\011[\000{\000o:\010Foo\000I\"\006a\000");
+	CHECK(m && MARSHAL_ARRAY == m->type && 4 == m->array.count);
+	copy = marshal_clone(NULL, m);
+	CHECK(copy && marshal_equal(m, copy));
+	marshal_free(copy);
+	for (i = 0; m && i < 3; i++)
+	{
+		cow = marshal_clone_cow(marshal_array_get(m, i));
+		CHECK(cow && marshal_unshare(&cow)
+			&& cow != marshal_array_get(m, i)
+			&& marshal_equal(cow, marshal_array_get(m, i)));
+		marshal_free(cow);
+	}
+	marshal_free(m);
+	CHECK(0 == live);
+	marshal_use_allocator(previous);
+}
+
+static void
+test_contexts(void)
+{
+	marshal_decoder_t *decoder = marshal_decoder_new(0, NULL);
+	marshal_encoder_t *encoder = marshal_encoder_new(NULL);
+	const void *again;
+	marshal_t *copy;
+	size_t size;
+	fixture_t f;
+	int i, j;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		for (j = 0; j < 2; j++)
+		{
+			copy = marshal_decoder_decode(decoder, f.data);
+			CHECK(marshal_equal(f.m, copy));
+			marshal_free(copy);
+			again = marshal_encoder_encode(encoder, f.m, &size);
+			CHECK(again && size == f.n && 0 == memcmp(again, f.encoded, f.n));
+		}
+		fixture_close(&f);
+	}
+	marshal_encoder_free(encoder);
+
+	/* objects of later decodes share the shapes of the first ones */
+	copy = marshal_decoder_decode(decoder,
+		"\004\010o:\010Foo\007:\007@ai\006:\007@bi\007");
+	CHECK(copy && MARSHAL_OBJECT == copy->type);
+	for (j = 0; copy && j < 2; j++)
+	{
+		marshal_t *other = marshal_decoder_decode(decoder, j
+			? "\004\010o:\010Foo\007:\007@bi\006:\007@ai\007"
+			: "\004\010[\006o:\010Foo\007:\007@ai\010:\007@bi\011");
+		marshal_t *object = other && MARSHAL_ARRAY == other->type
+			? other->array.values[0] : other;
+		CHECK(object && MARSHAL_OBJECT == object->type);
+		if (object)
+			CHECK(j != (object->object.shape == copy->object.shape));
+		marshal_free(other);
+	}
+	marshal_free(copy);
+	marshal_decoder_free(decoder);
+}
+
+static void
+test_batch(void)
+{
+	marshal_slice_t in[FIXTURE_COUNT + 2];
+	marshal_t *out[FIXTURE_COUNT + 2];
+	int errors[FIXTURE_COUNT + 2];
+	void *data[FIXTURE_COUNT];
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		data[i] = read_file(fixture_path(fixtures[i].name), &in[i].size);
+		in[i].data = data[i];
+	}
+	/* cut short, and of another version */
+	in[i].data = data[0];
+	in[i].size = in[0].size - 1;
+	in[i+1].data = "\x04\x09i\x06";
+	in[i+1].size = 4;
+
+	CHECK(2 == marshal_decode_batch(in, FIXTURE_COUNT + 2, out, errors, 0,
+		3));
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		marshal_t *m = marshal_decode_buffer(data[i], in[i].size, 0);
+		CHECK(MARSHAL_ERROR_NONE == errors[i] && marshal_equal(m, out[i]));
+		marshal_free(m);
+		marshal_free(out[i]);
+		free(data[i]);
+	}
+	CHECK(!out[i] && MARSHAL_ERROR_TRUNCATED == errors[i]);
+	CHECK(!out[i+1] && MARSHAL_ERROR_VERSION == errors[i+1]);
+}
+
+/* marshal_decode_stream's reader, a few bytes at a time */
+typedef struct
+{
+	const char *data;
+	size_t size;
+	size_t at;
+} reader_t;
+
+static size_t
+read_some(void *data, void *buffer, size_t size)
+{
+	reader_t *r = data;
+	size_t n = r->size - r->at;
+	if (n > 7)
+		n = 7;
+	if (n > size)
+		n = size;
+	memcpy(buffer, r->data + r->at, n);
+	r->at += n;
+	return n;
+}
+
+static void
+test_streams(void)
+{
+	reader_t reader;
+	marshal_t *copy;
+	fixture_t f;
+	size_t j;
+	int i;
+
+	for (i = 0; i < FIXTURE_COUNT; i++)
+	{
+		fixture_open(&f, i);
+		copy = marshal_decode_buffer(f.data, f.size, 0);
+		CHECK(marshal_equal(f.m, copy));
+		marshal_free(copy);
+		reader.data = f.data;
+		reader.size = f.size;
+		reader.at = 0;
+		copy = marshal_decode_stream(read_some, &reader, 0);
+		CHECK(marshal_equal(f.m, copy));
+		marshal_free(copy);
+
+		/* cut anywhere, it fails cleanly */
+		for (j = 0; j < f.size; j++)
+		{
+			copy = marshal_decode_buffer(f.data, j, 0);
+			CHECK(!copy);
+			marshal_free(copy);
+		}
+
+#ifdef HAVE_LIBZ
+		{
+			int format;
+			for (format = MARSHAL_STREAM_ZLIB; format <= MARSHAL_STREAM_GZIP;
+					format++)
+			{
+				marshal_buffer_t out;
+				memset(&out, 0, sizeof(out));
+				CHECK(0 == marshal_encode_stream(f.m, marshal_buffer_write,
+					&out, format));
+				CHECK(out.size && out.size != f.n);
+				copy = marshal_decode_buffer(out.data, out.size, 0);
+				CHECK(marshal_equal(f.m, copy));
+				marshal_free(copy);
+				marshal_free_memory(out.data);
+			}
+		}
+#endif
+		fixture_close(&f);
+	}
+}
+
+static void
+test_integers(void)
+{
+	static const int small[] = {
+		0, 1, -1, 122, 123, -123, -124, 255, 256, -256, -257,
+		65535, 65536, -65536, -65537, 1 << 24, -(1 << 24),
+		1073741823, -1073741823 - 1
+	};
+	marshal_t *m = load("integers");
+	marshal_t *big;
+	int i;
+
+	for (i = 0; i < (int)(sizeof(small) / sizeof(small[0])); i++)
+		CHECK(is_integer(marshal_array_get(m, i), small[i]));
+	/* 2**30 */
+	big = marshal_array_get(m, i);
+	CHECK(big && MARSHAL_BIGNUM == big->type && 1 == big->bignum.sign
+		&& 4 == big->bignum.length && 0x40 == big->bignum.bytes[3]);
+	/* 2**100, 13 bytes padded to whole shorts */
+	big = marshal_array_get(m, i + 5);
+	CHECK(big && MARSHAL_BIGNUM == big->type && 14 == big->bignum.length
+		&& 0x10 == big->bignum.bytes[12] && 0 == big->bignum.bytes[13]);
+	big = marshal_array_get(m, i + 6);
+	CHECK(big && -1 == big->bignum.sign);
+	marshal_free(m);
+}
+
+static void
+test_symbols(void)
+{
+	marshal_t *m = load("symbols");
+	marshal_t *a = marshal_array_get(m, 0);
+	marshal_t *hash = marshal_array_get(m, 4);
+	marshal_t *key = marshal_make_symbol("a");
+
+	CHECK(a && MARSHAL_SYMBOL == a->type && 0 == strcmp("a", a->symbol.name));
+	CHECK(marshal_equal(a, marshal_array_get(m, 2)));
+	/* written with its encoding (I:) */
+	CHECK(0 == strcmp("caf\xc3\xa9", marshal_array_get(m, 3)->symbol.name));
+	CHECK(marshal_equal(marshal_hash_get(hash, key),
+		marshal_array_get(marshal_array_get(m, 5), 0)));
+	marshal_free(key);
+	marshal_free(m);
+}
+
+static void
+test_types(void)
+{
+	marshal_t *m = load("structs");
+	marshal_t *value, *raw, *text, *time, *made;
+
+	CHECK(is_integer(marshal_object_get(marshal_array_get(m, 0), "x"), 1));
+	value = marshal_make_integer(2);
+	CHECK(!marshal_object_set(marshal_array_get(m, 0), "z", value));
+	marshal_free(value);
+	marshal_free(m);
+
+	m = load("wrapped");
+	value = marshal_array_get(m, 0);
+	CHECK(MARSHAL_USERCLASS == value->type
+		&& 0 == strcmp("MyStr", value->wrapped.klass));
+	CHECK(is_string(marshal_unwrap(value), "hello"));
+	value = marshal_array_get(m, 4);
+	CHECK(MARSHAL_EXTENDED == value->type
+		&& MARSHAL_ARRAY == marshal_unwrap(value)->type);
+	value = marshal_array_get(m, 5);
+	CHECK(MARSHAL_USRMARSHAL == value->type
+		&& 0 == strcmp("Pair", value->wrapped.klass));
+	marshal_free(m);
+
+	m = load("userdef");
+	raw = marshal_array_get(m, 0);
+	text = marshal_array_get(m, 1);
+	time = marshal_array_get(m, 2);
+	CHECK(raw && MARSHAL_USERDEF == raw->type && 3 == raw->userdef.size
+		&& 0 == memcmp("raw", raw->userdef.data, 3) && 0 == raw->userdef.count);
+	made = marshal_make_userdef("Token", 3, "raw");
+	CHECK(marshal_equal(made, raw));
+	marshal_free(made);
+	/* _dump strings carry their encoding */
+	CHECK(text && 1 == text->userdef.count);
+	CHECK(time && 0 == strcmp("Time", time->userdef.klass)
+		&& 8 == time->userdef.size && time->userdef.count >= 1);
+	marshal_free(m);
+}
+
+static void
+test_bounds(void)
+{
+	/* object and struct member counts beyond the input */
+	CHECK(!marshal_decode_buffer("\x04\x08o:\x06A\x04\xff\xff\xff\x3f", 10, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08S:\x06A\x04\xff\xff\xff\x3f", 10, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08[\x04\xff\xff\xff\x3f", 7, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08@\x00", 4, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08;\x00", 4, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08Z", 3, 0));
+	/* a hash with a default cut before it */
+	CHECK(!marshal_decode_buffer("\x04\x08}\x06i\x06i\x07", 8, 0));
+	/* bignum lengths, negative, overflowing and past the input */
+	CHECK(!marshal_decode_buffer("\x04\x08l+\xfa", 5, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08l+\x04\xff\xff\xff\x7f", 9, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08l+\x0a\x01\x02", 7, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08{\x04\xff\xff\xff\x7f", 8, 0));
+	CHECK(!marshal_decode_buffer("\x04\x08{\xfa", 4, 0));
+}
+
+static void
+test_singletons(void)
+{
+	marshal_t *m;
+
+	/* singletons need no memory */
+	CHECK(marshal_make_integer(5) == marshal_make_integer(5));
+	CHECK(marshal_make_nil() == marshal_make_nil());
+	CHECK(marshal_make_boolean(1) == marshal_make_boolean(1));
+	m = load("integers");
+	CHECK(marshal_array_get(m, 1) == marshal_make_integer(1));
+	marshal_free(m);
+	m = marshal_make_integer(100000);
+	CHECK(is_integer(m, 100000));
+	marshal_free(m);
+}
+
+static void
+test_inline(void)
+{
+	const marshal_allocator_t *previous = use_counting();
+	marshal_t *m;
+
+	/* short strings live in their node */
+	m = marshal_decode_buffer("\x04\x08\"\x0ahello", 9, 0);
+	CHECK(is_string(m, "hello") && 1 == live);
+	marshal_free(m);
+	m = marshal_decode_buffer("\x04\x08\"\x18the quick brown fox", 23, 0);
+	CHECK(is_string(m, "the quick brown fox") && 2 == live);
+	marshal_free(m);
+	/* with their NULs */
+	m = marshal_decode_buffer("\x04\x08\"\x08" "a\0b", 7, 0);
+	CHECK(m && 3 == m->string.data_size
+		&& 0 == memcmp(m->string.data, "a\0b", 3));
+	marshal_free(m);
+	CHECK(0 == live);
+	marshal_use_allocator(previous);
+}
+
+int
+main(void)
+{
+	test_fixtures();
+	test_utf8();
+	test_hash_index();
+	test_containers();
+	test_shapes();
+	test_hash_value();
+	test_dedup();
+	test_paths();
+	test_walks();
+	test_cow();
+	test_compact();
+	test_frozen();
+	test_free_async();
+	test_inspect();
+	test_to_json();
+	test_from_json();
+	test_transcode();
+	test_stats();
+	test_allocator();
+	test_empty();
+	test_contexts();
+	test_batch();
+	test_streams();
+	test_integers();
+	test_symbols();
+	test_types();
+	test_bounds();
+	test_singletons();
+	test_inline();
+
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures > 99 ? 99 : failures;
+}